@@ -0,0 +1,135 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "clock.h"
+
+#define THREADS 4
+#define RECORDS 250000 // Per thread, the binary log rotates a few times
+
+static char dir[] = "/tmp/accesslog_benchXXXXXX";
+static FILE *text_log;
+static pthread_mutex_t text_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fill(Exchange *ex, const int i) {
+  struct sockaddr_in client = {.sin_family = AF_INET,
+                               .sin_port = htons(40000 + i % 20000)};
+  client.sin_addr.s_addr = htonl(0x0a000000 | (i & 0xffff));
+  exchange_begin(ex, i, clock_precise_ns(), (struct sockaddr *)&client,
+                 "GET");
+  exchange_mark(ex, PHASE_PARSED);
+  exchange_mark(ex, PHASE_FIRST_BYTE);
+  exchange_mark(ex, PHASE_LAST_BYTE);
+  ex->rec.status = 200;
+  ex->rec.bytes_in = 412;
+  ex->rec.bytes_out = 4750 + i % 1000;
+}
+
+/* Common log format-like line with the same fields, as a text log would */
+static void write_text(const Exchange *ex) {
+  char client[INET_ADDRSTRLEN], line[512];
+  inet_ntop(AF_INET, ex->rec.client_ip, client, sizeof(client));
+  time_t sec = ex->rec.start_ns / 1000000000ULL;
+  struct tm tm;
+  char when[32];
+  localtime_r(&sec, &tm);
+  strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S %z", &tm);
+
+  int len = snprintf(line, sizeof(line),
+                     "%s:%u [%s] conn=%llu \"%s\" %u %llu %llu parsed=%u "
+                     "first_byte=%u last_byte=%u\n",
+                     client, ex->rec.client_port, when,
+                     (unsigned long long)ex->rec.conn_id,
+                     access_method_name(ex->rec.method), ex->rec.status,
+                     (unsigned long long)ex->rec.bytes_in,
+                     (unsigned long long)ex->rec.bytes_out,
+                     ex->rec.phase_us[PHASE_PARSED],
+                     ex->rec.phase_us[PHASE_FIRST_BYTE],
+                     ex->rec.phase_us[PHASE_LAST_BYTE]);
+  pthread_mutex_lock(&text_lock);
+  fwrite(line, 1, len, text_log);
+  pthread_mutex_unlock(&text_lock);
+}
+
+static void *run_binary(void *arg) {
+  double *spent = (double *)arg;
+  Exchange ex = {.open = false};
+  *spent = 0;
+  for (int i = 0; i < RECORDS; i++) {
+    fill(&ex, i);
+    double start = now_ns();
+    exchange_end(&ex);
+    *spent += now_ns() - start;
+  }
+  return NULL;
+}
+
+static void *run_text(void *arg) {
+  double *spent = (double *)arg;
+  Exchange ex = {.open = false};
+  *spent = 0;
+  for (int i = 0; i < RECORDS; i++) {
+    fill(&ex, i);
+    double start = now_ns();
+    write_text(&ex);
+    ex.open = false;
+    *spent += now_ns() - start;
+  }
+  return NULL;
+}
+
+/* Mean time to write a record, in nanoseconds */
+static double run(void *(*writer)(void *)) {
+  pthread_t tids[THREADS];
+  double spent[THREADS], total = 0;
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&tids[i], NULL, writer, &spent[i]);
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(tids[i], NULL);
+    total += spent[i];
+  }
+  return total / (THREADS * RECORDS);
+}
+
+int main(void) {
+  if (mkdtemp(dir) == NULL)
+    return EXIT_FAILURE;
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s/access.log", dir);
+  text_log = fopen(path, "w");
+  if (text_log == NULL)
+    return EXIT_FAILURE;
+  double text_ns = run(run_text);
+  fclose(text_log);
+  unlink(path);
+
+  snprintf(path, sizeof(path), "%s/access", dir);
+  if (accesslog_open(path) == -1)
+    return EXIT_FAILURE;
+  double binary_ns = run(run_binary);
+  accesslog_close();
+
+  char cmd[512];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  if (system(cmd) != 0)
+    fprintf(stderr, "Failed to remove %s\n", dir);
+
+  printf("threads:            %d x %d records\n", THREADS, RECORDS);
+  printf("text line:          %8.1f ns/record (%zu Bytes record binary)\n",
+         text_ns, sizeof(AccessRecord));
+  printf("binary mmap record: %8.1f ns/record (%.1fx)\n", binary_ns,
+         text_ns / binary_ns);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+
+#define DEFAULT_DOMAINS 1000000
+#define LOOKUPS 2000000
+
+static const char *const tlds[] = {"com", "net", "org", "io",  "ru",
+                                   "cn",  "de",  "info", "xyz", "co.uk"};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void random_domain(char *out, const size_t len) {
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  int label_len = 6 + rand() % 9;
+  for (int i = 0; i < label_len; i++)
+    out[i] = alphabet[rand() % (sizeof alphabet - 1)];
+  snprintf(out + label_len, len - label_len, ".%s",
+           tlds[rand() % (sizeof tlds / sizeof tlds[0])]);
+}
+
+static double bench_lookups(const Blocklist *bl, char **hosts,
+                            const size_t count, size_t *matches) {
+  *matches = 0;
+  double start = now_ns();
+  for (size_t i = 0; i < LOOKUPS; i++)
+    *matches += blocklist_match(bl, hosts[i % count]);
+  return (now_ns() - start) / LOOKUPS;
+}
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_DOMAINS;
+  srand(42);
+
+  char path[] = "/tmp/blocklist_bench_XXXXXX";
+  int fd = mkstemp(path);
+  FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+  char **listed = (char **)malloc(count * sizeof(char *));
+  if (fp == NULL || listed == NULL) {
+    perror("blocklist_bench");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    char domain[64];
+    random_domain(domain, sizeof domain);
+    fprintf(fp, "%s\n", domain);
+    listed[i] = strdup(domain);
+  }
+  fclose(fp);
+
+  double start = now_ns();
+  Blocklist *bl = blocklist_load(path);
+  double load_ms = (now_ns() - start) / 1e6;
+  unlink(path);
+  if (bl == NULL)
+    return EXIT_FAILURE;
+
+  // Query sets: listed domains, their subdomains and unlisted domains
+  size_t queries = count < 100000 ? count : 100000;
+  char **subdomains = (char **)malloc(queries * sizeof(char *));
+  char **misses = (char **)malloc(queries * sizeof(char *));
+  for (size_t i = 0; i < queries; i++) {
+    char host[96];
+    snprintf(host, sizeof host, "www.cdn.%s:443", listed[rand() % count]);
+    subdomains[i] = strdup(host);
+
+    random_domain(host, sizeof host);
+    misses[i] = strdup(host);
+  }
+
+  size_t hit_exact, hit_sub, hit_miss;
+  double exact_ns = bench_lookups(bl, listed, count, &hit_exact);
+  double sub_ns = bench_lookups(bl, subdomains, queries, &hit_sub);
+  double miss_ns = bench_lookups(bl, misses, queries, &hit_miss);
+
+  size_t memory = blocklist_memory(bl);
+  printf("domains:            %zu (%zu kept)\n", count, bl->entries);
+  printf("load time:          %.1f ms (%.0f ns/domain)\n", load_ms,
+         load_ms * 1e6 / count);
+  printf("memory:             %.1f MiB (%.1f Bytes/entry, %zu nodes)\n",
+         memory / (1024.0 * 1024.0), (double)memory / bl->entries,
+         bl->node_count);
+  printf("lookup exact hit:   %.1f ns (%zu/%d matched)\n", exact_ns,
+         hit_exact, LOOKUPS);
+  printf("lookup parent hit:  %.1f ns (%zu/%d matched)\n", sub_ns, hit_sub,
+         LOOKUPS);
+  printf("lookup miss:        %.1f ns (%zu/%d false matches)\n", miss_ns,
+         hit_miss, LOOKUPS);
+
+  int status = hit_exact == LOOKUPS && hit_sub == LOOKUPS ? EXIT_SUCCESS
+                                                          : EXIT_FAILURE;
+
+  for (size_t i = 0; i < count; i++)
+    free(listed[i]);
+  for (size_t i = 0; i < queries; i++) {
+    free(subdomains[i]);
+    free(misses[i]);
+  }
+  free(listed);
+  free(subdomains);
+  free(misses);
+  blocklist_free(bl);
+  return status;
+}
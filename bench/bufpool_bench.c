@@ -0,0 +1,117 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bufpool.h"
+
+#define THREADS 8          // Connections handled at once
+#define CONNECTIONS 4000   // Threads started, one per connection
+#define READS 64           // Receive buffers filled per connection
+#define READ_LEN 8192      // Bytes per read, MAX_HTTP_LEN
+#define BACKLOG 256 * 1024 // Output queued by a slow client, the watermark
+
+static unsigned char src[BACKLOG];
+
+typedef struct Allocator {
+  const char *name;
+  void *(*get)(const size_t size, size_t *cap);
+  void (*put)(void *buf, const size_t cap);
+} Allocator;
+
+static void *malloc_get(const size_t size, size_t *cap) {
+  *cap = size;
+  return malloc(size);
+}
+
+static void malloc_put(void *buf, const size_t cap) {
+  (void)cap;
+  free(buf);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * One connection: reads into its receive buffer, then a response queued for
+ * a client that doesn't keep up, growing the output buffer by doubling
+ */
+static void *connection(void *arg) {
+  const Allocator *alloc = (const Allocator *)arg;
+
+  size_t rx_cap;
+  unsigned char *rx = (unsigned char *)alloc->get(READ_LEN, &rx_cap);
+  for (int i = 0; i < READS; i++)
+    memcpy(rx, src + (i % 16) * 1024, READ_LEN);
+
+  unsigned char *out = NULL;
+  size_t len = 0, cap = 0;
+  while (len < BACKLOG) {
+    if (len + READ_LEN > cap) {
+      size_t grown_cap;
+      unsigned char *grown = (unsigned char *)alloc->get(
+          cap > 0 ? 2 * cap : READ_LEN, &grown_cap);
+      memcpy(grown, out, len);
+      alloc->put(out, cap);
+      out = grown;
+      cap = grown_cap;
+    }
+    memcpy(out + len, rx, READ_LEN);
+    len += READ_LEN;
+  }
+
+  alloc->put(out, cap);
+  alloc->put(rx, rx_cap);
+  return NULL;
+}
+
+/* Connections handled per second */
+static double run(const Allocator *alloc) {
+  double start = now_ns();
+  for (int done = 0; done < CONNECTIONS; done += THREADS) {
+    pthread_t tids[THREADS];
+    for (int i = 0; i < THREADS; i++)
+      pthread_create(&tids[i], NULL, connection, (void *)alloc);
+    for (int i = 0; i < THREADS; i++)
+      pthread_join(tids[i], NULL);
+  }
+  return CONNECTIONS / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char **argv) {
+  bool huge = argc > 1 && strcmp(argv[1], "huge") == 0;
+  bufpool_init(huge);
+  memset(src, 0xab, sizeof src);
+
+  const Allocator allocators[] = {
+      {"malloc", malloc_get, malloc_put},
+      {huge ? "pool (huge pages)" : "pool", bufpool_get, bufpool_put},
+  };
+
+  // Bytes copied per connection: the reads, then the queue and its growth
+  double bytes = (double)READS * READ_LEN + 2.0 * BACKLOG;
+  printf("%d connections, %d at a time, %d reads of %d Bytes and %d KiB "
+         "queued each\n",
+         CONNECTIONS, THREADS, READS, READ_LEN, BACKLOG / 1024);
+  for (size_t i = 0; i < sizeof(allocators) / sizeof(Allocator); i++) {
+    run(&allocators[i]); // Warm up, the pool maps its chunks
+    double rate = run(&allocators[i]);
+    printf("%-18s %9.0f connections/s %8.1f MB/s copied\n",
+           allocators[i].name, rate, rate * bytes / 1e6);
+  }
+
+  BufPoolStats stats;
+  bufpool_get_stats(&stats);
+  unsigned long long gets = stats.hits + stats.misses;
+  printf("pool: %llu gets, %.1f%% from the thread's cache, %zu KiB mapped, "
+         "%.1f%% wasted rounding up\n",
+         gets, gets > 0 ? 100.0 * stats.hits / gets : 0.0,
+         stats.mapped / 1024,
+         stats.granted > 0 ? 100.0 * stats.wasted / stats.granted : 0.0);
+  return EXIT_SUCCESS;
+}
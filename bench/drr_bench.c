@@ -0,0 +1,117 @@
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "drr.h"
+
+#define HEAVY_THREADS 16        // Connections of the flooding client
+#define HEAVY_TURN 16384        // Bytes relayed per heavy turn
+#define LIGHT_TURN 1024         // Bytes relayed per light turn
+#define LIGHT_SAMPLES 2000      // Light turns measured
+#define LIGHT_PERIOD_NS 1000000 // A light request every millisecond
+#define QUANTUM 16384
+#define SLOTS 4 // Turns at a time, a heavy client could take them all
+
+typedef struct Client {
+  struct sockaddr_in addr;
+  DrrFlow *flow;
+} Client;
+
+static DrrScheduler sched;
+static atomic_bool stop = false;
+static unsigned char src[HEAVY_TURN], dst[HEAVY_TURN];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Stand-in for relaying: touch every byte a few times */
+static void relay(const size_t bytes) {
+  for (int pass = 0; pass < 8; pass++)
+    for (size_t i = 0; i < bytes; i++)
+      dst[i] = src[i] ^ (unsigned char)(dst[i] + pass);
+}
+
+static void *heavy(void *arg) {
+  Client *client = (Client *)arg;
+  while (!atomic_load(&stop)) {
+    drr_enter(&sched, client->flow);
+    relay(HEAVY_TURN);
+    drr_leave(&sched, client->flow, HEAVY_TURN);
+  }
+  return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Light client latency while the heavy one floods, in microseconds */
+static void run(const bool fair, double *p50, double *p99, double *max) {
+  static double latency[LIGHT_SAMPLES];
+
+  drr_init(&sched, QUANTUM, SLOTS);
+  Client heavy_client = {.addr = {.sin_family = AF_INET}};
+  Client light_client = {.addr = {.sin_family = AF_INET}};
+  heavy_client.addr.sin_addr.s_addr = htonl(0x0a000001);
+  // Sharing a flow, every turn is served first come first served
+  light_client.addr.sin_addr.s_addr = htonl(fair ? 0x0a000002 : 0x0a000001);
+  heavy_client.flow = drr_join(&sched, (struct sockaddr *)&heavy_client.addr);
+  light_client.flow = drr_join(&sched, (struct sockaddr *)&light_client.addr);
+
+  atomic_store(&stop, false);
+  pthread_t tids[HEAVY_THREADS];
+  for (int i = 0; i < HEAVY_THREADS; i++)
+    pthread_create(&tids[i], NULL, heavy, &heavy_client);
+
+  for (int i = 0; i < LIGHT_SAMPLES; i++) {
+    struct timespec period = {0, LIGHT_PERIOD_NS};
+    nanosleep(&period, NULL);
+
+    double start = now_ns();
+    drr_enter(&sched, light_client.flow);
+    relay(LIGHT_TURN);
+    drr_leave(&sched, light_client.flow, LIGHT_TURN);
+    latency[i] = (now_ns() - start) / 1e3;
+  }
+
+  atomic_store(&stop, true);
+  for (int i = 0; i < HEAVY_THREADS; i++)
+    pthread_join(tids[i], NULL);
+  drr_part(&sched, heavy_client.flow);
+  drr_part(&sched, light_client.flow);
+
+  qsort(latency, LIGHT_SAMPLES, sizeof(double), compare);
+  *p50 = latency[LIGHT_SAMPLES / 2];
+  *p99 = latency[LIGHT_SAMPLES * 99 / 100];
+  *max = latency[LIGHT_SAMPLES - 1];
+}
+
+int main(void) {
+  memset(src, 0xab, sizeof src);
+
+  double start = now_ns();
+  relay(HEAVY_TURN);
+  double turn_us = (now_ns() - start) / 1e3;
+
+  double fifo[3], fair[3];
+  run(false, &fifo[0], &fifo[1], &fifo[2]);
+  run(true, &fair[0], &fair[1], &fair[2]);
+
+  printf("slots:              %d\n", SLOTS);
+  printf("heavy client:       %d connections, %d Bytes turns (%.1f us)\n",
+         HEAVY_THREADS, HEAVY_TURN, turn_us);
+  printf("light client:       1 connection, %d Bytes turns every %.1f ms\n",
+         LIGHT_TURN, LIGHT_PERIOD_NS / 1e6);
+  printf("first come first served: p50 %8.1f us, p99 %8.1f us, max %8.1f us\n",
+         fifo[0], fifo[1], fifo[2]);
+  printf("deficit round robin:     p50 %8.1f us, p99 %8.1f us, max %8.1f us\n",
+         fair[0], fair[1], fair[2]);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heavy.h"
+
+/*
+ * Accuracy of the merged top keys against exact counts, for a skewed stream
+ * split over more and more sketches. Memory per sketch is set at build time:
+ *   make clean && make bench CC="gcc -DHEAVY_CAPACITY=128"
+ */
+
+#define KEYS 10000       // Distinct hosts in the stream
+#define STREAM 1000000   // Requests counted per run
+#define TOP 10           // Heaviest keys checked
+#define MAX_SKETCHES 8   // Threads the stream is split over at most
+
+static char names[KEYS][32];
+static double cdf[KEYS];
+static uint64_t exact[KEYS];
+static int stream[STREAM];
+static HeavySketch sketches[MAX_SKETCHES];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/* Zipf distribution over the keys: key i has weight 1 / (i + 1)^skew */
+static void build_cdf(const double skew) {
+  double sum = 0;
+  for (int i = 0; i < KEYS; i++)
+    cdf[i] = sum += 1 / pow(i + 1, skew);
+  for (int i = 0; i < KEYS; i++)
+    cdf[i] /= sum;
+}
+
+static int draw(uint64_t *state) {
+  double u = (next_random(state) >> 11) * 0x1.0p-53;
+  int lo = 0, hi = KEYS - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int by_weight(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Count the stream split over `threads` sketches, as the handler threads
+ * do, and compare the merged top keys with the exact counts
+ */
+static void run(const double skew, const int threads) {
+  memset(sketches, 0, sizeof(sketches));
+  memset(exact, 0, sizeof(exact));
+  build_cdf(skew);
+
+  uint64_t state = 88172645463325252ULL;
+  for (int i = 0; i < STREAM; i++)
+    exact[stream[i] = draw(&state)]++;
+
+  double start = now_ns();
+  for (int i = 0; i < STREAM; i++)
+    heavy_add(&sketches[i % threads], names[stream[i]], 1);
+  double elapsed = now_ns() - start;
+
+  HeavySketch *list[MAX_SKETCHES];
+  for (int i = 0; i < threads; i++)
+    list[i] = &sketches[i];
+  HeavyStat top[TOP];
+  size_t count = heavy_merge(list, threads, top, TOP);
+
+  // Weight of the TOP-th heaviest key, keys at least as heavy are correct
+  static uint64_t sorted[KEYS];
+  memcpy(sorted, exact, sizeof(exact));
+  qsort(sorted, KEYS, sizeof(*sorted), by_weight);
+  uint64_t threshold = sorted[TOP - 1];
+
+  int found = 0;
+  double worst = 0;
+  for (size_t i = 0; i < count; i++) {
+    int key = atoi(top[i].key + 5);
+    if (exact[key] >= threshold)
+      found++;
+    double off = fabs((double)top[i].count - exact[key]) / exact[key];
+    if (off > worst)
+      worst = off;
+  }
+
+  printf("%5.2f %8d %9zu %7d/%d %11.2f%% %9.1f\n", skew, threads,
+         threads * sizeof(HeavySketch), found, TOP, worst * 100,
+         elapsed / STREAM);
+}
+
+int main(void) {
+  for (int i = 0; i < KEYS; i++)
+    snprintf(names[i], sizeof(names[i]), "host-%d.example.com", i);
+
+  printf("Space-Saving, %d entries per sketch, %d requests over %d hosts\n",
+         HEAVY_CAPACITY, STREAM, KEYS);
+  printf("%5s %8s %9s %9s %12s %9s\n", "skew", "sketches", "bytes",
+         "top found", "worst error", "ns/add");
+
+  static const double skews[] = {0.8, 1.0, 1.2};
+  for (size_t s = 0; s < sizeof(skews) / sizeof(*skews); s++)
+    for (int threads = 1; threads <= MAX_SKETCHES; threads *= 2)
+      run(skews[s], threads);
+
+  return 0;
+}
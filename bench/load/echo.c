@@ -0,0 +1,67 @@
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "load.h"
+
+/*
+ * Target of the tunnel load tests: sends every byte back, standing in for a
+ * TLS server behind a CONNECT. One thread per connection.
+ */
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "USAGE: %s [-p PORT]\n"
+          "Echo every byte received on 127.0.0.1:PORT (default: %d)\n",
+          prog, LOAD_ECHO_PORT);
+}
+
+static void *serve(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[LOAD_BUF];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+    if (send_all(fd, buf, n) == -1)
+      break;
+
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int port = LOAD_ECHO_PORT, opt;
+  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+    if (opt != 'p') {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    port = atoi(optarg);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  int listen_fd = listen_on(port);
+  if (listen_fd == -1)
+    return EXIT_FAILURE;
+
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+      continue;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+}
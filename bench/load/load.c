@@ -0,0 +1,208 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "load.h"
+
+int send_all(const int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return -1;
+    p += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+int listen_on(const int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 1024) == -1) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int connect_to(const char *host, const int port) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res = NULL;
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  if (getaddrinfo(host, service, &hints, &res) != 0)
+    return -1;
+
+  int fd = -1;
+  for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd != -1) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+/* Read more bytes, moving the unread ones to the front */
+static ssize_t fill(Reader *reader) {
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  if (reader->end == sizeof(reader->buf))
+    return -1;
+
+  ssize_t n;
+  do {
+    n = recv(reader->fd, reader->buf + reader->end,
+             sizeof(reader->buf) - reader->end, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n > 0)
+    reader->end += n;
+  return n;
+}
+
+ssize_t read_head(Reader *reader, char *head, const size_t size) {
+  while (1) {
+    const char *from = reader->buf + reader->start;
+    size_t avail = reader->end - reader->start;
+    const char *end = memmem(from, avail, "\r\n\r\n", 4);
+    if (end != NULL) {
+      size_t len = end + 4 - from;
+      if (len >= size)
+        return -1;
+      memcpy(head, from, len);
+      head[len] = '\0';
+      reader->start += len;
+      return len;
+    }
+
+    if (avail >= size)
+      return -1;
+    ssize_t n = fill(reader);
+    if (n <= 0)
+      return n == 0 && avail == 0 ? 0 : -1;
+  }
+}
+
+int read_line(Reader *reader, char *line, const size_t size) {
+  while (1) {
+    const char *from = reader->buf + reader->start;
+    size_t avail = reader->end - reader->start;
+    const char *end = memmem(from, avail, "\r\n", 2);
+    if (end != NULL) {
+      size_t len = end - from;
+      if (len >= size)
+        return -1;
+      memcpy(line, from, len);
+      line[len] = '\0';
+      reader->start += len + 2;
+      return 0;
+    }
+
+    if (fill(reader) <= 0)
+      return -1;
+  }
+}
+
+int reader_skip(Reader *reader, size_t len) {
+  while (len > 0) {
+    size_t avail = reader->end - reader->start;
+    if (avail == 0) {
+      if (fill(reader) <= 0)
+        return -1;
+      continue;
+    }
+
+    size_t used = avail < len ? avail : len;
+    reader->start += used;
+    len -= used;
+  }
+  return 0;
+}
+
+int parse_host_port(const char *spec, char *host, const size_t size,
+                    int *port) {
+  const char *colon = strrchr(spec, ':');
+  if (colon == NULL || (size_t)(colon - spec) >= size)
+    return -1;
+  memcpy(host, spec, colon - spec);
+  host[colon - spec] = '\0';
+  *port = atoi(colon + 1);
+  return *port > 0 && *port < 65536 ? 0 : -1;
+}
+
+int read_proc(const pid_t pid, ProcStat *stat) {
+  char path[64], buf[4096];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  buf[n] = '\0';
+
+  // Fields after the command name, which may hold spaces: utime is the 12th
+  unsigned long utime = 0, stime = 0;
+  const char *fields = strrchr(buf, ')');
+  if (fields == NULL ||
+      sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2)
+    return -1;
+  stat->cpu_s = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  if ((file = fopen(path, "r")) == NULL)
+    return -1;
+  while (fgets(buf, sizeof(buf), file) != NULL) {
+    sscanf(buf, "VmRSS: %ld", &stat->rss_kb);
+    sscanf(buf, "VmHWM: %ld", &stat->peak_rss_kb);
+  }
+  fclose(file);
+  return 0;
+}
+
+int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+uint32_t percentile(const uint32_t *sorted, const size_t count,
+                    const double q) {
+  if (count == 0)
+    return 0;
+  size_t index = (size_t)(q * count);
+  return sorted[index < count ? index : count - 1];
+}
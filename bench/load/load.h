@@ -0,0 +1,102 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Constants */
+#define LOAD_ORIGIN_PORT 18081 // Origin server of the load tests
+#define LOAD_ECHO_PORT 18082   // Echo server, the target of the tunnels
+#define LOAD_REPLAY_PORT 18083 // Stub origin of the replays
+#define LOAD_HEAD_MAX 8192     // Longest request or response head
+#define LOAD_BUF 65536         // Bytes read at once
+
+/* Data Structures */
+
+/* CPU time and memory of a process */
+typedef struct ProcStat {
+  double cpu_s;
+  long rss_kb, peak_rss_kb;
+} ProcStat;
+
+/* Buffered reader over a socket */
+typedef struct Reader {
+  int fd;
+  size_t start, end; // Unread bytes are buf[start, end)
+  char buf[LOAD_BUF];
+} Reader;
+
+/**
+ * @brief Send a whole buffer
+ *
+ * @return 0 on success, -1 on error
+ */
+int send_all(const int fd, const void *buf, size_t len);
+
+/**
+ * @brief Listen on 127.0.0.1:port
+ *
+ * @return Listening socket, -1 on error
+ */
+int listen_on(const int port);
+
+/**
+ * @brief Connect to host:port, with Nagle's algorithm off
+ *
+ * @return Connected socket, -1 on error
+ */
+int connect_to(const char *host, const int port);
+
+/**
+ * @brief Read a message head, up to and including the empty line
+ *
+ * @param head Filled with the head, NUL terminated
+ *
+ * @return Length of the head, 0 when the peer closed first, -1 on error
+ */
+ssize_t read_head(Reader *reader, char *head, const size_t size);
+
+/**
+ * @brief Read a line without its CRLF
+ *
+ * @return 0 on success, -1 on error or end of stream
+ */
+int read_line(Reader *reader, char *line, const size_t size);
+
+/**
+ * @brief Read and discard `len` bytes
+ *
+ * @return 0 on success, -1 on error or end of stream
+ */
+int reader_skip(Reader *reader, size_t len);
+
+/**
+ * @brief Split HOST:PORT
+ *
+ * @return 0 on success, -1 when malformed or `host` is too small
+ */
+int parse_host_port(const char *spec, char *host, const size_t size,
+                    int *port);
+
+/**
+ * @brief Read the CPU time and memory of a process from /proc
+ *
+ * @return 0 on success, -1 on error
+ */
+int read_proc(const pid_t pid, ProcStat *stat);
+
+/**
+ * @brief qsort() comparison of uint32_t values, ascending
+ */
+int compare_u32(const void *a, const void *b);
+
+/**
+ * @brief Value at quantile `q` of `count` sorted values (0 when empty)
+ */
+uint32_t percentile(const uint32_t *sorted, const size_t count,
+                    const double q);
+
+#endif /* LOAD_H */
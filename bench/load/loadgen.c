@@ -0,0 +1,457 @@
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "load.h"
+
+/*
+ * Closed-loop load generator: each connection sends a request through the
+ * proxy, waits for the whole response and sends the next one. Prints one
+ * JSON object with the request rate, throughput, latency percentiles and,
+ * given its PID, the proxy's CPU time and memory, along with what the idle
+ * connections added to it.
+ */
+
+#define IO_TIMEOUT_S 3 // A stalled proxy fails the request instead of hanging
+#define NO_RESPONSE -2 // Closed before any response, see run_get()
+#define IDLE_PER_SOURCE 20000 // Idle connections per loopback source address
+
+typedef enum { MODE_GET, MODE_TUNNEL } load_mode_t;
+
+typedef struct Options {
+  const char *name;
+  load_mode_t mode;
+  char proxy_host[256];
+  int proxy_port;
+  char url[2048];      // Absolute URL requested through the proxy
+  char authority[512]; // host:port of the URL, or of the tunnel target
+  int connections;
+  int idle; // Connections opened and left idle during the run
+  double seconds;
+  size_t echo_bytes; // Bytes sent and echoed back per tunnel round trip
+  bool close;        // One request per connection
+  pid_t pid;         // Proxy, for its CPU time and memory (0: not measured)
+} Options;
+
+typedef struct Worker {
+  pthread_t tid;
+  uint64_t requests, errors, retries, bytes;
+  uint32_t *latency_us; // One per completed request
+  size_t count, cap;
+  Reader reader;
+} Worker;
+
+static Options opts = {.name = "run",
+                       .proxy_host = "127.0.0.1",
+                       .proxy_port = 8080,
+                       .connections = 8,
+                       .seconds = 5,
+                       .echo_bytes = 4096};
+static atomic_bool stop = false;
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "USAGE: %s -x HOST:PORT (-u URL | -t HOST:PORT) [OPTIONS]\n"
+          "  -x HOST:PORT  Proxy\n"
+          "  -u URL        GET this http:// URL through the proxy\n"
+          "  -t HOST:PORT  Tunnel to this echo server with CONNECT instead\n"
+          "  -b BYTES      Bytes echoed per tunnel round trip (default: %zu)\n"
+          "  -c N          Concurrent connections (default: %d)\n"
+          "  -i N          Idle connections held open meanwhile (default: 0)\n"
+          "  -d SECONDS    Duration (default: %g)\n"
+          "  -C            Close the connection after each request\n"
+          "  -P PID        Report the CPU time and memory of this process\n"
+          "  -n NAME       Scenario name in the output\n",
+          prog, opts.echo_bytes, opts.connections, opts.seconds);
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_url(const char *url) {
+  if (strncmp(url, "http://", 7) != 0 || strlen(url) >= sizeof(opts.url))
+    return -1;
+  const char *host = url + 7, *slash = strchr(host, '/');
+  size_t len = slash != NULL ? (size_t)(slash - host) : strlen(host);
+  if (len == 0 || len >= sizeof(opts.authority))
+    return -1;
+  memcpy(opts.authority, host, len);
+  opts.authority[len] = '\0';
+  strcpy(opts.url, url);
+  return 0;
+}
+
+static void record(Worker *w, const double start, const uint64_t bytes) {
+  if (w->count == w->cap) {
+    size_t cap = w->cap ? w->cap * 2 : 4096;
+    uint32_t *grown = realloc(w->latency_us, cap * sizeof(*grown));
+    if (grown == NULL)
+      return;
+    w->latency_us = grown;
+    w->cap = cap;
+  }
+  w->latency_us[w->count++] = (uint32_t)((now_s() - start) * 1e6);
+  w->requests++;
+  w->bytes += bytes;
+}
+
+static int open_proxy(Worker *w) {
+  int fd = connect_to(opts.proxy_host, opts.proxy_port);
+  if (fd == -1)
+    return -1;
+
+  struct timeval timeout = {IO_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  w->reader.fd = fd;
+  w->reader.start = w->reader.end = 0;
+  return fd;
+}
+
+/* Read until the peer closes, returning the bytes read or -1 on error */
+static long drain(Reader *reader) {
+  long total = reader->end - reader->start;
+  reader->start = reader->end = 0;
+  ssize_t n;
+  while ((n = recv(reader->fd, reader->buf, sizeof(reader->buf), 0)) > 0)
+    total += n;
+  return n == 0 ? total : -1;
+}
+
+/*
+ * Read a whole response, returning its body length, NO_RESPONSE when the
+ * proxy closed first or -1 on error. `keep` is cleared when the connection
+ * can't carry another request.
+ */
+static long read_response(Reader *reader, bool *keep) {
+  char head[LOAD_HEAD_MAX], line[64];
+  ssize_t head_len = read_head(reader, head, sizeof(head));
+  if (head_len <= 0)
+    return head_len == 0 ? NO_RESPONSE : -1;
+
+  int status = 0;
+  if (sscanf(head, "HTTP/%*d.%*d %d", &status) != 1)
+    return -1;
+  *keep = strcasestr(head, "\r\nConnection: close") == NULL;
+
+  long body = 0;
+  const char *length = strcasestr(head, "\r\nContent-Length:");
+  if (length != NULL) {
+    body = strtol(length + 17, NULL, 10);
+    if (reader_skip(reader, body) == -1)
+      return -1;
+  } else if (strcasestr(head, "\r\nTransfer-Encoding: chunked") != NULL) {
+    while (1) {
+      if (read_line(reader, line, sizeof(line)) == -1)
+        return -1;
+      long size = strtol(line, NULL, 16);
+      if (size == 0)
+        break;
+      if (reader_skip(reader, size) == -1 ||
+          read_line(reader, line, sizeof(line)) == -1)
+        return -1;
+      body += size;
+    }
+    // Trailers end with an empty line
+    do {
+      if (read_line(reader, line, sizeof(line)) == -1)
+        return -1;
+    } while (line[0] != '\0');
+  } else {
+    body = drain(reader);
+    *keep = false;
+  }
+
+  return status >= 200 && status < 400 ? body : -1;
+}
+
+static void *run_get(void *arg) {
+  Worker *w = (Worker *)arg;
+  char request[4096];
+  int len = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n"
+                     "%s\r\n",
+                     opts.url, opts.authority,
+                     opts.close ? "Connection: close\r\n" : "");
+
+  int fd = -1;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    double start = now_s();
+    bool reused = fd != -1;
+    if (fd == -1 && (fd = open_proxy(w)) == -1) {
+      w->errors++;
+      usleep(10000);
+      continue;
+    }
+
+    bool keep = false;
+    long body = NO_RESPONSE;
+    if (send_all(fd, request, len) == 0)
+      body = read_response(&w->reader, &keep);
+
+    // Closed between requests, e.g. while the proxy drains: retried on a new
+    // connection, as browsers do
+    if (body == NO_RESPONSE && reused) {
+      w->retries++;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    if (body < 0)
+      w->errors++;
+    else
+      record(w, start, body);
+
+    if (body < 0 || !keep || opts.close) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd != -1)
+    close(fd);
+  return NULL;
+}
+
+static void *run_tunnel(void *arg) {
+  Worker *w = (Worker *)arg;
+  char request[1024], head[LOAD_HEAD_MAX];
+  int len = snprintf(request, sizeof(request),
+                     "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                     opts.authority, opts.authority);
+  char *payload = malloc(opts.echo_bytes);
+  if (payload == NULL)
+    return NULL;
+  memset(payload, 'e', opts.echo_bytes);
+
+  int fd = -1;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    if (fd == -1) {
+      int status = 0;
+      if ((fd = open_proxy(w)) == -1 || send_all(fd, request, len) == -1 ||
+          read_head(&w->reader, head, sizeof(head)) <= 0 ||
+          sscanf(head, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+        w->errors++;
+        if (fd != -1)
+          close(fd);
+        fd = -1;
+        usleep(10000);
+        continue;
+      }
+    }
+
+    double start = now_s();
+    if (send_all(fd, payload, opts.echo_bytes) == -1 ||
+        reader_skip(&w->reader, opts.echo_bytes) == -1) {
+      w->errors++;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    record(w, start, opts.echo_bytes);
+  }
+
+  if (fd != -1)
+    close(fd);
+  free(payload);
+  return NULL;
+}
+
+/*
+ * Idle connection `i`. To a loopback proxy they come from 127.0.0.1, .2 and
+ * so on: a source address only has so many ephemeral ports for one proxy.
+ */
+static int open_idle(const int i) {
+  struct in_addr proxy;
+  if (inet_pton(AF_INET, opts.proxy_host, &proxy) != 1 ||
+      (ntohl(proxy.s_addr) >> 24) != 127)
+    return connect_to(opts.proxy_host, opts.proxy_port);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  // The port is picked at connect(), for the whole address pair
+  int one = 1;
+  setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+  struct sockaddr_in from = {.sin_family = AF_INET};
+  from.sin_addr.s_addr = htonl(0x7f000001 + i / IDLE_PER_SOURCE);
+  struct sockaddr_in to = {.sin_family = AF_INET,
+                           .sin_port = htons(opts.proxy_port),
+                           .sin_addr = proxy};
+  if (bind(fd, (struct sockaddr *)&from, sizeof(from)) == -1 ||
+      connect(fd, (struct sockaddr *)&to, sizeof(to)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Idle connections still open, the proxy may have dropped some */
+static int count_held(const int *fds, const int count) {
+  int held = 0;
+  for (int i = 0; i < count; i++) {
+    struct pollfd pfd = {.fd = fds[i], .events = POLLIN};
+    if (fds[i] != -1 && poll(&pfd, 1, 0) == 0)
+      held++;
+  }
+  return held;
+}
+
+static int parse_args(int argc, char **argv) {
+  int opt;
+  bool target = false;
+  while ((opt = getopt(argc, argv, "x:u:t:b:c:i:d:CP:n:h")) != -1) {
+    switch (opt) {
+    case 'x':
+      if (parse_host_port(optarg, opts.proxy_host, sizeof(opts.proxy_host),
+                          &opts.proxy_port) == -1)
+        return -1;
+      break;
+    case 'u':
+      if (parse_url(optarg) == -1)
+        return -1;
+      opts.mode = MODE_GET;
+      target = true;
+      break;
+    case 't':
+      if (strlen(optarg) >= sizeof(opts.authority))
+        return -1;
+      strcpy(opts.authority, optarg);
+      opts.mode = MODE_TUNNEL;
+      target = true;
+      break;
+    case 'b':
+      opts.echo_bytes = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      opts.connections = atoi(optarg);
+      break;
+    case 'i':
+      opts.idle = atoi(optarg);
+      break;
+    case 'd':
+      opts.seconds = atof(optarg);
+      break;
+    case 'C':
+      opts.close = true;
+      break;
+    case 'P':
+      opts.pid = atoi(optarg);
+      break;
+    case 'n':
+      opts.name = optarg;
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (!target || opts.connections <= 0 || opts.idle < 0 ||
+      !(opts.seconds > 0) || opts.echo_bytes == 0 ||
+      opts.echo_bytes > LOAD_BUF)
+    return -1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (parse_args(argc, argv) == -1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int *idle = malloc((opts.idle + 1) * sizeof(*idle));
+  Worker *workers = calloc(opts.connections, sizeof(*workers));
+  if (idle == NULL || workers == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  // The proxy's memory before the idle connections, to tell what they cost
+  ProcStat base = {0}, before = {0}, after = {0};
+  bool measured = opts.pid > 0 && read_proc(opts.pid, &base) == 0;
+  for (int i = 0; i < opts.idle; i++)
+    idle[i] = open_idle(i);
+  measured = measured && read_proc(opts.pid, &before) == 0;
+
+  double start = now_s();
+  for (int i = 0; i < opts.connections; i++)
+    pthread_create(&workers[i].tid, NULL,
+                   opts.mode == MODE_GET ? run_get : run_tunnel, &workers[i]);
+
+  struct timespec pause = {(time_t)opts.seconds,
+                           (long)((opts.seconds - (time_t)opts.seconds) * 1e9)};
+  nanosleep(&pause, NULL);
+  atomic_store(&stop, true);
+  for (int i = 0; i < opts.connections; i++)
+    pthread_join(workers[i].tid, NULL);
+  double elapsed = now_s() - start;
+  measured = measured && read_proc(opts.pid, &after) == 0;
+  int held = count_held(idle, opts.idle);
+
+  uint64_t requests = 0, errors = 0, retries = 0, bytes = 0;
+  size_t count = 0;
+  for (int i = 0; i < opts.connections; i++) {
+    requests += workers[i].requests;
+    errors += workers[i].errors;
+    retries += workers[i].retries;
+    bytes += workers[i].bytes;
+    count += workers[i].count;
+  }
+  uint32_t *all = malloc((count + 1) * sizeof(*all));
+  if (all == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  size_t merged = 0;
+  for (int i = 0; i < opts.connections; i++) {
+    memcpy(all + merged, workers[i].latency_us,
+           workers[i].count * sizeof(*all));
+    merged += workers[i].count;
+    free(workers[i].latency_us);
+  }
+  qsort(all, merged, sizeof(*all), compare_u32);
+
+  printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"connections\":%d,"
+         "\"idle\":%d,\"idle_held\":%d,\"seconds\":%.3f,"
+         "\"requests\":%llu,\"errors\":%llu,\"retries\":%llu,"
+         "\"req_per_s\":%.1f,"
+         "\"bytes\":%llu,\"mib_per_s\":%.2f,"
+         "\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}",
+         opts.name, opts.mode == MODE_GET ? "get" : "tunnel",
+         opts.connections, opts.idle, held, elapsed,
+         (unsigned long long)requests, (unsigned long long)errors,
+         (unsigned long long)retries, requests / elapsed, (unsigned long long)bytes,
+         bytes / elapsed / (1 << 20), percentile(all, merged, 0.5),
+         percentile(all, merged, 0.99), percentile(all, merged, 0.999),
+         merged > 0 ? all[merged - 1] : 0);
+  if (measured)
+    printf(",\"proxy\":{\"cpu_percent\":%.1f,\"rss_kb\":%ld,"
+           "\"peak_rss_kb\":%ld,\"idle_rss_kb\":%ld}",
+           (after.cpu_s - before.cpu_s) / elapsed * 100, after.rss_kb,
+           after.peak_rss_kb, after.rss_kb - base.rss_kb);
+  printf("}\n");
+
+  for (int i = 0; i < opts.idle; i++)
+    if (idle[i] != -1)
+      close(idle[i]);
+  free(idle);
+  free(workers);
+  free(all);
+  return errors > 0 && requests == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "load.h"
+
+/*
+ * Origin server for the load tests, one thread per connection with
+ * keep-alive. Endpoints:
+ *   /size/N     N bytes with a Content-Length
+ *   /chunked/N  N bytes in chunks of CHUNK bytes
+ *   /slow/MS    A short body after MS milliseconds
+ * The request target may be absolute, as forwarded by a proxy. The head goes
+ * out in the same write as the start of the body, and each chunk in a write
+ * of its own, as most servers do.
+ */
+
+#define CHUNK 16384             // Bytes per write, and per chunk
+#define OUT_MAX (CHUNK + 512)   // A response head and a chunk
+
+static char filler[CHUNK];
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "USAGE: %s [-p PORT]\n"
+          "Serve /size/N, /chunked/N and /slow/MS on 127.0.0.1:PORT "
+          "(default: %d)\n",
+          prog, LOAD_ORIGIN_PORT);
+}
+
+/* Send a head and `len` body bytes, the head sharing the first write */
+static int send_sized(const int fd, char *out, const size_t used,
+                      size_t len) {
+  size_t part = len < CHUNK ? len : CHUNK;
+  memcpy(out + used, filler, part);
+  if (send_all(fd, out, used + part) == -1)
+    return -1;
+
+  for (len -= part; len > 0; len -= part) {
+    part = len < CHUNK ? len : CHUNK;
+    if (send_all(fd, filler, part) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Send a head and `len` body bytes in chunks, each chunk in one write */
+static int send_chunked(const int fd, char *out, size_t used, size_t len) {
+  do {
+    size_t part = len < CHUNK ? len : CHUNK;
+    if (part > 0) {
+      used += sprintf(out + used, "%zx\r\n", part);
+      memcpy(out + used, filler, part);
+      memcpy(out + used + part, "\r\n", 2);
+      used += part + 2;
+      len -= part;
+    }
+    if (len == 0) {
+      memcpy(out + used, "0\r\n\r\n", 5);
+      used += 5;
+    }
+
+    if (send_all(fd, out, used) == -1)
+      return -1;
+    used = 0;
+  } while (len > 0);
+  return 0;
+}
+
+/* Answer one request, returning -1 when the connection must close */
+static int respond(const int fd, const char *head, char *out) {
+  char method[16], target[2048], version[16];
+  if (sscanf(head, "%15s %2047s %15s", method, target, version) != 3)
+    return -1;
+
+  // Absolute form: skip the scheme and authority
+  const char *path = target;
+  if (strncmp(path, "http://", 7) == 0) {
+    path = strchr(path + 7, '/');
+    if (path == NULL)
+      path = "/";
+  }
+
+  bool close_after = strcasestr(head, "\r\nConnection: close") != NULL;
+  const char *connection = close_after ? "close" : "keep-alive";
+  unsigned long value = 0;
+  int status;
+
+  if (sscanf(path, "/size/%lu", &value) == 1) {
+    int n = sprintf(out,
+                    "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream"
+                    "\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+                    value, connection);
+    status = send_sized(fd, out, n, value);
+  } else if (sscanf(path, "/chunked/%lu", &value) == 1) {
+    int n = sprintf(out,
+                    "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream"
+                    "\r\nTransfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+                    connection);
+    status = send_chunked(fd, out, n, value);
+  } else if (sscanf(path, "/slow/%lu", &value) == 1) {
+    struct timespec pause = {value / 1000, (value % 1000) * 1000000L};
+    nanosleep(&pause, NULL);
+    int n = sprintf(out,
+                    "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                    "Content-Length: 3\r\nConnection: %s\r\n\r\nok\n",
+                    connection);
+    status = send_all(fd, out, n);
+  } else {
+    int n = sprintf(out,
+                    "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                    "Connection: %s\r\n\r\n",
+                    connection);
+    status = send_all(fd, out, n);
+  }
+
+  return close_after ? -1 : status;
+}
+
+static void *serve(void *arg) {
+  Reader *reader = malloc(sizeof(Reader));
+  char *head = malloc(LOAD_HEAD_MAX), *out = malloc(OUT_MAX);
+  if (reader != NULL && head != NULL && out != NULL) {
+    reader->fd = (int)(intptr_t)arg;
+    reader->start = reader->end = 0;
+
+    // Requests carry no body, only their heads are read
+    while (read_head(reader, head, LOAD_HEAD_MAX) > 0 &&
+           respond(reader->fd, head, out) == 0)
+      ;
+  }
+
+  close((int)(intptr_t)arg);
+  free(reader);
+  free(head);
+  free(out);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int port = LOAD_ORIGIN_PORT, opt;
+  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+    if (opt != 'p') {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    port = atoi(optarg);
+  }
+
+  memset(filler, 'x', sizeof(filler));
+  signal(SIGPIPE, SIG_IGN);
+  int listen_fd = listen_on(port);
+  if (listen_fd == -1)
+    return EXIT_FAILURE;
+
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+      continue;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+}
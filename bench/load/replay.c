@@ -0,0 +1,644 @@
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "load.h"
+
+/*
+ * Replays a capture taken with `httproxy --capture FILE` through a proxy.
+ * Each recorded client connection is opened, and its bytes sent, at the
+ * recorded times divided by the speed-up. A stub origin answers each request
+ * with a response recorded for the same request line, in the order they were
+ * recorded. Start the proxy with `--upstream 127.0.0.1:PORT` so that every
+ * request reaches the stub. Prints one JSON object, as loadgen does.
+ */
+
+#define IO_TIMEOUT_S 3 // Wait for a stalled response before giving up
+
+typedef struct Options {
+  const char *name;
+  const char *path;
+  char proxy_host[256];
+  int proxy_port;
+  int stub_port;
+  double speed; // 0: no pauses at all
+  pid_t pid;    // Proxy, for its CPU time and memory (0: not measured)
+} Options;
+
+/* Bytes the client sent */
+typedef struct Sent {
+  size_t off;     // Of the CLIENT record in the capture
+  uint64_t after; // Bytes of responses recorded before it
+} Sent;
+
+/* A recorded client connection and how its replay went */
+typedef struct Conn {
+  uint64_t id;
+  uint64_t open_ns, close_ns;
+  bool lost; // Records were dropped, the connection isn't replayed
+
+  Sent *records;
+  size_t count, cap;
+  uint64_t expected; // Bytes the upstream sent, relayed back by the proxy
+
+  // Pairing of the recorded requests and responses
+  size_t *starts; // Offsets of the records starting a request
+  size_t start_count, start_cap, answered;
+  size_t reply; // Index + 1 of the reply being gathered, 0: none
+
+  pthread_t tid;
+  bool started;
+  uint64_t requests, sent, received;
+  bool failed, incomplete;
+  double waiting_since; // A request was sent and nothing came back yet
+  uint32_t *latency_us; // Request start to the next bytes back
+  size_t latency_count, latency_cap;
+} Conn;
+
+/* Response recorded for a request line */
+typedef struct Reply {
+  const char *line;
+  size_t line_len;
+  size_t seq; // Keeps the recorded order among equal lines
+  unsigned char *data;
+  size_t len;
+} Reply;
+
+/* Replies to the same request line, handed out in turn */
+typedef struct ReplyGroup {
+  const Reply *first;
+  size_t count;
+  atomic_size_t next;
+} ReplyGroup;
+
+static Options opts = {.name = "replay",
+                       .proxy_host = "127.0.0.1",
+                       .proxy_port = 8080,
+                       .stub_port = LOAD_REPLAY_PORT,
+                       .speed = 1};
+
+static unsigned char *capture;
+static size_t capture_len;
+static Conn *conns;
+static size_t conn_count;
+static Reply *replies;
+static size_t reply_count;
+static ReplyGroup *groups;
+static size_t group_count;
+static double start_s;
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "USAGE: %s [OPTIONS] FILE\n"
+          "Replay a capture through a proxy sending its requests to a stub\n"
+          "  -x HOST:PORT  Proxy (default: 127.0.0.1:8080)\n"
+          "  -p PORT       Port of the stub origin (default: %d), give it to\n"
+          "                the proxy as --upstream 127.0.0.1:PORT\n"
+          "  -s SPEED      Replay SPEED times faster, 0 for no pauses "
+          "(default: 1)\n"
+          "  -P PID        Report the CPU time and memory of this process\n"
+          "  -n NAME       Scenario name in the output\n",
+          prog, LOAD_REPLAY_PORT);
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* When a recorded time comes in the replay */
+static double due(const uint64_t time_ns) {
+  return opts.speed > 0 ? start_s + time_ns / 1e9 / opts.speed : 0;
+}
+
+static void sleep_until(const double when) {
+  double left = when - now_s();
+  if (left <= 0)
+    return;
+  struct timespec pause = {(time_t)left, (long)((left - (time_t)left) * 1e9)};
+  nanosleep(&pause, NULL);
+}
+
+/* Records are packed in the file, their headers are copied out */
+static CaptureRecord record_at(const size_t off) {
+  CaptureRecord rec;
+  memcpy(&rec, capture + off, sizeof(rec));
+  return rec;
+}
+
+/* Make room for one more element */
+static int grow(void **array, const size_t count, size_t *cap,
+                const size_t size) {
+  if (count < *cap)
+    return 0;
+  size_t grown_cap = *cap ? *cap * 2 : 16;
+  void *grown = realloc(*array, grown_cap * size);
+  if (grown == NULL)
+    return -1;
+  *array = grown;
+  *cap = grown_cap;
+  return 0;
+}
+
+static int load_capture(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  capture_len = ftell(file);
+  rewind(file);
+  capture = malloc(capture_len + 1);
+  bool read = capture != NULL &&
+              fread(capture, 1, capture_len, file) == capture_len;
+  fclose(file);
+  if (!read) {
+    fprintf(stderr, "%s: failed to read\n", path);
+    return -1;
+  }
+
+  CaptureFileHeader header = {0};
+  if (capture_len >= sizeof(header))
+    memcpy(&header, capture, sizeof(header));
+  if (memcmp(header.magic, CAPTURE_FILE_MAGIC, sizeof(CAPTURE_FILE_MAGIC)) ||
+      header.version != CAPTURE_VERSION ||
+      header.record_size != sizeof(CaptureRecord)) {
+    fprintf(stderr, "%s: not a capture of this version\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Offset of the next whole record, 0 at the end (the last may be cut) */
+static size_t next_record(const size_t off) {
+  if (off + sizeof(CaptureRecord) > capture_len)
+    return 0;
+  CaptureRecord rec = record_at(off);
+  size_t end = off + sizeof(rec) + rec.len;
+  return end <= capture_len ? end : 0;
+}
+
+static int by_id(const void *a, const void *b) {
+  uint64_t x = ((const Conn *)a)->id, y = ((const Conn *)b)->id;
+  return (x > y) - (x < y);
+}
+
+static int by_open(const void *a, const void *b) {
+  uint64_t x = ((const Conn *)a)->open_ns, y = ((const Conn *)b)->open_ns;
+  return (x > y) - (x < y);
+}
+
+static int by_line(const void *a, const void *b) {
+  const Reply *x = (const Reply *)a, *y = (const Reply *)b;
+  size_t len = x->line_len < y->line_len ? x->line_len : y->line_len;
+  int cmp = memcmp(x->line, y->line, len);
+  if (cmp == 0)
+    cmp = (x->line_len > y->line_len) - (x->line_len < y->line_len);
+  if (cmp == 0)
+    cmp = (x->seq > y->seq) - (x->seq < y->seq);
+  return cmp;
+}
+
+/* Request line at the start of a record, the key of its reply */
+static void request_line(const size_t off, const char **line, size_t *len) {
+  CaptureRecord rec = record_at(off);
+  const char *data = (const char *)capture + off + sizeof(rec);
+  const char *end = memmem(data, rec.len, "\r\n", 2);
+  *line = data;
+  *len = end != NULL ? (size_t)(end - data) : rec.len;
+}
+
+/* Pair a response with the oldest request of the connection left unanswered */
+static int gather_reply(Conn *conn, const size_t off) {
+  CaptureRecord rec = record_at(off);
+  conn->expected += rec.len;
+
+  if (rec.flags & CAPTURE_START) {
+    conn->reply = 0;
+    if (conn->answered == conn->start_count)
+      return 0; // No request recorded for it
+
+    static size_t reply_cap = 0;
+    if (grow((void **)&replies, reply_count, &reply_cap, sizeof(*replies)) ==
+        -1)
+      return -1;
+    Reply *reply = &replies[reply_count];
+    *reply = (Reply){.seq = reply_count};
+    request_line(conn->starts[conn->answered++], &reply->line,
+                 &reply->line_len);
+    conn->reply = ++reply_count;
+  }
+  if (conn->reply == 0)
+    return 0;
+
+  Reply *reply = &replies[conn->reply - 1];
+  unsigned char *grown = realloc(reply->data, reply->len + rec.len);
+  if (grown == NULL)
+    return -1;
+  memcpy(grown + reply->len, capture + off + sizeof(rec), rec.len);
+  reply->data = grown;
+  reply->len += rec.len;
+  return 0;
+}
+
+/* Gather the connections, then their records and the recorded replies */
+static int index_capture(void) {
+  size_t cap = 0;
+  for (size_t off = sizeof(CaptureFileHeader), end; (end = next_record(off));
+       off = end) {
+    CaptureRecord rec = record_at(off);
+    if (rec.kind != CAPTURE_OPEN)
+      continue;
+    if (grow((void **)&conns, conn_count, &cap, sizeof(*conns)) == -1)
+      return -1;
+    conns[conn_count++] = (Conn){.id = rec.conn_id,
+                                 .open_ns = rec.time_ns,
+                                 .close_ns = rec.time_ns};
+  }
+  qsort(conns, conn_count, sizeof(*conns), by_id);
+
+  for (size_t off = sizeof(CaptureFileHeader), end; (end = next_record(off));
+       off = end) {
+    CaptureRecord rec = record_at(off);
+    Conn key = {.id = rec.conn_id};
+    Conn *conn = bsearch(&key, conns, conn_count, sizeof(*conns), by_id);
+    if (conn == NULL)
+      continue; // Opened before the capture started
+    conn->close_ns = rec.time_ns;
+
+    if (rec.kind == CAPTURE_CLOSE) {
+      conn->lost = rec.flags & CAPTURE_LOST;
+    } else if (rec.kind == CAPTURE_SERVER) {
+      if (gather_reply(conn, off) == -1)
+        return -1;
+    } else if (rec.kind == CAPTURE_CLIENT) {
+      if (grow((void **)&conn->records, conn->count, &conn->cap,
+               sizeof(Sent)) == -1)
+        return -1;
+      conn->records[conn->count++] = (Sent){off, conn->expected};
+      if (!(rec.flags & CAPTURE_START))
+        continue;
+      if (grow((void **)&conn->starts, conn->start_count, &conn->start_cap,
+               sizeof(size_t)) == -1)
+        return -1;
+      conn->starts[conn->start_count++] = off;
+    }
+  }
+
+  // Replies to the same request line next to each other, in recorded order
+  qsort(replies, reply_count, sizeof(*replies), by_line);
+  groups = calloc(reply_count + 1, sizeof(*groups));
+  if (groups == NULL)
+    return -1;
+  for (size_t i = 0; i < reply_count; i++) {
+    if (i == 0 || replies[i].line_len != replies[i - 1].line_len ||
+        memcmp(replies[i].line, replies[i - 1].line, replies[i].line_len))
+      groups[group_count++].first = &replies[i];
+    groups[group_count - 1].count++;
+  }
+
+  qsort(conns, conn_count, sizeof(*conns), by_open);
+  return 0;
+}
+
+static const Reply *find_reply(const char *line, const size_t len) {
+  size_t lo = 0, hi = group_count;
+  Reply key = {.line = line, .line_len = len, .seq = 0};
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    Reply first = *groups[mid].first;
+    first.seq = 0;
+    int cmp = by_line(&first, &key);
+    if (cmp == 0) {
+      size_t turn = atomic_fetch_add(&groups[mid].next, 1);
+      return groups[mid].first + turn % groups[mid].count;
+    }
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+/* Read the body of a request off the stub's connection */
+static int skip_body(Reader *reader, const char *head) {
+  const char *te = strcasestr(head, "\r\nTransfer-Encoding:");
+  if (te != NULL && strcasestr(te, "chunked") != NULL &&
+      strcasestr(te, "chunked") < strstr(te + 2, "\r\n")) {
+    char line[256];
+    while (1) {
+      if (read_line(reader, line, sizeof(line)) == -1)
+        return -1;
+      size_t size = strtoul(line, NULL, 16);
+      if (size == 0)
+        break;
+      if (reader_skip(reader, size + 2) == -1)
+        return -1;
+    }
+    do { // Trailer fields, up to the empty line
+      if (read_line(reader, line, sizeof(line)) == -1)
+        return -1;
+    } while (line[0] != '\0');
+    return 0;
+  }
+
+  const char *cl = strcasestr(head, "\r\nContent-Length:");
+  if (cl != NULL)
+    return reader_skip(reader, strtoul(cl + 17, NULL, 10));
+  return 0;
+}
+
+/* Whether the recorded response was delimited by closing the connection */
+static bool closes_after(const Reply *reply) {
+  const char *end = memmem(reply->data, reply->len, "\r\n\r\n", 4);
+  if (end == NULL)
+    return true;
+  size_t head_len = end - (const char *)reply->data;
+  char *head = strndup((const char *)reply->data, head_len);
+  if (head == NULL)
+    return true;
+
+  int status = atoi(head + 9); // Past "HTTP/1.1 "
+  bool closes = strcasestr(head, "\r\nConnection: close") != NULL ||
+                (status >= 200 && status != 204 && status != 304 &&
+                 strcasestr(head, "\r\nContent-Length:") == NULL &&
+                 strcasestr(head, "\r\nTransfer-Encoding:") == NULL);
+  free(head);
+  return closes;
+}
+
+static void *serve(void *arg) {
+  static const char not_found[] =
+      "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+  int fd = (int)(intptr_t)arg;
+  Reader *reader = malloc(sizeof(Reader));
+  char *head = malloc(LOAD_HEAD_MAX);
+  if (reader != NULL && head != NULL) {
+    reader->fd = fd;
+    reader->start = reader->end = 0;
+
+    while (read_head(reader, head, LOAD_HEAD_MAX) > 0 &&
+           skip_body(reader, head) == 0) {
+      const char *eol = strstr(head, "\r\n");
+      const Reply *reply = find_reply(head, eol - head);
+      if (reply == NULL) {
+        if (send_all(fd, not_found, sizeof(not_found) - 1) == -1)
+          break;
+        continue;
+      }
+      if (send_all(fd, reply->data, reply->len) == -1 || closes_after(reply))
+        break;
+    }
+  }
+
+  close(fd);
+  free(reader);
+  free(head);
+  return NULL;
+}
+
+static void *run_stub(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+      continue;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+  return NULL;
+}
+
+static void record_latency(Conn *conn) {
+  if (conn->waiting_since == 0)
+    return;
+  if (grow((void **)&conn->latency_us, conn->latency_count,
+           &conn->latency_cap, sizeof(uint32_t)) == 0)
+    conn->latency_us[conn->latency_count++] =
+        (uint32_t)((now_s() - conn->waiting_since) * 1e6);
+  conn->waiting_since = 0;
+}
+
+/*
+ * Read what the proxy sends back until `until` and until `need` bytes in all
+ * have arrived, so that no request goes out before the responses that came
+ * before it in the capture
+ *
+ * Returns 0 once both are met, -1 when the proxy closed or stalled
+ */
+static int pump(Conn *conn, const int fd, const double until,
+                const uint64_t need) {
+  static __thread char buf[LOAD_BUF];
+  double stall = now_s() + IO_TIMEOUT_S;
+  while (1) {
+    double now = now_s();
+    bool waiting = conn->received < need;
+    double wake = waiting && stall > until ? stall : until;
+    if (now >= wake)
+      return waiting ? -1 : 0;
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, (int)((wake - now) * 1000) + 1);
+    if (ready == 0)
+      continue;
+    if (ready == -1)
+      return -1;
+
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      return -1;
+    record_latency(conn);
+    conn->received += n;
+    stall = now_s() + IO_TIMEOUT_S;
+  }
+}
+
+static void *replay(void *arg) {
+  Conn *conn = (Conn *)arg;
+  int fd = connect_to(opts.proxy_host, opts.proxy_port);
+  if (fd == -1) {
+    conn->failed = true;
+    return NULL;
+  }
+
+  bool open = true;
+  for (size_t i = 0; i < conn->count; i++) {
+    const Sent *sent = &conn->records[i];
+    CaptureRecord rec = record_at(sent->off);
+    if (pump(conn, fd, due(rec.time_ns), sent->after) == -1) {
+      open = false;
+      break;
+    }
+
+    if (send_all(fd, capture + sent->off + sizeof(rec), rec.len) == -1) {
+      conn->failed = true;
+      open = false;
+      break;
+    }
+    conn->sent += rec.len;
+    if (rec.flags & CAPTURE_START) {
+      conn->requests++;
+      if (conn->waiting_since == 0)
+        conn->waiting_since = now_s();
+    }
+  }
+
+  // Hold the connection as long as it was held and for the responses left
+  if (open)
+    pump(conn, fd, due(conn->close_ns), conn->expected);
+
+  conn->incomplete = conn->received < conn->expected;
+  close(fd);
+  return NULL;
+}
+
+static int parse_args(int argc, char **argv) {
+  int opt;
+  char *end = NULL;
+  while ((opt = getopt(argc, argv, "x:p:s:P:n:h")) != -1) {
+    switch (opt) {
+    case 'x':
+      if (parse_host_port(optarg, opts.proxy_host, sizeof(opts.proxy_host),
+                          &opts.proxy_port) == -1)
+        return -1;
+      break;
+    case 'p':
+      opts.stub_port = atoi(optarg);
+      break;
+    case 's':
+      opts.speed = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || opts.speed < 0)
+        return -1;
+      break;
+    case 'P':
+      opts.pid = atoi(optarg);
+      break;
+    case 'n':
+      opts.name = optarg;
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (optind != argc - 1 || opts.stub_port <= 0 || opts.stub_port > 65535)
+    return -1;
+  opts.path = argv[optind];
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (parse_args(argc, argv) == -1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if (load_capture(opts.path) == -1)
+    return EXIT_FAILURE;
+  if (index_capture() == -1) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  int listen_fd = listen_on(opts.stub_port);
+  pthread_t stub;
+  if (listen_fd == -1 ||
+      pthread_create(&stub, NULL, run_stub, (void *)(intptr_t)listen_fd) != 0)
+    return EXIT_FAILURE;
+  pthread_detach(stub);
+
+  ProcStat before = {0}, after = {0};
+  bool measured = opts.pid > 0 && read_proc(opts.pid, &before) == 0;
+
+  // Connections start at their recorded times, the first one right away
+  uint64_t first_ns = conn_count > 0 ? conns[0].open_ns : 0, last_ns = 0;
+  start_s = now_s() - first_ns / 1e9 / (opts.speed > 0 ? opts.speed : 1);
+  size_t replayed = 0, skipped = 0;
+  for (size_t i = 0; i < conn_count; i++) {
+    if (conns[i].lost || conns[i].count == 0) {
+      skipped++;
+      continue;
+    }
+    if (conns[i].close_ns > last_ns)
+      last_ns = conns[i].close_ns;
+    sleep_until(due(conns[i].open_ns));
+    if (pthread_create(&conns[i].tid, NULL, replay, &conns[i]) != 0) {
+      conns[i].failed = true;
+      continue;
+    }
+    conns[i].started = true;
+    replayed++;
+  }
+
+  uint64_t requests = 0, sent = 0, received = 0, failed = 0, incomplete = 0;
+  size_t count = 0;
+  for (size_t i = 0; i < conn_count; i++) {
+    if (conns[i].lost || conns[i].count == 0)
+      continue;
+    if (conns[i].started)
+      pthread_join(conns[i].tid, NULL);
+    requests += conns[i].requests;
+    sent += conns[i].sent;
+    received += conns[i].received;
+    failed += conns[i].failed;
+    incomplete += conns[i].incomplete && !conns[i].failed;
+    count += conns[i].latency_count;
+  }
+  double elapsed = now_s() - (start_s + first_ns / 1e9 /
+                                            (opts.speed > 0 ? opts.speed : 1));
+  measured = measured && read_proc(opts.pid, &after) == 0;
+
+  uint32_t *all = malloc((count + 1) * sizeof(*all));
+  if (all == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  size_t merged = 0;
+  for (size_t i = 0; i < conn_count; i++) {
+    memcpy(all + merged, conns[i].latency_us,
+           conns[i].latency_count * sizeof(*all));
+    merged += conns[i].latency_count;
+  }
+  qsort(all, merged, sizeof(*all), compare_u32);
+
+  printf("{\"scenario\":\"%s\",\"mode\":\"replay\",\"speed\":%g,"
+         "\"connections\":%zu,\"skipped\":%zu,\"recorded_seconds\":%.3f,"
+         "\"seconds\":%.3f,\"requests\":%llu,\"errors\":%llu,"
+         "\"incomplete\":%llu,\"req_per_s\":%.1f,\"bytes_sent\":%llu,"
+         "\"bytes\":%llu,\"mib_per_s\":%.2f,"
+         "\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}",
+         opts.name, opts.speed, replayed, skipped,
+         (last_ns - first_ns) / 1e9, elapsed, (unsigned long long)requests,
+         (unsigned long long)failed, (unsigned long long)incomplete,
+         requests / elapsed, (unsigned long long)sent,
+         (unsigned long long)received, received / elapsed / (1 << 20),
+         percentile(all, merged, 0.5), percentile(all, merged, 0.99),
+         percentile(all, merged, 0.999), merged > 0 ? all[merged - 1] : 0);
+  if (measured)
+    printf(",\"proxy\":{\"cpu_percent\":%.1f,\"rss_kb\":%ld,"
+           "\"peak_rss_kb\":%ld}",
+           (after.cpu_s - before.cpu_s) / elapsed * 100, after.rss_kb,
+           after.peak_rss_kb);
+  printf("}\n");
+  return failed > 0 || incomplete > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Load test the proxy against the local origin and echo servers.
+#
+# Usage: bench/load/run.sh [OUTPUT]
+#   OUTPUT    JSON lines written there too (default: build/bench/load.json)
+# Environment:
+#   DURATION  Seconds per scenario (default: 5)
+#   PORT      Port the proxy listens on (default: 18080)
+#   PROXY_ARGS  Extra proxy options, e.g. "-s 1048576"
+#   IDLE      Connections left idle in idle_many (default: 10000), more
+#             need a higher `ulimit -n` for the proxy and the load generator
+set -eu
+
+BIN=build/bench/load
+OUT=${1:-build/bench/load.json}
+DURATION=${DURATION:-5}
+PORT=${PORT:-18080}
+ORIGIN=127.0.0.1:18081
+ECHO=127.0.0.1:18082
+LOG=build/bench/load-proxy.log
+
+pids=""
+cleanup() {
+  for pid in $pids; do kill "$pid" 2>/dev/null || true; done
+  wait 2>/dev/null || true
+}
+trap cleanup EXIT INT TERM
+
+"$BIN/origin" -p "${ORIGIN#*:}" & pids="$pids $!"
+"$BIN/echo" -p "${ECHO#*:}" & pids="$pids $!"
+# shellcheck disable=SC2086
+./httproxy -L "$LOG" ${PROXY_ARGS:-} "$PORT" >/dev/null 2>&1 & proxy=$!
+pids="$pids $proxy"
+sleep 1
+
+: > "$OUT"
+# A failing scenario is reported, the others still run
+scenario() {
+  name=$1
+  shift
+  "$BIN/loadgen" -n "$name" -x "127.0.0.1:$PORT" -d "$DURATION" \
+    -P "$proxy" "$@" | tee -a "$OUT" || true
+}
+
+scenario small_get -c 16 -u "http://$ORIGIN/size/1024"
+scenario small_get_close -c 16 -C -u "http://$ORIGIN/size/1024"
+scenario large_get -c 4 -u "http://$ORIGIN/size/8388608"
+scenario chunked_get -c 8 -u "http://$ORIGIN/chunked/262144"
+scenario slow_get -c 32 -u "http://$ORIGIN/slow/50"
+scenario tunnel -c 16 -b 4096 -t "$ECHO"
+scenario idle_get -c 4 -i 48 -u "http://$ORIGIN/size/1024"
+scenario idle_many -c 4 -i "${IDLE:-10000}" -u "http://$ORIGIN/size/1024"
+
+echo "Results written to $OUT, proxy log in $LOG" >&2
@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clog.h"
+
+#define THREADS 4
+#define MESSAGES 50000 // Per thread
+#define PERIOD 64      // Messages between pauses, roughly a request's worth
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *producer(void *arg) {
+  double *spent = (double *)arg;
+  *spent = 0;
+
+  for (int i = 0; i < MESSAGES; i++) {
+    double start = now_ns();
+    LOG(INFO, NULL, "Relayed %d Bytes from %s to client %d", i * 7,
+        "www.example.com", i % 97);
+    *spent += now_ns() - start;
+
+    // Leave the writer some room, as connection threads would
+    if (i % PERIOD == PERIOD - 1) {
+      struct timespec pause = {0, 200000};
+      nanosleep(&pause, NULL);
+    }
+  }
+  return NULL;
+}
+
+/* Mean time spent in LOG by the producers, in nanoseconds */
+static double run(void) {
+  pthread_t tids[THREADS];
+  double spent[THREADS];
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&tids[i], NULL, producer, &spent[i]);
+
+  double total = 0;
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(tids[i], NULL);
+    total += spent[i];
+  }
+  return total / (THREADS * MESSAGES);
+}
+
+int main(void) {
+  // Log lines go to /dev/null, results to the original stdout
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  if (out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    return EXIT_FAILURE;
+
+  double sync_ns = run();
+
+  logger_start();
+  double async_ns = run();
+  logger_cleanup();
+
+  fprintf(out, "%d threads, %d messages each\n", THREADS, MESSAGES);
+  fprintf(out, "synchronous:  %8.1f ns per message\n", sync_ns);
+  fprintf(out, "asynchronous: %8.1f ns per message, %lu dropped\n", async_ns,
+          logger_dropped());
+  fclose(out);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "common.h"
+
+/*
+ * Parse cost of a corpus of captured messages, one per file, requests or
+ * responses (starting with "HTTP/"). Each is parsed whole from one buffer
+ * into a Request or Response reused across rounds, as a handler does for the
+ * messages of a connection. Reported per message: time, bytes per TSC cycle
+ * (x86 only) and heap allocations.
+ *   build/bench/parser_bench [CORPUS_DIR]
+ */
+
+#define CORPUS_DIR "bench/corpus/parser"
+#define MAX_FILES 64
+#define MAX_MESSAGE 65536
+#define ROUNDS 20000       // Parses per message
+#define CHUNKED_BODY 65536 // Payload of the chunked body decoded
+
+/* Globals of the proxy that utils.c refers to */
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t thread_pool[MAX_THREADS];
+int thread_count = 0;
+
+typedef struct Message {
+  char name[256];
+  unsigned char data[MAX_MESSAGE];
+  size_t len;
+} Message;
+
+static Message corpus[MAX_FILES];
+static size_t corpus_count = 0;
+
+/* Allocations are counted by taking over the allocator entry points */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(((const Message *)a)->name, ((const Message *)b)->name);
+}
+
+static int load_corpus(const char *dir) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    perror(dir);
+    return -1;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL && corpus_count < MAX_FILES) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+      continue;
+
+    Message *msg = &corpus[corpus_count];
+    msg->len = fread(msg->data, 1, MAX_MESSAGE, f);
+    fclose(f);
+    snprintf(msg->name, sizeof(msg->name), "%s", entry->d_name);
+    if (msg->len > 0)
+      corpus_count++;
+  }
+  closedir(d);
+
+  qsort(corpus, corpus_count, sizeof(*corpus), by_name);
+  return corpus_count > 0 ? 0 : -1;
+}
+
+static void report(const char *name, const size_t len, const double ns,
+                   const unsigned long long cyc, const unsigned long allocs) {
+  if (cyc > 0)
+    printf("%-26s %7zu %9.0f %11.2f %11.1f\n", name, len, ns / ROUNDS,
+           (double)len * ROUNDS / cyc, (double)allocs / ROUNDS);
+  else
+    printf("%-26s %7zu %9.0f %11s %11.1f\n", name, len, ns / ROUNDS, "-",
+           (double)allocs / ROUNDS);
+}
+
+static int run_message(const Message *msg, Request *req, Response *res) {
+  bool is_response = msg->len >= 5 && memcmp(msg->data, "HTTP/", 5) == 0;
+
+  unsigned long allocs = allocations;
+  double start = now_ns();
+  unsigned long long cyc = cycles();
+  for (int i = 0; i < ROUNDS; i++) {
+    int rc = is_response ? parse_response(msg->data, msg->len, res, false)
+                         : parse_request(msg->data, msg->len, req);
+    if (rc == -1) {
+      fprintf(stderr, "%s: parse failed\n", msg->name);
+      return -1;
+    }
+  }
+  cyc = cycles() - cyc;
+  double elapsed = now_ns() - start;
+  allocs = allocations - allocs;
+
+  // The body must be whole in the file, else the next round continues it
+  if (is_response ? res->is_partial || res->is_chunked
+                  : req->is_partial || req->is_chunked) {
+    fprintf(stderr, "%s: body incomplete\n", msg->name);
+    return -1;
+  }
+
+  report(msg->name, msg->len, elapsed, cyc, allocs);
+  return 0;
+}
+
+static void run_normalize_uri(void) {
+  static const char *uris[] = {
+      "http://www.example.com/news/2024/05/index.html?ref=home",
+      "/v2/orders?dry_run=false",
+      "http://docs.example.com/guide/install.html#linux",
+  };
+  const size_t n = sizeof(uris) / sizeof(*uris);
+  size_t len = 0;
+  for (size_t u = 0; u < n; u++)
+    len += strlen(uris[u]);
+
+  unsigned long allocs = allocations;
+  double start = now_ns();
+  unsigned long long cyc = cycles();
+  for (int i = 0; i < ROUNDS; i++)
+    for (size_t u = 0; u < n; u++)
+      free(normalize_uri(uris[u], strlen(uris[u]), "GET"));
+  cyc = cycles() - cyc;
+  report("normalize_uri (3 URIs)", len, now_ns() - start, cyc,
+         allocations - allocs);
+}
+
+/* Chunked body of 4 KiB chunks with extensions, decoded in 1500 byte reads */
+static void run_chunked_framing(void) {
+  static unsigned char body[CHUNKED_BODY + CHUNKED_BODY / 64];
+  size_t len = 0;
+  for (size_t sent = 0; sent < CHUNKED_BODY; sent += 4096) {
+    len += sprintf((char *)body + len, "1000;ext=1\r\n");
+    memset(body + len, 'x', 4096);
+    len += 4096;
+    len += sprintf((char *)body + len, "\r\n");
+  }
+  len += sprintf((char *)body + len, "0\r\n\r\n");
+
+  const int rounds = ROUNDS / 100;
+  double start = now_ns();
+  unsigned long long cyc = cycles();
+  for (int i = 0; i < rounds; i++) {
+    BodyFraming bf = {.kind = BODY_CHUNKED};
+    for (size_t off = 0; off < len && !bf.done;) {
+      size_t read = len - off < 1500 ? len - off : 1500, consumed;
+      if (body_framing_feed(&bf, body + off, read, NULL, &consumed) == -1)
+        return;
+      off += consumed;
+    }
+  }
+  cyc = cycles() - cyc;
+  double elapsed = now_ns() - start;
+
+  printf("%-26s %7zu %9.0f %11.2f %11s\n", "chunked framing (64 KiB)", len,
+         elapsed / rounds, cyc > 0 ? (double)len * rounds / cyc : 0.0, "0.0");
+}
+
+int main(int argc, char **argv) {
+  if (load_corpus(argc > 1 ? argv[1] : CORPUS_DIR) == -1) {
+    fprintf(stderr, "No messages to parse\n");
+    return 1;
+  }
+
+  Request *req = (Request *)calloc(1, sizeof(Request));
+  Response *res = (Response *)calloc(1, sizeof(Response));
+  if (req == NULL || res == NULL)
+    return 1;
+
+  printf("%zu messages, %d rounds each\n", corpus_count, ROUNDS);
+  printf("%-26s %7s %9s %11s %11s\n", "message", "bytes", "ns/msg",
+         "bytes/cycle", "allocs/msg");
+  for (size_t i = 0; i < corpus_count; i++)
+    if (run_message(&corpus[i], req, res) == -1)
+      return 1;
+
+  run_normalize_uri();
+  run_chunked_framing();
+
+  free_req(&req);
+  free_res(&res);
+  return 0;
+}
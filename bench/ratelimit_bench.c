@@ -0,0 +1,125 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "ratelimit.h"
+
+#define THREADS 4
+#define CHECKS 5000000UL
+#define CLIENTS 50000
+
+typedef struct Worker {
+  const struct sockaddr_in *clients;
+  size_t client_count;
+  unsigned long allowed;
+} Worker;
+
+static RateRule rule;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *check(void *arg) {
+  Worker *worker = (Worker *)arg;
+  worker->allowed = 0;
+
+  for (unsigned long i = 0; i < CHECKS; i++) {
+    const struct sockaddr_in *client =
+        &worker->clients[(i * 7919) % worker->client_count];
+    worker->allowed += ratelimit_allow(&rule, (struct sockaddr *)client, NULL);
+  }
+  return NULL;
+}
+
+/* Wall time per check, threads sharing a CPU don't inflate it */
+static double run(const struct sockaddr_in *clients, const size_t count,
+                  unsigned long *allowed) {
+  pthread_t tids[THREADS];
+  Worker workers[THREADS];
+
+  double start = now_ns();
+  for (int i = 0; i < THREADS; i++) {
+    workers[i] = (Worker){clients, count, 0};
+    pthread_create(&tids[i], NULL, check, &workers[i]);
+  }
+
+  *allowed = 0;
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(tids[i], NULL);
+    *allowed += workers[i].allowed;
+  }
+  return (now_ns() - start) / (THREADS * CHECKS);
+}
+
+int main(void) {
+  if (clock_start() == -1)
+    return EXIT_FAILURE;
+
+  struct sockaddr_in *clients =
+      (struct sockaddr_in *)calloc(CLIENTS, sizeof(struct sockaddr_in));
+  if (clients == NULL) {
+    perror("ratelimit_bench");
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < CLIENTS; i++) {
+    clients[i].sin_family = AF_INET;
+    clients[i].sin_addr.s_addr = htonl(0x0a000000 + i); // 10.0.0.0/8
+  }
+
+  // Reading the clock
+  volatile uint64_t sink = 0;
+  double start = now_ns();
+  for (unsigned long i = 0; i < CHECKS; i++)
+    sink += clock_now_ns();
+  double cached_ns = (now_ns() - start) / CHECKS;
+
+  start = now_ns();
+  for (unsigned long i = 0; i < CHECKS; i++) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sink += ts.tv_nsec;
+  }
+  double gettime_ns = (now_ns() - start) / CHECKS;
+  (void)sink;
+
+  // A single hot client, then many clients spread over the shards
+  unsigned long hot_allowed, many_allowed, limited_allowed;
+  ratelimit_init(&rule, "bench", 1000000, 1000000, RATELIMIT_TOKEN_SCALE, 32,
+                 128);
+  double hot_ns = run(clients, 1, &hot_allowed);
+  ratelimit_free(&rule);
+
+  ratelimit_init(&rule, "bench", 1000000, 1000000, RATELIMIT_TOKEN_SCALE, 32,
+                 128);
+  double many_ns = run(clients, CLIENTS, &many_allowed);
+  ratelimit_free(&rule);
+
+  // Tight limit, nearly every check is refused
+  ratelimit_init(&rule, "bench", 10, 10, RATELIMIT_TOKEN_SCALE, 32, 128);
+  double limited_ns = run(clients, CLIENTS, &limited_allowed);
+
+  RateStats stats;
+  ratelimit_get_stats(&rule, &stats);
+  ratelimit_free(&rule);
+
+  printf("threads:                 %d x %lu checks\n", THREADS, CHECKS);
+  printf("clock_now_ns():          %.2f ns\n", cached_ns);
+  printf("clock_gettime():         %.2f ns\n", gettime_ns);
+  printf("check, one client:       %.1f ns (%lu allowed)\n", hot_ns,
+         hot_allowed);
+  printf("check, %d clients:    %.1f ns (%lu allowed)\n", CLIENTS, many_ns,
+         many_allowed);
+  printf("check, limited:          %.1f ns (%lu allowed, %lu buckets, %lu "
+         "without a bucket)\n",
+         limited_ns, limited_allowed, stats.entries, stats.overflows);
+
+  free(clients);
+  return EXIT_SUCCESS;
+}
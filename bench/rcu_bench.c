@@ -0,0 +1,127 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rcu.h"
+
+#define READERS 4
+#define READ_OPS 20000000UL
+#define RELOADS 200
+
+typedef struct Table {
+  long value;
+  char padding[4096]; // Stand-in for a real policy table
+} Table;
+
+static _Atomic(Table *) table = NULL;
+static atomic_bool stop = false;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *plain_reader(void *arg) {
+  double *ns = (double *)arg;
+  long sum = 0;
+
+  double start = now_ns();
+  for (unsigned long i = 0; i < READ_OPS; i++)
+    sum += atomic_load_explicit(&table, memory_order_acquire)->value;
+  *ns = (now_ns() - start) / READ_OPS;
+
+  return (void *)sum;
+}
+
+static void *rcu_reader(void *arg) {
+  double *ns = (double *)arg;
+  long sum = 0;
+
+  double start = now_ns();
+  for (unsigned long i = 0; i < READ_OPS; i++) {
+    rcu_read_lock();
+    sum += rcu_dereference(table)->value;
+    rcu_read_unlock();
+  }
+  *ns = (now_ns() - start) / READ_OPS;
+
+  return (void *)sum;
+}
+
+static void *writer(void *arg) {
+  double *reload_ns = (double *)arg;
+  double total = 0, worst = 0;
+  int reloads = 0;
+
+  while (!atomic_load(&stop) && reloads < RELOADS) {
+    Table *next = (Table *)calloc(1, sizeof(Table));
+    next->value = reloads;
+
+    double start = now_ns();
+    Table *old = rcu_publish(table, next);
+    rcu_synchronize();
+    free(old);
+    double elapsed = now_ns() - start;
+
+    total += elapsed;
+    worst = elapsed > worst ? elapsed : worst;
+    reloads++;
+
+    struct timespec pause = {0, 1000000}; // 1 ms between reloads
+    nanosleep(&pause, NULL);
+  }
+
+  reload_ns[0] = reloads ? total / reloads : 0;
+  reload_ns[1] = worst;
+  reload_ns[2] = reloads;
+  return NULL;
+}
+
+static double run_readers(void *(*reader)(void *), const bool reload,
+                          double *reload_ns) {
+  pthread_t readers[READERS], writer_tid;
+  double ns[READERS] = {0};
+
+  atomic_store(&stop, false);
+  if (reload)
+    pthread_create(&writer_tid, NULL, writer, reload_ns);
+
+  for (int i = 0; i < READERS; i++)
+    pthread_create(&readers[i], NULL, reader, &ns[i]);
+  for (int i = 0; i < READERS; i++)
+    pthread_join(readers[i], NULL);
+
+  atomic_store(&stop, true);
+  if (reload)
+    pthread_join(writer_tid, NULL);
+
+  double avg = 0;
+  for (int i = 0; i < READERS; i++)
+    avg += ns[i] / READERS;
+  return avg;
+}
+
+int main(void) {
+  atomic_store(&table, (Table *)calloc(1, sizeof(Table)));
+
+  double reload_ns[3] = {0};
+  double plain = run_readers(plain_reader, false, NULL);
+  double rcu = run_readers(rcu_reader, false, NULL);
+  double rcu_reloading = run_readers(rcu_reader, true, reload_ns);
+
+  printf("readers:                 %d threads x %lu reads\n", READERS,
+         READ_OPS);
+  printf("plain pointer load:      %.2f ns/read\n", plain);
+  printf("rcu read section:        %.2f ns/read (+%.2f ns)\n", rcu,
+         rcu - plain);
+  printf("rcu while reloading:     %.2f ns/read\n", rcu_reloading);
+  printf("reload (publish + grace): %.1f us avg, %.1f us max over %.0f "
+         "reloads\n",
+         reload_ns[0] / 1e3, reload_ns[1] / 1e3, reload_ns[2]);
+
+  free(rcu_publish(table, NULL));
+  return EXIT_SUCCESS;
+}
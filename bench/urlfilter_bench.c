@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "urlfilter.h"
+
+#define DEFAULT_PATTERNS 20000
+#define URIS 100000
+#define SCANS 1000000
+#define NAIVE_URIS 500 // The naive loop is far too slow for the full set
+
+static const char *const segments[] = {
+    "/api/v1", "/static/js", "/images", "/search", "/user/profile", "/cart",
+    "/assets", "/blog/2024", "/watch",  "/news",   "/download",     "/login"};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void random_word(char *out, const int len) {
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  for (int i = 0; i < len; i++)
+    out[i] = alphabet[rand() % (sizeof alphabet - 1)];
+  out[len] = '\0';
+}
+
+/* Paths like "/trk/x9f2ka/" and query keys like "cid_k2m1=" */
+static char *random_pattern(void) {
+  char word[16], pattern[32];
+  random_word(word, 6 + rand() % 6);
+  if (rand() % 2)
+    snprintf(pattern, sizeof pattern, "/%s/", word);
+  else
+    snprintf(pattern, sizeof pattern, "%s=", word);
+  return strdup(pattern);
+}
+
+/* Ordinary URI, with one of the patterns planted in a quarter of them */
+static char *random_uri(char **patterns, const size_t count) {
+  char word[16], query[16], uri[256];
+  random_word(word, 4 + rand() % 12);
+  random_word(query, 8);
+  int len = snprintf(uri, sizeof uri, "%s/%s?q=%s&page=%d",
+                     segments[rand() % (sizeof segments / sizeof segments[0])],
+                     word, query, rand() % 100);
+
+  if (rand() % 4 == 0)
+    snprintf(uri + len, sizeof uri - len, "&ref%s1",
+             patterns[rand() % count]);
+  return strdup(uri);
+}
+
+static url_action_t naive_match(char **patterns, const url_action_t *actions,
+                                const size_t count, const char *uri) {
+  url_action_t best = URL_ACTION_NONE;
+  for (size_t i = 0; i < count && best != URL_ACTION_BLOCK; i++)
+    if (actions[i] > best && strcasestr(uri, patterns[i]) != NULL)
+      best = actions[i];
+  return best;
+}
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_PATTERNS;
+  srand(42);
+
+  char **patterns = (char **)malloc(count * sizeof(char *));
+  url_action_t *actions = (url_action_t *)malloc(count * sizeof(url_action_t));
+  char **uris = (char **)malloc(URIS * sizeof(char *));
+  size_t *lens = (size_t *)malloc(URIS * sizeof(size_t));
+  if (patterns == NULL || actions == NULL || uris == NULL || lens == NULL) {
+    perror("urlfilter_bench");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    patterns[i] = random_pattern();
+    actions[i] = rand() % 4 ? URL_ACTION_BLOCK : URL_ACTION_TAG;
+  }
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < URIS; i++) {
+    uris[i] = random_uri(patterns, count);
+    lens[i] = strlen(uris[i]);
+    bytes += lens[i];
+  }
+
+  double start = now_ns();
+  UrlFilter *uf =
+      urlfilter_build((const char *const *)patterns, actions, count);
+  double build_ms = (now_ns() - start) / 1e6;
+  if (uf == NULL)
+    return EXIT_FAILURE;
+
+  size_t matched = 0, scanned = 0;
+  start = now_ns();
+  for (size_t i = 0; i < SCANS; i++) {
+    matched += urlfilter_match(uf, uris[i % URIS], lens[i % URIS], NULL) !=
+               URL_ACTION_NONE;
+    scanned += lens[i % URIS];
+  }
+  double dfa_ns = now_ns() - start;
+
+  size_t naive_bytes = 0, mismatches = 0;
+  url_action_t naive[NAIVE_URIS];
+  start = now_ns();
+  for (size_t i = 0; i < NAIVE_URIS; i++) {
+    naive[i] = naive_match(patterns, actions, count, uris[i]);
+    naive_bytes += lens[i];
+  }
+  double naive_ns = now_ns() - start;
+
+  for (size_t i = 0; i < NAIVE_URIS; i++)
+    mismatches += urlfilter_match(uf, uris[i], lens[i], NULL) != naive[i];
+
+  double dfa_mbps = scanned / (dfa_ns / 1e9) / (1024.0 * 1024.0);
+  double naive_mbps = naive_bytes / (naive_ns / 1e9) / (1024.0 * 1024.0);
+  printf("patterns:           %zu\n", uf->pattern_count);
+  printf("build time:         %.1f ms\n", build_ms);
+  printf("automaton:          %zu states x %zu classes, %.1f MiB\n",
+         uf->state_count, uf->class_count,
+         urlfilter_memory(uf) / (1024.0 * 1024.0));
+  printf("uris:               %d (%.0f Bytes avg)\n", URIS,
+         (double)bytes / URIS);
+  printf("automaton scan:     %.1f MiB/s, %.0f ns/uri (%zu/%d matched)\n",
+         dfa_mbps, dfa_ns / SCANS, matched, SCANS);
+  printf("naive strcasestr:   %.3f MiB/s, %.0f ns/uri (first %d uris)\n",
+         naive_mbps, naive_ns / NAIVE_URIS, NAIVE_URIS);
+  printf("speedup:            %.0fx\n", dfa_mbps / naive_mbps);
+  printf("disagreements:      %zu/%d\n", mismatches, NAIVE_URIS);
+
+  for (size_t i = 0; i < count; i++)
+    free(patterns[i]);
+  for (size_t i = 0; i < URIS; i++)
+    free(uris[i]);
+  free(patterns);
+  free(actions);
+  free(uris);
+  free(lens);
+  urlfilter_free(uf);
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,201 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* POSIX Networking Library */
+#include <sys/socket.h>
+
+/* Constants */
+#define ACCESS_FILE_MAGIC "HPXACC1"    // First bytes of every file
+#define ACCESS_VERSION 1               // Bumped on any layout change
+#define ACCESS_RECORD_MAGIC 0x41434352 // Set last, once a record is complete
+#define ACCESS_FILE_RECORDS (1 << 19)  // Records per file (64 MiB)
+#define ACCESS_FILES_KEPT 8            // Older files are deleted
+#define ACCESS_MAX_PHASES 8            // Phase slots in a record
+#define ACCESS_NO_PHASE UINT32_MAX     // Phase not reached
+
+/* Data Structures */
+
+/* Request methods, stored in a byte */
+typedef enum {
+  ACCESS_OTHER,
+  ACCESS_GET,
+  ACCESS_HEAD,
+  ACCESS_POST,
+  ACCESS_PUT,
+  ACCESS_DELETE,
+  ACCESS_CONNECT,
+  ACCESS_OPTIONS,
+  ACCESS_PATCH,
+  ACCESS_TRACE,
+} access_method_t;
+
+/* Cache outcome, always ACCESS_CACHE_NONE until the proxy caches */
+typedef enum {
+  ACCESS_CACHE_NONE,
+  ACCESS_CACHE_MISS,
+  ACCESS_CACHE_HIT,
+} access_cache_t;
+
+/* Phases of an exchange, in microseconds from its start. Only ever append. */
+typedef enum {
+  PHASE_PARSED,     // Request headers parsed
+  PHASE_CONNECTED,  // Upstream connected (not reached on a reused one)
+  PHASE_FIRST_BYTE, // First response byte received
+  PHASE_LAST_BYTE,  // Last response byte received so far
+  PHASE_RESOLVED,   // Upstream name resolved (not reached on a reused one)
+  PHASE_SENT,       // Last request byte sent to the upstream so far
+  ACCESS_PHASES
+} access_phase_t;
+
+/* Flags */
+#define ACCESS_TUNNEL 0x01    // CONNECT tunnel, bytes are counted blindly
+#define ACCESS_BLOCKED 0x02   // Refused by the blocklist or a URL pattern
+#define ACCESS_THROTTLED 0x04 // Refused by the request rate limit
+
+/*
+ * One request and its response. The layout is fixed and in host byte order,
+ * addresses excepted (network order, as in sockaddr).
+ */
+typedef struct AccessRecord {
+  uint32_t magic;   // ACCESS_RECORD_MAGIC when the record is complete
+  uint16_t status;  // Response status code, 0 if none was received
+  uint8_t method;   // access_method_t
+  uint8_t cache;    // access_cache_t
+  uint64_t conn_id; // Connection the exchange took place on
+  uint64_t start_ns; // Wall clock when the request arrived, ns since epoch
+  uint64_t bytes_in;  // Bytes received from the client
+  uint64_t bytes_out; // Bytes received from the upstream
+  uint32_t phase_us[ACCESS_MAX_PHASES]; // ACCESS_NO_PHASE when not reached
+
+  uint8_t client_ip[16];
+  uint8_t upstream_ip[16];
+  uint16_t client_port; // Host byte order
+  uint16_t upstream_port;
+  uint8_t client_family; // 4, 6 or 0 when unknown
+  uint8_t upstream_family;
+  uint8_t flags;
+  uint8_t spare;
+  uint32_t conn_age_us; // Time since the connection was accepted
+  uint8_t reserved[12];
+} AccessRecord;
+
+_Static_assert(sizeof(AccessRecord) == 128, "access record layout changed");
+
+/* Start of every file, followed by ACCESS_FILE_RECORDS record slots */
+typedef struct AccessFileHeader {
+  char magic[8];        // ACCESS_FILE_MAGIC
+  uint32_t version;     // ACCESS_VERSION
+  uint32_t record_size; // sizeof(AccessRecord)
+  uint64_t capacity;    // Record slots in the file
+  uint64_t created_ns;  // Wall clock, ns since epoch
+  uint8_t reserved[32];
+} AccessFileHeader;
+
+_Static_assert(sizeof(AccessFileHeader) == 64, "access header layout changed");
+
+/* File being appended to, records are placed with a single fetch-add */
+typedef struct AccessSegment {
+  unsigned char *map;
+  size_t map_len;
+  int fd;
+  unsigned long seq; // Suffix of the file name
+  atomic_size_t next; // Next free slot, may run past the capacity
+} AccessSegment;
+
+/* Exchange in progress on a connection */
+typedef struct Exchange {
+  bool open;
+  uint64_t start_mono; // Monotonic start, the phases are offsets from it
+  AccessRecord rec;
+  char target[128]; // Host and URI, only filled in while tracing
+} Exchange;
+
+/* Set once by accesslog_open() */
+extern bool accesslog_enabled;
+
+/**
+ * @brief Start appending records to PREFIX.NNNNNN files
+ *
+ * Files are memory-mapped and preallocated, a new one is started when the
+ * current one is full and only the last ACCESS_FILES_KEPT are kept.
+ *
+ * @param prefix Path prefix of the files
+ *
+ * @return 0 on success, -1 on error
+ */
+int accesslog_open(const char *prefix);
+
+/**
+ * @brief Append a record (ignored when the log is closed)
+ *
+ * @note Lock-free except when the file fills up and a thread has to start
+ * the next one.
+ */
+void accesslog_write(const AccessRecord *rec);
+
+/**
+ * @brief Log the number of records written and dropped
+ */
+void accesslog_log_stats(void);
+
+/**
+ * @brief Truncate the current file to the records written and close it
+ */
+void accesslog_close(void);
+
+/**
+ * @brief Start tracking a new exchange, ending the previous one
+ *
+ * @param ex Exchange of the connection
+ * @param conn_id Connection identifier
+ * @param accepted_ns Monotonic time the connection was accepted at
+ * @param client Address of the client
+ * @param method Request method
+ */
+void exchange_begin(Exchange *ex, const uint64_t conn_id,
+                    const uint64_t accepted_ns,
+                    const struct sockaddr *client, const char *method);
+
+/**
+ * @brief Record that a phase was reached now
+ */
+void exchange_mark(Exchange *ex, const access_phase_t phase);
+
+/**
+ * @brief Record the address of the upstream the exchange is relayed to
+ */
+void exchange_upstream(Exchange *ex, const int fd);
+
+/**
+ * @brief Name the exchange after its host and URI, for the trace
+ */
+void exchange_target(Exchange *ex, const char *host, const char *uri);
+
+/**
+ * @brief Feed the phase histograms, and write the exchange to the access log
+ * and the trace when they are open
+ */
+void exchange_end(Exchange *ex);
+
+/**
+ * @brief Map a method name to its code
+ */
+access_method_t access_method(const char *method);
+
+/**
+ * @brief Name of a method code
+ */
+const char *access_method_name(const uint8_t method);
+
+/**
+ * @brief Name of a phase, used as a column name by the decoder
+ */
+const char *access_phase_name(const access_phase_t phase);
+
+#endif /* ACCESSLOG_H */
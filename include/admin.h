@@ -0,0 +1,30 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+/**
+ * @brief Serve the metrics on a listener of their own
+ *
+ * GET /metrics returns the counters, gauges, latency histograms and heaviest
+ * hosts and clients in the Prometheus text format. Requests are answered one
+ * at a time by a dedicated thread, so scrapes never take a connection slot or
+ * a scheduling turn.
+ *
+ * @param spec "[HOST:]PORT" to listen on, HOST defaults to 127.0.0.1
+ * @param inherited Listener handed down by the previous process, -1 for none
+ *
+ * @return 0 on success, -1 on error
+ */
+int admin_start(const char *spec, const int inherited);
+
+/**
+ * @brief Listening socket, -1 when not serving
+ */
+int admin_listener(void);
+
+/**
+ * @brief Stop serving and close the listener, once it's handed to a new
+ * process, so every scrape reaches the same one
+ */
+void admin_stop(void);
+
+#endif /* ADMIN_H */
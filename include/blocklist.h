@@ -0,0 +1,105 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define BLOCKLIST_BLOOM_BITS 10 // Bloom filter bits per domain (~1% FP)
+#define BLOCKLIST_BLOOM_K 6     // Bits set per domain, all in one cache line
+#define MAX_LABEL_LEN 63        // Max length of a DNS label
+
+/* Data Structures */
+
+/*
+ * One label of the reversed-label trie. The children of a node are stored
+ * contiguously and sorted by label, so a level is searched with a binary
+ * search that usually only touches the inlined 4-byte prefix.
+ */
+typedef struct BlocklistNode {
+  uint32_t prefix;          // First 4 bytes of the label, big-endian
+  uint32_t label;           // Offset of the label in the label pool
+  uint32_t first_child;     // Index of the first child in the node array
+  uint32_t child_count : 24;
+  uint32_t label_len : 7;
+  uint32_t terminal : 1; // Domain listed: it and all its subdomains match
+} BlocklistNode;
+
+typedef struct Blocklist {
+  BlocklistNode *nodes; // nodes[0] is the root (empty label)
+  size_t node_count;
+
+  char *labels; // Label pool
+  size_t labels_size;
+
+  uint64_t *bloom; // Blocked Bloom filter, 512-bit blocks
+  size_t bloom_blocks;
+
+  size_t entries; // Domains kept after dropping those covered by a parent
+} Blocklist;
+
+/* Current blocklist, published with RCU (see rcu.h) */
+extern _Atomic(Blocklist *) blocklist;
+
+/**
+ * @brief Compile a list of domains into a blocklist
+ *
+ * Domains are matched exactly and as parents: "example.com" blocks
+ * "example.com" and "www.example.com" but not "badexample.com". Entries may
+ * be given as "*.example.com" or ".example.com", trailing dots are ignored.
+ *
+ * @param domains Array of domain names
+ * @param count Number of domains
+ *
+ * @return The compiled blocklist, or NULL on error
+ */
+Blocklist *blocklist_build(const char *const *domains, const size_t count);
+
+/**
+ * @brief Load and compile a blocklist file
+ *
+ * The file has one domain per line. Empty lines and lines starting with '#'
+ * are skipped, and hosts-file lines ("0.0.0.0 example.com") are accepted.
+ *
+ * @param path Path of the blocklist file
+ *
+ * @return The compiled blocklist, or NULL on error
+ */
+Blocklist *blocklist_load(const char *path);
+
+/**
+ * @brief Load a blocklist file off the hot path and swap it in
+ *
+ * The new list is published with a single atomic store, the previous one is
+ * freed once every reader that could still see it is done.
+ *
+ * @param path Path of the blocklist file
+ *
+ * @return 0 on success, -1 on error (the current list stays in place)
+ */
+int blocklist_reload(const char *path);
+
+/**
+ * @brief Check whether a host (optionally with a port) is blocked
+ *
+ * @param bl Blocklist (can be NULL, nothing is blocked then)
+ * @param host Value of the Host header
+ *
+ * @return true if the host or one of its parent domains is listed
+ */
+bool blocklist_match(const Blocklist *bl, const char *host);
+
+/**
+ * @brief Number of bytes used by a compiled blocklist
+ */
+size_t blocklist_memory(const Blocklist *bl);
+
+/**
+ * @brief Free a blocklist
+ */
+void blocklist_free(Blocklist *bl);
+
+#endif /* BLOCKLIST_H */
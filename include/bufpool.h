@@ -0,0 +1,74 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Constants */
+#define BUFPOOL_MIN_SHIFT 13            // Smallest class, 8 KiB (MAX_HTTP_LEN)
+#define BUFPOOL_CLASSES 7               // Up to the largest class
+#define BUFPOOL_MAX_SIZE (512 * 1024)   // Largest class
+#define BUFPOOL_CHUNK (2 * 1024 * 1024) // Mapped at once, one huge page
+#define BUFPOOL_BATCH_BYTES (64 * 1024) // Moved between a thread and the pool
+
+/* Data Structures */
+
+/*
+ * Buffers of the relay path (receive buffers, queued output) come in size
+ * classes, powers of two from 8 KiB to 512 KiB. Each thread keeps a few free
+ * buffers of every class and takes or gives back a batch of them at a time
+ * from the shared pool, so most gets and puts don't lock. The shared pool
+ * carves the buffers out of 2 MiB chunks, one class per chunk, optionally
+ * backed by huge pages. Memory stays with the pool once mapped. Larger
+ * buffers are malloc()ed.
+ */
+
+typedef struct BufPoolStats {
+  unsigned long long hits;      // Gets served from the thread's free buffers
+  unsigned long long misses;    // Gets that went to the shared pool
+  unsigned long long oversized; // Gets over the largest class, malloc()ed
+  unsigned long long granted;   // Bytes handed out, in whole classes
+  unsigned long long wasted;    // Of which beyond what was asked for
+  size_t mapped;                // Bytes of chunks mapped
+  size_t huge_mapped;           // Of which on reserved huge pages
+  size_t in_use;                // Bytes of classes handed out, not back yet
+} BufPoolStats;
+
+/**
+ * @brief Choose how the chunks are backed, before any buffer is taken
+ *
+ * @param huge_pages Map the chunks with MAP_HUGETLB, falling back on
+ * transparent huge pages if none are reserved
+ */
+void bufpool_init(const bool huge_pages);
+
+/**
+ * @brief Take a buffer of at least `size` bytes
+ *
+ * @param size Bytes needed
+ * @param cap Set to the usable size, passed back to bufpool_put()
+ *
+ * @return The buffer, uninitialized, NULL if out of memory
+ */
+void *bufpool_get(const size_t size, size_t *cap);
+
+/**
+ * @brief Give a buffer back, from any thread
+ *
+ * @param buf Buffer from bufpool_get(), NULL is ignored
+ * @param cap Its usable size
+ */
+void bufpool_put(void *buf, const size_t cap);
+
+/**
+ * @brief Read the pool counters
+ */
+void bufpool_get_stats(BufPoolStats *stats);
+
+/**
+ * @brief Log the pool hits, misses and fragmentation
+ */
+void bufpool_log_stats(void);
+
+#endif /* BUFPOOL_H */
@@ -0,0 +1,113 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define CAPTURE_FILE_MAGIC "HPXCAP1" // First bytes of the file
+#define CAPTURE_VERSION 1            // Bumped on any layout change
+#define CAPTURE_QUEUE_MAX (64 << 20) // Bytes waiting for the writer
+
+/* Data Structures */
+
+/* What a record holds */
+typedef enum {
+  CAPTURE_OPEN,   // A client connection was accepted
+  CAPTURE_CLIENT, // Bytes received from the client
+  CAPTURE_SERVER, // Bytes received from the upstream
+  CAPTURE_CLOSE,  // The connection was closed
+} capture_kind_t;
+
+/* Flags */
+#define CAPTURE_START 0x01 // The bytes start a new request or response
+#define CAPTURE_LOST 0x02  // On a close: records of the connection were lost
+
+/*
+ * Record header, followed by `len` bytes. The layout is fixed and in host
+ * byte order. Records of a connection are in the order they were received,
+ * those of different connections interleave.
+ */
+typedef struct CaptureRecord {
+  uint64_t conn_id;
+  uint64_t time_ns; // Since the capture started
+  uint32_t len;
+  uint8_t kind;  // capture_kind_t
+  uint8_t flags;
+  uint16_t spare;
+} CaptureRecord;
+
+_Static_assert(sizeof(CaptureRecord) == 24, "capture record layout changed");
+
+/* Start of the file, followed by the records */
+typedef struct CaptureFileHeader {
+  char magic[8];        // CAPTURE_FILE_MAGIC
+  uint32_t version;     // CAPTURE_VERSION
+  uint32_t record_size; // sizeof(CaptureRecord)
+  uint64_t created_ns;  // Wall clock, ns since epoch
+  uint8_t reserved[40];
+} CaptureFileHeader;
+
+_Static_assert(sizeof(CaptureFileHeader) == 64,
+               "capture header layout changed");
+
+/* Set once by capture_start(), checked before anything else is done */
+extern bool capture_enabled;
+
+/**
+ * @brief Start recording the plain HTTP traffic to a file, from a writer
+ * thread
+ *
+ * @param path File, truncated
+ *
+ * @return 0 on success, -1 on error
+ */
+int capture_start(const char *path);
+
+/**
+ * @brief Record the opening of a connection
+ *
+ * @param conn_id Connection
+ * @param lost Set when the record was dropped, the connection is then no
+ * longer recorded
+ */
+void capture_open(const uint64_t conn_id, bool *lost);
+
+/**
+ * @brief Queue a copy of bytes received on a connection
+ *
+ * Once a record of the connection has been dropped, because the writer fell
+ * CAPTURE_QUEUE_MAX bytes behind, the others are too.
+ *
+ * @param conn_id Connection
+ * @param kind CAPTURE_CLIENT or CAPTURE_SERVER
+ * @param start Whether the bytes start a new message
+ * @param data Bytes received
+ * @param len Number of bytes
+ * @param lost Set when the record was dropped
+ */
+void capture_data(const uint64_t conn_id, const capture_kind_t kind,
+                  const bool start, const unsigned char *data,
+                  const size_t len, bool *lost);
+
+/**
+ * @brief Record the closing of a connection, never dropped
+ *
+ * @param conn_id Connection
+ * @param lost Whether records of the connection were dropped
+ */
+void capture_close(const uint64_t conn_id, const bool lost);
+
+/**
+ * @brief Log the number of records written and dropped
+ */
+void capture_log_stats(void);
+
+/**
+ * @brief Write the queued records, stop the writer thread and close the file
+ */
+void capture_stop(void);
+
+#endif /* CAPTURE_H */
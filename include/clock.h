@@ -0,0 +1,36 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Constants */
+#define CLOCK_TICK_NS 1000000 // The cached time is refreshed every millisecond
+
+/* Monotonic time in nanoseconds, refreshed by the clock thread */
+extern atomic_uint_fast64_t cached_now_ns;
+
+/**
+ * @brief Start the thread keeping `cached_now_ns` up to date
+ *
+ * @return 0 on success, -1 on error
+ */
+int clock_start(void);
+
+/**
+ * @brief Read the monotonic clock without the cost of a clock_gettime() call
+ *
+ * @return Monotonic time in nanoseconds, at most CLOCK_TICK_NS behind (read
+ * directly until clock_start() has been called)
+ */
+uint64_t clock_now_ns(void);
+
+/**
+ * @brief Read the monotonic clock, for durations finer than CLOCK_TICK_NS
+ *
+ * @return Monotonic time in nanoseconds
+ */
+uint64_t clock_precise_ns(void);
+
+#endif /* CLOCK_H */
@@ -1,6 +1,9 @@
 #ifndef CLOG_H
 #define CLOG_H
 
+/* Standard Library */
+#include <stdio.h>
+
 /* Reset Escape Sequence */
 #define RESET "\x1B[0m" // Resets all previous ANSI escape codes
 
@@ -25,6 +28,21 @@ typedef enum {
   DBG   // Debugging information, typically for developers
 } log_level_t;
 
+/* Least severe level compiled in, LOG calls below it are removed entirely */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DBG
+#endif
+
+/* Severity of a level, from DBG (least severe) to ERR */
+#define LOG_SEVERITY(level) ((level) == DBG ? 0 : (level) + 1)
+
+/* Asynchronous Logger */
+#define LOG_RING_SIZE 256    // Records buffered per thread, power of two
+#define LOG_MAX_RINGS 256    // Threads logging at the same time
+#define LOG_TEXT_LEN 400     // Formatted message, longer ones are truncated
+#define LOG_CAUSE_LEN 64     // Custom error message
+#define LOG_BATCH_SIZE 65536 // Bytes written to stdout at once
+
 /**
  * @brief Logs a message with the specified log level, optional error message,
  *        and contextual information (file, line, function).
@@ -40,10 +58,38 @@ typedef enum {
 void log_message(log_level_t level, const char *custom_error, const char *file,
                  int line, const char *func, const char *format, ...);
 
+/**
+ * @brief Starts the background thread writing the log.
+ *
+ * From then on, log_message() formats the message into a fixed-size record
+ * and pushes it to a lock-free ring owned by the calling thread; the writer
+ * drains every ring in order, formats the lines and writes them to stdout in
+ * batches. When a ring is full the record is dropped and counted, the writer
+ * reports the drops. Before the logger is started, and after it's cleaned up,
+ * messages are written synchronously.
+ *
+ * @return 0 on success, -1 if the thread couldn't be created
+ *
+ * @note Registers logger_cleanup() with atexit() so buffered messages are
+ * written on exit.
+ */
+int logger_start(void);
+
+/**
+ * @brief Writes the log lines to `out` instead of stdout (NULL: stdout).
+ * The file is left open, it belongs to the caller.
+ */
+void logger_set_output(FILE *out);
+
+/**
+ * @brief Returns the number of messages dropped because a ring was full.
+ */
+unsigned long logger_dropped(void);
+
 /**
  * @brief Cleans up the logger resources.
- * This function should be called when the logger is no longer needed,
- * typically at program exit.
+ * Stops the writer thread and writes the messages still buffered. Safe to
+ * call more than once, the logger falls back to synchronous writes.
  */
 void logger_cleanup(void);
 
@@ -62,9 +108,13 @@ void logger_cleanup(void);
  *   arguments should be formatted in the log message.
  * - ...: Additional arguments used to fill in the format string.
  *
+ * Calls below LOG_MIN_LEVEL are compiled out, arguments included.
  */
 #define LOG(level, custom_error, format, ...)                                  \
-  log_message(level, custom_error, __FILE__, __LINE__, __func__, format,       \
-              ##__VA_ARGS__)
+  do {                                                                         \
+    if (LOG_SEVERITY(level) >= LOG_SEVERITY(LOG_MIN_LEVEL))                    \
+      log_message(level, custom_error, __FILE__, __LINE__, __func__, format,   \
+                  ##__VA_ARGS__);                                              \
+  } while (0)
 
 #endif /* CLOG_H */
@@ -23,6 +23,9 @@
 /* Parser */
 #include "parser.h"
 
+/* Runtime Configuration */
+#include "config.h"
+
 /* Thread Pool */
 #define MAX_THREADS 64 // Handle 64 simultaneous connections
 
@@ -40,22 +43,19 @@ extern pthread_mutex_t lock;
  *****************************************************/
 
 /**
- * @brief Find an empty slot in the thread pool.
+ * @brief Start a thread in an empty slot of the thread pool.
  *
- * This function searches for an available slot in the `thread_pool` array,
- * which represents the thread pool's current state. If an empty slot (0) is
- * found, the function returns the index of the slot.
+ * Finding the slot, creating the thread and counting it happen under `lock`,
+ * so threads spawning handlers at the same time never pick the same slot.
  *
- * @returns
- *   - Index of the first empty slot (>=1) on success.
- *   - -1 if there is no available slot or the thread pool is at capacity.
+ * @param start Thread function, removing itself with remove_thread()
+ * @param arg Argument of `start`
  *
- * @note
- *   This function locks `lock` for mutual exclusion as it reads and modifies
- *   shared resources (`thread_count` and `thread_pool`). It ensures no other
- *   thread can modify these variables concurrently.
+ * @returns
+ *   - Index of the slot (>=1) on success.
+ *   - -1 if the thread pool is at capacity or the thread couldn't be created.
  */
-int find_empty_slot(void);
+int spawn_thread(void *(*start)(void *), void *arg);
 
 /**
  * @brief Remove a thread from the thread pool.
@@ -77,43 +77,30 @@ int find_empty_slot(void);
  */
 void remove_thread(const pthread_t tid);
 
-/*********************************************************
- *            Connection Management Functions            *
- *********************************************************/
+/*****************************************************
+ *            Memory Management Functions            *
+ *****************************************************/
 
 /**
- * @brief Forward data to a specified destination file descriptor.
- *
- * This function attempts to send `len` bytes of data from the `buffer` to the
- * destination file descriptor (`dest_fd`). It continues sending until all
- * data is transferred or an error occurs.
- *
- * @parameters:
- *   - @param dest_fd: File descriptor of the destination socket to which data
- *     should be sent.
- *   - @param buffer: Pointer to the data buffer to be sent.
- *   - @param len: Length of the data in the buffer.
- *
- * @returns
- *   - 0 on successful data transfer.
- *   - -1 if an error occurs during sending.
+ * @brief Free what a parsed Request points to and zero it for the next message
  *
- * @note
- *   This function handles partial sends by attempting to resend until all
- *   data has been forwarded.
+ * @param req Request to clear, the struct itself is kept (NULL: ignored)
  */
-int forward(const int dest_fd, const unsigned char *buffer, const long len);
+void clear_req(Request *req);
 
-/*****************************************************
- *            Memory Management Functions            *
- *****************************************************/
+/**
+ * @brief Free what a parsed Response points to and zero it for the next message
+ *
+ * @param res Response to clear, the struct itself is kept (NULL: ignored)
+ */
+void clear_res(Response *res);
 
 /**
  * @brief Free the memory associated with a Request structure.
  *
  * This function releases all dynamically allocated memory within a `Request`
- * structure, including the request line (method, URI, version), headers, and
- * body. Finally, it frees the `Request` struct itself and sets the original
+ * structure, including the request line (method, URI, version) and headers.
+ * Finally, it frees the `Request` struct itself and sets the original
  * pointer to `NULL` to prevent dangling references.
  *
  * @parameters:
@@ -125,8 +112,8 @@ void free_req(Request **req);
  * @brief Free the memory associated with a Response structure.
  *
  * This function releases all dynamically allocated memory within a `Response`
- * structure, including the response line (version, status code, reason phrase),
- * headers, and body. Finally, it frees the `Response` struct itself and sets
+ * structure, including the response line (version, status code, reason phrase)
+ * and headers. Finally, it frees the `Response` struct itself and sets
  * the original pointer to `NULL` to prevent dangling references.
  *
  * @parameters:
@@ -134,56 +121,6 @@ void free_req(Request **req);
  */
 void free_res(Response **res);
 
-/*********************************************************
- *            HTTP Message Printing Functions            *
- *********************************************************/
-
-/**
- * @brief Prints an HTTP request message to stdout with formatted styling
- *
- * @param req Pointer to a Request structure containing the HTTP request details
- *           Must not be NULL
- *
- * @details Displays the following components:
- *          - Request line (method, URI, version)
- *          - Headers as key-value pairs
- *          - Message body (if present)
- *          All output is formatted with visual separators and styling
- */
-void print_res(const Response *res);
-
-/**
- * @brief Prints an HTTP response message to stdout with formatted styling
- *
- * @param res Pointer to a Response structure containing the HTTP response
- * details Must not be NULL
- *
- * @details Displays the following components:
- *          - Response line (version, status code, reason phrase)
- *          - Headers as key-value pairs
- *          - Message body (if present)
- *          All output is formatted with visual separators and styling
- *
- */
-void print_req(const Request *req);
-
-/**
- * @brief Prints a buffer's contents in hexadecimal format
- *
- * This function takes a buffer and prints its contents as hexadecimal values,
- * formatting the output in rows of 32 bytes. Each byte is printed as a
- * two-digit hexadecimal number followed by a space. A newline is inserted after
- * every 32 bytes to improve readability.
- *
- * Example output:
- * 48 45 4C 4C 4F 20 57 4F 52 4C 44 21 00 ...
- * 54 48 49 53 20 49 53 20 41 20 54 45 53 ...
- *
- * @param buffer     Pointer to the buffer containing the data to be printed.
- * @param buffer_len Length of the buffer in bytes
- */
-void print_hex(const unsigned char *buffer, const size_t buffer_len);
-
 /********************************************************
  *            HTTP Message Parsing Functions            *
  ********************************************************/
@@ -203,21 +140,4 @@ void print_hex(const unsigned char *buffer, const size_t buffer_len);
 const char *get_header_value(const char *target, const Header *headers,
                              const size_t headers_count);
 
-/**
- * @brief Parses and returns the size of an HTTP chunked transfer encoding chunk
- *
- * This function extracts and converts the hexadecimal chunk size from a chunk
- * header. The chunk header format should be: "<size in hex>\r\n"
- *
- * @param chunk Pointer to the start of the chunk header
- * @param chunk_len Length of the available chunk data
- *
- * @return The chunk size as an integer, or -1 if parsing fails
- *
- * @note The function expects the chunk to start with a hex number followed by
- * \r\n
- * @note The maximum chunk size is limited by the size_t type
- */
-int get_chunk_size(const unsigned char *chunk, const size_t chunk_len);
-
 #endif /* COMMON_H */
@@ -0,0 +1,147 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Compression Libraries */
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#include <zlib.h>
+
+/* Parser */
+#include "parser.h"
+
+/* Output Buffers */
+#include "outbuf.h"
+
+/* Content Codings (usable as a bitmask) */
+typedef enum {
+  ENC_IDENTITY = 0,
+  ENC_GZIP = 1 << 0,
+  ENC_DEFLATE = 1 << 1,
+  ENC_BR = 1 << 2,
+  ENC_UNKNOWN = 1 << 7, // Anything we can't decode (zstd, stacked codings...)
+} encoding_t;
+
+#define COMPRESS_MIN_SIZE 256 // Bodies smaller than this aren't worth it
+#define COMPRESS_OUT_LEN 16384 // Codec output buffer (one chunk on the wire)
+
+/* Data Structures */
+typedef struct Transform {
+  // Negotiated from the client's request
+  unsigned int accepted; // Mask of encodings from Accept-Encoding
+  bool any_coding;       // No Accept-Encoding: bodies pass through unchanged
+  bool is_head;          // Response will carry no body
+  bool chunked_ok;       // Client speaks HTTP/1.1 and can take chunked framing
+
+  // Per-response state
+  bool active;
+  bool compress; // Compress (true) or decompress (false) the origin's body
+  encoding_t encoding;
+  int level;
+
+  BodyFraming framing; // Where the origin's body ends
+
+  z_stream zs;
+  BrotliEncoderState *br_enc;
+  BrotliDecoderState *br_dec;
+
+  size_t bytes_in;  // Body bytes received from the origin
+  size_t bytes_out; // Body bytes sent to the client (excluding chunk framing)
+  long long cpu_ns; // Thread CPU time spent inside the codec
+} Transform;
+
+typedef struct CompressStats {
+  unsigned long long responses;   // Responses compressed
+  unsigned long long decoded;     // Responses decompressed for the client
+  unsigned long long bytes_in;    // Origin body bytes fed to the codecs
+  unsigned long long bytes_out;   // Body bytes produced by the codecs
+  unsigned long long bytes_saved; // Savings of compressed responses
+  unsigned long long cpu_ns;      // CPU time spent inside the codecs
+} CompressStats;
+
+/**
+ * @brief Parse an Accept-Encoding header value into a mask of encodings
+ *
+ * @param accept_encoding Header value (can be NULL)
+ *
+ * @return Bitmask of `encoding_t` values the client accepts, codings listed
+ * with q=0 are excluded
+ */
+unsigned int accept_encoding_mask(const char *accept_encoding);
+
+/**
+ * @brief Map a Content-Encoding header value to an `encoding_t`
+ *
+ * @param content_encoding Header value (can be NULL)
+ *
+ * @return ENC_IDENTITY if absent, ENC_UNKNOWN for unsupported or stacked
+ * codings
+ */
+encoding_t content_encoding_of(const char *content_encoding);
+
+/**
+ * @brief Decide whether a response must be transformed and, if so, send the
+ * rewritten headers to the client
+ *
+ * A response is compressed when its body is text (or another compressible
+ * type) sent without a Content-Encoding and the client accepts gzip, deflate
+ * or br. It is decompressed when the origin used a coding the client didn't
+ * advertise. Either way the framing is rewritten to chunked.
+ *
+ * @param xf Transform state of the connection (negotiation fields set)
+ * @param dest Output buffer of the client
+ * @param res Parsed response
+ *
+ * @return 1 if the transform is engaged, 0 if the response should be relayed
+ * untouched, -1 on error
+ */
+int transform_start(Transform *xf, OutBuf *dest, const Response *res);
+
+/**
+ * @brief Push raw origin bytes through the transform and send the result
+ *
+ * @param xf Engaged transform
+ * @param dest Output buffer of the client
+ * @param in Raw body bytes as received (decoded in place)
+ * @param len Number of bytes in `in`
+ *
+ * @return 1 when the body is complete, 0 if more is expected, -1 on error
+ */
+int transform_feed(Transform *xf, OutBuf *dest, unsigned char *in,
+                   const size_t len);
+
+/**
+ * @brief Terminate a body delimited by the origin closing the connection
+ *
+ * @param xf Engaged transform
+ * @param dest Output buffer of the client
+ *
+ * @return 0 on success, -1 on error
+ */
+int transform_finish(Transform *xf, OutBuf *dest);
+
+/**
+ * @brief Release the codec state of a transform and account its statistics
+ *
+ * Safe to call on an inactive transform. The negotiation fields are kept.
+ *
+ * @param xf Transform state
+ */
+void transform_end(Transform *xf);
+
+/**
+ * @brief Snapshot the process-wide compression counters
+ *
+ * @param stats Destination
+ */
+void compress_get_stats(CompressStats *stats);
+
+/**
+ * @brief Log the bytes saved and the codecs' CPU time per byte
+ */
+void compress_log_stats(void);
+
+#endif /* COMPRESS_H */
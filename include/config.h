@@ -0,0 +1,61 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* Defaults */
+#define DEFAULT_BLOCKLIST "./blocklist.txt"             // Blocked domains
+#define DEFAULT_BLOCKED_PAGE "./src/pages/blocked.html" // Blocked host page
+#define DEFAULT_URL_PATTERNS "./url_patterns.txt"       // URL substrings
+#define DEFAULT_V4_PREFIX 32      // Rate limit each IPv4 address on its own
+#define DEFAULT_V6_PREFIX 128     // Rate limit each IPv6 address on its own
+#define DEFAULT_DRAIN_S 30        // Requests in flight given this long to end
+#define DEFAULT_PARK_AFTER_MS 250 // Quiet connections give their thread back
+
+/* Data Structure */
+typedef struct Config {
+  const char *port;         // Port the proxy listens on
+  const char *blocklist;    // Path of the blocked domains file
+  const char *blocked_page; // Path of the page sent for blocked hosts
+  const char *url_patterns; // Path of the URL pattern file
+
+  unsigned int request_rate, request_burst; // Requests/s per client (0: off)
+  unsigned int conn_rate, conn_burst;       // Connections/s per client
+  int v4_prefix, v6_prefix;                 // Clients sharing a bucket
+
+  unsigned int shape_rate, shape_burst;         // Bytes/s per connection
+  unsigned int client_shape_rate, client_shape_burst; // Bytes/s per client
+
+  size_t fair_quantum; // Bytes per client per scheduling round (0: off)
+  int fair_slots;      // Connections relaying at the same time
+
+  double dump_sample;    // Fraction of the requests dumped (0: off)
+  const char *dump_host; // Only dump requests to matching hosts
+  const char *dump_uri;  // Only dump requests for matching URIs
+
+  const char *access_log; // Prefix of the binary access log files (NULL: off)
+  const char *admin;      // [HOST:]PORT serving the metrics (NULL: off)
+
+  const char *trace;          // Chrome trace of the slow requests (NULL: off)
+  unsigned int trace_slow_ms; // Requests slower than this are traced
+  double trace_sample;        // Fraction of the slow requests traced
+
+  const char *log_file; // Log written there instead of stdout (NULL: stdout)
+  bool tui;             // Live view on the terminal
+
+  unsigned int top_every; // Seconds between heavy hitter logs (0: off)
+
+  const char *capture;  // Plain HTTP traffic recorded there (NULL: off)
+  const char *upstream; // HOST:PORT every request is sent to (NULL: its Host)
+
+  unsigned int drain_s; // Seconds given to the connections on shutdown
+
+  size_t buffer_bytes; // Response bytes kept in memory before spilling to a
+                       // temp file, the upstream isn't held (0: relayed)
+
+  unsigned int park_after_ms; // Quiet this long, a connection is parked
+
+  bool huge_pages; // Buffer pool chunks on huge pages
+} Config;
+
+extern Config config;
+
+#endif /* CONFIG_H */
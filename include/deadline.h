@@ -0,0 +1,91 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Timer Wheel */
+#include "timer.h"
+
+/* Phases of a connection, each with its own time limit */
+typedef enum {
+  DEADLINE_HEADER,   // Accepted, the first request hasn't arrived
+  DEADLINE_IDLE,     // Kept alive between requests
+  DEADLINE_CONNECT,  // Connecting to the upstream, for each address tried
+  DEADLINE_RESPONSE, // Request sent, the response hasn't started
+  DEADLINE_TRANSFER, // Relaying a body or a tunnel, limit between bytes
+  DEADLINE_PHASES
+} deadline_phase_t;
+
+/* Defaults, in seconds */
+#define DEFAULT_HEADER_TIMEOUT_S 10
+#define DEFAULT_IDLE_TIMEOUT_S 60
+#define DEFAULT_CONNECT_TIMEOUT_S 10
+#define DEFAULT_RESPONSE_TIMEOUT_S 60
+#define DEFAULT_TRANSFER_TIMEOUT_S 60
+
+/* Data Structures */
+
+/*
+ * Deadline of a connection, driven by the timer wheel. When the phase runs
+ * out of time, the socket it waits on is shut down: the handler thread wakes
+ * up from poll() (or connect()), finds `expired` set and closes the
+ * connection. The handler itself never keeps time.
+ */
+typedef struct Deadline {
+  Timer timer;
+  int fd;                 // Shut down on expiry
+  deadline_phase_t phase; // Only changed while the timer isn't pending
+  atomic_bool expired;
+  atomic_uint_fast64_t active_ns; // Last transfer, limits are counted from it
+} Deadline;
+
+/**
+ * @brief Set the time limits of the phases
+ *
+ * @param spec PHASE=SECONDS pairs separated by commas, phases being header,
+ * idle, connect, response and transfer. 0 removes a limit.
+ *
+ * @return 0 on success, -1 on error
+ */
+int deadline_configure(const char *spec);
+
+/**
+ * @brief Prepare the deadline of a new connection, not running
+ */
+void deadline_init(Deadline *deadline);
+
+/**
+ * @brief Start a phase, replacing the previous one
+ *
+ * @param deadline Deadline of the connection
+ * @param phase Phase starting now
+ * @param fd Socket shut down when the phase runs out of time: the client for
+ * the header and idle phases, the upstream otherwise
+ */
+void deadline_start(Deadline *deadline, const deadline_phase_t phase,
+                    const int fd);
+
+/**
+ * @brief Stop the deadline, before closing the socket it watches
+ */
+void deadline_stop(Deadline *deadline);
+
+/**
+ * @brief Push back a response or transfer limit, bytes went through
+ */
+void deadline_touch(Deadline *deadline);
+
+/**
+ * @brief Whether the current phase ran out of time
+ */
+bool deadline_expired(Deadline *deadline);
+
+/**
+ * @brief Name of a phase, for logs and metrics
+ */
+const char *deadline_phase_name(const deadline_phase_t phase);
+
+#endif /* DEADLINE_H */
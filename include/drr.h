@@ -0,0 +1,108 @@
+#ifndef DRR_H
+#define DRR_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* POSIX Multi-Threading Library */
+#include <pthread.h>
+
+/* POSIX Networking Library */
+#include <sys/socket.h>
+
+/* Constants */
+#define DRR_BUCKETS 256 // Flow lookup table size, power of two
+
+/* Data Structures */
+
+/* Connection thread waiting for its turn */
+typedef struct DrrWaiter {
+  pthread_cond_t cond;
+  bool granted;
+  struct DrrWaiter *next;
+} DrrWaiter;
+
+/* Every connection of one client */
+typedef struct DrrFlow {
+  uint64_t key;
+  long deficit; // Bytes the flow may still relay this round (can go negative)
+  unsigned int refs; // Connections of the client
+
+  DrrWaiter *head, *tail; // Turns requested, served in order
+  bool active;            // Linked in the round
+  struct DrrFlow *next_active;
+  struct DrrFlow *next_hash;
+} DrrFlow;
+
+/*
+ * Deficit round robin over clients. Connection threads request a turn once
+ * their sockets are ready and only relay once it's granted; at most `slots`
+ * turns run at a time. Clients with waiting connections take turns in a
+ * round, each getting `quantum` more bytes of credit per round and one turn
+ * per visit while it has credit left. A client flooding with many
+ * connections thus gets the same share as one with a single connection.
+ */
+typedef struct DrrScheduler {
+  pthread_mutex_t lock;
+  size_t quantum; // Credit added per round, 0 when scheduling is off
+  int free_slots;
+
+  DrrFlow *round_head, *round_tail;
+  DrrFlow *flows[DRR_BUCKETS];
+
+  unsigned long long turns;  // Turns granted
+  unsigned long long rounds; // Credit refills
+} DrrScheduler;
+
+/* Scheduler shared by the connection handlers */
+extern DrrScheduler scheduler;
+
+/**
+ * @brief Set up a scheduler
+ *
+ * @param sched Scheduler to set up
+ * @param quantum Bytes of credit per round (0 turns scheduling off)
+ * @param slots Turns that can run at the same time
+ */
+void drr_init(DrrScheduler *sched, const size_t quantum, const int slots);
+
+/**
+ * @brief Register a connection of a client
+ *
+ * @param sched Scheduler
+ * @param addr Address of the client, only the IP identifies it
+ *
+ * @return The client's flow, or NULL when scheduling is off
+ */
+DrrFlow *drr_join(DrrScheduler *sched, const struct sockaddr *addr);
+
+/**
+ * @brief Unregister a connection, releasing the flow with its last one
+ */
+void drr_part(DrrScheduler *sched, DrrFlow *flow);
+
+/**
+ * @brief Wait for the flow's turn (returns immediately for a NULL flow)
+ *
+ * @note Cancellation point, the request is withdrawn if the thread is
+ * cancelled while waiting.
+ */
+void drr_enter(DrrScheduler *sched, DrrFlow *flow);
+
+/**
+ * @brief End a turn
+ *
+ * @param sched Scheduler
+ * @param flow Flow whose turn it was (NULL is ignored)
+ * @param bytes Bytes relayed during the turn, charged to the flow's credit
+ */
+void drr_leave(DrrScheduler *sched, DrrFlow *flow, const size_t bytes);
+
+/**
+ * @brief Log the number of turns and rounds so far
+ */
+void drr_log_stats(DrrScheduler *sched);
+
+#endif /* DRR_H */
@@ -0,0 +1,86 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Parser */
+#include "parser.h"
+
+/* Writer Queue */
+#include "writeq.h"
+
+/* Constants */
+#define DUMP_BODY_MAX 4096  // Body bytes captured per message
+#define DUMP_QUEUE_MAX 256  // Records waiting for the writer, others dropped
+
+/* Data Structures */
+typedef enum { DUMP_REQUEST, DUMP_RESPONSE } dump_kind_t;
+
+/* Message copied off the connection thread, formatted by the writer */
+typedef struct DumpRecord {
+  WriteNode node; // First, queued for the writer
+
+  dump_kind_t kind;
+  bool is_text;    // Body printed as is, hex dumped otherwise
+  bool is_chunked;
+  size_t body_size; // Size of the whole body as parsed
+  size_t head_len;  // Raw start line and headers
+  size_t body_len;  // Body bytes captured, at most DUMP_BODY_MAX
+
+  unsigned char data[]; // Head followed by the captured body
+} DumpRecord;
+
+/* Set once by dump_start(), checked before anything else is done */
+extern bool dump_enabled;
+
+/**
+ * @brief Start dumping a sample of the exchanges from a writer thread
+ *
+ * @param sample Fraction of the requests dumped, in (0, 1]
+ * @param host Only dump requests whose Host contains this (NULL: any)
+ * @param uri Only dump requests whose URI contains this (NULL: any)
+ *
+ * @return 0 on success, -1 on error
+ */
+int dump_start(const double sample, const char *host, const char *uri);
+
+/**
+ * @brief Decide whether a new request, and the responses to it, are dumped
+ *
+ * @note Only call when dump_enabled is set.
+ */
+bool dump_select(const char *host, const char *uri);
+
+/**
+ * @brief Queue a copy of a freshly parsed request for the writer
+ *
+ * @param req Parsed request
+ * @param raw Bytes it was parsed from
+ * @param len Number of bytes
+ */
+void dump_request(const Request *req, const unsigned char *raw,
+                  const size_t len);
+
+/**
+ * @brief Queue a copy of a freshly parsed response for the writer
+ *
+ * @param res Parsed response
+ * @param raw Bytes it was parsed from
+ * @param len Number of bytes
+ */
+void dump_response(const Response *res, const unsigned char *raw,
+                   const size_t len);
+
+/**
+ * @brief Log the number of messages dumped and dropped
+ */
+void dump_log_stats(void);
+
+/**
+ * @brief Write the queued messages and stop the writer thread
+ */
+void dump_stop(void);
+
+#endif /* DUMP_H */
@@ -7,23 +7,113 @@
 /* POSIX Multiplexing Library */
 #include <sys/poll.h>
 
+/* POSIX Networking Library */
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 /* Parser */
 #include "parser.h"
 
+/* Response Compression */
+#include "compress.h"
+
+/* Bandwidth Shaping */
+#include "shaper.h"
+
+/* Fair Scheduling */
+#include "drr.h"
+
+/* Traffic Dump */
+#include "dump.h"
+
+/* Access Log */
+#include "accesslog.h"
+
+/* Traffic Capture */
+#include "capture.h"
+
+/* Metrics */
+#include "metrics.h"
+
+/* Per-Phase Timeouts */
+#include "deadline.h"
+
+/* Output Buffers */
+#include "outbuf.h"
+
 /* Data Structures */
 typedef struct ConnInfo {
-  struct pollfd fds[2];
+  uint64_t id;          // Sequence number of the connection
+  uint64_t accepted_ns; // Monotonic time of the accept
+  bool first_byte_seen; // Accept to first upstream byte already timed
+  struct pollfd fds[3]; // Client, upstream, drain notice (proxy_drain_fd())
+  OutBuf out[2];        // Bytes on their way to the client and the upstream
+  struct sockaddr_storage peer; // Address of the client
+  char client[INET6_ADDRSTRLEN]; // Same, as text for the heavy hitters
 
   Request *req;
   Response *res;
+  unsigned char *rx; // Receive buffer from the pool, held while attached
+  size_t rx_cap;
+
+  bool is_TLS; // CONNECT tunnel established, relay bytes blindly
+
+  bool served;   // A request arrived, the connection isn't new
+  bool awaiting; // A request went upstream and its response hasn't ended
+
+  Deadline deadline; // Time limit of the current phase of the connection
+
+  Transform xf; // Response body compression/decompression
+
+  Shaper shaper; // Pauses reads of connections over their bandwidth
+
+  DrrFlow *flow;     // Client's share of the turns, NULL when not scheduled
+  size_t turn_bytes; // Bytes received during the current turn
+  bool in_turn;      // Holding a turn, only while receiving and relaying
+
+  bool dump; // The current request and its responses are dumped
+
+  bool capture_lost; // A record was dropped, the connection isn't captured
+
+  Exchange exchange; // Request being relayed, written to the access log
+  TopEntries top;     // Heavy hitter counts of the current request
+  char top_host[HEAVY_KEY_LEN]; // Its host, to find them again after parking
+
+  bool parked; // Watched by the park thread, see park.h
+  struct ConnInfo *prev, *next; // Parked or waiting for a thread
 } ConnInfo;
 
-#define TIMEOUT 120000 // 120 seconds
+#define TIMEOUT 120000 // Longest poll(), the deadlines close connections
+
+/**
+ * @brief Set up an accepted connection, in its header phase
+ *
+ * @param fd Client socket, non-blocking
+ *
+ * @return The connection, NULL when out of memory (the socket is left open)
+ */
+ConnInfo *conn_open(const int fd);
+
+/**
+ * @brief Close the sockets of a connection, log it and free it
+ */
+void conn_close(ConnInfo *info);
+
+/**
+ * @brief End the connection's relaying turn, if it holds one, before it
+ * waits on anything else (resolving and connecting upstream)
+ */
+void conn_end_turn(ConnInfo *info);
 
+/**
+ * @brief Serve a connection until it closes or is parked
+ *
+ * @param arg ConnInfo from conn_open(), new or resumed, owned by the thread
+ */
 void *handler(void *arg);
 
-int client_handler(struct pollfd *fds, Request *req, bool *is_TLS);
+int client_handler(ConnInfo *info);
 
-int server_handler(const struct pollfd *fds, Response *res, bool *is_TLS);
+int server_handler(ConnInfo *info);
 
 #endif /* HANDLER_H */
@@ -0,0 +1,81 @@
+#ifndef HEAVY_H
+#define HEAVY_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#ifndef HEAVY_CAPACITY
+#define HEAVY_CAPACITY 64 // Keys counted per sketch, see bench/heavy_bench.c
+#endif
+#define HEAVY_KEY_LEN 64 // Longer keys are cut
+
+/* Data Structures */
+
+/*
+ * Counter of a key. The owner renames an entry inside a seqlock (odd `seq`
+ * while it writes) so readers can tell a torn key. `count` overestimates the
+ * key's weight by at most `error`, inherited from the key it replaced.
+ */
+typedef struct HeavyEntry {
+  atomic_uint seq;
+  uint32_t hash; // Of the key, 0 when the entry is unused
+  char key[HEAVY_KEY_LEN];
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t error;
+} HeavyEntry;
+
+/*
+ * Space-Saving sketch: the heaviest keys of a stream in fixed memory. A key
+ * that isn't counted takes the place of the lightest one, and its count.
+ * Any key weighing more than total/HEAVY_CAPACITY is guaranteed an entry.
+ * Only one thread updates a sketch, any thread can read it.
+ */
+typedef struct HeavySketch {
+  HeavyEntry entries[HEAVY_CAPACITY];
+} HeavySketch;
+
+/* Estimated weight of a key, somewhere in [count - error, count] */
+typedef struct HeavyStat {
+  char key[HEAVY_KEY_LEN];
+  uint64_t count;
+  uint64_t error;
+} HeavyStat;
+
+/**
+ * @brief Add weight to a key
+ *
+ * @param sketch Sketch owned by the calling thread
+ * @param key Key, cut to HEAVY_KEY_LEN - 1 characters
+ * @param weight Weight added, 0 to only make sure the key is counted
+ *
+ * @return Entry of the key, valid for heavy_bump() until the next
+ * heavy_add() to the sketch
+ */
+HeavyEntry *heavy_add(HeavySketch *sketch, const char *key,
+                      const uint64_t weight);
+
+/**
+ * @brief Add weight to an entry returned by heavy_add() (NULL: ignored)
+ */
+void heavy_bump(HeavyEntry *entry, const uint64_t weight);
+
+/**
+ * @brief Merge sketches and keep the heaviest keys
+ *
+ * A key missing from a full sketch may weigh up to its lightest count there,
+ * which is added to both its count and its error.
+ *
+ * @param sketches Sketches to merge, read while they're updated
+ * @param n Number of sketches
+ * @param top Filled with up to `k` keys, heaviest first
+ * @param k Size of `top`
+ *
+ * @return Number of keys written to `top`
+ */
+size_t heavy_merge(HeavySketch *const *sketches, const size_t n,
+                   HeavyStat *top, const size_t k);
+
+#endif /* HEAVY_H */
@@ -0,0 +1,205 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Heavy Hitters */
+#include "heavy.h"
+
+/* Constants */
+#define METRICS_MAX_THREADS 256 // Threads with their own counters
+#define HIST_SUB_BITS 3         // 8 sub-buckets per power of two (12.5%)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36         // Values up to 2^36 us (about 19 hours)
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+#define METRICS_TOP 10      // Heaviest hosts and clients exported
+
+/* Counters, only ever incremented */
+typedef enum {
+  METRIC_CONN_ACCEPTED,      // Connections handed to a handler thread
+  METRIC_CONN_CLOSED,        // Handler threads done
+  METRIC_CONN_REJECTED,      // Dropped because every thread was busy
+  METRIC_CONN_THROTTLED,     // Refused by the connection rate limit
+  METRIC_REQUESTS,           // Requests parsed
+  METRIC_REQ_BAD,            // Requests that couldn't be parsed
+  METRIC_REQ_BLOCKED,        // Refused by the blocklist or a URL pattern
+  METRIC_REQ_THROTTLED,      // Refused by the request rate limit
+  METRIC_UPSTREAM_FAILED,    // Upstream connections that failed
+  METRIC_TIMEOUT_HEADER,     // Deadlines expired, in deadline_phase_t order
+  METRIC_TIMEOUT_IDLE,
+  METRIC_TIMEOUT_CONNECT,
+  METRIC_TIMEOUT_RESPONSE,
+  METRIC_TIMEOUT_TRANSFER,
+  METRIC_BYTES_FROM_CLIENT,  // Bytes received from clients
+  METRIC_BYTES_FROM_UPSTREAM, // Bytes received from upstreams
+  METRIC_SPILLED_BYTES,      // Response bytes buffered in a temp file
+  METRIC_UPSTREAM_RELEASED,  // Upstreams closed with their response buffered
+  METRIC_COUNTERS
+} metric_t;
+
+/* Latency histograms, in microseconds */
+typedef enum {
+  HIST_FIRST_BYTE, // Connection accepted to first upstream byte
+  HIST_RESOLVE,    // Request parsed to upstream name resolved
+  HIST_CONNECT,    // Upstream name resolved to connected
+  HIST_WAIT,       // Request sent to first response byte
+  HIST_REQUEST,    // Request arrival to last response byte (or its end)
+  METRIC_HISTOGRAMS
+} histogram_t;
+
+/* What the connection served by a thread is doing */
+typedef enum {
+  CONN_STATE_NONE,       // Not serving a connection
+  CONN_STATE_READING,    // Waiting for a request
+  CONN_STATE_CONNECTING, // Resolving and connecting to the upstream
+  CONN_STATE_WAITING,    // Request sent, no response byte yet
+  CONN_STATE_RELAYING,   // Response received, until the next request
+  CONN_STATE_TUNNEL,     // CONNECT tunnel
+  CONN_STATES
+} conn_state_t;
+
+/* Heavy hitters, each counted in per-thread Space-Saving sketches */
+typedef enum {
+  TOP_HOST_REQUESTS,   // Requests per upstream host
+  TOP_HOST_BYTES,      // Bytes relayed per upstream host, both ways
+  TOP_CLIENT_REQUESTS, // Requests per client address
+  TOP_CLIENT_BYTES,    // Bytes relayed per client address, both ways
+  METRIC_SKETCHES
+} sketch_t;
+
+/* Data Structures */
+
+/* Entries a connection adds the bytes it relays to */
+typedef struct TopEntries {
+  HeavyEntry *host;   // NULL before the first request
+  HeavyEntry *client;
+} TopEntries;
+
+/*
+ * Counters of one thread. Only the owner writes them, with plain (relaxed)
+ * loads and stores, readers add every slab up. The padding keeps each
+ * thread's counters on cache lines of their own.
+ */
+typedef struct MetricsSlab {
+  _Alignas(64) atomic_uint_fast64_t counters[METRIC_COUNTERS];
+  atomic_uint_fast64_t buckets[METRIC_HISTOGRAMS][HIST_BUCKETS];
+  atomic_uint_fast64_t sums[METRIC_HISTOGRAMS]; // Microseconds
+  atomic_int state; // conn_state_t
+  atomic_bool used;
+
+  HeavySketch sketches[METRIC_SKETCHES];
+} MetricsSlab;
+
+/* Sum of the slabs at some point in time */
+typedef struct MetricsSnapshot {
+  uint64_t counters[METRIC_COUNTERS];
+  uint64_t buckets[METRIC_HISTOGRAMS][HIST_BUCKETS];
+  uint64_t counts[METRIC_HISTOGRAMS];
+  uint64_t sums[METRIC_HISTOGRAMS];
+  uint64_t states[CONN_STATES]; // Connections in each state
+} MetricsSnapshot;
+
+/**
+ * @brief Add to a counter of the calling thread
+ *
+ * @note Takes no lock and issues no locked instruction, the thread claims a
+ * slab on first use and releases it when it exits (keeping its counts).
+ */
+void metrics_add(const metric_t metric, const uint64_t value);
+
+/**
+ * @brief Record a latency in a histogram of the calling thread
+ *
+ * @param hist Histogram
+ * @param us Latency in microseconds
+ */
+void metrics_observe(const histogram_t hist, const uint64_t us);
+
+/**
+ * @brief Publish what the connection of the calling thread is doing
+ */
+void metrics_state(const conn_state_t state);
+
+/**
+ * @brief Count a request in the heavy hitter sketches of the calling thread
+ *
+ * @param host Upstream host
+ * @param client Client address
+ * @param entries Set to the entries the request's bytes go to, valid until
+ * the thread counts another request
+ */
+void metrics_top_request(const char *host, const char *client,
+                         TopEntries *entries);
+
+/**
+ * @brief Find the entries of a request again in the calling thread's
+ * sketches, without counting it twice
+ *
+ * @param host Upstream host
+ * @param client Client address
+ * @param entries Set to the entries the request's bytes go to
+ */
+void metrics_top_resume(const char *host, const char *client,
+                        TopEntries *entries);
+
+/**
+ * @brief Add relayed bytes to the host and client of the current request
+ */
+void metrics_top_bytes(const TopEntries *entries, const uint64_t bytes);
+
+/**
+ * @brief Add every slab up
+ */
+void metrics_snapshot(MetricsSnapshot *snap);
+
+/**
+ * @brief Estimate a quantile of a histogram
+ *
+ * @param snap Snapshot
+ * @param hist Histogram
+ * @param q Quantile, in [0, 1]
+ *
+ * @return Upper bound of the bucket holding the quantile in microseconds, 0
+ * for an empty histogram
+ */
+uint64_t metrics_quantile(const MetricsSnapshot *snap, const histogram_t hist,
+                          const double q);
+
+/**
+ * @brief Merge the sketches of every thread and keep the heaviest keys
+ *
+ * @param sketch Sketch to merge
+ * @param top Filled with up to `k` keys, heaviest first
+ * @param k Size of `top`
+ *
+ * @return Number of keys written to `top`
+ */
+size_t metrics_top(const sketch_t sketch, HeavyStat *top, const size_t k);
+
+/**
+ * @brief Write the heaviest hosts and clients in the Prometheus text format
+ */
+void metrics_render_top(FILE *out);
+
+/**
+ * @brief Log the heaviest hosts and clients
+ */
+void metrics_log_top(void);
+
+/**
+ * @brief Log the heaviest hosts and clients every `seconds` from a thread
+ *
+ * @return 0 on success, -1 on error
+ */
+int metrics_top_start(const unsigned int seconds);
+
+/**
+ * @brief Write the counters and histograms in the Prometheus text format
+ */
+void metrics_render(FILE *out, const MetricsSnapshot *snap);
+
+#endif /* METRICS_H */
@@ -0,0 +1,100 @@
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* POSIX Types */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Constants */
+#define OUTBUF_HIGH_WATERMARK (256 * 1024) // Reads feeding it pause above this
+#define OUTBUF_LOW_WATERMARK (64 * 1024)   // and resume once drained below
+
+/* Data Structures */
+
+/*
+ * Bytes on their way to one side of a connection. Writes go straight to the
+ * non-blocking socket, what it doesn't take is queued and sent on POLLOUT.
+ * Past the high watermark the buffer is `full` and the handler stops reading
+ * the other side until it drained to the low watermark, so a connection holds
+ * at most the high watermark plus one read worth of output per direction.
+ * Nothing is allocated while the socket keeps up.
+ *
+ * With `spill_at` set, the buffer never fills up: past that many bytes in
+ * memory, what follows is appended to an unlinked temp file and sent from it
+ * with sendfile(). The side feeding it is read as fast as it sends.
+ */
+typedef struct OutBuf {
+  int fd;              // Socket written to, -1 until open
+  unsigned char *data; // Queued bytes from `start`, NULL when empty
+  size_t start, len, cap;
+  bool full; // Over the high watermark and not drained yet
+
+  size_t spill_at; // Bytes kept in memory before spilling (0: never)
+  int spill_fd;    // Temp file queued after `data`, -1 when none
+  off_t spill_sent, spill_len;
+  bool spill_shared; // `spill_fd` is a file of the caller's, never written
+} OutBuf;
+
+/**
+ * @brief Prepare an empty buffer
+ *
+ * @param out Buffer
+ * @param fd Socket written to, -1 if not open yet
+ */
+void outbuf_init(OutBuf *out, const int fd);
+
+/**
+ * @brief Send bytes after those already queued, queueing what the socket
+ * doesn't take
+ *
+ * @return 0 on success, -1 on error (peer gone, out of memory)
+ */
+int outbuf_write(OutBuf *out, const void *data, const size_t len);
+
+/**
+ * @brief Send several pieces with a single sendmsg() after those already
+ * queued, queueing what the socket doesn't take
+ *
+ * @param flags Passed to sendmsg(), MSG_MORE when a file follows
+ *
+ * @return 0 on success, -1 on error (peer gone, out of memory)
+ */
+int outbuf_writev(OutBuf *out, const struct iovec *iov, const int iov_count,
+                  const int flags);
+
+/**
+ * @brief Send part of a file with sendfile() after what's already queued.
+ * What the socket doesn't take is sent from the file later, not copied.
+ *
+ * @param file_fd File that doesn't change while queued, duplicated
+ * @param offset Start of the part in the file
+ * @param len Bytes of the part
+ *
+ * @return 0 on success, -1 on error
+ */
+int outbuf_sendfile(OutBuf *out, const int file_fd, const off_t offset,
+                    const size_t len);
+
+/**
+ * @brief Send what's queued, memory first then the spill file, when the
+ * socket is writable
+ *
+ * @return Bytes sent, -1 on error
+ */
+long outbuf_flush(OutBuf *out);
+
+/**
+ * @brief Whether bytes are waiting for the socket
+ */
+bool outbuf_pending(const OutBuf *out);
+
+/**
+ * @brief Drop the queued bytes and release the memory and the spill file
+ */
+void outbuf_free(OutBuf *out);
+
+#endif /* OUTBUF_H */
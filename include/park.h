@@ -0,0 +1,51 @@
+#ifndef PARK_H
+#define PARK_H
+
+/* Connection Handler */
+#include "handler.h"
+
+/* Constants */
+#define PARK_RETRY_MS 10 // Woken connections wait this long for a free thread
+#define PARK_EVENTS 256  // Readiness events taken at once
+
+/*
+ * Connections with nothing to do (kept alive between requests, quiet tunnels,
+ * accepted with every thread busy) don't hold a thread. Their handler frees
+ * the request and response, hands the ConnInfo over with park() and exits,
+ * giving its slot back. The park thread watches the sockets with epoll and,
+ * once either is readable (bytes, a hang-up, or a deadline shutting it down),
+ * spawns a handler thread to resume the connection. Deadlines keep running
+ * meanwhile, the ConnInfo doesn't move. Once draining, the parked
+ * connections kept alive between requests are closed right away.
+ */
+
+/**
+ * @brief Start the thread watching the parked connections
+ *
+ * @note Called once the proxy listens, the drain notice has to exist
+ *
+ * @return 0 on success, -1 on error
+ */
+int park_start(void);
+
+/**
+ * @brief Hand a connection to the park thread
+ *
+ * @param info Connection, no longer touched by the caller on success. Its
+ * request, response, receive and output buffers must be freed.
+ *
+ * @return 0 on success, -1 on error or once draining (the caller keeps it)
+ */
+int park(ConnInfo *info);
+
+/**
+ * @brief Connections parked or woken and waiting for a thread
+ */
+int park_count(void);
+
+/**
+ * @brief Log the number of connections parked and resumed
+ */
+void park_log_stats(void);
+
+#endif /* PARK_H */
@@ -8,6 +8,24 @@
 #define MAX_HEADERS 256
 
 /* Data Structure */
+typedef enum {
+  BODY_NONE,        // No body (HEAD, 1xx, 204, 304, Content-Length: 0)
+  BODY_LENGTH,      // Delimited by Content-Length
+  BODY_CHUNKED,     // Chunked transfer encoding
+  BODY_UNTIL_CLOSE, // Delimited by the server closing the connection
+} body_kind_t;
+
+typedef struct BodyFraming {
+  body_kind_t kind;
+  size_t remaining; // Bytes left in the body (LENGTH) or current chunk
+
+  // Chunked decoder state
+  int state;
+  size_t chunk_size;
+
+  bool done; // The whole body has been seen
+} BodyFraming;
+
 typedef struct Header {
   char *key;
   char *value;
@@ -26,13 +44,15 @@ typedef struct Request {
   // Size of the headers and the request line
   size_t header_size;
 
-  // Partial recv flag
+  // The body is still arriving, delimited by length (or the close)
   bool is_partial;
-  size_t partial_recv_size;
 
-  // Chunked transfer encoding flag
+  // The body is still arriving, with chunked transfer encoding
   bool is_chunked;
 
+  // Where the body ends, fed the bytes that follow the head
+  BodyFraming framing;
+
   // Content Type
   char *content_type;
   bool is_text;
@@ -40,8 +60,7 @@ typedef struct Request {
   // Content Encoding
   char *content_encoding;
 
-  // Body (optional)
-  unsigned char *body;
+  // Content-Length of the body, 0 when chunked or absent
   size_t body_size;
 } Request;
 
@@ -56,13 +75,15 @@ typedef struct Response {
   // Size of the headers and the response line
   size_t header_size;
 
-  // Partial recv flag
+  // The body is still arriving, delimited by length (or the close)
   bool is_partial;
-  size_t partial_recv_size;
 
-  // Chunked transfer encoding flag
+  // The body is still arriving, with chunked transfer encoding
   bool is_chunked;
 
+  // Where the body ends, fed the bytes that follow the head
+  BodyFraming framing;
+
   // Content Type
   char *content_type;
   bool is_text;
@@ -70,13 +91,74 @@ typedef struct Response {
   // Content Encoding
   char *content_encoding;
 
-  // Body
-  unsigned char *body;
+  // Content-Length of the body, 0 when chunked or absent
   size_t body_size;
 } Response;
 
+/**
+ * @brief Parse the head of a request, or continue the body of the last one
+ *
+ * While `is_partial` or `is_chunked` is set the bytes are taken as the body
+ * of the previous request. Otherwise `req` is cleared and a new head is
+ * parsed, which has to be whole in `raw`. The body itself isn't copied.
+ *
+ * @param raw Bytes received from the client
+ * @param len Number of bytes in `raw`
+ * @param req Request reused across the messages of a connection
+ *
+ * @return 0 on success, -1 on a malformed message
+ */
 int parse_request(const unsigned char *raw, const size_t len, Request *req);
 
-int parse_response(const unsigned char *raw, const size_t len, Response *res);
+/**
+ * @brief Parse the head of a response, or continue the body of the last one
+ *
+ * Same as parse_request(), for the messages of a server.
+ *
+ * @param is_head Whether the response answers a HEAD request: it has no
+ * body, whatever its Content-Length or Transfer-Encoding
+ */
+int parse_response(const unsigned char *raw, const size_t len, Response *res,
+                   const bool is_head);
+
+/**
+ * @brief Reduce a request target to its path, without the fragment
+ *
+ * @param uri Request target, absolute or origin form (NULL: "/")
+ * @param uri_len Length of `uri`
+ * @param method Method of the request, OPTIONS gives "*"
+ *
+ * @return The path, to be freed, or NULL when out of memory
+ */
+char *normalize_uri(const char *uri, const long uri_len, const char *method);
+
+/**
+ * @brief Determine how the body of a response is delimited on the wire
+ *
+ * @param bf Framing state to initialize
+ * @param res Parsed response headers
+ * @param is_head Whether the response answers a HEAD request
+ */
+void body_framing_init(BodyFraming *bf, const Response *res,
+                       const bool is_head);
+
+/**
+ * @brief Feed raw body bytes through the framing state machine
+ *
+ * Tracks where the body ends and, when `out` is not NULL, strips the chunked
+ * transfer coding so that only payload bytes are written to `out`. `out` may
+ * alias `in` since the payload is never longer than its encoding.
+ *
+ * @param bf Framing state
+ * @param in Raw bytes received from the peer
+ * @param len Number of bytes in `in`
+ * @param out Destination for the decoded payload (can be NULL)
+ * @param consumed Set to the number of bytes of `in` that belong to the body
+ *
+ * @return Number of payload bytes written to `out`, or -1 on malformed input
+ */
+long body_framing_feed(BodyFraming *bf, const unsigned char *in,
+                       const size_t len, unsigned char *out,
+                       size_t *consumed);
 
 #endif /* PARSER_H */
@@ -0,0 +1,51 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Standard Library */
+#include <stdint.h>
+
+/*
+ * USDT probes, listed with `readelf -n httproxy` and attached to with perf or
+ * bpftrace (see scripts/). Each one is a single nop in the code until a tracer
+ * attaches, arguments are only read by the tracer. Without <sys/sdt.h>, or
+ * with -DNO_PROBES, they compile to nothing.
+ *
+ * Probes (provider httproxy), the first argument is always the connection:
+ *   conn_accept(conn, fd)                     Handler thread started
+ *   conn_close(conn)                          Connection closed
+ *   request_parsed(conn, method, uri, bytes)  Request head parsed
+ *   upstream_connect_start(conn, host)        Resolving and connecting
+ *   upstream_connect_done(conn, fd)           Connected, fd is -1 on failure
+ *   response_first_byte(conn, bytes)          First bytes of a response
+ *   tunnel_start(conn, host)                  CONNECT tunnel established
+ *   forward_partial(conn, fd, sent, left)     send() took only part of a
+ *                                             buffer, `left` bytes are queued
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(httproxy, name, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef PROBE
+#define PROBE(name, ...)                                                       \
+  do {                                                                         \
+  } while (0)
+#endif
+
+/* Connection served by the calling handler thread, 0 on other threads */
+extern __thread uint64_t probe_conn_id;
+
+/*
+ * probe_conn_id as a probe argument. Passed directly it becomes an
+ * %fs-relative operand, which the USDT argument parsers of libbpf and bcc
+ * reject, the empty asm moves it to a register first.
+ */
+static inline uint64_t probe_conn(void) {
+  uint64_t conn = probe_conn_id;
+  __asm__("" : "+r"(conn));
+  return conn;
+}
+
+#endif /* PROBES_H */
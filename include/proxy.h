@@ -1,7 +1,58 @@
 #ifndef PROXY_H
 #define PROXY_H
 
-/* Proxy Server */
+/* Standard Library */
+#include <stdbool.h>
+
+/* Constants */
+#define DRAIN_POLL_MS 50 // Handlers left checked this often while draining
+
+/**
+ * @brief Listen on the proxy port, or take over a listener
+ *
+ * @param port Port to listen on
+ * @param inherited Listener handed down by the previous process, -1 for none
+ *
+ * @return 0 on success, -1 on error
+ */
+int proxy_listen(const char *port, const int inherited);
+
+/**
+ * @brief Listening socket, handed to the new process on a hot upgrade
+ */
+int proxy_listener(void);
+
+/* Proxy Server, accepts connections until proxy_stop() */
 void *proxy(void *arg);
 
+/**
+ * @brief Stop accepting connections and have the handlers close the idle ones
+ *
+ * Connections with a request in flight are closed once its response ended.
+ * Calling it again does nothing.
+ */
+void proxy_stop(void);
+
+/**
+ * @brief Whether proxy_stop() was called
+ */
+bool proxy_stopping(void);
+
+/**
+ * @brief Readable once proxy_stop() was called, polled by the handlers
+ */
+int proxy_drain_fd(void);
+
+/**
+ * @brief Wait for the handlers to finish, then cancel those left
+ *
+ * @param seconds Longest wait
+ */
+void proxy_drain(const unsigned int seconds);
+
+/**
+ * @brief Have proxy_drain() cancel the handlers left right away
+ */
+void proxy_drain_abort(void);
+
 #endif /* PROXY_H */
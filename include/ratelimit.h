@@ -0,0 +1,143 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* POSIX Networking Library */
+#include <sys/socket.h>
+
+/* Constants */
+#define RATELIMIT_SHARDS 16         // Power of two
+#define RATELIMIT_SHARD_SLOTS 4096  // Power of two
+#define RATELIMIT_MAX_PROBE 32      // Slots searched for a client
+#define RATELIMIT_TOKEN_SCALE 1000U // Bucket units per request token
+
+/* Data Structures */
+
+/* Token bucket of one client (or network), updated with a single CAS */
+typedef struct RateEntry {
+  atomic_uint_fast64_t key;   // Hash of the masked address, 0 when free
+  atomic_uint_fast64_t state; // Last refill in ms << 32 | signed units
+} RateEntry;
+
+/*
+ * Open-addressed, lock-free table of buckets. Slots are never emptied: a
+ * bucket idle long enough to have refilled completely is indistinguishable
+ * from a new one, so it's simply taken over by the next client that needs a
+ * slot in its probe window.
+ */
+typedef struct RateShard {
+  _Alignas(64) atomic_ulong allowed; // Requests, or bytes, let through
+  atomic_ulong limited;              // Requests refused, or bytes delayed
+  atomic_ulong delay_ms;             // Pauses imposed by byte rules
+  atomic_ulong entries;              // Slots claimed so far
+  atomic_ulong evictions;            // Idle buckets taken over
+  atomic_ulong overflows;            // Clients let through for lack of a slot
+
+  _Alignas(64) RateEntry slots[RATELIMIT_SHARD_SLOTS];
+} RateShard;
+
+typedef struct RateRule {
+  const char *name;
+  unsigned int rate;  // Tokens refilled per second, 0 disables the rule
+  unsigned int burst; // Bucket capacity
+  unsigned int scale; // Bucket units per token, refills are in whole units
+  int v4_prefix;      // IPv4 clients sharing a bucket (32: one per address)
+  int v6_prefix;      // IPv6 clients sharing a bucket (128: one per address)
+
+  RateShard *shards;
+} RateRule;
+
+typedef struct RateStats {
+  unsigned long allowed;
+  unsigned long limited;
+  unsigned long entries;
+  unsigned long evictions;
+  unsigned long overflows;
+  unsigned long delay_ms;
+} RateStats;
+
+/* New connections per client, checked as they're accepted */
+extern RateRule conn_limit;
+
+/* Requests per client, checked as they're parsed */
+extern RateRule request_limit;
+
+/* Bytes relayed per client, charged as they're received */
+extern RateRule bandwidth_limit;
+
+/**
+ * @brief Parse a "RATE[:BURST]" limit, the burst defaults to the rate
+ *
+ * @return 0 on success, -1 if the limit is invalid
+ */
+int ratelimit_parse(const char *spec, unsigned int *rate, unsigned int *burst);
+
+/**
+ * @brief Set up a rule, allocating its table if it's enabled
+ *
+ * @param rule Rule to set up
+ * @param name Name used in the statistics
+ * @param rate Tokens per second (0 disables the rule)
+ * @param burst Bucket capacity
+ * @param scale Bucket units per token: RATELIMIT_TOKEN_SCALE for request
+ * rules so slow rates refill smoothly, 1 for byte rules
+ * @param v4_prefix Prefix length grouping IPv4 clients
+ * @param v6_prefix Prefix length grouping IPv6 clients
+ *
+ * @return 0 on success, -1 on error
+ */
+int ratelimit_init(RateRule *rule, const char *name, const unsigned int rate,
+                   const unsigned int burst, const unsigned int scale,
+                   const int v4_prefix, const int v6_prefix);
+
+/**
+ * @brief Take a token from the client's bucket
+ *
+ * @param rule Rule to enforce
+ * @param addr Address of the client
+ * @param retry_after Set to the seconds until a token is available when the
+ * client is limited (can be NULL)
+ *
+ * @return true if the client may proceed, false if it's over the limit
+ *
+ * @note Lock-free, uses the cached clock (see clock.h). Unknown address
+ * families and clients that can't get a slot are let through.
+ */
+bool ratelimit_allow(RateRule *rule, const struct sockaddr *addr,
+                     unsigned int *retry_after);
+
+/**
+ * @brief Charge bytes already received to the client's bucket
+ *
+ * The bucket can go into debt, every connection of the client then has to
+ * wait for it to be paid back before reading again.
+ *
+ * @param rule Byte rule to enforce
+ * @param addr Address of the client
+ * @param amount Bytes received
+ *
+ * @return Milliseconds the client must pause for, 0 if it's within its rate
+ */
+unsigned int ratelimit_charge(RateRule *rule, const struct sockaddr *addr,
+                              const size_t amount);
+
+/**
+ * @brief Sum the counters of every shard of a rule
+ */
+void ratelimit_get_stats(const RateRule *rule, RateStats *stats);
+
+/**
+ * @brief Log the counters of a rule
+ */
+void ratelimit_log_stats(const RateRule *rule);
+
+/**
+ * @brief Release the table of a rule
+ */
+void ratelimit_free(RateRule *rule);
+
+#endif /* RATELIMIT_H */
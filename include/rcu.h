@@ -0,0 +1,58 @@
+#ifndef RCU_H
+#define RCU_H
+
+/* Standard Library */
+#include <stdatomic.h>
+
+/* Constants */
+#define RCU_MAX_READERS 256 // Threads that can be inside read-side sections
+
+/* Data Structure */
+typedef struct RcuReader {
+  // Epoch observed when the thread entered its read-side section, 0 when
+  // it's outside of one. Padded so readers never share a cache line.
+  _Alignas(64) atomic_ulong epoch;
+  atomic_bool used;
+  unsigned int nesting; // Only touched by the owning thread
+} RcuReader;
+
+/**
+ * @brief Enter a read-side critical section
+ *
+ * Pointers loaded with rcu_dereference() stay valid until the matching
+ * rcu_read_unlock(). The calling thread is registered on first use and
+ * unregistered automatically when it exits. Sections can be nested.
+ *
+ * @note Never blocks and takes no locks, it's a couple of stores to a cache
+ * line owned by the calling thread.
+ */
+void rcu_read_lock(void);
+
+/**
+ * @brief Leave a read-side critical section
+ */
+void rcu_read_unlock(void);
+
+/**
+ * @brief Wait for a grace period
+ *
+ * Returns once every read-side section that was running when it was called
+ * has ended, so data unpublished before the call can be freed safely.
+ *
+ * @note Must not be called from inside a read-side section.
+ */
+void rcu_synchronize(void);
+
+/**
+ * @brief Load an RCU-protected pointer inside a read-side section
+ */
+#define rcu_dereference(ptr) atomic_load_explicit(&(ptr), memory_order_acquire)
+
+/**
+ * @brief Publish a fully built object, returning the one it replaces
+ *
+ * The previous object must only be freed after rcu_synchronize().
+ */
+#define rcu_publish(ptr, value) atomic_exchange(&(ptr), (value))
+
+#endif /* RCU_H */
@@ -0,0 +1,111 @@
+#ifndef RESPONSES_H
+#define RESPONSES_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Output Buffers */
+#include "outbuf.h"
+
+/* Constants */
+#define SENDFILE_THRESHOLD 65536 // Bodies at least this large use sendfile()
+#define RESPONSE_SEND_WAIT_MS 10000 // Longest wait for a client to take more
+
+/* Responses generated by the proxy itself */
+typedef enum {
+  RESPONSE_BLOCKED,         // 403 carrying the blocked page
+  RESPONSE_BAD_REQUEST,     // 400 for requests that can't be parsed
+  RESPONSE_CONNECTED,       // 200 answering a CONNECT
+  RESPONSE_THROTTLED,       // 429 for clients over their rate limit
+  RESPONSE_REQUEST_TIMEOUT, // 408 for clients too slow to send a request
+  RESPONSE_GATEWAY_TIMEOUT, // 504 for upstreams too slow to connect or answer
+  RESPONSE_COUNT
+} response_t;
+
+/* Data Structures */
+typedef struct StaticResponse {
+  char *header; // Status line and headers, including the final CRLF
+  size_t header_len;
+
+  char *body; // In-memory body (NULL when served from `body_fd`)
+  size_t body_len;
+  int body_fd; // Sealed memfd holding large bodies, -1 otherwise
+} StaticResponse;
+
+/* Immutable snapshot of every static response, swapped as a whole on reload
+ */
+typedef struct ResponseSet {
+  StaticResponse responses[RESPONSE_COUNT];
+  atomic_int refs; // Senders using the set, plus one while it's published
+} ResponseSet;
+
+/**
+ * @brief Build the static responses, reading the blocked page from disk
+ *
+ * @param blocked_page Path of the HTML page sent for blocked hosts. A built-in
+ * page is used if it can't be read.
+ *
+ * @return 0 on success, -1 on error
+ */
+int responses_init(const char *blocked_page);
+
+/**
+ * @brief Rebuild the static responses from the same files and publish them
+ *
+ * Connections already sending the previous responses keep using them until
+ * they're done.
+ *
+ * @return 0 on success, -1 on error (the previous responses stay in use)
+ */
+int responses_reload(void);
+
+/**
+ * @brief Send a prebuilt response with a single writev(), or with sendfile()
+ * for large bodies
+ *
+ * @param dest_fd Socket of the client
+ * @param type Response to send
+ *
+ * @return 0 on success, -1 on error
+ */
+int send_response(const int dest_fd, const response_t type);
+
+/**
+ * @brief Queue a prebuilt response behind what's already on its way to the
+ * client, so it never lands in the middle of an earlier response
+ *
+ * @param out Output buffer of the client
+ * @param type Response to queue
+ *
+ * @return 0 on success, -1 on error
+ */
+int queue_response(OutBuf *out, const response_t type);
+
+/**
+ * @brief Send the 429 response with a Retry-After header
+ *
+ * @param dest_fd Socket of the client
+ * @param retry_after Seconds the client should wait
+ *
+ * @return 0 on success, -1 on error
+ */
+int send_throttled(const int dest_fd, const unsigned int retry_after);
+
+/**
+ * @brief Queue the 429 response with a Retry-After header, as
+ * queue_response()
+ *
+ * @param out Output buffer of the client
+ * @param retry_after Seconds the client should wait
+ *
+ * @return 0 on success, -1 on error
+ */
+int queue_throttled(OutBuf *out, const unsigned int retry_after);
+
+/**
+ * @brief Release the static responses
+ */
+void responses_cleanup(void);
+
+#endif /* RESPONSES_H */
@@ -0,0 +1,11 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+/**
+ * @brief Draw a uniform number in [0, 1) to decide whether to sample
+ *
+ * @return The number, from an xorshift64* generator seeded per thread
+ */
+double sample_random(void);
+
+#endif /* SAMPLE_H */
@@ -0,0 +1,78 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+/* Standard Library */
+#include <stddef.h>
+#include <stdint.h>
+
+/* POSIX Multiplexing Library */
+#include <sys/poll.h>
+
+/* POSIX Networking Library */
+#include <sys/socket.h>
+
+/* Constants */
+#define SHAPER_CLIENT 0 // Bytes read from the client (uploads)
+#define SHAPER_SERVER 1 // Bytes read from the server (downloads)
+
+/* Data Structures */
+
+/*
+ * Bandwidth shaping state of a connection. Bytes are charged after they're
+ * read; once the connection (or its client, see `bandwidth_limit` in
+ * ratelimit.h) is over its rate, reads from that side are paused by leaving
+ * POLLIN out of the poll set until the debt is paid back. Handler threads
+ * never sleep, so the other side keeps flowing and timeouts still apply.
+ */
+typedef struct Shaper {
+  double tokens;         // Bytes the connection may read, negative in debt
+  uint64_t last_ns;      // Last refill of `tokens`
+  uint64_t resume_ns[2]; // Reads from fds[i] are paused until then, or 0
+} Shaper;
+
+typedef struct ShapeStats {
+  unsigned long long bytes;     // Bytes charged
+  unsigned long long throttled; // Bytes that had to be paid back with a pause
+  unsigned long long pauses;    // Pauses imposed
+  unsigned long long delay_ms;  // Total length of the pauses
+} ShapeStats;
+
+/**
+ * @brief Start shaping a connection with a full burst
+ */
+void shaper_init(Shaper *shaper);
+
+/**
+ * @brief Charge bytes read from one side of the connection
+ *
+ * @param shaper Shaping state of the connection
+ * @param peer Address of the client
+ * @param side SHAPER_CLIENT or SHAPER_SERVER
+ * @param bytes Bytes read
+ */
+void shaper_charge(Shaper *shaper, const struct sockaddr *peer, const int side,
+                   const size_t bytes);
+
+/**
+ * @brief Update the poll set for the paused sides
+ *
+ * @param shaper Shaping state of the connection
+ * @param fds Poll set of the connection, POLLIN is cleared on paused sides
+ * and restored once their pause is over
+ * @param timeout Poll timeout in ms when nothing is paused
+ *
+ * @return Timeout to poll with, shortened to wake up when a pause ends
+ */
+int shaper_arm(Shaper *shaper, struct pollfd fds[2], const int timeout);
+
+/**
+ * @brief Read the shaping counters of every connection
+ */
+void shaper_get_stats(ShapeStats *stats);
+
+/**
+ * @brief Log the shaping counters
+ */
+void shaper_log_stats(void);
+
+#endif /* SHAPER_H */
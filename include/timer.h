@@ -0,0 +1,57 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* Standard Library */
+#include <stdint.h>
+
+/* Constants */
+#define TIMER_TICK_MS 10  // Resolution of the wheel
+#define TIMER_LEVELS 4    // 64 slots each: 640 ms, 41 s, 44 min, 46 h
+#define TIMER_SLOT_BITS 6 // 64 slots per level
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/* Data Structures */
+
+/*
+ * Timer embedded in whatever it times out. `fire` runs on the timer thread,
+ * with the wheel locked: it must be short, not block, and not call the
+ * functions below. It returns the milliseconds after which to fire again, 0
+ * when done.
+ */
+typedef struct Timer {
+  struct Timer *next, **pprev; // Slot list, pprev is NULL when not pending
+  uint64_t expires;            // Tick
+  uint64_t (*fire)(struct Timer *timer);
+} Timer;
+
+/**
+ * @brief Start the thread turning the wheel
+ *
+ * @return 0 on success, -1 on error
+ */
+int timer_start(void);
+
+/**
+ * @brief Prepare a timer, not pending
+ */
+void timer_init(Timer *timer, uint64_t (*fire)(Timer *timer));
+
+/**
+ * @brief Fire a timer in `ms` milliseconds (rounded up to a tick), replacing
+ * its previous expiry if it was pending. O(1).
+ */
+void timer_arm(Timer *timer, const uint64_t ms);
+
+/**
+ * @brief Stop a timer if it's pending. O(1).
+ *
+ * Once it returns, `fire` isn't running and won't run until armed again.
+ */
+void timer_cancel(Timer *timer);
+
+/**
+ * @brief Log the number of timers pending and fired
+ */
+void timer_log_stats(void);
+
+#endif /* TIMER_H */
@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Access Log */
+#include "accesslog.h"
+
+/* Constants */
+#define DEFAULT_TRACE_SLOW_MS 500 // Requests slower than this are traced
+
+/* Set once by trace_open() */
+extern bool trace_enabled;
+
+/**
+ * @brief Start writing slow requests to a Chrome trace-event JSON file
+ *
+ * The file can be opened in chrome://tracing or Perfetto, each connection
+ * showing as a thread with its requests broken down into phases.
+ *
+ * @param path File to write, truncated
+ * @param slow_ms Only trace requests that took at least this long
+ * @param sample Fraction of the slow requests traced, in (0, 1]
+ *
+ * @return 0 on success, -1 on error
+ */
+int trace_open(const char *path, const unsigned int slow_ms,
+               const double sample);
+
+/**
+ * @brief Trace an exchange if it's slow enough and sampled
+ *
+ * @param ex Exchange that just ended
+ * @param duration_us Time it took, in microseconds
+ *
+ * @note Writes on the calling thread under a lock, which only the sampled
+ * slow requests ever reach.
+ */
+void trace_exchange(const Exchange *ex, const uint64_t duration_us);
+
+/**
+ * @brief Log the number of requests traced
+ */
+void trace_log_stats(void);
+
+/**
+ * @brief Terminate the JSON array and close the file
+ */
+void trace_close(void);
+
+#endif /* TRACE_H */
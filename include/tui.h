@@ -0,0 +1,31 @@
+#ifndef TUI_H
+#define TUI_H
+
+/* Constants */
+#define DEFAULT_TUI_LOG "./httproxy.log" // Log file when none is given
+#define TUI_REFRESH_MS 250               // Time between two frames
+#define TUI_HOSTS 8                      // Hosts listed
+#define TUI_CLIENTS 4                    // Clients listed
+
+/**
+ * @brief Take over the terminal with a live view of the proxy
+ *
+ * The view is redrawn by a thread of its own from metrics snapshots: rates,
+ * connections per state, refusals, latency percentiles, the busiest hosts
+ * and clients and the last log lines. The connection threads only ever update
+ * their own counters, drawing takes no lock of theirs.
+ *
+ * @param log_path File the log is written to, its tail is shown
+ *
+ * @return 0 on success, -1 on error (stdout isn't a terminal, say)
+ */
+int tui_start(const char *log_path);
+
+/**
+ * @brief Stop redrawing and give the terminal back
+ *
+ * @note Safe to call more than once, or without tui_start().
+ */
+void tui_stop(void);
+
+#endif /* TUI_H */
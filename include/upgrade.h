@@ -0,0 +1,51 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* Constants */
+#define UPGRADE_ENV "HTTPROXY_UPGRADE_FD" // Socket to the previous process
+#define UPGRADE_SOCKET_FD 3               // Where the new process finds it
+#define UPGRADE_TIMEOUT_S 10 // Wait for the new process to be ready
+
+/**
+ * @brief Remember the binary and arguments this process was started with,
+ * the new process is started the same way
+ *
+ * @param argv Arguments of main(), kept as they are
+ *
+ * @return 0 on success, -1 on error
+ */
+int upgrade_init(char **argv);
+
+/**
+ * @brief Receive the listeners of the previous process, when this one was
+ * started by upgrade_exec()
+ *
+ * @param proxy_fd Set to the proxy listener, -1 when not upgrading
+ * @param admin_fd Set to the admin listener, -1 when there is none
+ *
+ * @return 0 on success, -1 on error
+ */
+int upgrade_receive(int *proxy_fd, int *admin_fd);
+
+/**
+ * @brief Tell the previous process this one is accepting, so that it drains
+ */
+void upgrade_ready(void);
+
+/**
+ * @brief Start the binary again, hand it the listeners over a UNIX socket
+ * (SCM_RIGHTS) and wait until it's ready
+ *
+ * The listening sockets are shared, not reopened, so no connection is
+ * refused while the processes change over. Connections already accepted stay
+ * with this process.
+ *
+ * @param proxy_fd Proxy listener
+ * @param admin_fd Admin listener, -1 for none
+ *
+ * @return 0 once the new process accepts, -1 when it failed to start (this
+ * process carries on)
+ */
+int upgrade_exec(const int proxy_fd, const int admin_fd);
+
+#endif /* UPGRADE_H */
@@ -0,0 +1,102 @@
+#ifndef URLFILTER_H
+#define URLFILTER_H
+
+/* Standard Library */
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define URLFILTER_MATCH_BIT 0x80000000U // Set on transitions into output states
+
+/* Action taken when a pattern matches, higher values take precedence */
+typedef enum {
+  URL_ACTION_NONE,
+  URL_ACTION_TAG,   // Let the request through but log it
+  URL_ACTION_BLOCK, // Answer with the blocked page
+} url_action_t;
+
+/* Data Structure */
+
+/*
+ * Aho-Corasick automaton compiled into a full DFA. Bytes are folded into
+ * equivalence classes (case-insensitive, every byte absent from the patterns
+ * shares class 0) and each state is a contiguous row of `class_count`
+ * transitions. Transitions store the offset of the target row directly, with
+ * URLFILTER_MATCH_BIT set when the target state reports a pattern, so the
+ * scan is a single table load per input byte.
+ */
+typedef struct UrlFilter {
+  uint32_t *delta; // state_count rows of class_count transitions
+  size_t state_count;
+  size_t class_count;
+  uint8_t classes[256]; // Byte to equivalence class
+
+  int32_t *outputs; // Per state: best pattern reported there, -1 for none
+
+  char **patterns;
+  url_action_t *actions;
+  size_t pattern_count;
+} UrlFilter;
+
+/* Current URL filter, published with RCU (see rcu.h) */
+extern _Atomic(UrlFilter *) urlfilter;
+
+/**
+ * @brief Compile patterns into an automaton
+ *
+ * @param patterns Substrings to look for (matched case-insensitively)
+ * @param actions Action of each pattern
+ * @param count Number of patterns
+ *
+ * @return The compiled filter, or NULL on error
+ */
+UrlFilter *urlfilter_build(const char *const *patterns,
+                           const url_action_t *actions, const size_t count);
+
+/**
+ * @brief Load and compile a pattern file
+ *
+ * Each line holds a pattern, optionally preceded by its action ("block" or
+ * "tag", "block" by default). Empty lines and lines starting with '#' are
+ * skipped.
+ *
+ * @param path Path of the pattern file
+ *
+ * @return The compiled filter, or NULL on error
+ */
+UrlFilter *urlfilter_load(const char *path);
+
+/**
+ * @brief Load a pattern file and swap it in with RCU
+ *
+ * @param path Path of the pattern file
+ *
+ * @return 0 on success, -1 on error (the current filter stays in place)
+ */
+int urlfilter_reload(const char *path);
+
+/**
+ * @brief Scan a URI once for every pattern
+ *
+ * @param uf Filter (can be NULL, nothing matches then)
+ * @param uri Normalized request URI
+ * @param len Length of the URI
+ * @param pattern Set to the pattern that decided the action (can be NULL)
+ *
+ * @return The strongest action among the matching patterns
+ */
+url_action_t urlfilter_match(const UrlFilter *uf, const char *uri,
+                             const size_t len, const char **pattern);
+
+/**
+ * @brief Number of bytes used by a compiled filter
+ */
+size_t urlfilter_memory(const UrlFilter *uf);
+
+/**
+ * @brief Free a filter
+ */
+void urlfilter_free(UrlFilter *uf);
+
+#endif /* URLFILTER_H */
@@ -0,0 +1,71 @@
+#ifndef WRITEQ_H
+#define WRITEQ_H
+
+/* Standard Library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* POSIX Multi-Threading Library */
+#include <pthread.h>
+
+/* Data Structures */
+
+/* Start of every record handed to a writer */
+typedef struct WriteNode {
+  struct WriteNode *next;
+  size_t bytes; // Counted against `max_bytes` until the writer takes it
+} WriteNode;
+
+/*
+ * Records copied off the connection threads and written out by a thread of
+ * their own, so slow output never stalls a connection. Senders reserve room
+ * first and drop the record when the writer is too far behind. The writer
+ * takes the whole queue at once and hands it to `write` oldest first.
+ */
+typedef struct WriteQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  WriteNode *head;       // Records queued, newest first
+  size_t count, bytes;   // Queued or reserved
+  size_t max_count;      // Records allowed at once (0: no limit)
+  size_t max_bytes;      // Bytes allowed at once (0: no limit)
+  bool stopping;
+  pthread_t writer;
+  void (*write)(WriteNode *batch); // Writes and frees a batch, oldest first
+} WriteQueue;
+
+/**
+ * @brief Start the writer thread
+ *
+ * @return 0 on success, -1 on error
+ */
+int writeq_start(WriteQueue *q);
+
+/**
+ * @brief Reserve room for a record before copying it
+ *
+ * @param bytes Bytes counted against `max_bytes`
+ * @param always Reserve even when over the limits
+ *
+ * @return Whether there was room, the record is dropped otherwise
+ */
+bool writeq_reserve(WriteQueue *q, const size_t bytes, const bool always);
+
+/**
+ * @brief Give back a reservation that won't be used
+ */
+void writeq_cancel(WriteQueue *q, const size_t bytes);
+
+/**
+ * @brief Queue a record reserved with writeq_reserve()
+ *
+ * @param node Start of the record, `bytes` as reserved
+ */
+void writeq_push(WriteQueue *q, WriteNode *node);
+
+/**
+ * @brief Write what's queued and stop the writer thread
+ */
+void writeq_stop(WriteQueue *q);
+
+#endif /* WRITEQ_H */
@@ -0,0 +1,329 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "clock.h"
+#include "common.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "trace.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+bool accesslog_enabled = false;
+
+static _Atomic(AccessSegment *) segment = NULL;
+static pthread_mutex_t rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *file_prefix = NULL;
+
+static atomic_ulong written;
+static atomic_ulong dropped;
+
+static const char *const method_names[] = {
+    "OTHER", "GET", "HEAD", "POST", "PUT",
+    "DELETE", "CONNECT", "OPTIONS", "PATCH", "TRACE",
+};
+
+static const char *const phase_names[ACCESS_PHASES] = {
+    [PHASE_PARSED] = "parsed",
+    [PHASE_CONNECTED] = "connected",
+    [PHASE_FIRST_BYTE] = "first_byte",
+    [PHASE_LAST_BYTE] = "last_byte",
+    [PHASE_RESOLVED] = "resolved",
+    [PHASE_SENT] = "sent",
+};
+
+/* Histograms fed with the time between two phases */
+static const struct {
+  histogram_t hist;
+  access_phase_t from, to;
+} phase_spans[] = {
+    {HIST_RESOLVE, PHASE_PARSED, PHASE_RESOLVED},
+    {HIST_CONNECT, PHASE_RESOLVED, PHASE_CONNECTED},
+    {HIST_WAIT, PHASE_SENT, PHASE_FIRST_BYTE},
+};
+
+static uint64_t wall_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void file_name(char *path, const size_t size, const unsigned long seq) {
+  snprintf(path, size, "%s.%06lu", file_prefix, seq);
+}
+
+/* Create and map the file following `seq`, skipping the ones that exist */
+static AccessSegment *open_segment(unsigned long seq) {
+  char path[4096];
+  int fd = -1;
+  while (1) {
+    file_name(path, sizeof(path), seq);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd != -1 || errno != EEXIST)
+      break;
+    seq++; // Left by a previous run
+  }
+  if (fd == -1) {
+    LOG(ERR, NULL, "Failed to create access log file %s", path);
+    return NULL;
+  }
+
+  size_t map_len = sizeof(AccessFileHeader) +
+                   (size_t)ACCESS_FILE_RECORDS * sizeof(AccessRecord);
+  if (ftruncate(fd, map_len) == -1) {
+    LOG(ERR, NULL, "Failed to size access log file %s", path);
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+
+  unsigned char *map =
+      (unsigned char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+  if (map == MAP_FAILED) {
+    LOG(ERR, NULL, "Failed to map access log file %s", path);
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+
+  AccessSegment *seg = (AccessSegment *)malloc(sizeof(AccessSegment));
+  if (seg == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for the access log");
+    munmap(map, map_len);
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+
+  AccessFileHeader header = {.version = ACCESS_VERSION,
+                             .record_size = sizeof(AccessRecord),
+                             .capacity = ACCESS_FILE_RECORDS,
+                             .created_ns = wall_ns()};
+  memcpy(header.magic, ACCESS_FILE_MAGIC, sizeof(header.magic));
+  memcpy(map, &header, sizeof(header));
+
+  seg->map = map;
+  seg->map_len = map_len;
+  seg->fd = fd;
+  seg->seq = seq;
+  atomic_init(&seg->next, 0);
+
+  // Keep a ring of the most recent files
+  if (seq >= ACCESS_FILES_KEPT) {
+    file_name(path, sizeof(path), seq - ACCESS_FILES_KEPT);
+    unlink(path);
+  }
+
+  return seg;
+}
+
+/* Drop the unused slots of a file nobody writes to anymore, and close it */
+static void close_segment(AccessSegment *seg) {
+  size_t used = MIN(atomic_load(&seg->next), (size_t)ACCESS_FILE_RECORDS);
+  munmap(seg->map, seg->map_len);
+  if (ftruncate(seg->fd, sizeof(AccessFileHeader) +
+                             used * sizeof(AccessRecord)) == -1)
+    LOG(WARN, NULL, "Failed to truncate access log file %lu", seg->seq);
+  close(seg->fd);
+  free(seg);
+}
+
+/* Start the next file once `full` is, unless another thread already did */
+static int rotate(AccessSegment *full) {
+  pthread_mutex_lock(&rotate_lock);
+  if (atomic_load(&segment) != full) {
+    pthread_mutex_unlock(&rotate_lock);
+    return 0;
+  }
+
+  AccessSegment *next = open_segment(full->seq + 1);
+  if (next == NULL) {
+    pthread_mutex_unlock(&rotate_lock);
+    return -1;
+  }
+  rcu_publish(segment, next);
+  pthread_mutex_unlock(&rotate_lock);
+
+  // Writers may still be copying into the slots they reserved
+  rcu_synchronize();
+  close_segment(full);
+  return 0;
+}
+
+int accesslog_open(const char *prefix) {
+  file_prefix = prefix;
+  AccessSegment *seg = open_segment(0);
+  if (seg == NULL)
+    return -1;
+
+  rcu_publish(segment, seg);
+  accesslog_enabled = true;
+
+  char path[4096];
+  file_name(path, sizeof(path), seg->seq);
+  LOG(INFO, NULL, "Access log: %s (%d records per file, %d files kept)", path,
+      ACCESS_FILE_RECORDS, ACCESS_FILES_KEPT);
+  return 0;
+}
+
+void accesslog_write(const AccessRecord *rec) {
+  while (1) {
+    rcu_read_lock();
+    AccessSegment *seg = rcu_dereference(segment);
+    if (seg == NULL) {
+      rcu_read_unlock();
+      return;
+    }
+
+    size_t slot =
+        atomic_fetch_add_explicit(&seg->next, 1, memory_order_relaxed);
+    if (slot < ACCESS_FILE_RECORDS) {
+      AccessRecord *dst =
+          (AccessRecord *)(seg->map + sizeof(AccessFileHeader)) + slot;
+      memcpy((unsigned char *)dst + sizeof(dst->magic),
+             (const unsigned char *)rec + sizeof(rec->magic),
+             sizeof(AccessRecord) - sizeof(rec->magic));
+      // Readers of the file only trust records whose magic is set
+      __atomic_store_n(&dst->magic, ACCESS_RECORD_MAGIC, __ATOMIC_RELEASE);
+      rcu_read_unlock();
+      atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+      return;
+    }
+    rcu_read_unlock();
+
+    if (rotate(seg) == -1) {
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+void accesslog_log_stats(void) {
+  if (!accesslog_enabled)
+    return;
+
+  LOG(INFO, NULL, "Access log: %lu records written, %lu dropped",
+      atomic_load(&written), atomic_load(&dropped));
+}
+
+void accesslog_close(void) {
+  pthread_mutex_lock(&rotate_lock);
+  AccessSegment *seg = rcu_publish(segment, NULL);
+  pthread_mutex_unlock(&rotate_lock);
+  if (seg == NULL)
+    return;
+
+  rcu_synchronize();
+  close_segment(seg);
+}
+
+access_method_t access_method(const char *method) {
+  for (size_t i = 1; i < sizeof(method_names) / sizeof(*method_names); i++)
+    if (strcmp(method, method_names[i]) == 0)
+      return (access_method_t)i;
+  return ACCESS_OTHER;
+}
+
+const char *access_method_name(const uint8_t method) {
+  if (method >= sizeof(method_names) / sizeof(*method_names))
+    return method_names[ACCESS_OTHER];
+  return method_names[method];
+}
+
+const char *access_phase_name(const access_phase_t phase) {
+  return phase < ACCESS_PHASES ? phase_names[phase] : "unknown";
+}
+
+/* Store an address in a record, returning its family as 4, 6 or 0 */
+static uint8_t store_addr(const struct sockaddr *addr, uint8_t ip[16],
+                          uint16_t *port) {
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    memcpy(ip, &in->sin_addr, sizeof(in->sin_addr));
+    *port = ntohs(in->sin_port);
+    return 4;
+  }
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    memcpy(ip, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    *port = ntohs(in6->sin6_port);
+    return 6;
+  }
+  return 0;
+}
+
+void exchange_begin(Exchange *ex, const uint64_t conn_id,
+                    const uint64_t accepted_ns,
+                    const struct sockaddr *client, const char *method) {
+  exchange_end(ex);
+
+  memset(&ex->rec, 0, sizeof(ex->rec));
+  for (int i = 0; i < ACCESS_MAX_PHASES; i++)
+    ex->rec.phase_us[i] = ACCESS_NO_PHASE;
+
+  ex->open = true;
+  ex->start_mono = clock_precise_ns();
+  ex->target[0] = '\0';
+  ex->rec.start_ns = wall_ns();
+  ex->rec.conn_id = conn_id;
+  uint64_t age = (ex->start_mono - accepted_ns) / 1000;
+  ex->rec.conn_age_us = age < UINT32_MAX ? age : UINT32_MAX;
+  ex->rec.method = access_method(method);
+  ex->rec.client_family =
+      store_addr(client, ex->rec.client_ip, &ex->rec.client_port);
+}
+
+void exchange_mark(Exchange *ex, const access_phase_t phase) {
+  if (!ex->open)
+    return;
+
+  uint64_t elapsed = (clock_precise_ns() - ex->start_mono) / 1000;
+  ex->rec.phase_us[phase] =
+      elapsed < ACCESS_NO_PHASE ? elapsed : ACCESS_NO_PHASE - 1;
+}
+
+void exchange_upstream(Exchange *ex, const int fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (!ex->open || getpeername(fd, (struct sockaddr *)&addr, &len) == -1)
+    return;
+
+  ex->rec.upstream_family = store_addr((struct sockaddr *)&addr,
+                                       ex->rec.upstream_ip,
+                                       &ex->rec.upstream_port);
+}
+
+void exchange_target(Exchange *ex, const char *host, const char *uri) {
+  // Origin-form URIs lack the host, absolute ones and CONNECT's carry it
+  if (uri[0] == '/')
+    snprintf(ex->target, sizeof(ex->target), "%s%s", host, uri);
+  else
+    snprintf(ex->target, sizeof(ex->target), "%s", uri);
+}
+
+void exchange_end(Exchange *ex) {
+  if (!ex->open)
+    return;
+
+  ex->open = false;
+  const uint32_t *phase = ex->rec.phase_us;
+  for (size_t i = 0; i < sizeof(phase_spans) / sizeof(*phase_spans); i++) {
+    uint32_t from = phase[phase_spans[i].from], to = phase[phase_spans[i].to];
+    if (from != ACCESS_NO_PHASE && to != ACCESS_NO_PHASE && to >= from)
+      metrics_observe(phase_spans[i].hist, to - from);
+  }
+
+  uint64_t duration = phase[PHASE_LAST_BYTE] != ACCESS_NO_PHASE
+                          ? phase[PHASE_LAST_BYTE]
+                          : (clock_precise_ns() - ex->start_mono) / 1000;
+  metrics_observe(HIST_REQUEST, duration);
+
+  if (accesslog_enabled)
+    accesslog_write(&ex->rec);
+  if (trace_enabled)
+    trace_exchange(ex, duration);
+}
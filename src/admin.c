@@ -0,0 +1,288 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "admin.h"
+#include "bufpool.h"
+#include "common.h"
+#include "compress.h"
+#include "drr.h"
+#include "metrics.h"
+#include "park.h"
+
+#define ADMIN_BACKLOG 8
+#define ADMIN_TIMEOUT_S 2 // Slow scrapers don't hold the listener up
+
+static int listener = -1;
+static int stop_pipe[2] = {-1, -1}; // Written once the listener is handed over
+
+static const char *const not_found = "HTTP/1.1 404 Not Found\r\n"
+                                     "Content-Type: text/plain\r\n"
+                                     "Content-Length: 10\r\n"
+                                     "Connection: close\r\n\r\n"
+                                     "Not Found\n";
+
+static int init_admin(const char *spec) {
+  char host[MAX_HOSTNAME_LEN] = "127.0.0.1";
+  const char *port = spec;
+  const char *delim = strrchr(spec, ':');
+  if (delim != NULL) {
+    size_t len = delim - spec;
+    if (len >= sizeof(host))
+      return -1;
+    memcpy(host, spec, len);
+    host[len] = '\0';
+    port = delim + 1;
+  }
+
+  struct addrinfo hints, *res, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int status = getaddrinfo(host, port, &hints, &res);
+  if (status != 0) {
+    LOG(ERR, gai_strerror(status), "getaddrinfo failed for the admin listener");
+    return -1;
+  }
+
+  int fd = -1, opt = 1;
+  for (p = res; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd == -1)
+      continue;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+    if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 &&
+        listen(fd, ADMIN_BACKLOG) == 0)
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd == -1) {
+    LOG(ERR, NULL, "Failed to listen for admin requests on %s:%s", host, port);
+    return -1;
+  }
+
+  LOG(INFO, NULL, "Serving metrics on http://%s:%s/metrics", host, port);
+  return fd;
+}
+
+/* Gauges read from the modules when scraped */
+static void render_gauges(FILE *out, const MetricsSnapshot *snap) {
+  pthread_mutex_lock(&lock);
+  int threads = thread_count;
+  pthread_mutex_unlock(&lock);
+
+  fprintf(out,
+          "# HELP httproxy_connections_open Connections being handled\n"
+          "# TYPE httproxy_connections_open gauge\n"
+          "httproxy_connections_open %llu\n",
+          (unsigned long long)(snap->counters[METRIC_CONN_ACCEPTED] -
+                               snap->counters[METRIC_CONN_CLOSED]));
+
+  // The proxy thread holds a slot of the pool too
+  fprintf(out,
+          "# HELP httproxy_threads_busy Handler threads in use\n"
+          "# TYPE httproxy_threads_busy gauge\n"
+          "httproxy_threads_busy %d\n"
+          "# HELP httproxy_threads_max Handler threads available\n"
+          "# TYPE httproxy_threads_max gauge\n"
+          "httproxy_threads_max %d\n",
+          threads > 0 ? threads - 1 : 0, MAX_THREADS - 1);
+
+  fprintf(out,
+          "# HELP httproxy_connections_parked Connections waiting without "
+          "a thread\n"
+          "# TYPE httproxy_connections_parked gauge\n"
+          "httproxy_connections_parked %d\n",
+          park_count());
+
+  if (scheduler.quantum > 0) {
+    pthread_mutex_lock(&scheduler.lock);
+    int free_slots = scheduler.free_slots;
+    pthread_mutex_unlock(&scheduler.lock);
+    fprintf(out,
+            "# HELP httproxy_fair_slots_free Relaying turns not taken\n"
+            "# TYPE httproxy_fair_slots_free gauge\n"
+            "httproxy_fair_slots_free %d\n",
+            free_slots);
+  }
+
+  CompressStats compress;
+  compress_get_stats(&compress);
+  fprintf(out,
+          "# HELP httproxy_compress_responses_total Response bodies "
+          "re-encoded\n"
+          "# TYPE httproxy_compress_responses_total counter\n"
+          "httproxy_compress_responses_total{op=\"compress\"} %llu\n"
+          "httproxy_compress_responses_total{op=\"decompress\"} %llu\n"
+          "# HELP httproxy_compress_bytes_total Body bytes through the "
+          "codecs\n"
+          "# TYPE httproxy_compress_bytes_total counter\n"
+          "httproxy_compress_bytes_total{dir=\"in\"} %llu\n"
+          "httproxy_compress_bytes_total{dir=\"out\"} %llu\n"
+          "# HELP httproxy_compress_saved_bytes_total Bytes saved by "
+          "compressing\n"
+          "# TYPE httproxy_compress_saved_bytes_total counter\n"
+          "httproxy_compress_saved_bytes_total %llu\n"
+          "# HELP httproxy_compress_cpu_seconds_total CPU time in the "
+          "codecs\n"
+          "# TYPE httproxy_compress_cpu_seconds_total counter\n"
+          "httproxy_compress_cpu_seconds_total %.6f\n",
+          compress.responses, compress.decoded, compress.bytes_in,
+          compress.bytes_out, compress.bytes_saved, compress.cpu_ns / 1e9);
+
+  BufPoolStats pool;
+  bufpool_get_stats(&pool);
+  fprintf(out,
+          "# HELP httproxy_buffer_pool_gets_total Buffers taken from the "
+          "pool\n"
+          "# TYPE httproxy_buffer_pool_gets_total counter\n"
+          "httproxy_buffer_pool_gets_total{from=\"thread\"} %llu\n"
+          "httproxy_buffer_pool_gets_total{from=\"shared\"} %llu\n"
+          "httproxy_buffer_pool_gets_total{from=\"malloc\"} %llu\n"
+          "# HELP httproxy_buffer_pool_wasted_bytes_total Bytes handed out "
+          "beyond the size asked for\n"
+          "# TYPE httproxy_buffer_pool_wasted_bytes_total counter\n"
+          "httproxy_buffer_pool_wasted_bytes_total %llu\n"
+          "# HELP httproxy_buffer_pool_bytes Memory of the buffer pool\n"
+          "# TYPE httproxy_buffer_pool_bytes gauge\n"
+          "httproxy_buffer_pool_bytes{state=\"mapped\"} %zu\n"
+          "httproxy_buffer_pool_bytes{state=\"in_use\"} %zu\n",
+          pool.hits, pool.misses, pool.oversized, pool.wasted, pool.mapped,
+          pool.in_use);
+
+  fprintf(out,
+          "# HELP httproxy_log_dropped_total Log messages dropped\n"
+          "# TYPE httproxy_log_dropped_total counter\n"
+          "httproxy_log_dropped_total %lu\n",
+          logger_dropped());
+}
+
+static int send_all(const int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return -1;
+    data += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+static void serve(const int fd) {
+  char request[1024];
+  ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+  if (len <= 0)
+    return;
+  request[len] = '\0';
+
+  if (strncmp(request, "GET /metrics ", 13) != 0 &&
+      strncmp(request, "GET /metrics?", 13) != 0) {
+    send_all(fd, not_found, strlen(not_found));
+    return;
+  }
+
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&body, &body_len);
+  if (out == NULL) {
+    LOG(ERR, NULL, "Failed to allocate the metrics page");
+    return;
+  }
+
+  static MetricsSnapshot snap; // Only touched by the admin thread
+  metrics_snapshot(&snap);
+  metrics_render(out, &snap);
+  metrics_render_top(out);
+  render_gauges(out, &snap);
+  fclose(out);
+
+  char head[256];
+  int head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n",
+                          body_len);
+  if (send_all(fd, head, head_len) == 0)
+    send_all(fd, body, body_len);
+  free(body);
+}
+
+static void *admin_loop(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+  struct pollfd fds[2] = {{.fd = listen_fd, .events = POLLIN},
+                          {.fd = stop_pipe[0], .events = POLLIN}};
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno != EINTR)
+        LOG(WARN, NULL, "Failed to poll the admin listener");
+      continue;
+    }
+    if (fds[1].revents & POLLIN)
+      break; // The new process serves the scrapes
+
+    // Non-blocking: until the handover, both processes poll the listener
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        LOG(WARN, NULL, "Failed to accept admin connection");
+      continue;
+    }
+
+    struct timeval timeout = {ADMIN_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    serve(fd);
+    close(fd);
+  }
+
+  close(listen_fd);
+  LOG(INFO, NULL, "No longer serving metrics");
+  return NULL;
+}
+
+int admin_start(const char *spec, const int inherited) {
+  int fd = inherited != -1 ? inherited : init_admin(spec);
+  if (fd == -1)
+    return -1;
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+      pipe2(stop_pipe, O_CLOEXEC) == -1) {
+    LOG(ERR, NULL, "Failed to prepare the admin listener");
+    close(fd);
+    return -1;
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, admin_loop, (void *)(intptr_t)fd) != 0) {
+    LOG(ERR, NULL, "Failed to create the admin thread");
+    close(fd);
+    return -1;
+  }
+
+  pthread_detach(tid);
+  listener = fd;
+  return 0;
+}
+
+int admin_listener(void) { return listener; }
+
+void admin_stop(void) {
+  if (stop_pipe[1] == -1 || listener == -1)
+    return;
+
+  // The thread closes the listener, its handle here goes stale
+  listener = -1;
+  if (write(stop_pipe[1], "", 1) != 1)
+    LOG(ERR, NULL, "Failed to stop the admin thread");
+}
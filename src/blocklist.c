@@ -0,0 +1,543 @@
+#include <ctype.h>
+#include <time.h>
+
+#include "blocklist.h"
+#include "common.h"
+#include "rcu.h"
+
+#define MAX_DOMAIN_LEN 253 // Max length of a domain name
+#define BLOOM_BLOCK_WORDS 8 // 512-bit (one cache line) Bloom filter blocks
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+_Atomic(Blocklist *) blocklist = NULL;
+
+/* Domain stored with its labels reversed, "a.example.com" -> "com.example.a" */
+typedef struct Entry {
+  uint32_t offset;
+  uint32_t len;
+} Entry;
+
+/* Pending trie node whose children still have to be laid out */
+typedef struct Pending {
+  uint32_t node;
+  uint32_t lo, hi; // Range of sorted entries below the node
+  uint32_t off;    // Offset of the children's label in those entries
+} Pending;
+
+/*****************************************************
+ *                 Hashing Functions                 *
+ *****************************************************/
+static inline uint64_t fnv_update(uint64_t h, const char *s,
+                                  const size_t len) {
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * FNV_PRIME;
+  return h;
+}
+
+static inline uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static void bloom_add(Blocklist *bl, const uint64_t h) {
+  uint64_t *block =
+      bl->bloom + (mix(h) % bl->bloom_blocks) * BLOOM_BLOCK_WORDS;
+  uint64_t bits = mix(h ^ FNV_PRIME);
+
+  for (int i = 0; i < BLOCKLIST_BLOOM_K; i++, bits >>= 9)
+    block[(bits & 511) >> 6] |= 1ULL << (bits & 63);
+}
+
+static bool bloom_test(const Blocklist *bl, const uint64_t h) {
+  const uint64_t *block =
+      bl->bloom + (mix(h) % bl->bloom_blocks) * BLOOM_BLOCK_WORDS;
+  uint64_t bits = mix(h ^ FNV_PRIME);
+
+  for (int i = 0; i < BLOCKLIST_BLOOM_K; i++, bits >>= 9)
+    if (!(block[(bits & 511) >> 6] & (1ULL << (bits & 63))))
+      return false;
+  return true;
+}
+
+/*****************************************************
+ *                 Building Functions                *
+ *****************************************************/
+static inline uint32_t label_prefix(const char *label, const size_t len) {
+  uint32_t prefix = 0;
+  for (size_t i = 0; i < 4; i++)
+    prefix = (prefix << 8) | (i < len ? (unsigned char)label[i] : 0);
+  return prefix;
+}
+
+/*
+ * Lowercase and validate a domain, dropping wildcard/leading dots and the
+ * trailing root dot. Returns the normalized length, or 0 if the entry is
+ * invalid.
+ */
+static size_t normalize_domain(const char *in, char *out) {
+  while (*in == ' ' || *in == '\t')
+    in++;
+  if (in[0] == '*' && in[1] == '.')
+    in += 2;
+  if (in[0] == '.')
+    in++;
+
+  size_t len = 0, label_len = 0;
+  for (; *in != '\0' && !isspace((unsigned char)*in); in++) {
+    char c = (char)tolower((unsigned char)*in);
+    if (c == '.') {
+      if (label_len == 0)
+        return 0; // Empty label
+      label_len = 0;
+    } else if (isalnum((unsigned char)c) || c == '-' || c == '_') {
+      if (++label_len > MAX_LABEL_LEN)
+        return 0;
+    } else {
+      return 0;
+    }
+
+    if (len == MAX_DOMAIN_LEN)
+      return 0;
+    out[len++] = c;
+  }
+
+  if (len > 0 && out[len - 1] == '.')
+    len--;
+  return len;
+}
+
+/* Write the labels of `domain` in reverse order */
+static void reverse_labels(const char *domain, const size_t len, char *out) {
+  size_t end = len, pos = 0;
+  while (end > 0) {
+    size_t start = end;
+    while (start > 0 && domain[start - 1] != '.')
+      start--;
+
+    memcpy(out + pos, domain + start, end - start);
+    pos += end - start;
+    if (start > 0)
+      out[pos++] = '.';
+
+    end = start > 0 ? start - 1 : 0;
+  }
+}
+
+/* Order reversed-label strings so that the dot sorts below every other byte,
+ * which keeps all domains sharing a label path contiguous. */
+static int entry_cmp(const void *a, const void *b, void *arg) {
+  const char *pool = (const char *)arg;
+  const Entry *ea = (const Entry *)a, *eb = (const Entry *)b;
+  const unsigned char *sa = (const unsigned char *)pool + ea->offset;
+  const unsigned char *sb = (const unsigned char *)pool + eb->offset;
+
+  size_t n = ea->len < eb->len ? ea->len : eb->len;
+  for (size_t i = 0; i < n; i++) {
+    int ca = sa[i] == '.' ? 1 : sa[i];
+    int cb = sb[i] == '.' ? 1 : sb[i];
+    if (ca != cb)
+      return ca - cb;
+  }
+
+  return (ea->len > eb->len) - (ea->len < eb->len);
+}
+
+static int push_node(Blocklist *bl, size_t *cap, const char *label,
+                     const size_t len) {
+  if (bl->node_count == *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 1024;
+    BlocklistNode *nodes =
+        (BlocklistNode *)realloc(bl->nodes, new_cap * sizeof(BlocklistNode));
+    if (nodes == NULL)
+      return -1;
+    bl->nodes = nodes;
+    *cap = new_cap;
+  }
+
+  BlocklistNode *node = &bl->nodes[bl->node_count++];
+  memset(node, 0, sizeof(BlocklistNode));
+  node->prefix = label_prefix(label, len);
+  node->label = bl->labels_size;
+  node->label_len = len;
+
+  memcpy(bl->labels + bl->labels_size, label, len);
+  bl->labels_size += len;
+  return 0;
+}
+
+/*
+ * Lay the trie out breadth-first so that the children of every node end up
+ * next to each other in `nodes`. Entries are sorted and pruned, so a group of
+ * entries sharing a label is contiguous and a terminal label has no entries
+ * below it.
+ */
+static int build_trie(Blocklist *bl, const char *pool, const Entry *entries,
+                      const size_t count) {
+  size_t cap = 0, queue_cap = count + 1;
+  Pending *queue = (Pending *)malloc(queue_cap * sizeof(Pending));
+  if (queue == NULL || push_node(bl, &cap, "", 0) == -1) {
+    free(queue);
+    return -1;
+  }
+
+  size_t head = 0, tail = 0;
+  queue[tail++] = (Pending){0, 0, count, 0};
+
+  while (head < tail) {
+    Pending p = queue[head++];
+    bl->nodes[p.node].first_child = bl->node_count;
+
+    uint32_t i = p.lo;
+    while (i < p.hi) {
+      const char *label = pool + entries[i].offset + p.off;
+      const char *dot = memchr(label, '.', entries[i].len - p.off);
+      size_t label_len =
+          dot != NULL ? (size_t)(dot - label) : entries[i].len - p.off;
+
+      // Gather every entry continuing with the same label
+      uint32_t j = i + 1;
+      while (j < p.hi && entries[j].len - p.off >= label_len &&
+             memcmp(pool + entries[j].offset + p.off, label, label_len) ==
+                 0 &&
+             (entries[j].len - p.off == label_len ||
+              pool[entries[j].offset + p.off + label_len] == '.'))
+        j++;
+
+      uint32_t child = bl->node_count;
+      if (push_node(bl, &cap, label, label_len) == -1) {
+        free(queue);
+        return -1;
+      }
+
+      if (entries[i].len - p.off == label_len) {
+        bl->nodes[child].terminal = 1;
+      } else {
+        if (tail == queue_cap) {
+          Pending *grown = (Pending *)realloc(
+              queue, (queue_cap *= 2) * sizeof(Pending));
+          if (grown == NULL) {
+            free(queue);
+            return -1;
+          }
+          queue = grown;
+        }
+        queue[tail++] = (Pending){child, i, j, p.off + label_len + 1};
+      }
+
+      if (++bl->nodes[p.node].child_count == 0) {
+        LOG(ERR, NULL, "Too many subdomains under a single blocklist label");
+        free(queue);
+        return -1;
+      }
+      i = j;
+    }
+  }
+
+  free(queue);
+  return 0;
+}
+
+Blocklist *blocklist_build(const char *const *domains, const size_t count) {
+  // Normalized domains are never longer than their source
+  size_t total = 1;
+  for (size_t i = 0; i < count; i++)
+    total += strlen(domains[i]);
+
+  Blocklist *bl = (Blocklist *)calloc(1, sizeof(Blocklist));
+  char *pool = (char *)malloc(total);
+  Entry *entries = (Entry *)malloc((count ? count : 1) * sizeof(Entry));
+  if (bl == NULL || pool == NULL || entries == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory to build the blocklist");
+    goto fail;
+  }
+
+  // Normalize every domain and store it with its labels reversed
+  size_t pool_size = 0, n = 0;
+  for (size_t i = 0; i < count; i++) {
+    char domain[MAX_DOMAIN_LEN + 1];
+    size_t len = normalize_domain(domains[i], domain);
+    if (len == 0) {
+      LOG(WARN, NULL, "Skipping invalid blocklist entry \"%s\"", domains[i]);
+      continue;
+    }
+
+    reverse_labels(domain, len, pool + pool_size);
+    entries[n++] = (Entry){pool_size, len};
+    pool_size += len;
+  }
+
+  qsort_r(entries, n, sizeof(Entry), entry_cmp, pool);
+
+  // Drop duplicates and domains already covered by a listed parent
+  size_t kept = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (kept > 0) {
+      const Entry *parent = &entries[kept - 1];
+      if (entries[i].len >= parent->len &&
+          memcmp(pool + entries[i].offset, pool + parent->offset,
+                 parent->len) == 0 &&
+          (entries[i].len == parent->len ||
+           pool[entries[i].offset + parent->len] == '.'))
+        continue;
+    }
+    entries[kept++] = entries[i];
+  }
+  bl->entries = kept;
+
+  bl->labels = (char *)malloc(pool_size > 0 ? pool_size : 1);
+  if (bl->labels == NULL || build_trie(bl, pool, entries, kept) == -1) {
+    LOG(ERR, NULL, "Failed to build the blocklist trie");
+    goto fail;
+  }
+
+  // Shrink the label pool and node array to what's used
+  char *labels = (char *)realloc(bl->labels, bl->labels_size + 1);
+  if (labels != NULL)
+    bl->labels = labels;
+  BlocklistNode *nodes = (BlocklistNode *)realloc(
+      bl->nodes, bl->node_count * sizeof(BlocklistNode));
+  if (nodes != NULL)
+    bl->nodes = nodes;
+
+  size_t bits = kept * BLOCKLIST_BLOOM_BITS;
+  bl->bloom_blocks = bits / (BLOOM_BLOCK_WORDS * 64) + 1;
+  bl->bloom = (uint64_t *)aligned_alloc(
+      64, bl->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+  if (bl->bloom == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for the blocklist filter");
+    goto fail;
+  }
+  memset(bl->bloom, 0, bl->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+
+  for (size_t i = 0; i < kept; i++)
+    bloom_add(bl, fnv_update(FNV_OFFSET, pool + entries[i].offset,
+                             entries[i].len));
+
+  free(pool);
+  free(entries);
+  return bl;
+
+fail:
+  free(pool);
+  free(entries);
+  blocklist_free(bl);
+  return NULL;
+}
+
+Blocklist *blocklist_load(const char *path) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    LOG(ERR, NULL, "Couldn't open blocklist file %s", path);
+    return NULL;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  char *content = (char *)malloc(size + 1);
+  if (content == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory to read the blocklist");
+    fclose(fp);
+    return NULL;
+  }
+  size = fread(content, 1, size, fp);
+  content[size] = '\0';
+  fclose(fp);
+
+  // Split lines in place, keeping the last field of hosts-file lines
+  size_t count = 0, cap = 1024;
+  const char **domains = (const char **)malloc(cap * sizeof(char *));
+  for (char *line = content; domains != NULL && line < content + size;) {
+    char *eol = strchr(line, '\n');
+    if (eol != NULL)
+      *eol = '\0';
+
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+
+    char *field = NULL;
+    for (char *tok = strtok(line, " \t\r"); tok; tok = strtok(NULL, " \t\r"))
+      field = tok;
+
+    if (field != NULL) {
+      if (count == cap) {
+        const char **grown =
+            (const char **)realloc(domains, (cap *= 2) * sizeof(char *));
+        if (grown == NULL) {
+          free(domains);
+          domains = NULL;
+          break;
+        }
+        domains = grown;
+      }
+      domains[count++] = field;
+    }
+
+    if (eol == NULL)
+      break;
+    line = eol + 1;
+  }
+
+  if (domains == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory to read the blocklist");
+    free(content);
+    return NULL;
+  }
+
+  Blocklist *bl = blocklist_build(domains, count);
+  free(domains);
+  free(content);
+  if (bl == NULL)
+    return NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6;
+  size_t memory = blocklist_memory(bl);
+  LOG(INFO, NULL,
+      "Loaded %zu blocked domains from %s in %.2f ms (%zu Bytes, %.1f "
+      "Bytes/entry)",
+      bl->entries, path, ms, memory,
+      bl->entries ? (double)memory / bl->entries : 0.0);
+  return bl;
+}
+
+int blocklist_reload(const char *path) {
+  Blocklist *bl = blocklist_load(path);
+  if (bl == NULL)
+    return -1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  Blocklist *old = rcu_publish(blocklist, bl);
+  rcu_synchronize();
+  blocklist_free(old);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (old != NULL)
+    LOG(INFO, NULL, "Blocklist swapped in, old list freed after %.3f ms",
+        (end.tv_sec - start.tv_sec) * 1e3 +
+            (end.tv_nsec - start.tv_nsec) / 1e6);
+  return 0;
+}
+
+/*****************************************************
+ *                  Lookup Functions                 *
+ *****************************************************/
+static const BlocklistNode *find_child(const Blocklist *bl,
+                                       const BlocklistNode *node,
+                                       const char *label, const size_t len) {
+  const uint32_t prefix = label_prefix(label, len);
+  size_t lo = node->first_child, hi = lo + node->child_count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const BlocklistNode *child = &bl->nodes[mid];
+
+    int cmp;
+    if (child->prefix != prefix) {
+      cmp = child->prefix < prefix ? -1 : 1;
+    } else {
+      size_t n = child->label_len < len ? child->label_len : len;
+      cmp = memcmp(bl->labels + child->label, label, n);
+      if (cmp == 0)
+        cmp = (child->label_len > len) - (child->label_len < len);
+    }
+
+    if (cmp == 0)
+      return child;
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return NULL;
+}
+
+bool blocklist_match(const Blocklist *bl, const char *host) {
+  if (bl == NULL || host == NULL || bl->entries == 0)
+    return false;
+
+  // Lowercase the host and strip the port and the trailing root dot
+  char name[MAX_DOMAIN_LEN + 1];
+  size_t len = 0;
+  for (; host[len] != '\0' && host[len] != ':'; len++) {
+    if (len == MAX_DOMAIN_LEN)
+      return false;
+    name[len] = (char)tolower((unsigned char)host[len]);
+  }
+  if (len > 0 && name[len - 1] == '.')
+    len--;
+
+  // Fast path: none of the host's suffixes are in the Bloom filter
+  uint64_t h = FNV_OFFSET;
+  bool maybe = false;
+  for (size_t end = len; end > 0 && !maybe;) {
+    size_t start = end;
+    while (start > 0 && name[start - 1] != '.')
+      start--;
+
+    if (end != len)
+      h = fnv_update(h, ".", 1);
+    h = fnv_update(h, name + start, end - start);
+    maybe = bloom_test(bl, h);
+
+    end = start > 0 ? start - 1 : 0;
+  }
+
+  if (!maybe)
+    return false;
+
+  // Walk the trie from the top-level domain down
+  const BlocklistNode *node = &bl->nodes[0];
+  for (size_t end = len; end > 0;) {
+    size_t start = end;
+    while (start > 0 && name[start - 1] != '.')
+      start--;
+
+    node = find_child(bl, node, name + start, end - start);
+    if (node == NULL)
+      return false;
+    if (node->terminal)
+      return true;
+
+    end = start > 0 ? start - 1 : 0;
+  }
+
+  return false;
+}
+
+size_t blocklist_memory(const Blocklist *bl) {
+  if (bl == NULL)
+    return 0;
+
+  return sizeof(Blocklist) + bl->node_count * sizeof(BlocklistNode) +
+         bl->labels_size +
+         bl->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+void blocklist_free(Blocklist *bl) {
+  if (bl == NULL)
+    return;
+
+  free(bl->nodes);
+  bl->nodes = NULL;
+  free(bl->labels);
+  bl->labels = NULL;
+  free(bl->bloom);
+  bl->bloom = NULL;
+  free(bl);
+}
@@ -0,0 +1,340 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "bufpool.h"
+#include "common.h"
+
+/* A free buffer links to the next through its first bytes */
+typedef struct FreeBuf {
+  struct FreeBuf *next;
+} FreeBuf;
+
+typedef struct FreeList {
+  FreeBuf *head;
+  unsigned int count;
+} FreeList;
+
+/*
+ * Free buffers and counters of a thread. Only the owner writes the counters,
+ * the stats read them. A thread exiting leaves both to the next one starting,
+ * which finds buffers right away.
+ */
+typedef struct BufCache {
+  FreeList lists[BUFPOOL_CLASSES];
+  atomic_ullong hits, misses, oversized, granted, wasted;
+  atomic_ullong in_use; // Wraps below 0 when putting buffers of other threads
+  bool used;            // Owned by a thread, under `pool_lock`
+  struct BufCache *next;
+} BufCache;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static FreeList pool[BUFPOOL_CLASSES];
+static unsigned char *carve_next[BUFPOOL_CLASSES]; // Rest of the class's
+static unsigned char *carve_end[BUFPOOL_CLASSES];  // last chunk
+static size_t mapped = 0, huge_mapped = 0;
+static BufCache *caches = NULL; // Never freed
+static BufCache shared;         // Counters of the threads without a cache,
+                                // written under `pool_lock`
+
+static bool huge_pages = false; // Asked for
+static bool hugetlb = false;    // Reserved huge pages still available
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread BufCache *self = NULL;
+
+static size_t class_size(const int class) {
+  return (size_t)1 << (BUFPOOL_MIN_SHIFT + class);
+}
+
+/* Smallest class holding `size` bytes, at most BUFPOOL_MAX_SIZE */
+static int class_of(const size_t size) {
+  if (size <= class_size(0))
+    return 0;
+  int bits = (int)(sizeof(unsigned long) * 8) - __builtin_clzl(size - 1);
+  return bits - BUFPOOL_MIN_SHIFT;
+}
+
+/* Buffers moved at once, threads keep at most twice that many */
+static unsigned int batch_of(const int class) {
+  size_t batch = BUFPOOL_BATCH_BYTES / class_size(class);
+  return batch > 0 ? batch : 1;
+}
+
+/* Add to a counter only the caller writes, no need for a locked add */
+static void bump(atomic_ullong *counter, const unsigned long long value) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+void bufpool_init(const bool huge) {
+  huge_pages = hugetlb = huge;
+}
+
+/* Map a chunk aligned to its size, so huge pages can back it */
+static unsigned char *map_chunk(void) {
+  const int prot = PROT_READ | PROT_WRITE;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (hugetlb) {
+    void *chunk = mmap(NULL, BUFPOOL_CHUNK, prot, flags | MAP_HUGETLB, -1, 0);
+    if (chunk != MAP_FAILED) {
+      mapped += BUFPOOL_CHUNK;
+      huge_mapped += BUFPOOL_CHUNK;
+      return (unsigned char *)chunk;
+    }
+
+    LOG(WARN, NULL, "No huge pages reserved, falling back on transparent ones");
+    hugetlb = false;
+  }
+
+  // Twice the size, trimmed to the aligned chunk inside
+  unsigned char *area =
+      (unsigned char *)mmap(NULL, 2 * BUFPOOL_CHUNK, prot, flags, -1, 0);
+  if (area == MAP_FAILED) {
+    LOG(ERR, NULL, "Failed to map memory for the buffer pool");
+    return NULL;
+  }
+
+  size_t head = -(uintptr_t)area & (BUFPOOL_CHUNK - 1);
+  unsigned char *chunk = area + head;
+  if (head > 0)
+    munmap(area, head);
+  munmap(chunk + BUFPOOL_CHUNK, BUFPOOL_CHUNK - head);
+
+  if (huge_pages && madvise(chunk, BUFPOOL_CHUNK, MADV_HUGEPAGE) == -1)
+    LOG(WARN, NULL, "Transparent huge pages unavailable for the buffer pool");
+
+  mapped += BUFPOOL_CHUNK;
+  return chunk;
+}
+
+/* A free buffer of the shared pool, carved from a chunk if there's none */
+static FreeBuf *take_locked(const int class) {
+  FreeList *list = &pool[class];
+  if (list->head != NULL) {
+    FreeBuf *buf = list->head;
+    list->head = buf->next;
+    list->count--;
+    return buf;
+  }
+
+  if (carve_next[class] == carve_end[class]) {
+    unsigned char *chunk = map_chunk();
+    if (chunk == NULL)
+      return NULL;
+    carve_next[class] = chunk;
+    carve_end[class] = chunk + BUFPOOL_CHUNK;
+  }
+
+  FreeBuf *buf = (FreeBuf *)carve_next[class];
+  carve_next[class] += class_size(class);
+  return buf;
+}
+
+static void push(FreeList *list, FreeBuf *buf) {
+  buf->next = list->head;
+  list->head = buf;
+  list->count++;
+}
+
+/* Give `count` buffers of a thread's list back to the shared pool */
+static void give_back_locked(FreeList *list, const int class,
+                             unsigned int count) {
+  while (count-- > 0 && list->head != NULL) {
+    FreeBuf *buf = list->head;
+    list->head = buf->next;
+    list->count--;
+    push(&pool[class], buf);
+  }
+}
+
+/* Left with its buffers, the trimmed ones go back for the other threads */
+static void release_cache(void *arg) {
+  BufCache *cache = (BufCache *)arg;
+
+  pthread_mutex_lock(&pool_lock);
+  for (int class = 0; class < BUFPOOL_CLASSES; class++) {
+    FreeList *list = &cache->lists[class];
+    unsigned int batch = batch_of(class);
+    if (list->count > batch)
+      give_back_locked(list, class, list->count - batch);
+  }
+  cache->used = false;
+  pthread_mutex_unlock(&pool_lock);
+
+  self = NULL;
+}
+
+static void create_cache_key(void) {
+  if (pthread_key_create(&cache_key, release_cache) != 0) {
+    LOG(ERR, NULL, "Failed to create the buffer cache key");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* The calling thread's cache, NULL if it can't have one */
+static BufCache *own_cache(void) {
+  if (self != NULL)
+    return self;
+
+  pthread_once(&cache_key_once, create_cache_key);
+  pthread_mutex_lock(&pool_lock);
+  BufCache *cache = caches;
+  while (cache != NULL && cache->used)
+    cache = cache->next;
+  if (cache == NULL) {
+    cache = (BufCache *)calloc(1, sizeof(BufCache));
+    if (cache != NULL) {
+      cache->next = caches;
+      caches = cache;
+    }
+  }
+  if (cache != NULL)
+    cache->used = pthread_setspecific(cache_key, cache) == 0;
+  pthread_mutex_unlock(&pool_lock);
+
+  if (cache == NULL || !cache->used)
+    return NULL;
+  self = cache;
+  return cache;
+}
+
+void *bufpool_get(const size_t size, size_t *cap) {
+  BufCache *cache = own_cache();
+  BufCache *counts = cache != NULL ? cache : &shared;
+
+  if (size > BUFPOOL_MAX_SIZE) {
+    void *buf = malloc(size);
+    if (buf == NULL) {
+      LOG(ERR, NULL, "Failed to allocate a buffer of %zu Bytes", size);
+      return NULL;
+    }
+
+    if (cache == NULL)
+      pthread_mutex_lock(&pool_lock);
+    bump(&counts->oversized, 1);
+    if (cache == NULL)
+      pthread_mutex_unlock(&pool_lock);
+    *cap = size;
+    return buf;
+  }
+
+  const int class = class_of(size);
+  const unsigned int batch = batch_of(class);
+  FreeBuf *buf = NULL;
+  bool hit = false;
+
+  if (cache != NULL) {
+    FreeList *list = &cache->lists[class];
+    hit = list->head != NULL;
+    if (!hit) {
+      pthread_mutex_lock(&pool_lock);
+      FreeBuf *taken;
+      while (list->count < batch && (taken = take_locked(class)) != NULL)
+        push(list, taken);
+      pthread_mutex_unlock(&pool_lock);
+    }
+
+    buf = list->head;
+    if (buf != NULL) {
+      list->head = buf->next;
+      list->count--;
+    }
+  } else {
+    pthread_mutex_lock(&pool_lock);
+    buf = take_locked(class);
+  }
+
+  if (buf != NULL) {
+    bump(hit ? &counts->hits : &counts->misses, 1);
+    bump(&counts->granted, class_size(class));
+    bump(&counts->wasted, class_size(class) - size);
+    bump(&counts->in_use, class_size(class));
+  }
+  if (cache == NULL)
+    pthread_mutex_unlock(&pool_lock);
+
+  if (buf == NULL) {
+    LOG(ERR, NULL, "Failed to take a buffer of %zu Bytes", size);
+    return NULL;
+  }
+
+  *cap = class_size(class);
+  return buf;
+}
+
+void bufpool_put(void *buf, const size_t cap) {
+  if (buf == NULL)
+    return;
+  if (cap > BUFPOOL_MAX_SIZE) {
+    free(buf);
+    return;
+  }
+
+  const int class = class_of(cap);
+  BufCache *cache = own_cache();
+  if (cache == NULL) {
+    pthread_mutex_lock(&pool_lock);
+    push(&pool[class], (FreeBuf *)buf);
+    bump(&shared.in_use, -(unsigned long long)cap);
+    pthread_mutex_unlock(&pool_lock);
+    return;
+  }
+
+  FreeList *list = &cache->lists[class];
+  push(list, (FreeBuf *)buf);
+  bump(&cache->in_use, -(unsigned long long)cap);
+
+  // Too many kept, the oldest batch goes back for the other threads
+  const unsigned int batch = batch_of(class);
+  if (list->count > 2 * batch) {
+    pthread_mutex_lock(&pool_lock);
+    give_back_locked(list, class, batch);
+    pthread_mutex_unlock(&pool_lock);
+  }
+}
+
+static void add(unsigned long long *into, atomic_ullong *from) {
+  *into += atomic_load_explicit(from, memory_order_relaxed);
+}
+
+void bufpool_get_stats(BufPoolStats *stats) {
+  memset(stats, 0, sizeof(BufPoolStats));
+  unsigned long long in_use = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  for (BufCache *cache = &shared; cache != NULL;
+       cache = cache == &shared ? caches : cache->next) {
+    add(&stats->hits, &cache->hits);
+    add(&stats->misses, &cache->misses);
+    add(&stats->oversized, &cache->oversized);
+    add(&stats->granted, &cache->granted);
+    add(&stats->wasted, &cache->wasted);
+    add(&in_use, &cache->in_use);
+  }
+  stats->mapped = mapped;
+  stats->huge_mapped = huge_mapped;
+  pthread_mutex_unlock(&pool_lock);
+
+  stats->in_use = in_use;
+}
+
+void bufpool_log_stats(void) {
+  BufPoolStats stats;
+  bufpool_get_stats(&stats);
+
+  unsigned long long gets = stats.hits + stats.misses;
+  // Idle: mapped but not handed out, wasted: handed out but not asked for
+  LOG(INFO, NULL,
+      "Buffer pool: %llu gets, %.1f%% from the thread's cache, %llu "
+      "oversized, %zu KiB mapped (%zu KiB on huge pages), %.1f%% idle, "
+      "%.1f%% wasted rounding up",
+      gets, gets > 0 ? 100.0 * stats.hits / gets : 0.0, stats.oversized,
+      stats.mapped / 1024, stats.huge_mapped / 1024,
+      stats.mapped > 0 ? 100.0 * (stats.mapped - stats.in_use) / stats.mapped
+                       : 0.0,
+      stats.granted > 0 ? 100.0 * stats.wasted / stats.granted : 0.0);
+}
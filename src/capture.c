@@ -0,0 +1,139 @@
+#include <stdatomic.h>
+#include <time.h>
+
+#include "capture.h"
+#include "clock.h"
+#include "common.h"
+#include "writeq.h"
+
+/* Record copied off the connection thread, written by the writer */
+typedef struct CaptureNode {
+  WriteNode node; // First, queued for the writer
+  CaptureRecord rec;
+  unsigned char data[];
+} CaptureNode;
+
+bool capture_enabled = false;
+
+static FILE *file = NULL;
+static uint64_t started_ns = 0;
+
+static atomic_ulong written;
+static atomic_ulong dropped;
+
+static void write_records(WriteNode *batch) {
+  while (batch != NULL) {
+    CaptureNode *node = (CaptureNode *)batch;
+    batch = batch->next;
+    if (fwrite(&node->rec, sizeof(node->rec), 1, file) != 1 ||
+        fwrite(node->data, 1, node->rec.len, file) != node->rec.len)
+      LOG(ERR, NULL, "Failed to write to the capture file");
+    free(node);
+  }
+  fflush(file);
+}
+
+static WriteQueue queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                           .cond = PTHREAD_COND_INITIALIZER,
+                           .max_bytes = CAPTURE_QUEUE_MAX,
+                           .write = write_records};
+
+int capture_start(const char *path) {
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    LOG(ERR, NULL, "Failed to open the capture file %s", path);
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  CaptureFileHeader header = {.magic = CAPTURE_FILE_MAGIC,
+                              .version = CAPTURE_VERSION,
+                              .record_size = sizeof(CaptureRecord),
+                              .created_ns = now.tv_sec * 1000000000ULL +
+                                            now.tv_nsec};
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    LOG(ERR, NULL, "Failed to write to the capture file %s", path);
+    fclose(file);
+    return -1;
+  }
+
+  started_ns = clock_precise_ns();
+  if (writeq_start(&queue) == -1) {
+    LOG(ERR, NULL, "Failed to create the capture writer thread");
+    fclose(file);
+    return -1;
+  }
+
+  capture_enabled = true;
+  LOG(INFO, NULL, "Capturing the plain HTTP traffic to %s", path);
+  return 0;
+}
+
+/* Queue a record, dropping it when the writer is too far behind */
+static bool queue_record(const uint64_t conn_id, const capture_kind_t kind,
+                         const uint8_t flags, const unsigned char *data,
+                         const size_t len, const bool always) {
+  if (!writeq_reserve(&queue, len, always)) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return false;
+  }
+
+  CaptureNode *node = (CaptureNode *)malloc(sizeof(CaptureNode) + len);
+  if (node == NULL) {
+    writeq_cancel(&queue, len);
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return false;
+  }
+
+  node->node.bytes = len;
+  node->rec = (CaptureRecord){.conn_id = conn_id,
+                              .time_ns = clock_precise_ns() - started_ns,
+                              .len = len,
+                              .kind = kind,
+                              .flags = flags};
+  if (len > 0)
+    memcpy(node->data, data, len);
+
+  writeq_push(&queue, &node->node);
+  atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+  return true;
+}
+
+void capture_open(const uint64_t conn_id, bool *lost) {
+  if (!queue_record(conn_id, CAPTURE_OPEN, 0, NULL, 0, false))
+    *lost = true;
+}
+
+void capture_data(const uint64_t conn_id, const capture_kind_t kind,
+                  const bool start, const unsigned char *data,
+                  const size_t len, bool *lost) {
+  if (*lost)
+    return;
+
+  if (!queue_record(conn_id, kind, start ? CAPTURE_START : 0, data, len,
+                    false))
+    *lost = true;
+}
+
+void capture_close(const uint64_t conn_id, const bool lost) {
+  queue_record(conn_id, CAPTURE_CLOSE, lost ? CAPTURE_LOST : 0, NULL, 0, true);
+}
+
+void capture_log_stats(void) {
+  if (!capture_enabled)
+    return;
+
+  LOG(INFO, NULL, "Capture: %lu records written, %lu dropped",
+      atomic_load(&written), atomic_load(&dropped));
+}
+
+void capture_stop(void) {
+  if (!capture_enabled)
+    return;
+
+  writeq_stop(&queue);
+  capture_enabled = false;
+  fclose(file);
+  file = NULL;
+}
@@ -1,15 +1,26 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
 
+#include "blocklist.h"
 #include "common.h"
 #include "handler.h"
+#include "metrics.h"
+#include "probes.h"
+#include "ratelimit.h"
+#include "rcu.h"
+#include "responses.h"
+#include "trace.h"
+#include "urlfilter.h"
 
 typedef struct Server_Info {
   struct addrinfo *res;
   int *server_fd;
+  Deadline *deadline; // May be watching `server_fd`
 } Server_Info;
 
 static void clean(void *arg) {
   Server_Info *info = (Server_Info *)arg;
+  deadline_stop(info->deadline);
   if (*info->server_fd != -1) {
     close(*info->server_fd);
     *info->server_fd = -1;
@@ -19,10 +30,15 @@ static void clean(void *arg) {
   info->res = NULL;
 }
 
-static int establish_connection(const char *host) {
+static int establish_connection(const char *host, Exchange *ex,
+                                Deadline *deadline) {
   char hostname[MAX_HOSTNAME_LEN] = {0};
   char port[MAX_PORT_LEN] = "80";
 
+  // Every request goes to the same server, e.g. a replay stub
+  if (config.upstream != NULL)
+    host = config.upstream;
+
   char *delim = strchr(host, ':');
   if (delim) {
     size_t len = delim - host;
@@ -41,15 +57,22 @@ static int establish_connection(const char *host) {
   hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
   hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
 
+  // Resolving counts as connecting, it just can't be cut short
+  deadline_start(deadline, DEADLINE_CONNECT, -1);
   int status = getaddrinfo(hostname, port, &hints, &res);
   if (status != 0) {
     LOG(ERR, gai_strerror(status), "getaddrinfo failed");
     return -1;
   }
+  if (deadline_expired(deadline)) {
+    freeaddrinfo(res);
+    return -1;
+  }
+  exchange_mark(ex, PHASE_RESOLVED);
 
   char ip[INET6_ADDRSTRLEN] = {0};
   int server_fd = -1;
-  Server_Info info = {res, &server_fd};
+  Server_Info info = {res, &server_fd, deadline};
   pthread_cleanup_push(clean, &info);
   for (p = res; p != NULL; p = p->ai_next) {
     pthread_testcancel();
@@ -71,11 +94,20 @@ static int establish_connection(const char *host) {
     if (server_fd == -1)
       continue;
 
-    if (connect(server_fd, p->ai_addr, p->ai_addrlen) != -1)
+    // Each address gets the whole limit, expiring shuts the socket down
+    deadline_start(deadline, DEADLINE_CONNECT, server_fd);
+    int connected = connect(server_fd, p->ai_addr, p->ai_addrlen);
+    deadline_stop(deadline);
+    if (connected != -1 && !deadline_expired(deadline))
       break; // Connection successfully established
 
     close(server_fd);
     server_fd = -1;
+    if (deadline_expired(deadline)) {
+      errno = ETIMEDOUT; // Logged below, no other address is tried
+      p = NULL;
+      break;
+    }
   }
 
   freeaddrinfo(res);
@@ -86,13 +118,26 @@ static int establish_connection(const char *host) {
     return -1;
   }
 
+  // Relayed without blocking from here, connect() is cut short by the deadline
+  int flags = fcntl(server_fd, F_GETFL);
+  if (flags == -1 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    LOG(ERR, NULL, "Failed to make the upstream socket non-blocking");
+    close(server_fd);
+    return -1;
+  }
+
   LOG(INFO, NULL, "Connection to %s:%s has been established!", hostname, port);
   return server_fd;
 }
 
-int client_handler(struct pollfd *fds, Request *req, bool *is_TLS) {
-  unsigned char buffer[MAX_HTTP_LEN] = {0};
+int client_handler(ConnInfo *info) {
+  struct pollfd *fds = info->fds;
+  Request *req = info->req;
+
+  unsigned char *buffer = info->rx;
   long bytes_recv = recv(fds[0].fd, buffer, MAX_HTTP_LEN - 1, 0);
+  if (bytes_recv == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0; // Woken up for nothing, the socket is non-blocking
   if (bytes_recv <= 0) {
     if (bytes_recv == -1)
       LOG(ERR, NULL, "Failed to receive from client");
@@ -100,27 +145,64 @@ int client_handler(struct pollfd *fds, Request *req, bool *is_TLS) {
       LOG(INFO, NULL, "Client closed the connection!");
     return -1;
   }
+  buffer[bytes_recv] = '\0'; // The buffer is reused, parsed as a string
 
-  if (*is_TLS && fds[1].fd != -1) {
+  info->turn_bytes += bytes_recv;
+  shaper_charge(&info->shaper, (struct sockaddr *)&info->peer, SHAPER_CLIENT,
+                bytes_recv);
+  info->exchange.rec.bytes_in += bytes_recv;
+  metrics_add(METRIC_BYTES_FROM_CLIENT, bytes_recv);
+
+  if (info->is_TLS && fds[1].fd != -1) {
     LOG(DBG, NULL, "Received TLS traffic from client (%zu Bytes)", bytes_recv);
-    if (forward(fds[1].fd, buffer, bytes_recv) == -1) {
+    metrics_top_bytes(&info->top, bytes_recv);
+    if (outbuf_write(&info->out[1], buffer, bytes_recv) == -1) {
       LOG(ERR, NULL, "Couldn't forward bytes to server");
       return -1;
     }
+    deadline_touch(&info->deadline);
     return 0;
   }
 
   LOG(DBG, NULL, "Received from client (%ld Bytes): ", bytes_recv);
 
+  // Otherwise the bytes continue the body of the previous request
+  bool fresh = !req->is_partial && !req->is_chunked;
+  if (capture_enabled)
+    capture_data(info->id, CAPTURE_CLIENT, fresh, buffer, bytes_recv,
+                 &info->capture_lost);
   if (parse_request(buffer, bytes_recv, req) == -1) {
-    const char *response = "HTTP/1.1 400 Bad Request\r\n\r\n";
-    if (forward(fds[0].fd, (unsigned char *)response, strlen(response)) == -1)
-      LOG(ERR, NULL, "Couldn't forward bytes to server");
+    metrics_add(METRIC_REQ_BAD, 1);
+    if (queue_response(&info->out[0], RESPONSE_BAD_REQUEST) == -1)
+      LOG(ERR, NULL, "Couldn't forward bytes to client");
 
     return -1;
   }
 
-  print_req(req);
+  if (fresh) {
+    deadline_stop(&info->deadline); // Until connecting or forwarding
+    exchange_begin(&info->exchange, info->id, info->accepted_ns,
+                   (struct sockaddr *)&info->peer, req->method);
+    exchange_mark(&info->exchange, PHASE_PARSED);
+    info->exchange.rec.bytes_in = bytes_recv;
+    metrics_add(METRIC_REQUESTS, 1);
+    info->served = true;
+    PROBE(request_parsed, info->id, req->method, req->uri, bytes_recv);
+  }
+
+  // Charged once per request, the reads of its body are part of it
+  unsigned int retry_after = 0;
+  if (fresh && !ratelimit_allow(&request_limit, (struct sockaddr *)&info->peer,
+                                &retry_after)) {
+    LOG(WARN, NULL, "Client over its request rate, retry in %us",
+        retry_after);
+    info->exchange.rec.status = 429;
+    info->exchange.rec.flags |= ACCESS_THROTTLED;
+    metrics_add(METRIC_REQ_THROTTLED, 1);
+    if (queue_throttled(&info->out[0], retry_after) == -1)
+      LOG(ERR, NULL, "Couldn't forward bytes to client");
+    return -1; // Close the connection
+  }
 
   const char *host = get_header_value("Host", req->headers, req->headers_count);
   if (host == NULL) {
@@ -128,105 +210,110 @@ int client_handler(struct pollfd *fds, Request *req, bool *is_TLS) {
     return -1;
   }
 
-  // TODO: Read the blocked website at program startup from a file
-  if (strncmp("vulnweb.com", host, 11) == 0) {
-    FILE *fp = fopen("./src/pages/blocked.html", "r");
-    if (fp == NULL) {
-      LOG(ERR, NULL, "Couldn't open blocked page file, using default response");
-
-      const char *response = "HTTP/1.1 403 Forbidden\r\n"
-                             "Content-Type: text/html\r\n"
-                             "Content-Length: 25\r\n"
-                             "Proxy-Agent: HTTProxy/1.0\r\n"
-                             "\r\n"
-                             "<h1>Website Blocked!</h1>";
-      if (forward(fds[0].fd, (unsigned char *)response, strlen(response)) ==
-          -1) {
-        LOG(ERR, NULL, "Couldn't forward bytes to server");
-        return -1;
-      }
-      LOG(INFO, "", "Blocked site, connection closed with fallback response!");
-      return -1; // Close the connection
-    }
-
-    // Get the Content-Length
-    fseek(fp, 0, SEEK_END);
-    long content_length = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    char *buffer = (char *)malloc(content_length + 1);
-    if (buffer == NULL) {
-      LOG(ERR, NULL,
-          "Failed to allocate memory for blocked page, using default "
-          "response");
-      fclose(fp);
-
-      const char *response = "HTTP/1.1 403 Forbidden\r\n"
-                             "Content-Type: text/html\r\n"
-                             "Content-Length: 25\r\n"
-                             "Proxy-Agent: HTTProxy/1.0\r\n"
-                             "\r\n"
-                             "<h1>Website Blocked!</h1>";
-      if (forward(fds[0].fd, (unsigned char *)response, strlen(response)) ==
-          -1) {
-        LOG(ERR, NULL, "Couldn't forward bytes to server");
-        return -1;
-      }
-      LOG(INFO, "", "Blocked site, connection closed with fallback response!");
-      return -1; // Close the connection
-    }
+  if (fresh && trace_enabled)
+    exchange_target(&info->exchange, host, req->uri);
 
-    fread(buffer, 1, content_length, fp);
-    buffer[content_length] = '\0';
-    fclose(fp);
+  if (fresh) {
+    metrics_top_request(host, info->client, &info->top);
+    snprintf(info->top_host, sizeof(info->top_host), "%s", host);
+  }
+  metrics_top_bytes(&info->top, bytes_recv);
 
-    char response[MAX_HTTP_LEN] = {0};
-    snprintf(response, MAX_HTTP_LEN - 1,
-             "HTTP/1.1 403 Forbidden\r\nContent-Type: text/html; "
-             "charset=UTF-8\r\nContent-Length: %ld\r\nProxy-Agent: "
-             "HTTProxy/1.0\r\n\r\n",
-             content_length);
+  if (fresh && dump_enabled) {
+    info->dump = dump_select(host, req->uri);
+    if (info->dump)
+      dump_request(req, buffer, bytes_recv);
+  }
 
-    if (forward(fds[0].fd, (unsigned char *)response, strlen(response)) == -1) {
-      LOG(ERR, NULL, "Couldn't forward bytes to server");
-      free(buffer);
-      return -1;
+  // Judged once per request: the reads of its body pass, even across a
+  // reload, as part of it already went upstream
+  bool blocked = false;
+  if (fresh) {
+    rcu_read_lock();
+    blocked = blocklist_match(rcu_dereference(blocklist), host);
+    if (!blocked) {
+      // The matched pattern belongs to the filter, use it inside the section
+      const char *pattern = NULL;
+      url_action_t action = urlfilter_match(rcu_dereference(urlfilter),
+                                            req->uri, strlen(req->uri),
+                                            &pattern);
+      if (action == URL_ACTION_TAG)
+        LOG(INFO, NULL, "Tagged %s%s (matched \"%s\")", host, req->uri,
+            pattern);
+      if (action == URL_ACTION_BLOCK)
+        LOG(INFO, NULL, "Blocked %s%s (matched \"%s\")", host, req->uri,
+            pattern);
+      blocked = action == URL_ACTION_BLOCK;
     }
+    rcu_read_unlock();
+  }
 
-    if (forward(fds[0].fd, (unsigned char *)buffer, content_length) == -1) {
-      LOG(ERR, NULL, "Couldn't forward bytes to server");
-      free(buffer);
+  if (blocked) {
+    info->exchange.rec.status = 403;
+    info->exchange.rec.flags |= ACCESS_BLOCKED;
+    metrics_add(METRIC_REQ_BLOCKED, 1);
+    if (queue_response(&info->out[0], RESPONSE_BLOCKED) == -1) {
+      LOG(ERR, NULL, "Couldn't forward bytes to client");
       return -1;
     }
 
-    free(buffer);
     LOG(INFO, "",
         "Blocked site, connection closed after sending blocked page!");
     return -1; // Close the connection
   }
 
+  // Negotiate the response transform from what the client can decode
+  const char *accept_encoding =
+      get_header_value("Accept-Encoding", req->headers, req->headers_count);
+  info->xf.accepted = accept_encoding_mask(accept_encoding);
+  info->xf.any_coding = accept_encoding == NULL;
+  info->xf.is_head = strncmp("HEAD", req->method, 4) == 0;
+  info->xf.chunked_ok = strncmp("HTTP/1.1", req->version, 8) == 0;
+
   if (fds[1].fd == -1) {
-    fds[1].fd = establish_connection(host);
-    if (fds[1].fd == -1)
+    conn_end_turn(info); // Other clients relay while this one connects
+    metrics_state(CONN_STATE_CONNECTING);
+    PROBE(upstream_connect_start, info->id, host);
+    fds[1].fd = establish_connection(host, &info->exchange, &info->deadline);
+    PROBE(upstream_connect_done, info->id, fds[1].fd);
+    if (fds[1].fd == -1) {
+      metrics_add(METRIC_UPSTREAM_FAILED, 1);
       return -1;
+    }
+    info->out[1].fd = fds[1].fd;
+    exchange_mark(&info->exchange, PHASE_CONNECTED);
   }
+  if (fresh)
+    exchange_upstream(&info->exchange, fds[1].fd);
 
   if (strncmp("CONNECT", req->method, 7) == 0) {
-    const char *response = "HTTP/1.1 200 Connection Established\r\n"
-                           "Proxy-Agent: HTTProxy/1.0\r\n"
-                           "\r\n";
-    if (forward(fds[0].fd, (unsigned char *)response, strlen(response)) == -1) {
-      LOG(ERR, NULL, "Couldn't forward bytes to server");
+    if (queue_response(&info->out[0], RESPONSE_CONNECTED) == -1) {
+      LOG(ERR, NULL, "Couldn't forward bytes to client");
       return -1;
     }
-    *is_TLS = true;
+    info->is_TLS = true;
+    info->out[0].spill_at = 0; // Tunnels aren't buffered, they never end
+    deadline_start(&info->deadline, DEADLINE_TRANSFER, fds[1].fd);
+    metrics_state(CONN_STATE_TUNNEL);
+    PROBE(tunnel_start, info->id, host);
+    info->exchange.rec.status = 200;
+    info->exchange.rec.flags |= ACCESS_TUNNEL;
     return 0;
   }
 
-  if (forward(fds[1].fd, buffer, bytes_recv) == -1) {
+  if (outbuf_write(&info->out[1], buffer, bytes_recv) == -1) {
     LOG(ERR, NULL, "Couldn't forward bytes to server");
     return -1;
   }
+  exchange_mark(&info->exchange, PHASE_SENT);
+  info->awaiting = true;
+  // A request body going up pushes back the wait for the response
+  if (fresh)
+    deadline_start(&info->deadline, DEADLINE_RESPONSE, fds[1].fd);
+  else
+    deadline_touch(&info->deadline);
+  if (fresh)
+    metrics_state(CONN_STATE_WAITING);
 
   LOG(INFO, NULL, "Bytes successfully forwarded to server");
   return 0;
@@ -0,0 +1,43 @@
+#include <time.h>
+
+#include "clock.h"
+#include "common.h"
+
+atomic_uint_fast64_t cached_now_ns = 0;
+
+static void *tick(void *arg) {
+  (void)arg;
+
+  struct timespec period = {0, CLOCK_TICK_NS};
+  while (1) {
+    atomic_store_explicit(&cached_now_ns, clock_precise_ns(),
+                          memory_order_relaxed);
+    nanosleep(&period, NULL);
+  }
+
+  return NULL;
+}
+
+int clock_start(void) {
+  atomic_store(&cached_now_ns, clock_precise_ns());
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, tick, NULL) != 0) {
+    LOG(ERR, NULL, "Failed to start the clock thread");
+    return -1;
+  }
+
+  pthread_detach(tid);
+  return 0;
+}
+
+uint64_t clock_now_ns(void) {
+  uint64_t now = atomic_load_explicit(&cached_now_ns, memory_order_relaxed);
+  return now != 0 ? now : clock_precise_ns();
+}
+
+uint64_t clock_precise_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
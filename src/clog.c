@@ -2,6 +2,9 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,110 +12,424 @@
 
 #include "clog.h"
 
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOG_IDLE_MIN_NS 1000000  // Writer poll interval while messages flow
+#define LOG_IDLE_MAX_NS 16000000 // Writer poll interval once idle
+#define LOG_LINE_MAX 1024        // Longest formatted line
 
-/**
- * @brief Retrieves the current system time as a string in the format
- *        "YYYY/MM/DD HH:MM:SS".
- *
- * @param buffer The buffer to store the formatted time string.
- * @param buffer_size The size of the buffer.
- */
-static void get_current_time(char *buffer, size_t buffer_size) {
-  time_t raw_time;
-  struct tm time_info;
+/* Slot states */
+enum { RING_FREE, RING_OWNED, RING_CLOSED };
 
-  // Get the current system time
-  time(&raw_time);
+/* Message captured at the call site, formatted into a line by the writer */
+typedef struct LogRecord {
+  uint64_t seq; // Orders records across rings
+  time_t time;
+  const char *file;
+  const char *func;
+  int line;
+  int err_code; // errno at the call site
+  log_level_t level;
+  char text[LOG_TEXT_LEN];
+  char cause[LOG_CAUSE_LEN]; // Custom error, empty if none
+} LogRecord;
 
-  // Convert it to local time (based on system's timezone)
-  // Thread-safe version of localtime
-  localtime_r(&raw_time, &time_info);
+/* Single producer (the owning thread), single consumer (the writer) */
+typedef struct LogRing {
+  _Alignas(64) atomic_size_t head; // Next record to fill, producer side
+  _Alignas(64) atomic_size_t tail; // Next record to write, consumer side
+  atomic_ulong dropped;            // Records lost since the last report
+  int slot;
 
-  // Format the time as "YYYY/MM/DD HH:MM:SS"
-  strftime(buffer, buffer_size, "%Y/%m/%d %H:%M:%S", &time_info);
-}
+  LogRecord records[LOG_RING_SIZE];
+} LogRing;
 
-void log_message(log_level_t level, const char *custom_err, const char *file,
-                 int line, const char *func, const char *format, ...) {
-  va_list args;
-  va_start(args, format); // Initialize the argument list
+/* Serializes the writes and the draining of the rings */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *log_out = NULL; // stdout when NULL
 
-  int err_code = errno;
+static _Atomic(LogRing *) rings[LOG_MAX_RINGS];
+static atomic_int ring_state[LOG_MAX_RINGS];
+static atomic_int ring_limit; // Slots ever claimed
+static __thread LogRing *local_ring;
+static pthread_key_t ring_key;
 
-  char time_buffer[20];
-  get_current_time(time_buffer, sizeof(time_buffer));
+static atomic_uint_fast64_t next_seq;
+static atomic_ulong dropped_total;
+static atomic_bool running;
+static pthread_t writer;
 
-  char *message = NULL;
-  int message_len = 0;
+/* Formatted time of the last second logged, guarded by log_mutex */
+static time_t cached_sec = -1;
+static char cached_time[20];
 
-  // First, try to format the message to determine its length
-  va_list args_copy;
-  va_copy(args_copy, args);
-  message_len = vsnprintf(NULL, 0, format, args_copy) + 1;
-  va_end(args_copy);
+/* Where the lines go, must be called with log_mutex held */
+static FILE *output(void) { return log_out != NULL ? log_out : stdout; }
 
-  // Allocate memory for the message
-  message = (char *)malloc(message_len);
-  if (!message) {
-    perror("Failed to allocate memory for log message\n");
-    va_end(args);
-    exit(EXIT_FAILURE);
-  }
+/**
+ * @brief Retrieves the time as a string in the format "YYYY/MM/DD HH:MM:SS",
+ *        formatting it only once per second.
+ *
+ * @note Must be called with log_mutex held.
+ */
+static const char *get_time_string(const time_t raw_time) {
+  if (raw_time != cached_sec) {
+    struct tm time_info;
 
-  // Actually format the message
-  vsnprintf(message, message_len, format, args);
-  va_end(args);
+    // Convert it to local time (based on system's timezone)
+    // Thread-safe version of localtime
+    localtime_r(&raw_time, &time_info);
 
-  // Lock the mutex before writing to stdout
-  if (pthread_mutex_lock(&log_mutex) != 0) {
-    fprintf(stderr, "Failed to lock mutex for logging\n");
-    free(message);
-    exit(EXIT_FAILURE);
+    // Format the time as "YYYY/MM/DD HH:MM:SS"
+    strftime(cached_time, sizeof(cached_time), "%Y/%m/%d %H:%M:%S",
+             &time_info);
+    cached_sec = raw_time;
   }
 
-  printf(STYLE_BOLD "%s" STYLE_NO_BOLD " ", time_buffer);
-  // Print the log level-specific annotation and color
-  switch (level) {
+  return cached_time;
+}
+
+/**
+ * @brief Formats a record into a colored log line.
+ *
+ * @return Length of the line, at most size - 1
+ *
+ * @note Must be called with log_mutex held.
+ */
+static size_t format_record(const LogRecord *rec, char *out,
+                            const size_t size) {
+  const char *label = NULL;
+  switch (rec->level) {
   case INFO:
-    printf(STYLE_BOLD INFO_COLOR "[INFO] " STYLE_NO_BOLD MSG_COLOR);
+    label = STYLE_BOLD INFO_COLOR "[INFO] " STYLE_NO_BOLD MSG_COLOR;
     break;
   case WARN:
-    printf(STYLE_BOLD WARN_COLOR "[WARNING] " STYLE_NO_BOLD MSG_COLOR);
-    printf(STYLE_DIM "(%s:%d in %s) " STYLE_NO_DIM, file, line, func);
+    label = STYLE_BOLD WARN_COLOR "[WARNING] " STYLE_NO_BOLD MSG_COLOR;
     break;
   case ERR:
-    printf(STYLE_BOLD ERR_COLOR "[ERROR] " STYLE_NO_BOLD MSG_COLOR);
-    printf(STYLE_DIM "(%s:%d in %s) " STYLE_NO_DIM, file, line, func);
+    label = STYLE_BOLD ERR_COLOR "[ERROR] " STYLE_NO_BOLD MSG_COLOR;
     break;
   case DBG:
-    printf(STYLE_BOLD DEBUG_COLOR "[DEBUG] " STYLE_NO_BOLD MSG_COLOR);
-    printf(STYLE_DIM "(%s:%d in %s) " STYLE_NO_DIM, file, line, func);
+  default:
+    label = STYLE_BOLD DEBUG_COLOR "[DEBUG] " STYLE_NO_BOLD MSG_COLOR;
     break;
   }
 
-  // Print the user-provided log message (format string and arguments)
-  printf("%s", message);
-
-  // If the log level is ERROR or WARN, print a custom error message
+  // If the log level is ERROR or WARN, append a custom error message
   // or strerror(errno)
-  if (level == ERR) {
-    if (custom_err)
-      printf(": %s", custom_err);
-    else if (err_code != 0)
-      printf(": %s", strerror(err_code));
-  } else if (level == WARN && err_code != 0) {
-    printf(": %s", strerror(err_code));
+  const char *cause = NULL;
+  if (rec->level == ERR) {
+    if (rec->cause[0] != '\0')
+      cause = rec->cause;
+    else if (rec->err_code != 0)
+      cause = strerror(rec->err_code);
+  } else if (rec->level == WARN && rec->err_code != 0) {
+    cause = strerror(rec->err_code);
   }
 
-  printf(RESET "\n");
-  fflush(stdout);
+  const char *time_buffer = get_time_string(rec->time);
+  int len = 0;
+  if (rec->level == INFO)
+    len = snprintf(out, size, STYLE_BOLD "%s" STYLE_NO_BOLD " %s%s" RESET "\n",
+                   time_buffer, label, rec->text);
+  else
+    len = snprintf(out, size,
+                   STYLE_BOLD "%s" STYLE_NO_BOLD " %s" STYLE_DIM
+                   "(%s:%d in %s) " STYLE_NO_DIM "%s%s%s" RESET "\n",
+                   time_buffer, label, rec->file, rec->line, rec->func,
+                   rec->text, cause ? ": " : "", cause ? cause : "");
+
+  if (len < 0)
+    return 0;
+  return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+/* Capture everything the line needs, the arguments won't outlive the call */
+static void fill_record(LogRecord *rec, log_level_t level,
+                        const char *custom_err, const char *file, int line,
+                        const char *func, int err_code, const char *format,
+                        va_list args) {
+  rec->seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+  rec->time = time(NULL);
+  rec->file = file;
+  rec->func = func;
+  rec->line = line;
+  rec->err_code = err_code;
+  rec->level = level;
+
+  int len = vsnprintf(rec->text, sizeof(rec->text), format, args);
+  if (len >= (int)sizeof(rec->text))
+    memcpy(rec->text + sizeof(rec->text) - 4, "...", 4);
+
+  rec->cause[0] = '\0';
+  if (level == ERR && custom_err != NULL)
+    snprintf(rec->cause, sizeof(rec->cause), "%s", custom_err);
+}
+
+static void release_ring(void *arg) {
+  LogRing *ring = (LogRing *)arg;
+  local_ring = NULL;
+  // The writer frees the slot once the remaining records are written
+  atomic_store_explicit(&ring_state[ring->slot], RING_CLOSED,
+                        memory_order_release);
+}
+
+/* Claim a ring for the calling thread, NULL if none is left */
+static LogRing *acquire_ring(void) {
+  for (int i = 0; i < LOG_MAX_RINGS; i++) {
+    int expected = RING_FREE;
+    if (!atomic_compare_exchange_strong(&ring_state[i], &expected, RING_OWNED))
+      continue;
+
+    LogRing *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+    if (ring == NULL) {
+      ring = (LogRing *)aligned_alloc(_Alignof(LogRing), sizeof(LogRing));
+      if (ring == NULL) {
+        atomic_store(&ring_state[i], RING_FREE);
+        return NULL;
+      }
+      atomic_init(&ring->head, 0);
+      atomic_init(&ring->tail, 0);
+      atomic_init(&ring->dropped, 0);
+      ring->slot = i;
+      atomic_store_explicit(&rings[i], ring, memory_order_release);
+    }
+
+    int limit = atomic_load(&ring_limit);
+    while (limit <= i &&
+           !atomic_compare_exchange_weak(&ring_limit, &limit, i + 1))
+      ;
+
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+  }
+
+  return NULL;
+}
+
+/* Append a line to the batch, writing the batch out first if it's full */
+static void batch_append(char *batch, size_t *len, const LogRecord *rec) {
+  if (*len + LOG_LINE_MAX > LOG_BATCH_SIZE) {
+    fwrite(batch, 1, *len, output());
+    *len = 0;
+  }
+  *len += format_record(rec, batch + *len, LOG_LINE_MAX);
+}
+
+/* Report records a ring couldn't take */
+static void report_drops(char *batch, size_t *len, LogRing *ring) {
+  unsigned long dropped = atomic_exchange(&ring->dropped, 0);
+  if (dropped == 0)
+    return;
+
+  atomic_fetch_add(&dropped_total, dropped);
+  LogRecord rec = {.time = time(NULL),
+                   .file = __FILE__,
+                   .func = __func__,
+                   .line = __LINE__,
+                   .level = WARN};
+  snprintf(rec.text, sizeof(rec.text),
+           "Log buffer full, dropped %lu messages", dropped);
+  batch_append(batch, len, &rec);
+}
+
+/**
+ * @brief Writes the records buffered in every ring, in the order they were
+ *        logged.
+ *
+ * @return Number of records written
+ *
+ * @note Must be called with log_mutex held.
+ */
+static size_t drain_rings(void) {
+  static char batch[LOG_BATCH_SIZE];
+  size_t heads[LOG_MAX_RINGS];
+  size_t len = 0, written = 0;
+  int limit = atomic_load_explicit(&ring_limit, memory_order_acquire);
+
+  // Only what was published so far, later records wait for the next pass
+  for (int i = 0; i < limit; i++) {
+    LogRing *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+    heads[i] = ring != NULL
+                   ? atomic_load_explicit(&ring->head, memory_order_acquire)
+                   : 0;
+    if (ring != NULL)
+      report_drops(batch, &len, ring);
+  }
+
+  // Merge the rings on the sequence numbers
+  while (1) {
+    LogRing *next = NULL;
+    const LogRecord *oldest = NULL;
+    for (int i = 0; i < limit; i++) {
+      LogRing *ring = atomic_load_explicit(&rings[i], memory_order_relaxed);
+      if (ring == NULL)
+        continue;
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      if (tail == heads[i])
+        continue;
+      const LogRecord *rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+      if (oldest == NULL || rec->seq < oldest->seq) {
+        oldest = rec;
+        next = ring;
+      }
+    }
+    if (next == NULL)
+      break;
+
+    batch_append(batch, &len, oldest);
+    atomic_fetch_add_explicit(&next->tail, 1, memory_order_release);
+    written++;
+  }
+
+  if (len > 0)
+    fwrite(batch, 1, len, output());
+  if (len > 0 || written > 0)
+    fflush(output());
+
+  // Rings of exited threads are free once empty
+  for (int i = 0; i < limit; i++) {
+    LogRing *ring = atomic_load_explicit(&rings[i], memory_order_relaxed);
+    if (ring != NULL &&
+        atomic_load_explicit(&ring_state[i], memory_order_acquire) ==
+            RING_CLOSED &&
+        atomic_load(&ring->tail) == atomic_load(&ring->head))
+      atomic_store_explicit(&ring_state[i], RING_FREE, memory_order_release);
+  }
+
+  return written;
+}
+
+static void *write_log(void *arg) {
+  (void)arg;
+  long idle_ns = LOG_IDLE_MIN_NS;
+
+  while (atomic_load_explicit(&running, memory_order_acquire)) {
+    pthread_mutex_lock(&log_mutex);
+    size_t written = drain_rings();
+    pthread_mutex_unlock(&log_mutex);
+
+    // Back off while nothing is logged
+    if (written > 0)
+      idle_ns = LOG_IDLE_MIN_NS;
+    else if (idle_ns < LOG_IDLE_MAX_NS)
+      idle_ns *= 2;
+
+    struct timespec pause = {0, idle_ns};
+    nanosleep(&pause, NULL);
+  }
+
+  return NULL;
+}
+
+/* Format and write the message on the calling thread */
+static void write_now(log_level_t level, const char *custom_err,
+                      const char *file, int line, const char *func,
+                      int err_code, const char *format, va_list args) {
+  LogRecord rec;
+  char out[LOG_LINE_MAX];
+
+  fill_record(&rec, level, custom_err, file, line, func, err_code, format,
+              args);
+
+  // Lock the mutex before writing out
+  if (pthread_mutex_lock(&log_mutex) != 0) {
+    fprintf(stderr, "Failed to lock mutex for logging\n");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t len = format_record(&rec, out, sizeof(out));
+  fwrite(out, 1, len, output());
+  fflush(output());
 
   if (pthread_mutex_unlock(&log_mutex) != 0) {
     fprintf(stderr, "Failed to unlock mutex after logging\n");
   }
+}
 
-  free(message);
+void log_message(log_level_t level, const char *custom_err, const char *file,
+                 int line, const char *func, const char *format, ...) {
+  va_list args;
+  va_start(args, format); // Initialize the argument list
+
+  int err_code = errno;
+
+  LogRing *ring = NULL;
+  if (atomic_load_explicit(&running, memory_order_acquire)) {
+    ring = local_ring;
+    if (ring == NULL)
+      ring = acquire_ring();
+  }
+
+  if (ring == NULL) {
+    write_now(level, custom_err, file, line, func, err_code, format, args);
+    va_end(args);
+    errno = err_code;
+    return;
+  }
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == LOG_RING_SIZE) {
+    // Never wait for the writer, drop the record instead
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+  } else {
+    fill_record(&ring->records[head & (LOG_RING_SIZE - 1)], level,
+                custom_err, file, line, func, err_code, format, args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  }
+
+  va_end(args);
+  errno = err_code;
 }
 
-void logger_cleanup(void) { pthread_mutex_destroy(&log_mutex); }
+int logger_start(void) {
+  static bool registered = false;
+
+  if (atomic_load(&running))
+    return 0;
+
+  if (!registered) {
+    if (pthread_key_create(&ring_key, release_ring) != 0)
+      return -1;
+    atexit(logger_cleanup);
+    registered = true;
+  }
+
+  atomic_store(&running, true);
+  if (pthread_create(&writer, NULL, write_log, NULL) != 0) {
+    atomic_store(&running, false);
+    return -1;
+  }
+
+  return 0;
+}
+
+void logger_set_output(FILE *out) {
+  pthread_mutex_lock(&log_mutex);
+  fflush(output());
+  log_out = out;
+  pthread_mutex_unlock(&log_mutex);
+}
+
+unsigned long logger_dropped(void) {
+  unsigned long dropped = atomic_load(&dropped_total);
+  int limit = atomic_load(&ring_limit);
+  for (int i = 0; i < limit; i++) {
+    LogRing *ring = atomic_load(&rings[i]);
+    if (ring != NULL)
+      dropped += atomic_load(&ring->dropped);
+  }
+  return dropped;
+}
+
+void logger_cleanup(void) {
+  if (!atomic_exchange(&running, false))
+    return;
+
+  pthread_join(writer, NULL);
+
+  // New messages are written synchronously, flush what's left
+  pthread_mutex_lock(&log_mutex);
+  drain_rings();
+  pthread_mutex_unlock(&log_mutex);
+}
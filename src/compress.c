@@ -0,0 +1,545 @@
+#include <stdatomic.h>
+#include <strings.h>
+#include <time.h>
+
+#include "common.h"
+#include "compress.h"
+
+#define CHUNK_PREFIX_LEN 18 // Room for "<16 hex digits>\r\n"
+
+/* Codec operations */
+enum { CODEC_PROCESS, CODEC_FLUSH, CODEC_FINISH };
+
+static atomic_ullong stat_responses = 0;
+static atomic_ullong stat_decoded = 0;
+static atomic_ullong stat_bytes_in = 0;
+static atomic_ullong stat_bytes_out = 0;
+static atomic_ullong stat_bytes_saved = 0;
+static atomic_ullong stat_cpu_ns = 0;
+
+static const char *const compressible_types[] = {
+    "application/json",       "application/javascript",
+    "application/x-javascript", "application/xml",
+    "application/xhtml+xml",  "application/rss+xml",
+    "image/svg+xml",          NULL,
+};
+
+static long long thread_cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *encoding_name(const encoding_t encoding) {
+  switch (encoding) {
+  case ENC_GZIP:
+    return "gzip";
+  case ENC_DEFLATE:
+    return "deflate";
+  case ENC_BR:
+    return "br";
+  default:
+    return "identity";
+  }
+}
+
+static encoding_t encoding_from_token(const char *token, const size_t len) {
+  if ((len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+      (len == 6 && strncasecmp(token, "x-gzip", 6) == 0))
+    return ENC_GZIP;
+  if (len == 7 && strncasecmp(token, "deflate", 7) == 0)
+    return ENC_DEFLATE;
+  if (len == 2 && strncasecmp(token, "br", 2) == 0)
+    return ENC_BR;
+  if (len == 8 && strncasecmp(token, "identity", 8) == 0)
+    return ENC_IDENTITY;
+  return ENC_UNKNOWN;
+}
+
+unsigned int accept_encoding_mask(const char *accept_encoding) {
+  unsigned int mask = 0;
+  if (accept_encoding == NULL)
+    return mask;
+
+  const char *p = accept_encoding;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    if (*p == '\0')
+      break;
+
+    const char *token = p;
+    while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ')
+      p++;
+    size_t token_len = p - token;
+
+    // A weight of zero means "not acceptable"
+    bool rejected = false;
+    const char *end = strchr(p, ',');
+    const char *q = strstr(p, "q=");
+    if (q != NULL && (end == NULL || q < end))
+      rejected = strtod(q + 2, NULL) == 0.0;
+
+    if (!rejected) {
+      if (token_len == 1 && *token == '*')
+        mask |= ENC_GZIP | ENC_DEFLATE | ENC_BR;
+      else
+        mask |= encoding_from_token(token, token_len) & ~ENC_UNKNOWN;
+    }
+
+    p = end != NULL ? end : p + strlen(p);
+  }
+
+  return mask;
+}
+
+encoding_t content_encoding_of(const char *content_encoding) {
+  if (content_encoding == NULL)
+    return ENC_IDENTITY;
+
+  while (*content_encoding == ' ')
+    content_encoding++;
+
+  size_t len = strcspn(content_encoding, " ,;");
+  if (content_encoding[strspn(content_encoding + len, " ") + len] != '\0')
+    return ENC_UNKNOWN; // Stacked codings, e.g. "gzip, br"
+
+  return encoding_from_token(content_encoding, len);
+}
+
+static bool is_compressible(const Response *res) {
+  if (res->is_text)
+    return true;
+  if (res->content_type == NULL)
+    return false;
+
+  for (int i = 0; compressible_types[i] != NULL; i++)
+    if (strncasecmp(compressible_types[i], res->content_type,
+                    strlen(compressible_types[i])) == 0)
+      return true;
+
+  return false;
+}
+
+/*
+ * Pick a compression level from the 1-minute load average normalized by the
+ * number of CPUs. The load is sampled at most once per second so the check
+ * stays off the per-buffer path.
+ */
+static int adaptive_level(const encoding_t encoding) {
+  static const int gzip_levels[] = {1, 4, 6};
+  static const int brotli_levels[] = {1, 3, 5};
+  static atomic_long last_sample = 0;
+  static atomic_int tier = 2;
+
+  long now = (long)time(NULL);
+  if (atomic_exchange(&last_sample, now) != now) {
+    double load = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (getloadavg(&load, 1) == 1 && cpus > 0) {
+      double ratio = load / cpus;
+      atomic_store(&tier, ratio < 0.5 ? 2 : ratio < 0.85 ? 1 : 0);
+    }
+  }
+
+  int t = atomic_load(&tier);
+  return encoding == ENC_BR ? brotli_levels[t] : gzip_levels[t];
+}
+
+static int codec_init(Transform *xf) {
+  memset(&xf->zs, 0, sizeof(z_stream));
+
+  switch (xf->encoding) {
+  case ENC_GZIP:
+  case ENC_DEFLATE:
+    if (xf->compress) {
+      // windowBits + 16 selects the gzip wrapper, plain selects zlib
+      int bits = xf->encoding == ENC_GZIP ? 15 + 16 : 15;
+      if (deflateInit2(&xf->zs, xf->level, Z_DEFLATED, bits, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    } else {
+      // windowBits + 32 auto-detects gzip and zlib wrappers
+      if (inflateInit2(&xf->zs, 15 + 32) != Z_OK)
+        return -1;
+    }
+    return 0;
+
+  case ENC_BR:
+    if (xf->compress) {
+      xf->br_enc = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+      if (xf->br_enc == NULL)
+        return -1;
+      BrotliEncoderSetParameter(xf->br_enc, BROTLI_PARAM_QUALITY, xf->level);
+      BrotliEncoderSetParameter(xf->br_enc, BROTLI_PARAM_MODE,
+                                BROTLI_MODE_TEXT);
+    } else {
+      xf->br_dec = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+      if (xf->br_dec == NULL)
+        return -1;
+    }
+    return 0;
+
+  default:
+    return -1;
+  }
+}
+
+static int send_chunk(OutBuf *dest, unsigned char *data, const size_t len) {
+  if (len == 0)
+    return 0;
+
+  char prefix[CHUNK_PREFIX_LEN + 1];
+  int prefix_len = snprintf(prefix, sizeof prefix, "%zx\r\n", len);
+  memcpy(data - prefix_len, prefix, prefix_len);
+  data[len] = '\r';
+  data[len + 1] = '\n';
+
+  return outbuf_write(dest, data - prefix_len, prefix_len + len + 2);
+}
+
+/*
+ * Run `len` bytes through the codec, sending every filled output buffer to
+ * the client as one chunk. `op` selects whether the codec may buffer input
+ * (PROCESS), must emit everything it has so far (FLUSH) or must terminate the
+ * stream (FINISH).
+ */
+static int codec_run(Transform *xf, OutBuf *dest, const unsigned char *in,
+                     size_t len, const int op) {
+  unsigned char buf[CHUNK_PREFIX_LEN + COMPRESS_OUT_LEN + 2];
+  unsigned char *out = buf + CHUNK_PREFIX_LEN;
+  bool more = true;
+
+  while (more) {
+    size_t avail_out = COMPRESS_OUT_LEN;
+    long long start = thread_cpu_ns();
+
+    if (xf->encoding != ENC_BR) {
+      xf->zs.next_in = (Bytef *)in;
+      xf->zs.avail_in = len;
+      xf->zs.next_out = out;
+      xf->zs.avail_out = avail_out;
+
+      int ret;
+      if (xf->compress) {
+        int flush = op == CODEC_FINISH  ? Z_FINISH
+                    : op == CODEC_FLUSH ? Z_SYNC_FLUSH
+                                        : Z_NO_FLUSH;
+        ret = deflate(&xf->zs, flush);
+        more = op == CODEC_FINISH ? ret != Z_STREAM_END
+                                  : xf->zs.avail_out == 0;
+      } else {
+        ret = inflate(&xf->zs, Z_NO_FLUSH);
+        if (ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_NEED_DICT) {
+          LOG(ERR, xf->zs.msg, "Failed to inflate %s body",
+              encoding_name(xf->encoding));
+          return -1;
+        }
+        more = ret != Z_STREAM_END && xf->zs.avail_out == 0;
+      }
+
+      if (ret == Z_STREAM_ERROR)
+        return -1;
+
+      in = xf->zs.next_in;
+      len = xf->zs.avail_in;
+      avail_out = xf->zs.avail_out;
+    } else if (xf->compress) {
+      BrotliEncoderOperation operation =
+          op == CODEC_FINISH  ? BROTLI_OPERATION_FINISH
+          : op == CODEC_FLUSH ? BROTLI_OPERATION_FLUSH
+                              : BROTLI_OPERATION_PROCESS;
+      uint8_t *next_out = out;
+      if (!BrotliEncoderCompressStream(xf->br_enc, operation, &len, &in,
+                                       &avail_out, &next_out, NULL))
+        return -1;
+
+      more = len > 0 || BrotliEncoderHasMoreOutput(xf->br_enc);
+      if (op == CODEC_FINISH)
+        more = !BrotliEncoderIsFinished(xf->br_enc);
+    } else {
+      uint8_t *next_out = out;
+      BrotliDecoderResult ret = BrotliDecoderDecompressStream(
+          xf->br_dec, &len, &in, &avail_out, &next_out, NULL);
+      if (ret == BROTLI_DECODER_RESULT_ERROR) {
+        LOG(ERR,
+            BrotliDecoderErrorString(BrotliDecoderGetErrorCode(xf->br_dec)),
+            "Failed to decode br body");
+        return -1;
+      }
+      more = ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+    }
+
+    xf->cpu_ns += thread_cpu_ns() - start;
+
+    size_t produced = COMPRESS_OUT_LEN - avail_out;
+    xf->bytes_out += produced;
+    if (send_chunk(dest, out, produced) == -1) {
+      LOG(ERR, NULL, "Couldn't forward bytes to client");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int write_header(char *dst, const size_t cap, size_t *off,
+                        const char *key, const char *value) {
+  int n = snprintf(dst + *off, cap - *off, "%s: %s\r\n", key, value);
+  if (n < 0 || (size_t)n >= cap - *off)
+    return -1;
+  *off += n;
+  return 0;
+}
+
+static int send_headers(const Transform *xf, OutBuf *dest,
+                        const Response *res) {
+  size_t cap = res->header_size + 256, off = 0;
+  char *headers = (char *)malloc(cap);
+  if (headers == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for rewritten headers");
+    return -1;
+  }
+
+  off = snprintf(headers, cap, "%s %s %s\r\n", res->version, res->status_code,
+                 res->reason_phrase);
+
+  bool has_vary = false;
+  for (size_t i = 0; i < res->headers_count; i++) {
+    const char *key = res->headers[i].key;
+    const char *value = res->headers[i].value;
+    char buf[MAX_HTTP_LEN + 32];
+
+    if (strcasecmp(key, "Content-Length") == 0 ||
+        strcasecmp(key, "Transfer-Encoding") == 0 ||
+        strcasecmp(key, "Content-Encoding") == 0)
+      continue;
+
+    // The representation changes, so a strong validator no longer holds
+    if (strcasecmp(key, "ETag") == 0 && value[0] == '"') {
+      snprintf(buf, sizeof buf, "W/%s", value);
+      value = buf;
+    }
+
+    if (xf->compress && strcasecmp(key, "Vary") == 0) {
+      has_vary = true;
+      if (strcasestr(value, "Accept-Encoding") == NULL &&
+          strcmp(value, "*") != 0) {
+        snprintf(buf, sizeof buf, "%.*s, Accept-Encoding", MAX_HTTP_LEN,
+                 value);
+        value = buf;
+      }
+    }
+
+    if (write_header(headers, cap, &off, key, value) == -1)
+      goto overflow;
+  }
+
+  if (xf->compress) {
+    if (!has_vary &&
+        write_header(headers, cap, &off, "Vary", "Accept-Encoding") == -1)
+      goto overflow;
+    if (write_header(headers, cap, &off, "Content-Encoding",
+                     encoding_name(xf->encoding)) == -1)
+      goto overflow;
+  }
+
+  if (write_header(headers, cap, &off, "Transfer-Encoding", "chunked") == -1 ||
+      off + 2 >= cap)
+    goto overflow;
+  memcpy(headers + off, "\r\n", 2);
+  off += 2;
+
+  int status = outbuf_write(dest, (unsigned char *)headers, off);
+  if (status == -1)
+    LOG(ERR, NULL, "Couldn't forward bytes to client");
+
+  free(headers);
+  return status;
+
+overflow:
+  LOG(ERR, NULL, "Rewritten response headers don't fit");
+  free(headers);
+  return -1;
+}
+
+int transform_start(Transform *xf, OutBuf *dest, const Response *res) {
+  xf->active = false;
+  if (!xf->chunked_ok || res->status_code == NULL)
+    return 0;
+
+  long status = strtol(res->status_code, NULL, 10);
+  if (status < 200 || status >= 300 || status == 206)
+    return 0;
+
+  const char *cache_control =
+      get_header_value("Cache-Control", res->headers, res->headers_count);
+  if ((cache_control != NULL && strcasestr(cache_control, "no-transform")) ||
+      get_header_value("Content-Range", res->headers, res->headers_count))
+    return 0;
+
+  // Without Accept-Encoding, any coding is acceptable (RFC 9110 12.5.3)
+  if (xf->any_coding)
+    return 0;
+
+  BodyFraming framing;
+  body_framing_init(&framing, res, xf->is_head);
+  if (framing.kind == BODY_NONE)
+    return 0;
+
+  encoding_t origin = content_encoding_of(res->content_encoding);
+  if (origin == ENC_IDENTITY) {
+    if (!is_compressible(res) ||
+        (framing.kind == BODY_LENGTH && framing.remaining < COMPRESS_MIN_SIZE))
+      return 0;
+
+    if (xf->accepted & ENC_BR)
+      xf->encoding = ENC_BR;
+    else if (xf->accepted & ENC_GZIP)
+      xf->encoding = ENC_GZIP;
+    else if (xf->accepted & ENC_DEFLATE)
+      xf->encoding = ENC_DEFLATE;
+    else
+      return 0;
+
+    xf->compress = true;
+    xf->level = adaptive_level(xf->encoding);
+  } else if (origin != ENC_UNKNOWN && !(xf->accepted & origin)) {
+    xf->encoding = origin;
+    xf->compress = false;
+    xf->level = 0;
+  } else {
+    return 0;
+  }
+
+  xf->framing = framing;
+  xf->bytes_in = 0;
+  xf->bytes_out = 0;
+  xf->cpu_ns = 0;
+
+  if (codec_init(xf) == -1) {
+    LOG(ERR, NULL, "Failed to initialize %s codec",
+        encoding_name(xf->encoding));
+    transform_end(xf);
+    return -1;
+  }
+  xf->active = true;
+
+  if (send_headers(xf, dest, res) == -1)
+    return -1;
+
+  LOG(DBG, NULL, "%s response body with %s (level %d)",
+      xf->compress ? "Compressing" : "Decompressing",
+      encoding_name(xf->encoding), xf->level);
+  return 1;
+}
+
+static int send_last_chunk(OutBuf *dest) {
+  const char *last_chunk = "0\r\n\r\n";
+  if (outbuf_write(dest, (const unsigned char *)last_chunk, 5) == -1) {
+    LOG(ERR, NULL, "Couldn't forward bytes to client");
+    return -1;
+  }
+  return 0;
+}
+
+int transform_finish(Transform *xf, OutBuf *dest) {
+  if (!xf->active)
+    return 0;
+
+  if (xf->compress && codec_run(xf, dest, NULL, 0, CODEC_FINISH) == -1)
+    return -1;
+
+  return send_last_chunk(dest);
+}
+
+int transform_feed(Transform *xf, OutBuf *dest, unsigned char *in,
+                   const size_t len) {
+  size_t consumed = 0;
+  long payload = body_framing_feed(&xf->framing, in, len, in, &consumed);
+  if (payload == -1) {
+    LOG(ERR, NULL, "Malformed chunked body from server");
+    return -1;
+  }
+  xf->bytes_in += payload;
+
+  int op = xf->framing.done ? CODEC_FINISH : CODEC_FLUSH;
+  if (!xf->compress)
+    op = CODEC_PROCESS;
+
+  if ((payload > 0 || op == CODEC_FINISH) &&
+      codec_run(xf, dest, in, payload, op) == -1)
+    return -1;
+
+  if (!xf->framing.done)
+    return 0;
+
+  if (send_last_chunk(dest) == -1)
+    return -1;
+  return 1;
+}
+
+void transform_end(Transform *xf) {
+  if (xf->encoding == ENC_GZIP || xf->encoding == ENC_DEFLATE) {
+    if (xf->compress)
+      deflateEnd(&xf->zs);
+    else
+      inflateEnd(&xf->zs);
+  }
+
+  if (xf->br_enc != NULL) {
+    BrotliEncoderDestroyInstance(xf->br_enc);
+    xf->br_enc = NULL;
+  }
+
+  if (xf->br_dec != NULL) {
+    BrotliDecoderDestroyInstance(xf->br_dec);
+    xf->br_dec = NULL;
+  }
+
+  if (xf->active) {
+    atomic_fetch_add(xf->compress ? &stat_responses : &stat_decoded, 1);
+    atomic_fetch_add(&stat_bytes_in, xf->bytes_in);
+    atomic_fetch_add(&stat_bytes_out, xf->bytes_out);
+    atomic_fetch_add(&stat_cpu_ns, xf->cpu_ns);
+
+    double ns_per_byte =
+        xf->bytes_in ? (double)xf->cpu_ns / (double)xf->bytes_in : 0;
+    if (xf->compress) {
+      size_t saved =
+          xf->bytes_in > xf->bytes_out ? xf->bytes_in - xf->bytes_out : 0;
+      atomic_fetch_add(&stat_bytes_saved, saved);
+      LOG(INFO, NULL,
+          "Compressed body with %s (level %d): %zu -> %zu Bytes, %zu Bytes "
+          "saved, %.2f ns/Byte",
+          encoding_name(xf->encoding), xf->level, xf->bytes_in, xf->bytes_out,
+          saved, ns_per_byte);
+    } else {
+      LOG(INFO, NULL, "Decompressed %s body: %zu -> %zu Bytes, %.2f ns/Byte",
+          encoding_name(xf->encoding), xf->bytes_in, xf->bytes_out,
+          ns_per_byte);
+    }
+  }
+
+  xf->active = false;
+  xf->encoding = ENC_IDENTITY;
+}
+
+void compress_get_stats(CompressStats *stats) {
+  stats->responses = atomic_load(&stat_responses);
+  stats->decoded = atomic_load(&stat_decoded);
+  stats->bytes_in = atomic_load(&stat_bytes_in);
+  stats->bytes_out = atomic_load(&stat_bytes_out);
+  stats->bytes_saved = atomic_load(&stat_bytes_saved);
+  stats->cpu_ns = atomic_load(&stat_cpu_ns);
+}
+
+void compress_log_stats(void) {
+  CompressStats stats;
+  compress_get_stats(&stats);
+  LOG(INFO, NULL,
+      "Compression: %llu responses compressed, %llu decompressed, %llu "
+      "Bytes saved, %.1f ns of CPU per Byte in",
+      stats.responses, stats.decoded, stats.bytes_saved,
+      stats.bytes_in > 0 ? (double)stats.cpu_ns / stats.bytes_in : 0.0);
+}
@@ -0,0 +1,111 @@
+#include <limits.h>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "common.h"
+#include "deadline.h"
+#include "metrics.h"
+
+static const char *phase_names[DEADLINE_PHASES] = {
+    [DEADLINE_HEADER] = "header",     [DEADLINE_IDLE] = "idle",
+    [DEADLINE_CONNECT] = "connect",   [DEADLINE_RESPONSE] = "response",
+    [DEADLINE_TRANSFER] = "transfer",
+};
+
+static unsigned int limits_s[DEADLINE_PHASES] = {
+    [DEADLINE_HEADER] = DEFAULT_HEADER_TIMEOUT_S,
+    [DEADLINE_IDLE] = DEFAULT_IDLE_TIMEOUT_S,
+    [DEADLINE_CONNECT] = DEFAULT_CONNECT_TIMEOUT_S,
+    [DEADLINE_RESPONSE] = DEFAULT_RESPONSE_TIMEOUT_S,
+    [DEADLINE_TRANSFER] = DEFAULT_TRANSFER_TIMEOUT_S,
+};
+
+int deadline_configure(const char *spec) {
+  unsigned int limits[DEADLINE_PHASES];
+  memcpy(limits, limits_s, sizeof(limits));
+
+  while (*spec != '\0') {
+    const char *equal = strchr(spec, '=');
+    if (equal == NULL)
+      return -1;
+
+    int phase = 0;
+    size_t len = equal - spec;
+    while (phase < DEADLINE_PHASES &&
+           (strlen(phase_names[phase]) != len ||
+            strncmp(phase_names[phase], spec, len) != 0))
+      phase++;
+    if (phase == DEADLINE_PHASES)
+      return -1;
+
+    char *end = NULL;
+    unsigned long seconds = strtoul(equal + 1, &end, 10);
+    if (end == equal + 1 || (*end != ',' && *end != '\0') ||
+        seconds > UINT_MAX / 1000)
+      return -1;
+
+    limits[phase] = seconds;
+    spec = *end == ',' ? end + 1 : end;
+  }
+
+  memcpy(limits_s, limits, sizeof(limits));
+  return 0;
+}
+
+/* Runs on the timer thread, the handler may be blocked on the socket */
+static uint64_t expire(Timer *timer) {
+  Deadline *deadline = (Deadline *)timer;
+  uint64_t limit_ns = limits_s[deadline->phase] * 1000000000ULL;
+  uint64_t elapsed_ns =
+      clock_now_ns() -
+      atomic_load_explicit(&deadline->active_ns, memory_order_relaxed);
+
+  // Touched since armed: wait for what's left rather than re-arming each time
+  if (elapsed_ns < limit_ns)
+    return (limit_ns - elapsed_ns + 999999) / 1000000;
+
+  atomic_store_explicit(&deadline->expired, true, memory_order_release);
+  metrics_add(METRIC_TIMEOUT_HEADER + deadline->phase, 1);
+
+  // The client may still be sent a 408. Shutting both ways wakes up poll()
+  // whatever it waits for.
+  shutdown(deadline->fd,
+           deadline->phase == DEADLINE_HEADER ? SHUT_RD : SHUT_RDWR);
+  return 0;
+}
+
+void deadline_init(Deadline *deadline) {
+  timer_init(&deadline->timer, expire);
+  deadline->fd = -1;
+  deadline->phase = DEADLINE_HEADER;
+  atomic_init(&deadline->expired, false);
+  atomic_init(&deadline->active_ns, 0);
+}
+
+void deadline_start(Deadline *deadline, const deadline_phase_t phase,
+                    const int fd) {
+  // Not pending any more, expire() can't be looking at the fields
+  timer_cancel(&deadline->timer);
+  deadline->phase = phase;
+  deadline->fd = fd;
+  atomic_store_explicit(&deadline->expired, false, memory_order_relaxed);
+  deadline_touch(deadline);
+
+  if (limits_s[phase] > 0)
+    timer_arm(&deadline->timer, limits_s[phase] * 1000ULL);
+}
+
+void deadline_stop(Deadline *deadline) { timer_cancel(&deadline->timer); }
+
+void deadline_touch(Deadline *deadline) {
+  atomic_store_explicit(&deadline->active_ns, clock_now_ns(),
+                        memory_order_relaxed);
+}
+
+bool deadline_expired(Deadline *deadline) {
+  return atomic_load_explicit(&deadline->expired, memory_order_acquire);
+}
+
+const char *deadline_phase_name(const deadline_phase_t phase) {
+  return phase_names[phase];
+}
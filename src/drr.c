@@ -0,0 +1,219 @@
+#include <netinet/in.h>
+
+#include "common.h"
+#include "drr.h"
+
+DrrScheduler scheduler = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+typedef struct Abandon {
+  DrrScheduler *sched;
+  DrrFlow *flow;
+  DrrWaiter *waiter;
+} Abandon;
+
+static uint64_t flow_key(const struct sockaddr *addr) {
+  const void *ip = NULL;
+  size_t len = 0;
+  if (addr->sa_family == AF_INET) {
+    ip = &((const struct sockaddr_in *)addr)->sin_addr;
+    len = sizeof(struct in_addr);
+  } else if (addr->sa_family == AF_INET6) {
+    ip = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+    len = sizeof(struct in6_addr);
+  }
+
+  const unsigned char *bytes = (const unsigned char *)ip;
+  uint64_t h = 0xcbf29ce484222325ULL ^ addr->sa_family; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ bytes[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static void unlink_flow(DrrScheduler *sched, DrrFlow *flow) {
+  DrrFlow **p = &sched->flows[flow->key & (DRR_BUCKETS - 1)];
+  while (*p != flow)
+    p = &(*p)->next_hash;
+  *p = flow->next_hash;
+  free(flow);
+}
+
+/* Move the head of the round to its back */
+static void rotate(DrrScheduler *sched, DrrFlow *flow) {
+  if (flow->next_active == NULL)
+    return; // Alone in the round
+  sched->round_head = flow->next_active;
+  flow->next_active = NULL;
+  sched->round_tail->next_active = flow;
+  sched->round_tail = flow;
+}
+
+/*
+ * Grant turns while slots are free. Called with the lock held. A turn's bytes
+ * are only known once it ends, so a flow is granted one per visit: a client
+ * with many ready connections can't take every free slot before the others
+ * get theirs.
+ */
+static void dispatch(DrrScheduler *sched) {
+  while (sched->free_slots > 0 && sched->round_head != NULL) {
+    DrrFlow *flow = sched->round_head;
+
+    if (flow->head == NULL) {
+      // Nothing waiting, the flow leaves the round and loses its credit
+      sched->round_head = flow->next_active;
+      if (sched->round_head == NULL)
+        sched->round_tail = NULL;
+      flow->active = false;
+      flow->deficit = 0;
+      if (flow->refs == 0)
+        unlink_flow(sched, flow);
+      continue;
+    }
+
+    if (flow->deficit <= 0) {
+      // Out of credit: refill it and move to the back of the round
+      flow->deficit += sched->quantum;
+      sched->rounds++;
+      rotate(sched, flow);
+      continue;
+    }
+
+    DrrWaiter *waiter = flow->head;
+    flow->head = waiter->next;
+    if (flow->head == NULL)
+      flow->tail = NULL;
+
+    waiter->granted = true;
+    sched->free_slots--;
+    sched->turns++;
+    pthread_cond_signal(&waiter->cond);
+    rotate(sched, flow);
+  }
+}
+
+/* Withdraw a request whose thread was cancelled while waiting */
+static void abandon(void *arg) {
+  Abandon *a = (Abandon *)arg;
+
+  if (a->waiter->granted) {
+    a->sched->free_slots++;
+  } else {
+    DrrWaiter **p = &a->flow->head;
+    DrrWaiter *prev = NULL;
+    while (*p != a->waiter) {
+      prev = *p;
+      p = &(*p)->next;
+    }
+    *p = a->waiter->next;
+    if (a->flow->tail == a->waiter)
+      a->flow->tail = prev;
+  }
+
+  dispatch(a->sched);
+  pthread_mutex_unlock(&a->sched->lock);
+  pthread_cond_destroy(&a->waiter->cond);
+}
+
+void drr_init(DrrScheduler *sched, const size_t quantum, const int slots) {
+  sched->quantum = quantum;
+  sched->free_slots = slots > 0 ? slots : 1;
+  if (quantum > 0)
+    LOG(INFO, NULL, "Fair scheduling: %zu Bytes per round, %d concurrent turns",
+        quantum, sched->free_slots);
+}
+
+DrrFlow *drr_join(DrrScheduler *sched, const struct sockaddr *addr) {
+  if (sched->quantum == 0 ||
+      (addr->sa_family != AF_INET && addr->sa_family != AF_INET6))
+    return NULL;
+
+  uint64_t key = flow_key(addr);
+  pthread_mutex_lock(&sched->lock);
+
+  DrrFlow *flow = sched->flows[key & (DRR_BUCKETS - 1)];
+  while (flow != NULL && flow->key != key)
+    flow = flow->next_hash;
+
+  if (flow == NULL) {
+    flow = (DrrFlow *)calloc(1, sizeof(DrrFlow));
+    if (flow == NULL) {
+      LOG(ERR, NULL, "Failed to allocate memory for a scheduler flow");
+      pthread_mutex_unlock(&sched->lock);
+      return NULL; // The connection runs unscheduled
+    }
+    flow->key = key;
+    flow->next_hash = sched->flows[key & (DRR_BUCKETS - 1)];
+    sched->flows[key & (DRR_BUCKETS - 1)] = flow;
+  }
+  flow->refs++;
+
+  pthread_mutex_unlock(&sched->lock);
+  return flow;
+}
+
+void drr_part(DrrScheduler *sched, DrrFlow *flow) {
+  if (flow == NULL)
+    return;
+
+  pthread_mutex_lock(&sched->lock);
+  if (--flow->refs == 0 && !flow->active)
+    unlink_flow(sched, flow);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void drr_enter(DrrScheduler *sched, DrrFlow *flow) {
+  if (flow == NULL)
+    return;
+
+  DrrWaiter waiter = {.granted = false, .next = NULL};
+  pthread_cond_init(&waiter.cond, NULL);
+  Abandon a = {sched, flow, &waiter};
+
+  pthread_mutex_lock(&sched->lock);
+  if (flow->tail != NULL)
+    flow->tail->next = &waiter;
+  else
+    flow->head = &waiter;
+  flow->tail = &waiter;
+
+  if (!flow->active) {
+    flow->active = true;
+    flow->next_active = NULL;
+    if (sched->round_tail != NULL)
+      sched->round_tail->next_active = flow;
+    else
+      sched->round_head = flow;
+    sched->round_tail = flow;
+  }
+  dispatch(sched);
+
+  pthread_cleanup_push(abandon, &a);
+  while (!waiter.granted)
+    pthread_cond_wait(&waiter.cond, &sched->lock);
+  pthread_cleanup_pop(0);
+
+  pthread_mutex_unlock(&sched->lock);
+  pthread_cond_destroy(&waiter.cond);
+}
+
+void drr_leave(DrrScheduler *sched, DrrFlow *flow, const size_t bytes) {
+  if (flow == NULL)
+    return;
+
+  pthread_mutex_lock(&sched->lock);
+  flow->deficit -= bytes;
+  sched->free_slots++;
+  dispatch(sched);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void drr_log_stats(DrrScheduler *sched) {
+  if (sched->quantum == 0)
+    return;
+
+  pthread_mutex_lock(&sched->lock);
+  unsigned long long turns = sched->turns, rounds = sched->rounds;
+  pthread_mutex_unlock(&sched->lock);
+
+  LOG(INFO, NULL, "Fair scheduling: %llu turns granted, %llu credit refills",
+      turns, rounds);
+}
@@ -0,0 +1,185 @@
+#include <stdatomic.h>
+
+#include "common.h"
+#include "dump.h"
+#include "sample.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define SEPARATOR                                                              \
+  STYLE_DIM "\n####################################\n\n" STYLE_NO_DIM
+
+bool dump_enabled = false;
+
+static double sample_rate = 1.0;
+static const char *host_filter = NULL;
+static const char *uri_filter = NULL;
+
+static void write_dumps(WriteNode *batch);
+
+static WriteQueue queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                           .cond = PTHREAD_COND_INITIALIZER,
+                           .max_count = DUMP_QUEUE_MAX,
+                           .write = write_dumps};
+
+static atomic_ulong dumped;
+static atomic_ulong dropped;
+
+static void print_hex(FILE *out, const unsigned char *buffer,
+                      const size_t buffer_len) {
+  static const char digits[] = "0123456789ABCDEF";
+  char line[32 * 3 + 1];
+
+  // Rows of 32 Bytes, each as two hex digits followed by a space
+  for (size_t i = 0; i < buffer_len; i += 32) {
+    size_t row = MIN(buffer_len - i, (size_t)32), n = 0;
+    for (size_t j = 0; j < row; j++) {
+      line[n++] = digits[buffer[i + j] >> 4];
+      line[n++] = digits[buffer[i + j] & 0xf];
+      line[n++] = ' ';
+    }
+    line[n++] = '\n';
+    fwrite(line, 1, n, out);
+  }
+}
+
+static void print_record(FILE *out, const DumpRecord *rec) {
+  fputs(SEPARATOR, out);
+  fprintf(out, STYLE_BOLD "------ %s (Header Size: %zu Bytes): \n",
+          rec->kind == DUMP_REQUEST ? "Request" : "Response", rec->head_len);
+
+  // The head as received, minus the carriage returns and the blank line
+  size_t head_len = rec->head_len >= 2 ? rec->head_len - 2 : 0;
+  for (size_t i = 0; i < head_len; i++)
+    if (rec->data[i] != '\r')
+      putc_unlocked(rec->data[i], out);
+
+  fprintf(out, "\n------ Body (Body Size: %zu Bytes%s", rec->body_size,
+          rec->is_chunked ? ", chunked" : "");
+  if (rec->body_len < rec->body_size)
+    fprintf(out, ", first %zu shown", rec->body_len);
+  fputs("): \n" STYLE_NO_BOLD, out);
+
+  const unsigned char *body = rec->data + rec->head_len;
+  if (rec->body_len == 0)
+    fputs(STYLE_BOLD "No Body!\n" STYLE_NO_BOLD, out);
+  else if (rec->is_text)
+    fprintf(out, "%.*s\n", (int)rec->body_len, body);
+  else
+    print_hex(out, body, rec->body_len);
+
+  fputs(SEPARATOR, out);
+}
+
+static void write_dumps(WriteNode *batch) {
+  flockfile(stdout);
+  while (batch != NULL) {
+    DumpRecord *rec = (DumpRecord *)batch;
+    batch = batch->next;
+    print_record(stdout, rec);
+    free(rec);
+  }
+  fflush(stdout);
+  funlockfile(stdout);
+}
+
+int dump_start(const double sample, const char *host, const char *uri) {
+  if (!(sample > 0 && sample <= 1)) {
+    LOG(ERR, NULL, "Dump sample must be in (0, 1], got %g", sample);
+    return -1;
+  }
+
+  sample_rate = sample;
+  host_filter = host;
+  uri_filter = uri;
+
+  if (writeq_start(&queue) == -1) {
+    LOG(ERR, NULL, "Failed to create the dump writer thread");
+    return -1;
+  }
+
+  dump_enabled = true;
+  LOG(INFO, NULL, "Dumping %g%% of the requests%s%s%s%s", sample * 100,
+      host ? " to hosts matching " : "", host ? host : "",
+      uri ? " for URIs matching " : "", uri ? uri : "");
+  return 0;
+}
+
+bool dump_select(const char *host, const char *uri) {
+  if (host_filter != NULL && (host == NULL || !strcasestr(host, host_filter)))
+    return false;
+  if (uri_filter != NULL && (uri == NULL || !strstr(uri, uri_filter)))
+    return false;
+  return sample_rate >= 1 || sample_random() < sample_rate;
+}
+
+/* Copy the head and the start of the body, and hand them to the writer */
+static void capture(DumpRecord *tmpl, const unsigned char *raw,
+                    const size_t len, const size_t header_size) {
+  size_t head_len = MIN(header_size, len);
+  size_t body_len = MIN(len - head_len, (size_t)DUMP_BODY_MAX);
+
+  // Reserve the slot, the copy is made outside the lock
+  if (!writeq_reserve(&queue, 0, false)) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  DumpRecord *rec = (DumpRecord *)malloc(sizeof(DumpRecord) + head_len +
+                                         body_len);
+  if (rec == NULL) {
+    writeq_cancel(&queue, 0);
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  *rec = *tmpl;
+  rec->node.bytes = 0;
+  rec->head_len = head_len;
+  rec->body_len = body_len;
+  memcpy(rec->data, raw, head_len + body_len);
+
+  writeq_push(&queue, &rec->node);
+
+  atomic_fetch_add_explicit(&dumped, 1, memory_order_relaxed);
+}
+
+void dump_request(const Request *req, const unsigned char *raw,
+                  const size_t len) {
+  DumpRecord tmpl = {
+      .kind = DUMP_REQUEST,
+      .is_text = (req->is_text || req->content_type == NULL) &&
+                 req->content_encoding == NULL,
+      .is_chunked = req->is_chunked,
+      .body_size = req->body_size,
+  };
+  capture(&tmpl, raw, len, req->header_size);
+}
+
+void dump_response(const Response *res, const unsigned char *raw,
+                   const size_t len) {
+  DumpRecord tmpl = {
+      .kind = DUMP_RESPONSE,
+      .is_text = (res->is_text || res->content_type == NULL) &&
+                 res->content_encoding == NULL,
+      .is_chunked = res->is_chunked,
+      .body_size = res->body_size,
+  };
+  capture(&tmpl, raw, len, res->header_size);
+}
+
+void dump_log_stats(void) {
+  if (!dump_enabled)
+    return;
+
+  LOG(INFO, NULL, "Dump: %lu messages dumped, %lu dropped",
+      atomic_load(&dumped), atomic_load(&dropped));
+}
+
+void dump_stop(void) {
+  if (!dump_enabled)
+    return;
+
+  writeq_stop(&queue);
+  dump_enabled = false;
+}
@@ -1,11 +1,33 @@
+#include <arpa/inet.h>
+
 #include "handler.h"
+#include "bufpool.h"
+#include "clock.h"
 #include "common.h"
+#include "metrics.h"
+#include "park.h"
+#include "probes.h"
+#include "proxy.h"
+#include "responses.h"
 
-static void cleanup(void *arg) {
-  ConnInfo *info = (ConnInfo *)arg;
+__thread uint64_t probe_conn_id = 0;
+
+void conn_end_turn(ConnInfo *info) {
+  if (!info->in_turn)
+    return;
+
+  drr_leave(&scheduler, info->flow, info->turn_bytes);
+  info->in_turn = false;
+}
+
+void conn_close(ConnInfo *info) {
   if (info == NULL)
     return;
 
+  conn_end_turn(info); // Cancelled in the middle of one
+  deadline_stop(&info->deadline); // Before the socket it watches is closed
+  outbuf_free(&info->out[0]);
+  outbuf_free(&info->out[1]);
   if (info->fds[0].fd != -1) { // close client fd
     close(info->fds[0].fd);
     info->fds[0].fd = -1;
@@ -16,60 +38,301 @@ static void cleanup(void *arg) {
     info->fds[1].fd = -1;
   }
 
+  exchange_end(&info->exchange);
+  if (capture_enabled)
+    capture_close(info->id, info->capture_lost);
+  metrics_add(METRIC_CONN_CLOSED, 1);
+  metrics_state(CONN_STATE_NONE);
+  PROBE(conn_close, info->id);
+  transform_end(&info->xf);
+  drr_part(&scheduler, info->flow);
+  info->flow = NULL;
   free_req(&info->req);
   free_res(&info->res);
+  bufpool_put(info->rx, info->rx_cap);
+  free(info);
 }
 
-void *handler(void *arg) {
-  ConnInfo info = {.fds = {{0}, {0}}, .req = NULL, .res = NULL};
-  bool is_TLS = false;
+/* Cancelled while draining, the slot is given back too */
+static void cancelled(void *arg) {
+  conn_close((ConnInfo *)arg);
+  remove_thread(pthread_self());
+}
+
+/*
+ * Request, response and receive buffer of a connection starting or resuming
+ * in a thread
+ */
+static int attach(ConnInfo *info) {
+  if (info->req == NULL) {
+    info->req = (Request *)calloc(1, sizeof(Request));
+    if (info->req == NULL) {
+      LOG(ERR, NULL, "Failed to allocate memory to request struct");
+      return -1;
+    }
+  }
+
+  if (info->res == NULL) {
+    info->res = (Response *)calloc(1, sizeof(Response));
+    if (info->res == NULL) {
+      LOG(ERR, NULL, "Failed to allocate memory to response struct");
+      return -1;
+    }
+  }
+
+  if (info->rx == NULL) {
+    info->rx = (unsigned char *)bufpool_get(MAX_HTTP_LEN, &info->rx_cap);
+    if (info->rx == NULL)
+      return -1;
+  }
+
+  // A tunnel resuming keeps adding its bytes to the host and client it had
+  if (info->top_host[0] != '\0')
+    metrics_top_resume(info->top_host, info->client, &info->top);
+
+  return 0;
+}
+
+/* Parking: nothing is parsed between messages, the next one starts afresh */
+static void detach(ConnInfo *info) {
+  free_req(&info->req);
+  free_res(&info->res);
+  bufpool_put(info->rx, info->rx_cap);
+  info->rx = NULL;
+  // The entries belong to this thread's sketches, attach() finds them again
+  // in the next one's
+  info->top.host = info->top.client = NULL;
+}
+
+/*
+ * Between requests, a tunnel never is. A connection accepted just before the
+ * drain gets to send its first request.
+ */
+static bool is_idle(const ConnInfo *info) {
+  return info->served && !info->is_TLS && !info->awaiting &&
+         !info->req->is_partial && !info->req->is_chunked &&
+         !outbuf_pending(&info->out[0]);
+}
+
+/*
+ * Nothing in flight either way and no pause to wait out: only the peers can
+ * move the connection on, the park thread can wait for them. Not while
+ * draining, idle connections close instead.
+ */
+static bool is_quiet(const ConnInfo *info) {
+  return !info->awaiting && !info->req->is_partial && !info->req->is_chunked &&
+         !outbuf_pending(&info->out[0]) && !outbuf_pending(&info->out[1]) &&
+         info->shaper.resume_ns[SHAPER_CLIENT] == 0 &&
+         info->shaper.resume_ns[SHAPER_SERVER] == 0 &&
+         info->fds[2].fd != -1 && !proxy_stopping();
+}
+
+/*
+ * Poll for what each side can take. Besides shaping pauses, a full output
+ * buffer stops the reads of the side feeding it, and a client still being
+ * sent a response it no longer waits on sends its next request once that's
+ * out (responses stay in order). Returns the poll timeout.
+ */
+static int arm_events(ConnInfo *info) {
+  for (int side = 0; side < 2; side++)
+    info->fds[side].events =
+        POLLIN | (outbuf_pending(&info->out[side]) ? POLLOUT : 0);
+  int timeout = shaper_arm(&info->shaper, info->fds, TIMEOUT);
+
+  if (info->out[1].full ||
+      (!info->is_TLS && !info->awaiting && outbuf_pending(&info->out[0])))
+    info->fds[0].events &= ~POLLIN;
+  if (info->out[0].full)
+    info->fds[1].events &= ~POLLIN;
+  return timeout;
+}
+
+/* Send the output buffers along, a side that took bytes wasn't stalled */
+static int flush(ConnInfo *info) {
+  for (int side = 0; side < 2; side++) {
+    if (info->fds[side].fd == -1 || !(info->fds[side].revents & POLLOUT))
+      continue;
+
+    long sent = outbuf_flush(&info->out[side]);
+    if (sent == -1) {
+      LOG(ERR, NULL, "Couldn't forward bytes to %s",
+          side == 0 ? "client" : "server");
+      return -1;
+    }
+    if (sent > 0)
+      deadline_touch(&info->deadline);
+  }
+
+  return 0;
+}
+
+/*
+ * Closing: what's still queued for the client (e.g. a body delimited by the
+ * upstream closing) is sent first, until the client stalls for the transfer
+ * limit.
+ */
+static void flush_client(ConnInfo *info) {
+  OutBuf *out = &info->out[0];
+  if (!outbuf_pending(out) || deadline_expired(&info->deadline))
+    return;
+
+  deadline_start(&info->deadline, DEADLINE_TRANSFER, info->fds[0].fd);
+  struct pollfd pfd = {.fd = info->fds[0].fd, .events = POLLOUT};
+  while (outbuf_pending(out) && poll(&pfd, 1, TIMEOUT) == 1 &&
+         !deadline_expired(&info->deadline)) {
+    long sent = outbuf_flush(out);
+    if (sent == -1)
+      break;
+    if (sent > 0)
+      deadline_touch(&info->deadline);
+  }
+}
 
-  info.fds[0].fd = *(int *)arg;
-  info.fds[0].events = POLLIN;
+/*
+ * The deadline shut a socket down. A client still waiting for its request to
+ * be read, or for a response that hasn't started, is told why, unless bytes
+ * of an earlier response are still on their way.
+ */
+static void timed_out(ConnInfo *info) {
+  deadline_phase_t phase = info->deadline.phase;
+  LOG(INFO, NULL, "Connection timed out (%s)", deadline_phase_name(phase));
 
-  info.fds[1].fd = -1;
-  info.fds[1].events = POLLIN;
+  response_t response = RESPONSE_COUNT;
+  if (phase == DEADLINE_HEADER)
+    response = RESPONSE_REQUEST_TIMEOUT;
+  else if ((phase == DEADLINE_CONNECT || phase == DEADLINE_RESPONSE) &&
+           info->exchange.rec.phase_us[PHASE_FIRST_BYTE] == ACCESS_NO_PHASE) {
+    response = RESPONSE_GATEWAY_TIMEOUT;
+    info->exchange.rec.status = 504;
+  }
 
-  info.req = (Request *)malloc(sizeof(Request));
-  if (info.req == NULL) {
-    LOG(ERR, NULL, "Failed to allocate memory to request struct");
-    close(info.fds[0].fd);
+  if (response == RESPONSE_COUNT || outbuf_pending(&info->out[0]))
+    return;
+  if (send_response(info->fds[0].fd, response) == -1)
+    LOG(ERR, NULL, "Couldn't forward bytes to client");
+}
+
+ConnInfo *conn_open(const int fd) {
+  static atomic_ulong next_id = 1;
+  ConnInfo *info = (ConnInfo *)calloc(1, sizeof(ConnInfo));
+  if (info == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory to connection struct");
     return NULL;
   }
-  memset(info.req, 0, sizeof(Request));
 
-  info.res = (Response *)malloc(sizeof(Response));
-  if (info.res == NULL) {
-    LOG(ERR, NULL, "Failed to allocate memory to request struct");
-    free(info.req);
-    close(info.fds[0].fd);
+  info->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+  info->accepted_ns = clock_precise_ns();
+  metrics_add(METRIC_CONN_ACCEPTED, 1);
+  info->fds[0].fd = fd;
+  outbuf_init(&info->out[0], fd);
+  outbuf_init(&info->out[1], -1);
+  info->out[0].spill_at = config.buffer_bytes;
+  PROBE(conn_accept, info->id, fd);
+  if (capture_enabled)
+    capture_open(info->id, &info->capture_lost);
+  info->fds[1].fd = -1;
+
+  info->fds[2].fd = proxy_drain_fd();
+  info->fds[2].events = POLLIN;
+
+  socklen_t peer_len = sizeof info->peer;
+  if (getpeername(fd, (struct sockaddr *)&info->peer, &peer_len) == -1)
+    info->peer.ss_family = AF_UNSPEC; // Not rate limited
+
+  const void *addr = NULL;
+  if (info->peer.ss_family == AF_INET)
+    addr = &((struct sockaddr_in *)&info->peer)->sin_addr;
+  else if (info->peer.ss_family == AF_INET6)
+    addr = &((struct sockaddr_in6 *)&info->peer)->sin6_addr;
+  if (addr == NULL || inet_ntop(info->peer.ss_family, addr, info->client,
+                                sizeof(info->client)) == NULL)
+    strcpy(info->client, "unknown");
+
+  shaper_init(&info->shaper);
+  info->flow = drr_join(&scheduler, (struct sockaddr *)&info->peer);
+  deadline_init(&info->deadline);
+  deadline_start(&info->deadline, DEADLINE_HEADER, fd);
+  return info;
+}
+
+void *handler(void *arg) {
+  ConnInfo *info = (ConnInfo *)arg;
+  probe_conn_id = info->id;
+  metrics_state(info->is_TLS ? CONN_STATE_TUNNEL : CONN_STATE_READING);
+  if (attach(info) == -1) {
+    conn_close(info);
+    remove_thread(pthread_self());
     return NULL;
   }
-  memset(info.res, 0, sizeof(Response));
 
-  pthread_cleanup_push(cleanup, &info);
+  bool parked = false;
+  pthread_cleanup_push(cancelled, info);
   while (1) {
     pthread_testcancel();
-    int nfds = info.fds[1].fd != -1 ? 2 : 1;
-    int events = poll(info.fds, nfds, TIMEOUT);
-    if (events <= 0) {
-      if (events == -1)
-        LOG(ERR, NULL, "Failed to poll for events");
-      if (events == 0)
-        LOG(INFO, NULL, "Connection timeout!");
+    // Sockets not open (-1) are skipped by poll()
+    int timeout = arm_events(info);
+    bool quiet = is_quiet(info);
+    if (quiet && timeout > (int)config.park_after_ms)
+      timeout = config.park_after_ms;
+
+    int events = poll(info->fds, 3, timeout);
+    if (events == 0 && quiet) {
+      // Quiet for a while: the thread and the buffers are given back
+      detach(info);
+      if (park(info) == 0) {
+        parked = true;
+        break;
+      }
+      if (attach(info) == -1)
+        break;
+      continue;
+    }
+    if (events == 0)
+      continue; // Woke up to resume reading a paused side
+
+    if (events == -1) {
+      LOG(ERR, NULL, "Failed to poll for events");
       break;
     }
 
-    if (info.fds[0].revents & POLLIN)
-      if (client_handler(info.fds, info.req, &is_TLS) == -1)
-        break;
+    if (deadline_expired(&info->deadline)) {
+      timed_out(info);
+      break;
+    }
 
-    if (info.fds[1].fd != -1 && (info.fds[1].revents & POLLIN))
-      if (server_handler(info.fds, info.res, &is_TLS) == -1)
-        break;
+    drr_enter(&scheduler, info->flow);
+    info->in_turn = true;
+    info->turn_bytes = 0;
+
+    // Hang-ups are still handled while a side is paused
+    int status = flush(info);
+    if (status != -1 && info->fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      status = client_handler(info);
+
+    if (status != -1 && info->fds[1].fd != -1 &&
+        (info->fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+      status = server_handler(info);
+
+    conn_end_turn(info);
+    if (status == -1) {
+      if (deadline_expired(&info->deadline)) // While connecting
+        timed_out(info);
+      break;
+    }
+
+    // Draining: the pipe stays readable, it's no longer polled once noticed
+    if (info->fds[2].revents & POLLIN)
+      info->fds[2].fd = -1;
+    if (info->fds[2].fd == -1 && is_idle(info)) {
+      LOG(INFO, NULL, "Closing the connection to drain");
+      break;
+    }
   }
 
-  cleanup(&info);
+  if (!parked) {
+    flush_client(info);
+    conn_close(info);
+  }
   pthread_cleanup_pop(0);
   remove_thread(pthread_self());
   return NULL;
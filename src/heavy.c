@@ -0,0 +1,161 @@
+#include "common.h"
+#include "heavy.h"
+
+/* Entry as read from a sketch, with the sketch's lightest count */
+typedef struct HeavyRead {
+  HeavyStat stat;
+  uint64_t floor;
+} HeavyRead;
+
+/* FNV-1a over the part of the key that is kept, never 0 */
+static uint32_t hash_key(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; key[i] != '\0' && i < HEAVY_KEY_LEN - 1; i++)
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  return hash != 0 ? hash : 1;
+}
+
+void heavy_bump(HeavyEntry *entry, const uint64_t weight) {
+  if (entry == NULL)
+    return;
+
+  // Only the owner writes, no read-modify-write instruction is needed
+  atomic_store_explicit(
+      &entry->count,
+      atomic_load_explicit(&entry->count, memory_order_relaxed) + weight,
+      memory_order_relaxed);
+}
+
+HeavyEntry *heavy_add(HeavySketch *sketch, const char *key,
+                      const uint64_t weight) {
+  uint32_t hash = hash_key(key);
+  HeavyEntry *unused = NULL, *lightest = NULL;
+  uint64_t lightest_count = UINT64_MAX;
+
+  for (int i = 0; i < HEAVY_CAPACITY; i++) {
+    HeavyEntry *entry = &sketch->entries[i];
+    if (entry->hash == 0) {
+      if (unused == NULL)
+        unused = entry;
+      continue;
+    }
+
+    if (entry->hash == hash &&
+        strncmp(entry->key, key, HEAVY_KEY_LEN - 1) == 0) {
+      heavy_bump(entry, weight);
+      return entry;
+    }
+
+    uint64_t count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+    if (count < lightest_count) {
+      lightest = entry;
+      lightest_count = count;
+    }
+  }
+
+  // The newcomer may have been the lightest key all along
+  HeavyEntry *entry = unused != NULL ? unused : lightest;
+  uint64_t inherited = unused != NULL ? 0 : lightest_count;
+
+  unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+  atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  entry->hash = hash;
+  strncpy(entry->key, key, HEAVY_KEY_LEN - 1);
+  entry->key[HEAVY_KEY_LEN - 1] = '\0';
+  atomic_store_explicit(&entry->count, inherited + weight,
+                        memory_order_relaxed);
+  atomic_store_explicit(&entry->error, inherited, memory_order_relaxed);
+  atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+  return entry;
+}
+
+/* Copy the used entries of a sketch, returning how many there were */
+static size_t read_sketch(HeavySketch *sketch, HeavyRead *out) {
+  size_t used = 0;
+  uint64_t floor = UINT64_MAX;
+
+  for (int i = 0; i < HEAVY_CAPACITY; i++) {
+    HeavyEntry *entry = &sketch->entries[i];
+    HeavyStat *stat = &out[used].stat;
+    unsigned int before, after;
+    uint32_t hash;
+    do {
+      before = atomic_load_explicit(&entry->seq, memory_order_acquire);
+      hash = entry->hash;
+      memcpy(stat->key, entry->key, sizeof(stat->key));
+      stat->count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+      stat->error = atomic_load_explicit(&entry->error, memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      after = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    if (hash == 0)
+      continue;
+    stat->key[sizeof(stat->key) - 1] = '\0';
+    if (stat->count < floor)
+      floor = stat->count;
+    used++;
+  }
+
+  // Keys missing from a sketch that isn't full were never seen by it
+  if (used < HEAVY_CAPACITY)
+    floor = 0;
+  for (size_t i = 0; i < used; i++)
+    out[i].floor = floor;
+  return used;
+}
+
+static int by_key(const void *a, const void *b) {
+  return strcmp(((const HeavyRead *)a)->stat.key,
+                ((const HeavyRead *)b)->stat.key);
+}
+
+static int by_count(const void *a, const void *b) {
+  uint64_t x = ((const HeavyRead *)a)->stat.count;
+  uint64_t y = ((const HeavyRead *)b)->stat.count;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+size_t heavy_merge(HeavySketch *const *sketches, const size_t n,
+                   HeavyStat *top, const size_t k) {
+  HeavyRead *all = (HeavyRead *)malloc(n * HEAVY_CAPACITY * sizeof(*all));
+  if (all == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory to merge the sketches");
+    return 0;
+  }
+
+  size_t count = 0;
+  uint64_t floors = 0; // Weight a key missing everywhere may have
+  for (size_t i = 0; i < n; i++) {
+    size_t used = read_sketch(sketches[i], all + count);
+    if (used > 0)
+      floors += all[count].floor;
+    count += used;
+  }
+
+  // Add the entries of each key up, and the floors of the sketches missing it
+  qsort(all, count, sizeof(*all), by_key);
+  size_t merged = 0;
+  for (size_t i = 0; i < count;) {
+    HeavyRead sum = all[i];
+    uint64_t present_floors = all[i].floor;
+    size_t j = i + 1;
+    for (; j < count && strcmp(all[j].stat.key, sum.stat.key) == 0; j++) {
+      sum.stat.count += all[j].stat.count;
+      sum.stat.error += all[j].stat.error;
+      present_floors += all[j].floor;
+    }
+    sum.stat.count += floors - present_floors;
+    sum.stat.error += floors - present_floors;
+    all[merged++] = sum;
+    i = j;
+  }
+
+  qsort(all, merged, sizeof(*all), by_count);
+  size_t kept = merged < k ? merged : k;
+  for (size_t i = 0; i < kept; i++)
+    top[i] = all[i].stat;
+  free(all);
+  return kept;
+}
@@ -1,12 +1,46 @@
+#include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 
+#include "accesslog.h"
+#include "admin.h"
+#include "blocklist.h"
+#include "bufpool.h"
+#include "capture.h"
+#include "clock.h"
 #include "common.h"
+#include "compress.h"
+#include "deadline.h"
+#include "drr.h"
+#include "dump.h"
+#include "metrics.h"
+#include "park.h"
 #include "proxy.h"
+#include "ratelimit.h"
+#include "rcu.h"
+#include "responses.h"
+#include "shaper.h"
+#include "timer.h"
+#include "trace.h"
+#include "tui.h"
+#include "upgrade.h"
+#include "urlfilter.h"
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_t thread_pool[MAX_THREADS] = {0};
 int thread_count = 0;
 
+Config config = {.port = NULL,
+                 .blocklist = DEFAULT_BLOCKLIST,
+                 .blocked_page = DEFAULT_BLOCKED_PAGE,
+                 .url_patterns = DEFAULT_URL_PATTERNS,
+                 .v4_prefix = DEFAULT_V4_PREFIX,
+                 .v6_prefix = DEFAULT_V6_PREFIX,
+                 .trace_slow_ms = DEFAULT_TRACE_SLOW_MS,
+                 .trace_sample = 1,
+                 .drain_s = DEFAULT_DRAIN_S,
+                 .park_after_ms = DEFAULT_PARK_AFTER_MS};
+
 static void print_banner(void) {
   printf("$$\\   $$\\ $$$$$$$$\\ $$$$$$$$\\ $$$$$$$\\\n");
   printf("$$ |  $$ |\\__$$  __|\\__$$  __|$$  __$$\\\n");
@@ -33,52 +67,543 @@ static void print_banner(void) {
          "  \\______/\n");
 }
 
-static void stop_exec(int sig_num) {
-  (void)sig_num;
-  const char *msg = "Closing the proxy server...";
-  write(1, STYLE_BOLD, strlen(STYLE_BOLD));
-  write(1, MSG_COLOR, strlen(MSG_COLOR));
-  write(1, msg, strlen(msg));
-  write(1, RESET, strlen(RESET));
-
-  // cancel handler threads before, the proxy server
-  pthread_mutex_lock(&lock);
-  for (int i = MAX_THREADS - 1; i >= 0; i--) {
-    if (thread_pool[i] != 0)
-      pthread_cancel(thread_pool[i]);
+/* Move a file aside, the open stream keeps writing to it under its new name */
+static bool set_aside(const char *path, char *old, const size_t size) {
+  if (path == NULL)
+    return false;
+  snprintf(old, size, "%s.%d", path, (int)getpid());
+  return rename(path, old) == 0;
+}
+
+/*
+ * Start the new binary on the listeners, then drain. The trace and the
+ * capture are reopened by the new process, so this one's are moved aside.
+ */
+static void hot_upgrade(void) {
+  if (proxy_stopping()) {
+    LOG(WARN, NULL, "Already draining, not upgrading");
+    return;
+  }
+  if (config.tui) {
+    LOG(WARN, NULL, "Hot upgrades aren't supported with the TUI");
+    return;
+  }
+
+  char old_trace[PATH_MAX], old_capture[PATH_MAX];
+  bool trace_moved = set_aside(config.trace, old_trace, sizeof(old_trace));
+  bool capture_moved =
+      set_aside(config.capture, old_capture, sizeof(old_capture));
+
+  if (upgrade_exec(proxy_listener(), admin_listener()) == -1) {
+    if (trace_moved)
+      rename(old_trace, config.trace);
+    if (capture_moved)
+      rename(old_capture, config.capture);
+    return;
+  }
+
+  admin_stop();
+  LOG(INFO, NULL, "Draining for up to %us", config.drain_s);
+  proxy_stop();
+}
+
+/*
+ * Signals are blocked in every thread and handled here synchronously, so the
+ * reload can allocate and log like any other code. New tables are built on
+ * this thread and swapped in without stalling the connection handlers.
+ * SIGUSR1 logs the compression, rate limiting, shaping, scheduling, dump,
+ * capture, access log, trace, timer, parking, buffer pool and logging
+ * counters. SIGINT and SIGTERM drain the connections, a second one closes
+ * those left; SIGUSR2 hands the listeners to a new process first.
+ */
+static void *signal_loop(void *arg) {
+  sigset_t *set = (sigset_t *)arg;
+
+  while (1) {
+    int sig_num = 0;
+    if (sigwait(set, &sig_num) != 0)
+      continue;
+
+    if (sig_num == SIGHUP) {
+      LOG(INFO, NULL, "Received SIGHUP, reloading");
+      if (blocklist_reload(config.blocklist) == -1)
+        LOG(WARN, NULL, "Failed to reload, keeping the previous blocklist");
+      if (urlfilter_reload(config.url_patterns) == -1)
+        LOG(WARN, NULL, "Failed to reload, keeping the previous URL filter");
+      if (responses_reload() == -1)
+        LOG(WARN, NULL, "Failed to reload, keeping the previous responses");
+    } else if (sig_num == SIGUSR1) {
+      compress_log_stats();
+      ratelimit_log_stats(&conn_limit);
+      ratelimit_log_stats(&request_limit);
+      ratelimit_log_stats(&bandwidth_limit);
+      shaper_log_stats();
+      drr_log_stats(&scheduler);
+      dump_log_stats();
+      capture_log_stats();
+      accesslog_log_stats();
+      trace_log_stats();
+      timer_log_stats();
+      park_log_stats();
+      bufpool_log_stats();
+      metrics_log_top();
+      LOG(INFO, NULL, "Logger: %lu messages dropped", logger_dropped());
+    } else if (sig_num == SIGUSR2) {
+      LOG(INFO, NULL, "Received SIGUSR2, upgrading");
+      hot_upgrade();
+    } else if (!proxy_stopping()) {
+      LOG(INFO, NULL, "Received %s, draining for up to %us",
+          sig_num == SIGINT ? "SIGINT" : "SIGTERM", config.drain_s);
+      proxy_stop();
+    } else {
+      LOG(INFO, NULL, "Received %s again, closing the connections left",
+          sig_num == SIGINT ? "SIGINT" : "SIGTERM");
+      proxy_drain_abort();
+    }
   }
-  pthread_mutex_unlock(&lock);
+
+  return NULL;
 }
 
 static void init_sig_handler(void) {
-  struct sigaction sa;
+  static sigset_t signal_set;
+  sigemptyset(&signal_set);
+  sigaddset(&signal_set, SIGHUP);
+  sigaddset(&signal_set, SIGUSR1);
+  sigaddset(&signal_set, SIGUSR2);
+  sigaddset(&signal_set, SIGINT);
+  sigaddset(&signal_set, SIGTERM);
 
-  sa.sa_handler = stop_exec;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = SA_RESTART;
-
-  if (sigaction(SIGINT, &sa, NULL) == -1) {
-    LOG(ERR, NULL, "Failed to initialize signal handler");
+  // Threads created from now on inherit the mask
+  pthread_t tid;
+  if (pthread_sigmask(SIG_BLOCK, &signal_set, NULL) != 0 ||
+      pthread_create(&tid, NULL, signal_loop, &signal_set) != 0) {
+    LOG(ERR, NULL, "Failed to initialize the signal thread");
     exit(EXIT_FAILURE);
   }
+  pthread_detach(tid);
+}
+
+static void print_usage(const char *prog) {
+  LOG(INFO, NULL, "USAGE: %s [OPTIONS] PORT", prog);
+  printf("Options:\n"
+         "  -b, --blocklist FILE     Blocked domains, one per line (default: "
+         "%s)\n"
+         "  -p, --blocked-page FILE  Page sent for blocked hosts (default: "
+         "%s)\n"
+         "  -u, --url-patterns FILE  URL substrings to block or tag (default: "
+         "%s)\n"
+         "  -r, --rate RATE[:BURST]  Requests per second per client (default: "
+         "off)\n"
+         "  -c, --conn-rate RATE[:BURST]\n"
+         "                           New connections per second per client "
+         "(default: off)\n"
+         "  -m, --cidr V4[:V6]       Prefix lengths of the networks sharing a "
+         "limit\n"
+         "                           (default: %d:%d)\n"
+         "  -s, --shape RATE[:BURST] Bytes per second relayed per connection "
+         "(default: off)\n"
+         "  -S, --client-shape RATE[:BURST]\n"
+         "                           Bytes per second relayed per client "
+         "(default: off)\n"
+         "  -q, --fair-quantum BYTES Serve clients in deficit round robin, "
+         "BYTES per\n"
+         "                           round (default: off)\n"
+         "  -w, --fair-slots N       Connections relaying at the same time "
+         "when\n"
+         "                           scheduling (default: one per CPU)\n"
+         "  -d, --dump FRACTION      Dump this fraction of the requests and "
+         "their\n"
+         "                           responses, 1 for all (default: off)\n"
+         "  -H, --dump-host TEXT     Only dump requests to hosts containing "
+         "TEXT\n"
+         "                           (alone, every such request is dumped)\n"
+         "  -U, --dump-uri TEXT      Only dump requests for URIs containing "
+         "TEXT\n"
+         "  -a, --access-log PREFIX  Write a binary access log to "
+         "PREFIX.NNNNNN files\n"
+         "                           (decode with build/tools/access_decode)\n"
+         "  -A, --admin [HOST:]PORT  Serve Prometheus metrics on "
+         "/metrics (HOST\n"
+         "                           defaults to 127.0.0.1)\n"
+         "  -t, --trace FILE         Write the slow requests to FILE in the "
+         "Chrome\n"
+         "                           trace-event format (default: off)\n"
+         "  -T, --trace-slow MS[:FRACTION]\n"
+         "                           Trace this fraction of the requests "
+         "taking\n"
+         "                           MS or more (default: %d:1)\n"
+         "  -L, --log FILE           Append the log to FILE instead of stdout\n"
+         "  -i, --tui                Show a live view of the proxy, logging to "
+         "%s\n"
+         "                           unless -L is given\n"
+         "  -k, --top-every SECONDS  Log the busiest hosts and clients every "
+         "SECONDS\n"
+         "                           (default: off, also logged on SIGUSR1)\n"
+         "  -C, --capture FILE       Record the plain HTTP traffic to FILE\n"
+         "                           for build/bench/load/replay\n"
+         "  -o, --upstream HOST:PORT Send every request to HOST:PORT,\n"
+         "                           whatever its Host (default: off)\n"
+         "  -D, --drain SECONDS      Time given to the requests in flight on\n"
+         "                           SIGINT, SIGTERM or SIGUSR2 (default: %u)\n"
+         "  -O, --timeouts PHASE=SECONDS[,...]\n"
+         "                           Time limits of the header, idle, "
+         "connect,\n"
+         "                           response and transfer phases, 0 for none\n"
+         "                           (default: header=%d,idle=%d,connect=%d,\n"
+         "                           response=%d,transfer=%d)\n"
+         "  -B, --buffer BYTES       Read responses as fast as the upstream "
+         "sends,\n"
+         "                           keeping BYTES in memory and the rest in "
+         "a\n"
+         "                           temp file, and close the upstream once "
+         "read\n"
+         "                           (default: off)\n"
+         "  -K, --park-after MS      Hand connections quiet for MS to the "
+         "park\n"
+         "                           thread, freeing their thread and "
+         "buffers\n"
+         "                           (default: %d)\n"
+         "  -G, --huge-pages         Back the buffer pool with huge pages\n"
+         "  -h, --help               Show this message\n",
+         DEFAULT_BLOCKLIST, DEFAULT_BLOCKED_PAGE,
+         DEFAULT_URL_PATTERNS, DEFAULT_V4_PREFIX, DEFAULT_V6_PREFIX,
+         DEFAULT_TRACE_SLOW_MS, DEFAULT_TUI_LOG, DEFAULT_DRAIN_S,
+         DEFAULT_HEADER_TIMEOUT_S, DEFAULT_IDLE_TIMEOUT_S,
+         DEFAULT_CONNECT_TIMEOUT_S, DEFAULT_RESPONSE_TIMEOUT_S,
+         DEFAULT_TRANSFER_TIMEOUT_S, DEFAULT_PARK_AFTER_MS);
+}
+
+static int parse_cidr(const char *spec) {
+  char *end = NULL;
+  long v4 = strtol(spec, &end, 10), v6 = config.v6_prefix;
+  if (end == spec || v4 < 0 || v4 > 32)
+    return -1;
+
+  if (*end == ':') {
+    spec = end + 1;
+    v6 = strtol(spec, &end, 10);
+    if (end == spec || v6 < 0 || v6 > 128)
+      return -1;
+  }
+
+  config.v4_prefix = v4;
+  config.v6_prefix = v6;
+  return *end == '\0' ? 0 : -1;
+}
+
+static int parse_trace_slow(const char *spec) {
+  char *end = NULL;
+  unsigned long ms = strtoul(spec, &end, 10);
+  double sample = config.trace_sample;
+  if (end == spec || ms > UINT_MAX)
+    return -1;
+
+  if (*end == ':') {
+    spec = end + 1;
+    sample = strtod(spec, &end);
+    if (end == spec || !(sample > 0) || sample > 1)
+      return -1;
+  }
+
+  config.trace_slow_ms = ms;
+  config.trace_sample = sample;
+  return *end == '\0' ? 0 : -1;
+}
+
+static int parse_args(int argc, char **argv) {
+  static const struct option options[] = {
+      {"blocklist", required_argument, NULL, 'b'},
+      {"blocked-page", required_argument, NULL, 'p'},
+      {"url-patterns", required_argument, NULL, 'u'},
+      {"rate", required_argument, NULL, 'r'},
+      {"conn-rate", required_argument, NULL, 'c'},
+      {"cidr", required_argument, NULL, 'm'},
+      {"shape", required_argument, NULL, 's'},
+      {"client-shape", required_argument, NULL, 'S'},
+      {"fair-quantum", required_argument, NULL, 'q'},
+      {"fair-slots", required_argument, NULL, 'w'},
+      {"dump", required_argument, NULL, 'd'},
+      {"dump-host", required_argument, NULL, 'H'},
+      {"dump-uri", required_argument, NULL, 'U'},
+      {"access-log", required_argument, NULL, 'a'},
+      {"admin", required_argument, NULL, 'A'},
+      {"trace", required_argument, NULL, 't'},
+      {"trace-slow", required_argument, NULL, 'T'},
+      {"log", required_argument, NULL, 'L'},
+      {"tui", no_argument, NULL, 'i'},
+      {"top-every", required_argument, NULL, 'k'},
+      {"capture", required_argument, NULL, 'C'},
+      {"upstream", required_argument, NULL, 'o'},
+      {"drain", required_argument, NULL, 'D'},
+      {"timeouts", required_argument, NULL, 'O'},
+      {"buffer", required_argument, NULL, 'B'},
+      {"park-after", required_argument, NULL, 'K'},
+      {"huge-pages", no_argument, NULL, 'G'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  char *end = NULL;
+  while ((opt = getopt_long(argc, argv,
+                            "b:p:u:r:c:m:s:S:q:w:d:H:U:a:A:t:T:L:ik:C:o:D:O:B:"
+                            "K:Gh",
+                            options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      config.blocklist = optarg;
+      break;
+    case 'p':
+      config.blocked_page = optarg;
+      break;
+    case 'u':
+      config.url_patterns = optarg;
+      break;
+    case 'r':
+      if (ratelimit_parse(optarg, &config.request_rate,
+                          &config.request_burst) == -1)
+        return -1;
+      break;
+    case 'c':
+      if (ratelimit_parse(optarg, &config.conn_rate, &config.conn_burst) == -1)
+        return -1;
+      break;
+    case 'm':
+      if (parse_cidr(optarg) == -1)
+        return -1;
+      break;
+    case 's':
+      if (ratelimit_parse(optarg, &config.shape_rate, &config.shape_burst) ==
+          -1)
+        return -1;
+      break;
+    case 'S':
+      if (ratelimit_parse(optarg, &config.client_shape_rate,
+                          &config.client_shape_burst) == -1)
+        return -1;
+      break;
+    case 'q':
+      config.fair_quantum = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0')
+        return -1;
+      break;
+    case 'w':
+      config.fair_slots = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || config.fair_slots <= 0)
+        return -1;
+      break;
+    case 'd':
+      config.dump_sample = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !(config.dump_sample > 0) ||
+          config.dump_sample > 1)
+        return -1;
+      break;
+    case 'H':
+      config.dump_host = optarg;
+      break;
+    case 'U':
+      config.dump_uri = optarg;
+      break;
+    case 'a':
+      config.access_log = optarg;
+      break;
+    case 'A':
+      config.admin = optarg;
+      break;
+    case 't':
+      config.trace = optarg;
+      break;
+    case 'T':
+      if (parse_trace_slow(optarg) == -1)
+        return -1;
+      break;
+    case 'L':
+      config.log_file = optarg;
+      break;
+    case 'i':
+      config.tui = true;
+      break;
+    case 'k': {
+      unsigned long seconds = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || seconds == 0 || seconds > UINT_MAX)
+        return -1;
+      config.top_every = seconds;
+      break;
+    }
+    case 'C':
+      config.capture = optarg;
+      break;
+    case 'o':
+      if (strchr(optarg, ':') == NULL)
+        return -1;
+      config.upstream = optarg;
+      break;
+    case 'D': {
+      unsigned long seconds = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || seconds > UINT_MAX)
+        return -1;
+      config.drain_s = seconds;
+      break;
+    }
+    case 'O':
+      if (deadline_configure(optarg) == -1)
+        return -1;
+      break;
+    case 'B':
+      config.buffer_bytes = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || config.buffer_bytes == 0)
+        return -1;
+      break;
+    case 'K': {
+      unsigned long ms = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || ms > INT_MAX)
+        return -1;
+      config.park_after_ms = ms;
+      break;
+    }
+    case 'G':
+      config.huge_pages = true;
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (optind != argc - 1)
+    return -1;
+
+  // A filter alone dumps every matching request
+  if (config.dump_sample == 0 && (config.dump_host || config.dump_uri))
+    config.dump_sample = 1;
+
+  // The view would be drawn over the log lines
+  if (config.tui && config.log_file == NULL)
+    config.log_file = DEFAULT_TUI_LOG;
+
+  config.port = argv[optind];
+  return 0;
 }
 
 int main(int argc, char **argv) {
   print_banner();
-  if (argc != 2) {
-    LOG(INFO, NULL, "USAGE: %s PORT", argv[0]);
+  if (parse_args(argc, argv) == -1) {
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
+  if (config.log_file != NULL) {
+    FILE *log = fopen(config.log_file, "a");
+    if (log == NULL) {
+      LOG(ERR, NULL, "Failed to open log file %s", config.log_file);
+      return EXIT_FAILURE;
+    }
+    LOG(INFO, NULL, "Logging to %s", config.log_file);
+    logger_set_output(log); // Open until exit
+  }
+
   init_sig_handler();
+  bufpool_init(config.huge_pages);
+  if (logger_start() == -1)
+    LOG(WARN, NULL, "Failed to start the log writer, logging synchronously");
+
+  // Started by a hot upgrade: the listeners come from the previous process
+  int proxy_fd = -1, admin_fd = -1;
+  upgrade_init(argv);
+  if (upgrade_receive(&proxy_fd, &admin_fd) == -1)
+    return EXIT_FAILURE;
+  if (config.admin == NULL && admin_fd != -1)
+    close(admin_fd);
+
+  if (config.dump_sample > 0 &&
+      dump_start(config.dump_sample, config.dump_host, config.dump_uri) == -1)
+    return EXIT_FAILURE;
+
+  if (config.access_log != NULL && accesslog_open(config.access_log) == -1)
+    return EXIT_FAILURE;
+
+  if (config.capture != NULL && capture_start(config.capture) == -1)
+    return EXIT_FAILURE;
+  if (config.upstream != NULL)
+    LOG(INFO, NULL, "Sending every request to %s", config.upstream);
+
+  if (config.admin != NULL && admin_start(config.admin, admin_fd) == -1)
+    return EXIT_FAILURE;
+
+  if (config.trace != NULL &&
+      trace_open(config.trace, config.trace_slow_ms, config.trace_sample) ==
+          -1)
+    return EXIT_FAILURE;
+
+  if (config.top_every > 0 && metrics_top_start(config.top_every) == -1)
+    return EXIT_FAILURE;
+
+  if (config.fair_slots == 0)
+    config.fair_slots = sysconf(_SC_NPROCESSORS_ONLN);
+  drr_init(&scheduler, config.fair_quantum, config.fair_slots);
 
-  if (pthread_create(&thread_pool[thread_count++], NULL, proxy, argv[1]) != 0) {
+  if (clock_start() == -1 || timer_start() == -1 ||
+      ratelimit_init(&conn_limit, "connections", config.conn_rate,
+                     config.conn_burst, RATELIMIT_TOKEN_SCALE,
+                     config.v4_prefix, config.v6_prefix) == -1 ||
+      ratelimit_init(&request_limit, "requests", config.request_rate,
+                     config.request_burst, RATELIMIT_TOKEN_SCALE,
+                     config.v4_prefix, config.v6_prefix) == -1 ||
+      ratelimit_init(&bandwidth_limit, "client bandwidth",
+                     config.client_shape_rate, config.client_shape_burst, 1,
+                     config.v4_prefix, config.v6_prefix) == -1) {
+    ratelimit_free(&conn_limit);
+    ratelimit_free(&request_limit);
+    ratelimit_free(&bandwidth_limit);
+    return EXIT_FAILURE;
+  }
+
+  if (blocklist_reload(config.blocklist) == -1)
+    LOG(WARN, NULL, "Running without a blocklist");
+  if (urlfilter_reload(config.url_patterns) == -1)
+    LOG(WARN, NULL, "Running without URL filtering");
+
+  if (responses_init(config.blocked_page) == -1) {
+    LOG(ERR, NULL, "Failed to build the static responses");
+    blocklist_free(rcu_publish(blocklist, NULL));
+    urlfilter_free(rcu_publish(urlfilter, NULL));
+    ratelimit_free(&conn_limit);
+    ratelimit_free(&request_limit);
+    ratelimit_free(&bandwidth_limit);
+    return EXIT_FAILURE;
+  }
+
+  if (config.tui && tui_start(config.log_file) == -1)
+    LOG(WARN, NULL, "Running without the TUI");
+
+  if (proxy_listen(config.port, proxy_fd) == -1 || park_start() == -1 ||
+      pthread_create(&thread_pool[thread_count++], NULL, proxy, NULL) != 0) {
     LOG(ERR, NULL, "Failed to create proxy server thread");
+    responses_cleanup();
+    blocklist_free(rcu_publish(blocklist, NULL));
+    urlfilter_free(rcu_publish(urlfilter, NULL));
+    ratelimit_free(&conn_limit);
+    ratelimit_free(&request_limit);
+    ratelimit_free(&bandwidth_limit);
     pthread_mutex_destroy(&lock);
     return EXIT_FAILURE;
   }
 
+  upgrade_ready();
+
   pthread_join(thread_pool[PROXY_TID_INDEX], NULL);
+  proxy_drain(config.drain_s);
+  tui_stop();
+  dump_stop();
+  capture_stop();
+  accesslog_close();
+  trace_close();
+  responses_cleanup();
+  blocklist_free(rcu_publish(blocklist, NULL));
+  urlfilter_free(rcu_publish(urlfilter, NULL));
+  ratelimit_free(&conn_limit);
+  ratelimit_free(&request_limit);
+  ratelimit_free(&bandwidth_limit);
   pthread_mutex_destroy(&lock);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,394 @@
+#include <time.h>
+
+#include "common.h"
+#include "metrics.h"
+
+/* The last slab is shared by the threads that couldn't get one */
+#define SHARED_SLAB METRICS_MAX_THREADS
+
+static MetricsSlab slabs[METRICS_MAX_THREADS + 1];
+
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsSlab *self = NULL;
+
+typedef struct MetricInfo {
+  const char *name;
+  const char *label; // Extra label, NULL if none
+  const char *help;
+} MetricInfo;
+
+static const MetricInfo counter_info[METRIC_COUNTERS] = {
+    [METRIC_CONN_ACCEPTED] = {"httproxy_connections_accepted_total", NULL,
+                              "Connections handed to a handler thread"},
+    [METRIC_CONN_CLOSED] = {"httproxy_connections_closed_total", NULL,
+                            "Connections closed"},
+    [METRIC_CONN_REJECTED] = {"httproxy_connections_refused_total",
+                              "reason=\"busy\"",
+                              "Connections refused at accept"},
+    [METRIC_CONN_THROTTLED] = {"httproxy_connections_refused_total",
+                               "reason=\"throttled\"", NULL},
+    [METRIC_REQUESTS] = {"httproxy_requests_total", NULL, "Requests parsed"},
+    [METRIC_REQ_BAD] = {"httproxy_requests_refused_total",
+                        "reason=\"bad_request\"", "Requests refused"},
+    [METRIC_REQ_BLOCKED] = {"httproxy_requests_refused_total",
+                            "reason=\"blocked\"", NULL},
+    [METRIC_REQ_THROTTLED] = {"httproxy_requests_refused_total",
+                              "reason=\"throttled\"", NULL},
+    [METRIC_UPSTREAM_FAILED] = {"httproxy_upstream_connect_failures_total",
+                                NULL, "Upstream connections that failed"},
+    [METRIC_TIMEOUT_HEADER] = {"httproxy_timeouts_total", "phase=\"header\"",
+                               "Connections closed for running out of time"},
+    [METRIC_TIMEOUT_IDLE] = {"httproxy_timeouts_total", "phase=\"idle\"",
+                             NULL},
+    [METRIC_TIMEOUT_CONNECT] = {"httproxy_timeouts_total",
+                                "phase=\"connect\"", NULL},
+    [METRIC_TIMEOUT_RESPONSE] = {"httproxy_timeouts_total",
+                                 "phase=\"response\"", NULL},
+    [METRIC_TIMEOUT_TRANSFER] = {"httproxy_timeouts_total",
+                                 "phase=\"transfer\"", NULL},
+    [METRIC_BYTES_FROM_CLIENT] = {"httproxy_received_bytes_total",
+                                  "from=\"client\"", "Bytes received"},
+    [METRIC_BYTES_FROM_UPSTREAM] = {"httproxy_received_bytes_total",
+                                    "from=\"upstream\"", NULL},
+    [METRIC_SPILLED_BYTES] = {"httproxy_spilled_bytes_total", NULL,
+                              "Response bytes buffered in a temp file"},
+    [METRIC_UPSTREAM_RELEASED] = {
+        "httproxy_upstream_released_total", NULL,
+        "Upstream connections closed once their response was buffered"},
+};
+
+static const MetricInfo histogram_info[METRIC_HISTOGRAMS] = {
+    [HIST_FIRST_BYTE] = {"httproxy_first_byte_seconds", NULL,
+                         "Connection accepted to first upstream byte"},
+    [HIST_RESOLVE] = {"httproxy_upstream_resolve_seconds", NULL,
+                      "Request parsed to upstream name resolved"},
+    [HIST_CONNECT] = {"httproxy_upstream_connect_seconds", NULL,
+                      "Upstream name resolved to connected"},
+    [HIST_WAIT] = {"httproxy_upstream_wait_seconds", NULL,
+                   "Request sent to first response byte"},
+    [HIST_REQUEST] = {"httproxy_request_duration_seconds", NULL,
+                      "Request arrival to last response byte"},
+};
+
+typedef struct SketchInfo {
+  const char *name;
+  const char *label; // Of the key
+  const char *help;
+  const char *title; // In the log
+} SketchInfo;
+
+static const SketchInfo sketch_info[METRIC_SKETCHES] = {
+    [TOP_HOST_REQUESTS] = {"httproxy_top_host_requests", "host",
+                           "Requests to the busiest upstream hosts",
+                           "host by requests"},
+    [TOP_HOST_BYTES] = {"httproxy_top_host_bytes", "host",
+                        "Bytes relayed for the busiest upstream hosts",
+                        "host by bytes"},
+    [TOP_CLIENT_REQUESTS] = {"httproxy_top_client_requests", "client",
+                             "Requests from the busiest clients",
+                             "client by requests"},
+    [TOP_CLIENT_BYTES] = {"httproxy_top_client_bytes", "client",
+                          "Bytes relayed for the busiest clients",
+                          "client by bytes"},
+};
+
+static const char *const state_names[CONN_STATES] = {
+    [CONN_STATE_NONE] = "none",
+    [CONN_STATE_READING] = "reading",
+    [CONN_STATE_CONNECTING] = "connecting",
+    [CONN_STATE_WAITING] = "waiting",
+    [CONN_STATE_RELAYING] = "relaying",
+    [CONN_STATE_TUNNEL] = "tunnel",
+};
+
+static void release_slab(void *arg) {
+  MetricsSlab *slab = (MetricsSlab *)arg;
+  // The counts stay, the next owner keeps adding to them
+  atomic_store_explicit(&slab->state, CONN_STATE_NONE, memory_order_relaxed);
+  atomic_store_explicit(&slab->used, false, memory_order_release);
+}
+
+static void create_slab_key(void) {
+  if (pthread_key_create(&slab_key, release_slab) != 0) {
+    LOG(ERR, NULL, "Failed to create the metrics slab key");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Claim a slab for the calling thread, released when it exits */
+static MetricsSlab *register_slab(void) {
+  pthread_once(&slab_key_once, create_slab_key);
+
+  for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&slabs[i].used, &expected, true)) {
+      pthread_setspecific(slab_key, &slabs[i]);
+      return &slabs[i];
+    }
+  }
+
+  return &slabs[SHARED_SLAB];
+}
+
+/* Add to a slot, atomically only when the slab is shared */
+static inline void bump(MetricsSlab *slab, atomic_uint_fast64_t *slot,
+                        const uint64_t value) {
+  if (slab == &slabs[SHARED_SLAB]) {
+    atomic_fetch_add_explicit(slot, value, memory_order_relaxed);
+    return;
+  }
+
+  atomic_store_explicit(
+      slot, atomic_load_explicit(slot, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+static int bucket_of(const uint64_t us) {
+  if (us < HIST_SUB)
+    return us;
+
+  int shift = 63 - __builtin_clzll(us) - HIST_SUB_BITS;
+  int index = (shift + 1) * HIST_SUB + ((us >> shift) & (HIST_SUB - 1));
+  return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/* Smallest value that no longer falls in the bucket */
+static uint64_t bucket_limit(const int index) {
+  if (index < HIST_SUB)
+    return index + 1;
+
+  int shift = index / HIST_SUB - 1;
+  return (uint64_t)(HIST_SUB + index % HIST_SUB + 1) << shift;
+}
+
+void metrics_add(const metric_t metric, const uint64_t value) {
+  if (self == NULL)
+    self = register_slab();
+
+  bump(self, &self->counters[metric], value);
+}
+
+void metrics_observe(const histogram_t hist, const uint64_t us) {
+  if (self == NULL)
+    self = register_slab();
+
+  bump(self, &self->buckets[hist][bucket_of(us)], 1);
+  bump(self, &self->sums[hist], us);
+}
+
+void metrics_state(const conn_state_t state) {
+  if (self == NULL)
+    self = register_slab();
+
+  // The shared slab has no single connection to describe
+  if (self != &slabs[SHARED_SLAB])
+    atomic_store_explicit(&self->state, state, memory_order_relaxed);
+}
+
+void metrics_top_request(const char *host, const char *client,
+                         TopEntries *entries) {
+  if (self == NULL)
+    self = register_slab();
+  // The shared slab's sketches would need a lock, its requests go uncounted
+  if (self == &slabs[SHARED_SLAB]) {
+    entries->host = entries->client = NULL;
+    return;
+  }
+
+  HeavySketch *sketches = self->sketches;
+  heavy_add(&sketches[TOP_HOST_REQUESTS], host, 1);
+  heavy_add(&sketches[TOP_CLIENT_REQUESTS], client, 1);
+  entries->host = heavy_add(&sketches[TOP_HOST_BYTES], host, 0);
+  entries->client = heavy_add(&sketches[TOP_CLIENT_BYTES], client, 0);
+}
+
+void metrics_top_resume(const char *host, const char *client,
+                        TopEntries *entries) {
+  if (self == NULL)
+    self = register_slab();
+  if (self == &slabs[SHARED_SLAB]) {
+    entries->host = entries->client = NULL;
+    return;
+  }
+
+  HeavySketch *sketches = self->sketches;
+  entries->host = heavy_add(&sketches[TOP_HOST_BYTES], host, 0);
+  entries->client = heavy_add(&sketches[TOP_CLIENT_BYTES], client, 0);
+}
+
+void metrics_top_bytes(const TopEntries *entries, const uint64_t bytes) {
+  heavy_bump(entries->host, bytes);
+  heavy_bump(entries->client, bytes);
+}
+
+size_t metrics_top(const sketch_t sketch, HeavyStat *top, const size_t k) {
+  HeavySketch *sketches[METRICS_MAX_THREADS];
+  for (int i = 0; i < METRICS_MAX_THREADS; i++)
+    sketches[i] = &slabs[i].sketches[sketch];
+  return heavy_merge(sketches, METRICS_MAX_THREADS, top, k);
+}
+
+/* Write a label value with `\`, `"` and newlines escaped */
+static void put_label(FILE *out, const char *value) {
+  for (; *value != '\0'; value++) {
+    if (*value == '\\' || *value == '"')
+      fputc('\\', out);
+    if (*value == '\n')
+      fputs("\\n", out);
+    else
+      fputc(*value, out);
+  }
+}
+
+void metrics_render_top(FILE *out) {
+  HeavyStat top[METRICS_TOP];
+  for (int s = 0; s < METRIC_SKETCHES; s++) {
+    const SketchInfo *info = &sketch_info[s];
+    size_t count = metrics_top(s, top, METRICS_TOP);
+
+    // Each estimate comes with a family telling how much it may overcount
+    for (int error = 0; error < 2; error++) {
+      const char *suffix = error ? "_error" : "";
+      if (error)
+        fprintf(out, "# HELP %s_error Most %s may overcount by\n", info->name,
+                info->name);
+      else
+        fprintf(out, "# HELP %s %s\n", info->name, info->help);
+      fprintf(out, "# TYPE %s%s gauge\n", info->name, suffix);
+      for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s%s{%s=\"", info->name, suffix, info->label);
+        put_label(out, top[i].key);
+        fprintf(out, "\"} %llu\n",
+                (unsigned long long)(error ? top[i].error : top[i].count));
+      }
+    }
+  }
+}
+
+void metrics_log_top(void) {
+  HeavyStat top[METRICS_TOP];
+  for (int s = 0; s < METRIC_SKETCHES; s++) {
+    size_t count = metrics_top(s, top, METRICS_TOP);
+    for (size_t i = 0; i < count; i++)
+      LOG(INFO, NULL, "Top %s #%zu: %s %llu (+/- %llu)",
+          sketch_info[s].title, i + 1, top[i].key,
+          (unsigned long long)top[i].count,
+          (unsigned long long)top[i].error);
+  }
+}
+
+static void *log_top_loop(void *arg) {
+  struct timespec period = {(time_t)(uintptr_t)arg, 0};
+  while (1) {
+    nanosleep(&period, NULL);
+    metrics_log_top();
+  }
+
+  return NULL;
+}
+
+int metrics_top_start(const unsigned int seconds) {
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, log_top_loop, (void *)(uintptr_t)seconds) !=
+      0) {
+    LOG(ERR, NULL, "Failed to start the heavy hitters thread");
+    return -1;
+  }
+
+  pthread_detach(tid);
+  return 0;
+}
+
+void metrics_snapshot(MetricsSnapshot *snap) {
+  memset(snap, 0, sizeof(MetricsSnapshot));
+
+  for (int i = 0; i <= METRICS_MAX_THREADS; i++) {
+    const MetricsSlab *slab = &slabs[i];
+    int state = atomic_load_explicit(&slab->state, memory_order_relaxed);
+    snap->states[state]++;
+    for (int m = 0; m < METRIC_COUNTERS; m++)
+      snap->counters[m] +=
+          atomic_load_explicit(&slab->counters[m], memory_order_relaxed);
+
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+      snap->sums[h] += atomic_load_explicit(&slab->sums[h],
+                                            memory_order_relaxed);
+      for (int b = 0; b < HIST_BUCKETS; b++) {
+        uint64_t n =
+            atomic_load_explicit(&slab->buckets[h][b], memory_order_relaxed);
+        snap->buckets[h][b] += n;
+        snap->counts[h] += n;
+      }
+    }
+  }
+}
+
+uint64_t metrics_quantile(const MetricsSnapshot *snap, const histogram_t hist,
+                          const double q) {
+  if (snap->counts[hist] == 0)
+    return 0;
+
+  uint64_t rank = q * snap->counts[hist], seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += snap->buckets[hist][b];
+    if (seen > rank)
+      return bucket_limit(b) - 1;
+  }
+  return bucket_limit(HIST_BUCKETS - 1) - 1;
+}
+
+static void render_histogram(FILE *out, const MetricsSnapshot *snap,
+                             const histogram_t hist) {
+  const MetricInfo *info = &histogram_info[hist];
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help,
+          info->name);
+
+  // Exported at powers of two, which the sub-buckets never straddle
+  uint64_t cumulative = 0;
+  int b = 0;
+  for (int exp = 0; exp <= HIST_MAX_EXP; exp++) {
+    uint64_t limit = 1ULL << exp;
+    while (b < HIST_BUCKETS && bucket_limit(b) <= limit)
+      cumulative += snap->buckets[hist][b++];
+    fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", info->name, limit / 1e6,
+            (unsigned long long)cumulative);
+  }
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", info->name,
+          (unsigned long long)snap->counts[hist]);
+  fprintf(out, "%s_sum %g\n%s_count %llu\n", info->name,
+          snap->sums[hist] / 1e6, info->name,
+          (unsigned long long)snap->counts[hist]);
+
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  fprintf(out, "# TYPE %s_quantile gauge\n", info->name);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(*quantiles); i++)
+    fprintf(out, "%s_quantile{quantile=\"%g\"} %g\n", info->name,
+            quantiles[i],
+            metrics_quantile(snap, hist, quantiles[i]) / 1e6);
+}
+
+void metrics_render(FILE *out, const MetricsSnapshot *snap) {
+  for (int m = 0; m < METRIC_COUNTERS; m++) {
+    const MetricInfo *info = &counter_info[m];
+    // Series sharing a name follow the first one, which has the help text
+    if (info->help != NULL)
+      fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", info->name,
+              info->help, info->name);
+    if (info->label != NULL)
+      fprintf(out, "%s{%s} %llu\n", info->name, info->label,
+              (unsigned long long)snap->counters[m]);
+    else
+      fprintf(out, "%s %llu\n", info->name,
+              (unsigned long long)snap->counters[m]);
+  }
+
+  fprintf(out, "# HELP httproxy_connections Connections in each state\n"
+               "# TYPE httproxy_connections gauge\n");
+  for (int s = CONN_STATE_NONE + 1; s < CONN_STATES; s++)
+    fprintf(out, "httproxy_connections{state=\"%s\"} %llu\n", state_names[s],
+            (unsigned long long)snap->states[s]);
+
+  for (int h = 0; h < METRIC_HISTOGRAMS; h++)
+    render_histogram(out, snap, h);
+}
@@ -0,0 +1,349 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "bufpool.h"
+#include "common.h"
+#include "metrics.h"
+#include "outbuf.h"
+#include "probes.h"
+
+void outbuf_init(OutBuf *out, const int fd) {
+  out->fd = fd;
+  out->data = NULL;
+  out->start = out->len = out->cap = 0;
+  out->full = false;
+  out->spill_at = 0;
+  out->spill_fd = -1;
+  out->spill_sent = out->spill_len = 0;
+  out->spill_shared = false;
+}
+
+/* Send from `data` until the socket is full, returns the bytes sent */
+static long send_some(const int fd, const unsigned char *data,
+                      const size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    sent += n;
+  }
+
+  return sent;
+}
+
+static int queue(OutBuf *out, const unsigned char *data, const size_t len) {
+  if (out->start + out->len + len > out->cap) {
+    if (out->len + len > out->cap) {
+      // Move to a buffer at least twice as large, from the pool's classes
+      size_t need = out->len + len, cap;
+      unsigned char *grown = (unsigned char *)bufpool_get(
+          need > 2 * out->cap ? need : 2 * out->cap, &cap);
+      if (grown == NULL) {
+        LOG(ERR, NULL, "Failed to allocate memory for an output buffer");
+        return -1;
+      }
+      if (out->len > 0)
+        memcpy(grown, out->data + out->start, out->len);
+      bufpool_put(out->data, out->cap);
+      out->data = grown;
+      out->cap = cap;
+    } else {
+      // Sliding the queued bytes back makes room
+      memmove(out->data, out->data + out->start, out->len);
+    }
+    out->start = 0;
+  }
+
+  memcpy(out->data + out->start + out->len, data, len);
+  out->len += len;
+  if (out->spill_at == 0 && out->len >= OUTBUF_HIGH_WATERMARK)
+    out->full = true;
+  return 0;
+}
+
+/* Unlinked file in $TMPDIR (or /tmp), gone once closed */
+static int open_spill(void) {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0')
+    dir = "/tmp";
+
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR))
+    return fd;
+
+  // Without O_TMPFILE support, a named file unlinked right away
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/httproxy-spill-XXXXXX", dir);
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd != -1)
+    unlink(path);
+  return fd;
+}
+
+/* Append part of a file to the spill file, copied in the kernel */
+static int spill_file(OutBuf *out, const int file_fd, off_t offset,
+                      const size_t len) {
+  if (lseek(out->spill_fd, out->spill_len, SEEK_SET) == -1)
+    return -1;
+
+  size_t copied = 0;
+  while (copied < len) {
+    ssize_t n = sendfile(out->spill_fd, file_fd, &offset, len - copied);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    copied += n;
+  }
+
+  out->spill_len += len;
+  return 0;
+}
+
+/*
+ * A file of the caller's can't take more bytes: what's left of it moves to a
+ * temp file the next ones are appended to
+ */
+static int own_spill(OutBuf *out) {
+  int shared_fd = out->spill_fd;
+  off_t from = out->spill_sent;
+  size_t left = out->spill_len - out->spill_sent;
+
+  out->spill_fd = open_spill();
+  out->spill_sent = out->spill_len = 0;
+  out->spill_shared = false;
+  int status =
+      out->spill_fd != -1 ? spill_file(out, shared_fd, from, left) : -1;
+  close(shared_fd);
+  if (status == -1)
+    LOG(ERR, NULL, "Failed to buffer a response to a file");
+  return status;
+}
+
+static int spill(OutBuf *out, const unsigned char *data, const size_t len) {
+  if (out->spill_shared && own_spill(out) == -1)
+    return -1;
+
+  if (out->spill_fd == -1) {
+    out->spill_fd = open_spill();
+    if (out->spill_fd == -1) {
+      LOG(ERR, NULL, "Failed to create a file to buffer a response");
+      return -1;
+    }
+  }
+
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = pwrite(out->spill_fd, data + written, len - written,
+                       out->spill_len + written);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      LOG(ERR, NULL, "Failed to buffer a response to a file");
+      return -1;
+    }
+    written += n;
+  }
+
+  out->spill_len += len;
+  metrics_add(METRIC_SPILLED_BYTES, len);
+  return 0;
+}
+
+/* Send from the spill file, closed once it's all out */
+static long send_spilled(OutBuf *out) {
+  long sent = 0;
+  while (out->spill_sent < out->spill_len) {
+    ssize_t n = sendfile(out->fd, out->spill_fd, &out->spill_sent,
+                         out->spill_len - out->spill_sent);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return sent;
+      return -1;
+    }
+    if (n == 0)
+      return -1; // The file is shorter than what was written
+    sent += n;
+  }
+
+  close(out->spill_fd);
+  out->spill_fd = -1;
+  out->spill_sent = out->spill_len = 0;
+  out->spill_shared = false;
+  return sent;
+}
+
+int outbuf_write(OutBuf *out, const void *data, const size_t len) {
+  if (out->fd == -1)
+    return -1;
+
+  // Queued bytes go first, the new ones wait behind them
+  long sent = 0;
+  if (!outbuf_pending(out)) {
+    sent = send_some(out->fd, (const unsigned char *)data, len);
+    if (sent == -1)
+      return -1;
+    if ((size_t)sent == len)
+      return 0;
+
+    PROBE(forward_partial, probe_conn(), out->fd, sent, len - sent);
+  }
+
+  // Once spilling, everything goes to the file until it's drained
+  const unsigned char *rest = (const unsigned char *)data + sent;
+  if (out->spill_fd != -1 ||
+      (out->spill_at > 0 && out->len + len - sent > out->spill_at))
+    return spill(out, rest, len - sent);
+  return queue(out, rest, len - sent);
+}
+
+/* Queue what's left after the first `sent` bytes of the pieces */
+static int queue_rest(OutBuf *out, const struct iovec *iov,
+                      const int iov_count, size_t sent) {
+  for (int i = 0; i < iov_count; i++) {
+    if (sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+
+    // outbuf_write() sends nothing once bytes are pending
+    if (outbuf_write(out, (const unsigned char *)iov[i].iov_base + sent,
+                     iov[i].iov_len - sent) == -1)
+      return -1;
+    sent = 0;
+  }
+
+  return 0;
+}
+
+int outbuf_writev(OutBuf *out, const struct iovec *iov, const int iov_count,
+                  const int flags) {
+  if (out->fd == -1)
+    return -1;
+
+  size_t len = 0;
+  for (int i = 0; i < iov_count; i++)
+    len += iov[i].iov_len;
+
+  size_t sent = 0;
+  if (!outbuf_pending(out)) {
+    struct msghdr msg = {0};
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iov_count;
+
+    ssize_t n;
+    do
+      n = sendmsg(out->fd, &msg, flags | MSG_NOSIGNAL);
+    while (n == -1 && errno == EINTR);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+
+    sent = n > 0 ? n : 0;
+    if (sent == len)
+      return 0;
+    PROBE(forward_partial, probe_conn(), out->fd, sent, len - sent);
+  }
+
+  return queue_rest(out, iov, iov_count, sent);
+}
+
+int outbuf_sendfile(OutBuf *out, const int file_fd, const off_t offset,
+                    const size_t len) {
+  if (out->fd == -1)
+    return -1;
+
+  off_t next = offset;
+  if (!outbuf_pending(out)) {
+    while ((size_t)(next - offset) < len) {
+      ssize_t n = sendfile(out->fd, file_fd, &next, len - (next - offset));
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      if (n <= 0)
+        return -1;
+    }
+    if ((size_t)(next - offset) == len)
+      return 0;
+  }
+
+  size_t left = len - (next - offset);
+  if (out->spill_fd != -1) {
+    // Behind a spill file of its own, the rest is appended to it
+    if (out->spill_shared && own_spill(out) == -1)
+      return -1;
+    if (spill_file(out, file_fd, next, left) == -1) {
+      LOG(ERR, NULL, "Failed to buffer a response to a file");
+      return -1;
+    }
+    return 0;
+  }
+
+  // Sent from the file itself once the queued bytes are out
+  out->spill_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+  if (out->spill_fd == -1) {
+    LOG(ERR, NULL, "Failed to queue a file for a client");
+    return -1;
+  }
+  out->spill_sent = next;
+  out->spill_len = offset + len;
+  out->spill_shared = true;
+  return 0;
+}
+
+long outbuf_flush(OutBuf *out) {
+  if (out->len == 0)
+    return out->spill_fd != -1 ? send_spilled(out) : 0;
+
+  long sent = send_some(out->fd, out->data + out->start, out->len);
+  if (sent == -1)
+    return -1;
+
+  out->start += sent;
+  out->len -= sent;
+  if (out->len <= OUTBUF_LOW_WATERMARK)
+    out->full = false;
+
+  // Drained: a connection that keeps up holds no buffer
+  if (out->len == 0) {
+    bufpool_put(out->data, out->cap);
+    out->data = NULL;
+    out->start = out->cap = 0;
+
+    if (out->spill_fd != -1) {
+      long spilled = send_spilled(out);
+      if (spilled == -1)
+        return -1;
+      sent += spilled;
+    }
+  }
+
+  return sent;
+}
+
+bool outbuf_pending(const OutBuf *out) {
+  return out->len > 0 || out->spill_fd != -1;
+}
+
+void outbuf_free(OutBuf *out) {
+  bufpool_put(out->data, out->cap);
+  out->data = NULL;
+  out->start = out->len = out->cap = 0;
+  out->full = false;
+
+  if (out->spill_fd != -1)
+    close(out->spill_fd);
+  out->spill_fd = -1;
+  out->spill_sent = out->spill_len = 0;
+  out->spill_shared = false;
+}
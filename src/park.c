@@ -0,0 +1,202 @@
+#include <sys/epoll.h>
+
+#include "common.h"
+#include "park.h"
+#include "proxy.h"
+
+static int epoll_fd = -1;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Under the lock
+static ConnInfo *parked = NULL; // Watched
+static ConnInfo *ready_head = NULL, *ready_tail = NULL; // Waiting for a thread
+static int parked_count = 0, ready_count = 0;
+static bool draining = false;
+static unsigned long long parks = 0, resumes = 0;
+
+int park(ConnInfo *info) {
+  struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP,
+                              .data.ptr = info};
+
+  pthread_mutex_lock(&park_lock);
+  if (draining || epoll_fd == -1) {
+    pthread_mutex_unlock(&park_lock);
+    return -1;
+  }
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, info->fds[0].fd, &event) == -1) {
+    pthread_mutex_unlock(&park_lock);
+    LOG(WARN, NULL, "Failed to park the connection");
+    return -1;
+  }
+  if (info->fds[1].fd != -1 &&
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, info->fds[1].fd, &event) == -1) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info->fds[0].fd, NULL);
+    pthread_mutex_unlock(&park_lock);
+    LOG(WARN, NULL, "Failed to park the connection");
+    return -1;
+  }
+
+  // Linked before the park thread can see an event for it
+  info->parked = true;
+  info->prev = NULL;
+  info->next = parked;
+  if (parked != NULL)
+    parked->prev = info;
+  parked = info;
+  parked_count++;
+  parks++;
+  pthread_mutex_unlock(&park_lock);
+  return 0;
+}
+
+/* Stop watching a connection, with the lock held */
+static void unwatch(ConnInfo *info) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info->fds[0].fd, NULL);
+  if (info->fds[1].fd != -1)
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info->fds[1].fd, NULL);
+
+  if (info->prev != NULL)
+    info->prev->next = info->next;
+  else
+    parked = info->next;
+  if (info->next != NULL)
+    info->next->prev = info->prev;
+  info->parked = false;
+  parked_count--;
+}
+
+/* Queue a connection for a thread, with the lock held */
+static void wake(ConnInfo *info) {
+  unwatch(info);
+  info->prev = NULL;
+  info->next = NULL;
+  if (ready_tail != NULL)
+    ready_tail->next = info;
+  else
+    ready_head = info;
+  ready_tail = info;
+  ready_count++;
+}
+
+/* Resume the woken connections, as long as there are threads for them */
+static void resume_ready(void) {
+  pthread_mutex_lock(&park_lock);
+  while (ready_head != NULL) {
+    // Taken off first, the new thread may close it right away
+    ConnInfo *info = ready_head;
+    ready_head = info->next;
+    if (ready_head == NULL)
+      ready_tail = NULL;
+    info->next = NULL;
+
+    if (spawn_thread(handler, info) == -1) {
+      info->next = ready_head;
+      ready_head = info;
+      if (ready_tail == NULL)
+        ready_tail = info;
+      break; // Retried after PARK_RETRY_MS
+    }
+    ready_count--;
+    resumes++;
+  }
+  pthread_mutex_unlock(&park_lock);
+}
+
+/*
+ * Draining, with the lock held: the connections kept alive between requests
+ * are closed here, without a thread. Those that haven't sent a request yet
+ * and the tunnels stay parked, their handler finds out once they're woken.
+ */
+static void drain(void) {
+  draining = true;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, proxy_drain_fd(), NULL);
+
+  int closed = 0;
+  ConnInfo *info = parked;
+  while (info != NULL) {
+    ConnInfo *next = info->next;
+    if (info->served && !info->is_TLS) {
+      unwatch(info);
+      conn_close(info);
+      closed++;
+    }
+    info = next;
+  }
+  LOG(INFO, NULL, "Closed %d parked connection(s) to drain", closed);
+}
+
+static void *watch(void *arg) {
+  (void)arg;
+  struct epoll_event events[PARK_EVENTS];
+
+  while (1) {
+    pthread_mutex_lock(&park_lock);
+    int timeout = ready_head != NULL ? PARK_RETRY_MS : -1;
+    pthread_mutex_unlock(&park_lock);
+
+    int count = epoll_wait(epoll_fd, events, PARK_EVENTS, timeout);
+    if (count == -1) {
+      if (errno != EINTR)
+        LOG(WARN, NULL, "Failed to wait for the parked connections");
+      count = 0;
+    }
+
+    // An event may be for a connection already woken in this batch, none
+    // is resumed or closed before the whole batch is seen
+    bool drain_notice = false;
+    pthread_mutex_lock(&park_lock);
+    for (int i = 0; i < count; i++) {
+      ConnInfo *info = (ConnInfo *)events[i].data.ptr;
+      if (info == NULL)
+        drain_notice = true;
+      else if (info->parked)
+        wake(info);
+    }
+    if (drain_notice)
+      drain();
+    pthread_mutex_unlock(&park_lock);
+
+    resume_ready();
+  }
+
+  return NULL;
+}
+
+int park_start(void) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    LOG(ERR, NULL, "Failed to create the epoll instance of the park thread");
+    return -1;
+  }
+
+  // The drain notice stays readable, it's watched until it fires once
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  pthread_t tid;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, proxy_drain_fd(), &event) == -1 ||
+      pthread_create(&tid, NULL, watch, NULL) != 0) {
+    LOG(ERR, NULL, "Failed to start the park thread");
+    close(epoll_fd);
+    epoll_fd = -1;
+    return -1;
+  }
+
+  pthread_detach(tid);
+  return 0;
+}
+
+int park_count(void) {
+  pthread_mutex_lock(&park_lock);
+  int count = parked_count + ready_count;
+  pthread_mutex_unlock(&park_lock);
+  return count;
+}
+
+void park_log_stats(void) {
+  pthread_mutex_lock(&park_lock);
+  LOG(INFO, NULL,
+      "Parking: %d parked, %d waiting for a thread, %llu parked and %llu "
+      "resumed so far",
+      parked_count, ready_count, parks, resumes);
+  pthread_mutex_unlock(&park_lock);
+}
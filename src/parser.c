@@ -1,11 +1,8 @@
 #include "common.h"
 #include <string.h>
+#include <stdint.h>
 
-#define CRLF 2
-#define CHUNK_SIZE_LEN(size) ((size == 0) ? 1 : 16)
-
-static char *normalize_uri(const char *uri, const long uri_len,
-                           const char *method) {
+char *normalize_uri(const char *uri, const long uri_len, const char *method) {
   bool is_options = strncmp("OPTIONS", method, 7) == 0;
   if (uri == NULL || is_options) {
     if (is_options)
@@ -54,6 +51,10 @@ static unsigned char *parse_request_line(const unsigned char *raw,
 
   unsigned char *method_end =
       (unsigned char *)memchr(raw, ' ', req->header_size);
+  if (method_end == NULL) {
+    LOG(ERR, NULL, "Malformed request line");
+    return NULL;
+  }
   long method_size = method_end - raw;
 
   req->method = (char *)malloc(method_size + 1);
@@ -68,6 +69,10 @@ static unsigned char *parse_request_line(const unsigned char *raw,
 
   unsigned char *uri_end = (unsigned char *)memchr(
       method_end, ' ', req->header_size - (method_size + 1));
+  if (uri_end == NULL) {
+    LOG(ERR, NULL, "Malformed request line");
+    return NULL;
+  }
   long uri_size = uri_end - method_end;
 
   char *raw_uri = (char *)malloc(uri_size + 1);
@@ -92,6 +97,10 @@ static unsigned char *parse_request_line(const unsigned char *raw,
 
   unsigned char *version_end = (unsigned char *)memchr(
       uri_end, '\r', req->header_size - (method_size + uri_size + 2));
+  if (version_end == NULL) {
+    LOG(ERR, NULL, "Malformed request line");
+    return NULL;
+  }
   long version_size = version_end - uri_end;
 
   req->version = (char *)malloc(version_size + 1);
@@ -112,6 +121,10 @@ static unsigned char *parse_response_line(const unsigned char *raw,
 
   unsigned char *version_end =
       (unsigned char *)memchr(raw, ' ', res->header_size);
+  if (version_end == NULL) {
+    LOG(ERR, NULL, "Malformed status line");
+    return NULL;
+  }
   long version_size = version_end - raw;
 
   res->version = (char *)malloc(version_size + 1);
@@ -126,6 +139,10 @@ static unsigned char *parse_response_line(const unsigned char *raw,
 
   unsigned char *status_code = (unsigned char *)memchr(
       version_end, ' ', res->header_size - (version_size + 1));
+  if (status_code == NULL) {
+    LOG(ERR, NULL, "Malformed status line");
+    return NULL;
+  }
   long status_code_size = status_code - version_end;
 
   res->status_code = (char *)malloc(status_code_size + 1);
@@ -141,6 +158,10 @@ static unsigned char *parse_response_line(const unsigned char *raw,
   unsigned char *reason_phrase = (unsigned char *)memchr(
       status_code, '\r',
       res->header_size - (version_size + status_code_size + 2));
+  if (reason_phrase == NULL) {
+    LOG(ERR, NULL, "Malformed status line");
+    return NULL;
+  }
   long reason_phrase_size = reason_phrase - status_code;
 
   res->reason_phrase = (char *)malloc(reason_phrase_size + 1);
@@ -174,8 +195,7 @@ static int init_header_value(const unsigned char *value, const long value_len,
         "Failed to allocate memory to store value field of a header");
     return -1;
   }
-  memcpy(headers[headers_count].value, value,
-         value_len); // Skip past the : and SP
+  memcpy(headers[headers_count].value, value, value_len);
   headers[headers_count].value[value_len] = '\0';
   return 0;
 }
@@ -198,14 +218,22 @@ static unsigned char *parse_headers(unsigned char *line,
     unsigned char *delim = memchr(line, ':', header_len);
     if (delim != NULL) {
       long key_len = delim - line;
-      long value_len = header_len - (key_len + 2); // Account for the : and SP
+
+      // The value follows the : and any SP or HTAB
+      unsigned char *value = delim + 1;
+      while (value < next_line && (*value == ' ' || *value == '\t'))
+        value++;
+      long value_len = next_line - value;
 
       if (init_header_key(line, key_len, headers, *headers_count) == -1)
         return NULL;
 
-      if (init_header_value(delim + 2, value_len, headers, *headers_count) ==
-          -1)
+      if (init_header_value(value, value_len, headers, *headers_count) ==
+          -1) {
+        free(headers[*headers_count].key);
+        headers[*headers_count].key = NULL;
         return NULL;
+      }
 
       (*headers_count)++;
     }
@@ -216,6 +244,201 @@ static unsigned char *parse_headers(unsigned char *line,
   return line + 2; // Skip the last CRLF
 }
 
+/* Chunked transfer coding decoder states */
+enum {
+  CHUNK_SIZE,         // Reading the hex chunk size
+  CHUNK_EXT,          // Skipping chunk extensions up to the CRLF
+  CHUNK_DATA,         // Reading chunk payload
+  CHUNK_DATA_CR,      // Expecting the CR after the payload
+  CHUNK_DATA_LF,      // Expecting the LF after the payload
+  CHUNK_TRAILER,      // At the start of a trailer line (or the final CRLF)
+  CHUNK_TRAILER_LINE, // Skipping a trailer field line
+  CHUNK_TRAILER_LF,   // Expecting the LF of the final CRLF
+};
+
+static int hex_value(const unsigned char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Determine how the body is delimited from the headers alone */
+static void framing_from_headers(BodyFraming *bf, const Header *headers,
+                                 const size_t headers_count) {
+  const char *transfer_encoding =
+      get_header_value("Transfer-Encoding", headers, headers_count);
+  if (transfer_encoding != NULL &&
+      strcasestr(transfer_encoding, "chunked") != NULL) {
+    bf->kind = BODY_CHUNKED;
+    bf->state = CHUNK_SIZE;
+    return;
+  }
+
+  const char *content_length_str =
+      get_header_value("Content-Length", headers, headers_count);
+  if (content_length_str != NULL) {
+    bf->kind = BODY_LENGTH;
+    bf->remaining = strtoull(content_length_str, NULL, 10);
+    bf->done = bf->remaining == 0;
+    return;
+  }
+
+  bf->kind = BODY_UNTIL_CLOSE;
+}
+
+void body_framing_init(BodyFraming *bf, const Response *res,
+                       const bool is_head) {
+  memset(bf, 0, sizeof(BodyFraming));
+
+  long status = res->status_code ? strtol(res->status_code, NULL, 10) : 0;
+  if (is_head || (status >= 100 && status < 200) || status == 204 ||
+      status == 304) {
+    bf->kind = BODY_NONE;
+    bf->done = true;
+    return;
+  }
+
+  framing_from_headers(bf, res->headers, res->headers_count);
+}
+
+long body_framing_feed(BodyFraming *bf, const unsigned char *in,
+                       const size_t len, unsigned char *out,
+                       size_t *consumed) {
+  size_t i = 0, written = 0;
+
+  if (bf->done || bf->kind == BODY_NONE) {
+    bf->done = true;
+    *consumed = 0;
+    return 0;
+  }
+
+  if (bf->kind == BODY_UNTIL_CLOSE || bf->kind == BODY_LENGTH) {
+    size_t n = len;
+    if (bf->kind == BODY_LENGTH && n > bf->remaining)
+      n = bf->remaining;
+
+    if (out != NULL && out != in)
+      memmove(out, in, n);
+
+    if (bf->kind == BODY_LENGTH) {
+      bf->remaining -= n;
+      bf->done = bf->remaining == 0;
+    }
+
+    *consumed = n;
+    return n;
+  }
+
+  while (i < len && !bf->done) {
+    const unsigned char c = in[i];
+
+    switch (bf->state) {
+    case CHUNK_SIZE: {
+      int v = hex_value(c);
+      if (v != -1) {
+        if (bf->chunk_size > (SIZE_MAX >> 4))
+          return -1; // Chunk size overflow
+        bf->chunk_size = (bf->chunk_size << 4) | v;
+        i++;
+        break;
+      }
+
+      if (c != ';' && c != ' ' && c != '\t' && c != '\r')
+        return -1;
+
+      bf->state = CHUNK_EXT;
+      break;
+    }
+
+    case CHUNK_EXT:
+      i++;
+      if (c != '\n')
+        break;
+
+      if (bf->chunk_size == 0) {
+        bf->state = CHUNK_TRAILER;
+        break;
+      }
+
+      bf->remaining = bf->chunk_size;
+      bf->chunk_size = 0;
+      bf->state = CHUNK_DATA;
+      break;
+
+    case CHUNK_DATA: {
+      size_t n = len - i;
+      if (n > bf->remaining)
+        n = bf->remaining;
+
+      if (out != NULL)
+        memmove(out + written, in + i, n);
+
+      written += n;
+      i += n;
+      bf->remaining -= n;
+      if (bf->remaining == 0)
+        bf->state = CHUNK_DATA_CR;
+      break;
+    }
+
+    case CHUNK_DATA_CR:
+      if (c != '\r')
+        return -1;
+      i++;
+      bf->state = CHUNK_DATA_LF;
+      break;
+
+    case CHUNK_DATA_LF:
+      if (c != '\n')
+        return -1;
+      i++;
+      bf->state = CHUNK_SIZE;
+      break;
+
+    case CHUNK_TRAILER:
+      i++;
+      bf->state = c == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+      if (c == '\n')
+        bf->done = true; // Tolerate a bare LF as the final line
+      break;
+
+    case CHUNK_TRAILER_LINE:
+      i++;
+      if (c == '\n')
+        bf->state = CHUNK_TRAILER;
+      break;
+
+    case CHUNK_TRAILER_LF:
+      if (c != '\n')
+        return -1;
+      i++;
+      bf->done = true;
+      break;
+    }
+  }
+
+  *consumed = i;
+  return written;
+}
+
+/* Track the end of a body across reads, setting the still-arriving flags */
+static int feed_body(BodyFraming *bf, const unsigned char *raw,
+                     const size_t len, bool *is_partial, bool *is_chunked) {
+  size_t consumed = 0;
+  if (body_framing_feed(bf, raw, len, NULL, &consumed) == -1) {
+    LOG(ERR, NULL, "Malformed chunked body");
+    return -1;
+  }
+
+  *is_chunked = !bf->done && bf->kind == BODY_CHUNKED;
+  *is_partial = !bf->done && bf->kind != BODY_CHUNKED;
+  return 0;
+}
+
 static int parse_req_body(const unsigned char *body, const size_t body_len,
                           Request *req) {
   /*
@@ -269,67 +492,20 @@ static int parse_req_body(const unsigned char *body, const size_t body_len,
   req->content_encoding = (char *)get_header_value(
       "Content-Encoding", req->headers, req->headers_count);
 
-  const char *transfer_encoding =
-      get_header_value("Transfer-Encoding", req->headers, req->headers_count);
-  if (transfer_encoding != NULL &&
-      memcmp("chunked", transfer_encoding, 7) == 0) {
-    int chunk_size = get_chunk_size(body, body_len);
-    if (chunk_size == -1)
-      return -1;
-
-    if (chunk_size == 0) {
-      req->body = (unsigned char *)malloc(
-          chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-      if (req->body == NULL) {
-        LOG(ERR, NULL, "Failed to allocate memory to store request body");
-        return -1;
-      }
-      memcpy(req->body, body,
-             chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-      req->body_size = chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2;
-      req->is_chunked = false;
-      return 0;
-    }
-
-    req->body = (unsigned char *)malloc(chunk_size +
-                                        CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-    if (req->body == NULL) {
-      LOG(ERR, NULL, "Failed to allocate memory to store request body");
-      return -1;
-    }
-    memcpy(req->body, body, chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-    req->body_size = chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2;
-    req->is_chunked = true;
-    return 0;
+  framing_from_headers(&req->framing, req->headers, req->headers_count);
+  if (req->framing.kind == BODY_UNTIL_CLOSE) { // Only responses run to close
+    req->framing.kind = BODY_NONE;
+    req->framing.done = true;
   }
+  if (req->framing.kind == BODY_LENGTH)
+    req->body_size = req->framing.remaining;
 
-  const char *content_length_str =
-      get_header_value("Content-Length", req->headers, req->headers_count);
-  if (content_length_str != NULL) {
-    int content_length = strtol(content_length_str, NULL, 10);
-    if (content_length == 0) {
-      req->body = NULL;
-      req->body_size = 0;
-      return 0;
-    }
-
-    req->body = (unsigned char *)malloc(content_length);
-    if (req->body == NULL) {
-      LOG(ERR, NULL, "Failed to allocate memory to store request body");
-      return -1;
-    }
-    memcpy(req->body, body, content_length);
-    req->body_size = content_length;
-    return 0;
-  }
-
-  req->body = NULL;
-  req->body_size = 0;
-  return 0;
+  return feed_body(&req->framing, body, body_len, &req->is_partial,
+                   &req->is_chunked);
 }
 
 static int parse_res_body(const unsigned char *body, const size_t body_len,
-                          Response *res) {
+                          Response *res, const bool is_head) {
   /*
    * Rules for determining if an HTTP response has a body (RFC 9110):
    *
@@ -378,89 +554,24 @@ static int parse_res_body(const unsigned char *body, const size_t body_len,
   res->content_encoding = (char *)get_header_value(
       "Content-Encoding", res->headers, res->headers_count);
 
-  const char *transfer_encoding =
-      get_header_value("Transfer-Encoding", res->headers, res->headers_count);
-  if (transfer_encoding != NULL &&
-      memcmp("chunked", transfer_encoding, 7) == 0) {
-    int chunk_size = get_chunk_size(body, body_len);
-    if (chunk_size == -1)
-      return -1;
-
-    if (chunk_size == 0) {
-      res->body = (unsigned char *)malloc(
-          chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-      if (res->body == NULL) {
-        LOG(ERR, NULL, "Failed to allocate memory to store response body");
-        return -1;
-      }
-      memcpy(res->body, body,
-             chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-      res->body_size = chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2;
-      res->is_chunked = false;
-      return 0;
-    }
-
-    res->body = (unsigned char *)malloc(chunk_size +
-                                        CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-    if (res->body == NULL) {
-      LOG(ERR, NULL, "Failed to allocate memory to store response body");
-      return -1;
-    }
-    memcpy(res->body, body, chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2);
-    res->body_size = chunk_size + CHUNK_SIZE_LEN(chunk_size) + CRLF * 2;
-    res->is_chunked = true;
-    return 0;
-  }
-
-  const char *content_length_str =
-      get_header_value("Content-Length", res->headers, res->headers_count);
-  if (content_length_str != NULL) {
-    int content_length = strtol(content_length_str, NULL, 10);
-    if (content_length == 0) {
-      res->body = NULL;
-      res->body_size = 0;
-      return 0;
-    }
-
-    res->body = (unsigned char *)malloc(content_length);
-    if (res->body == NULL) {
-      LOG(ERR, NULL, "Failed to allocate memory to store response body");
-      return -1;
-    }
-    memcpy(res->body, body, content_length);
-    res->body_size = content_length;
-    return 0;
-  }
+  body_framing_init(&res->framing, res, is_head);
+  if (res->framing.kind == BODY_LENGTH)
+    res->body_size = res->framing.remaining;
 
-  res->body = NULL;
-  res->body_size = 0;
-  return 0;
+  return feed_body(&res->framing, body, body_len, &res->is_partial,
+                   &res->is_chunked);
 }
 
 int parse_request(const unsigned char *raw, const size_t len, Request *req) {
   if (raw == NULL || req == NULL)
     return -1;
 
-  if (req->is_partial) {
-    memcpy(req->body + req->partial_recv_size, raw, len);
-
-    req->partial_recv_size += len - 1;
-    if (req->partial_recv_size == req->body_size) {
-      req->is_partial = false;
-      req->partial_recv_size = 0;
-    }
-
-    return 0;
-  }
+  // Bytes of a body that didn't fit in the read of its head
+  if (req->is_partial || req->is_chunked)
+    return feed_body(&req->framing, raw, len, &req->is_partial,
+                     &req->is_chunked);
 
-  if (req->is_chunked) {
-    free(req->body);
-    req->body = NULL;
-
-    return parse_req_body(raw, len, req);
-  }
-
-  memset(req, 0, sizeof(Request));
+  clear_req(req);
 
   // Search for the last '\r\n\r\n' indicating the end of the header section
   unsigned char *headers_end = (unsigned char *)memmem(raw, len, "\r\n\r\n", 4);
@@ -487,43 +598,25 @@ int parse_request(const unsigned char *raw, const size_t len, Request *req) {
   if (parse_req_body(body_start, len - req->header_size, req) == -1)
     return -1;
 
-  if (len - req->header_size < req->body_size && req->is_partial == false) {
-    req->is_partial = true;
-    req->partial_recv_size = len - req->header_size - 1;
-  }
-
   return 0;
 }
 
-int parse_response(const unsigned char *raw, const size_t len, Response *res) {
+int parse_response(const unsigned char *raw, const size_t len, Response *res,
+                   const bool is_head) {
   if (raw == NULL || res == NULL)
     return -1;
 
-  if (res->is_partial) {
-    memcpy(res->body + res->partial_recv_size, raw, len);
+  // Bytes of a body that didn't fit in the read of its head
+  if (res->is_partial || res->is_chunked)
+    return feed_body(&res->framing, raw, len, &res->is_partial,
+                     &res->is_chunked);
 
-    res->partial_recv_size += len - 1;
-    if (res->partial_recv_size == res->body_size) {
-      res->is_partial = false;
-      res->partial_recv_size = 0;
-    }
-
-    return 0;
-  }
-
-  if (res->is_chunked) {
-    free(res->body);
-    res->body = NULL;
-
-    return parse_res_body(raw, len, res);
-  }
-
-  memset(res, 0, sizeof(Response));
+  clear_res(res);
 
   // Search for the last '\r\n\r\n' indicating the end of the header section
   unsigned char *headers_end = (unsigned char *)memmem(raw, len, "\r\n\r\n", 4);
   if (headers_end == NULL) {
-    LOG(ERR, NULL, "Invalid Request");
+    LOG(ERR, NULL, "Invalid Response");
     return -1;
   }
   // Move the headers_end past the last '\r\n\r\n'.
@@ -542,13 +635,8 @@ int parse_response(const unsigned char *raw, const size_t len, Response *res) {
   if (body_start == NULL)
     return -1;
 
-  if (parse_res_body(body_start, len - res->header_size, res) == -1)
+  if (parse_res_body(body_start, len - res->header_size, res, is_head) == -1)
     return -1;
 
-  if (len - res->header_size < res->body_size && res->is_partial == false) {
-    res->is_partial = true;
-    res->partial_recv_size = len - res->header_size - 1;
-  }
-
   return 0;
 }
@@ -1,10 +1,25 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
 
+#include "clock.h"
 #include "common.h"
 #include "handler.h"
+#include "metrics.h"
+#include "park.h"
 #include "proxy.h"
+#include "ratelimit.h"
+#include "responses.h"
 
-#define BACKLOG 32 // Max members in listening queue
+#define BACKLOG 1024 // Max members in listening queue, bursts of clients
+                     // find room while the handlers spawn
+
+static int listener = -1;
+static int drain_pipe[2] = {-1, -1}; // Written once to wake up every poller
+static atomic_bool stopping = false;
+static atomic_bool drain_aborted = false;
 
 static void cleanup(void *arg) {
   int *proxy_fd = (int *)arg;
@@ -28,7 +43,8 @@ static int init_proxy(const char *port) {
 
   int proxy_fd = -1, opt = 1;
   for (p = res; p != NULL; p = p->ai_next) {
-    proxy_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    proxy_fd =
+        socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
     if (proxy_fd == -1)
       continue;
 
@@ -71,14 +87,25 @@ static void event_loop(const int proxy_fd) {
   struct sockaddr_storage client_addr;
   socklen_t addr_len = sizeof(client_addr);
   int client_fd = -1;
+  struct pollfd fds[2] = {{.fd = proxy_fd, .events = POLLIN},
+                          {.fd = drain_pipe[0], .events = POLLIN}};
 
   while (1) {
-    pthread_testcancel();
+    if (poll(fds, 2, -1) == -1) {
+      if (errno != EINTR)
+        LOG(WARN, NULL, "Failed to poll the listener");
+      continue;
+    }
+    if (fds[1].revents & POLLIN)
+      break; // Stopped
 
+    // Non-blocking: after a hot upgrade both processes poll the listener
     memset(&client_addr, 0, addr_len);
-    client_fd = accept(proxy_fd, (struct sockaddr *)&client_addr, &addr_len);
+    client_fd = accept4(proxy_fd, (struct sockaddr *)&client_addr, &addr_len,
+                        SOCK_CLOEXEC | SOCK_NONBLOCK);
     if (client_fd == -1) {
-      LOG(WARN, NULL, "Failed to accept client connection");
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        LOG(WARN, NULL, "Failed to accept client connection");
       continue;
     }
 
@@ -110,49 +137,133 @@ static void event_loop(const int proxy_fd) {
       continue;
     }
 
-    // TODO: Implement a client connection queue, in case the # of connection
-    // exceeds the MAX_THREADS, accept those new connection and enqueue them and
-    // handle them when a client handler exits
-
-    int slot = find_empty_slot();
-    if (slot != -1) {
-      if (pthread_create(&thread_pool[slot], NULL, handler, &client_fd) != 0) {
-        LOG(WARN, NULL, "Failed to create handler thread for client");
-        close(client_fd);
-        client_fd = -1;
-        continue;
-      }
-      pthread_detach(thread_pool[slot]);
+    unsigned int retry_after = 0;
+    if (!ratelimit_allow(&conn_limit, (struct sockaddr *)&client_addr,
+                         &retry_after)) {
+      LOG(WARN, NULL, "%s is over its connection rate, retry in %us", ip,
+          retry_after);
+      metrics_add(METRIC_CONN_THROTTLED, 1);
+      send_throttled(client_fd, retry_after);
+      close(client_fd);
+      client_fd = -1;
+      continue;
+    }
 
-      pthread_mutex_lock(&lock);
-      thread_count++;
-      pthread_mutex_unlock(&lock);
+    ConnInfo *info = conn_open(client_fd);
+    if (info == NULL) {
+      close(client_fd);
+      client_fd = -1;
       continue;
     }
 
-    LOG(WARN, NULL,
-        "Max number of connection reached! Dropping the connection!");
-    close(client_fd);
+    // With every thread busy, it's parked until it sends something and a
+    // thread is free
+    if (spawn_thread(handler, info) != -1 || park(info) == 0)
+      continue;
+
+    LOG(WARN, NULL, "Failed to hand the connection over! Dropping it!");
+    metrics_add(METRIC_CONN_REJECTED, 1);
+    conn_close(info);
     client_fd = -1;
   }
 }
 
-void *proxy(void *arg) {
+int proxy_listen(const char *port, const int inherited) {
   char *endptr = NULL;
-  const long port = strtol((char *)arg, &endptr, 10);
-  if (endptr == (char *)arg || *endptr != '\0' || port < 0 || port > 65535) {
+  const long port_num = strtol(port, &endptr, 10);
+  if (endptr == port || *endptr != '\0' || port_num < 0 || port_num > 65535) {
     LOG(ERR, NULL, "Invalid port number");
-    return NULL;
+    return -1;
+  }
+
+  if (pipe2(drain_pipe, O_CLOEXEC) == -1) {
+    LOG(ERR, NULL, "Failed to create the drain pipe");
+    return -1;
+  }
+  if (atomic_load(&stopping)) // Stopped while starting up
+    write(drain_pipe[1], "", 1);
+
+  listener = inherited != -1 ? inherited : init_proxy(port);
+  if (listener == -1)
+    return -1;
+  if (inherited != -1)
+    LOG(INFO, NULL, "Accepting on the listener of the previous process");
+
+  int flags = fcntl(listener, F_GETFL);
+  if (flags == -1 || fcntl(listener, F_SETFL, flags | O_NONBLOCK) == -1) {
+    LOG(ERR, NULL, "Failed to make the listener non-blocking");
+    close(listener);
+    listener = -1;
+    return -1;
   }
+  return 0;
+}
+
+int proxy_listener(void) { return listener; }
 
-  int proxy_fd = init_proxy((char *)arg);
-  if (proxy_fd == -1) // Failed to create proxy server
-    return NULL;
+void *proxy(void *arg) {
+  (void)arg;
+  int proxy_fd = listener;
   pthread_cleanup_push(cleanup, &proxy_fd);
 
   event_loop(proxy_fd);
-  close(proxy_fd);
+  LOG(INFO, NULL, "No longer accepting connections");
 
-  pthread_cleanup_pop(0);
+  pthread_cleanup_pop(1);
   return NULL;
 }
+
+void proxy_stop(void) {
+  if (atomic_exchange(&stopping, true))
+    return;
+
+  // Never read, the pipe stays readable for every poller
+  if (drain_pipe[1] != -1 && write(drain_pipe[1], "", 1) != 1)
+    LOG(ERR, NULL, "Failed to wake up the connections to drain");
+}
+
+bool proxy_stopping(void) { return atomic_load(&stopping); }
+
+int proxy_drain_fd(void) { return drain_pipe[0]; }
+
+/* Handler threads running, the proxy thread holds a slot too, and parked
+ * connections */
+static int handlers_left(void) {
+  pthread_mutex_lock(&lock);
+  int left = thread_count - 1;
+  pthread_mutex_unlock(&lock);
+  return left + park_count();
+}
+
+static void sleep_ms(const long ms) {
+  struct timespec pause = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&pause, NULL);
+}
+
+void proxy_drain(const unsigned int seconds) {
+  uint64_t deadline = clock_precise_ns() + seconds * 1000000000ULL;
+  int left;
+  while ((left = handlers_left()) > 0 && !atomic_load(&drain_aborted) &&
+         clock_precise_ns() < deadline)
+    sleep_ms(DRAIN_POLL_MS);
+
+  if (left <= 0) {
+    LOG(INFO, NULL, "All connections drained");
+    return;
+  }
+
+  LOG(WARN, NULL, "%d connection(s) still open, closing them", left);
+  pthread_mutex_lock(&lock);
+  for (int i = MAX_THREADS - 1; i > PROXY_TID_INDEX; i--) {
+    if (thread_pool[i] != 0)
+      pthread_cancel(thread_pool[i]);
+  }
+  pthread_mutex_unlock(&lock);
+
+  // Their cleanup handlers close the sockets and give the slots back
+  for (int waited = 0; handlers_left() > 0 && waited < 1000;
+       waited += DRAIN_POLL_MS)
+    sleep_ms(DRAIN_POLL_MS);
+}
+
+void proxy_drain_abort(void) { atomic_store(&drain_aborted, true); }
@@ -0,0 +1,298 @@
+#include <limits.h>
+#include <netinet/in.h>
+
+#include "clock.h"
+#include "common.h"
+#include "ratelimit.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+RateRule conn_limit = {.name = "connections"};
+RateRule request_limit = {.name = "requests"};
+RateRule bandwidth_limit = {.name = "client bandwidth"};
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static uint32_t prefix_mask(const int bits) {
+  return bits <= 0 ? 0 : bits >= 32 ? UINT32_MAX : UINT32_MAX << (32 - bits);
+}
+
+/* Hash the address with the host bits cleared, never returns 0 */
+static uint64_t client_key(const RateRule *rule, const struct sockaddr *addr) {
+  uint64_t h;
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    uint32_t ip = ntohl(in->sin_addr.s_addr) & prefix_mask(rule->v4_prefix);
+    h = mix(ip | (uint64_t)AF_INET << 32);
+  } else if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    h = mix(AF_INET6);
+    for (int i = 0; i < 4; i++) {
+      uint32_t word;
+      memcpy(&word, in6->sin6_addr.s6_addr + i * 4, sizeof word);
+      word = ntohl(word) & prefix_mask(rule->v6_prefix - i * 32);
+      h = mix(h ^ word);
+    }
+  } else {
+    return 0;
+  }
+
+  return h != 0 ? h : 1;
+}
+
+/*
+ * Bucket units at `now_ms`, capped to the burst and negative while in debt.
+ * `stamp` is set to the time the units are up to date at: another thread may
+ * have stored a later time than this one's clock, no time passed then.
+ */
+static int64_t refilled(const RateRule *rule, const uint64_t state,
+                        const uint32_t now_ms, uint32_t *stamp) {
+  uint32_t last = (uint32_t)(state >> 32);
+  int32_t delta = (int32_t)(now_ms - last);
+  uint32_t elapsed = delta > 0 ? delta : 0;
+
+  uint64_t per_second = (uint64_t)rule->rate * rule->scale;
+  int64_t credit = elapsed * per_second / 1000;
+  int64_t units = (int32_t)(state & UINT32_MAX) + credit;
+  int64_t capacity = (int64_t)rule->burst * rule->scale;
+  if (units >= capacity) {
+    *stamp = last + elapsed;
+    return capacity;
+  }
+
+  // Only the time the credit took is used up, a fraction of a unit carries
+  // over: slow byte rules charged often would never refill otherwise
+  *stamp = last + (credit * 1000 + per_second - 1) / per_second;
+  return units;
+}
+
+static uint64_t pack_state(const uint32_t now_ms, const int64_t units) {
+  return (uint64_t)now_ms << 32 | (uint32_t)(int32_t)units;
+}
+
+static RateEntry *find_entry(RateRule *rule, const uint64_t key,
+                             const uint32_t now_ms) {
+  RateShard *shard = &rule->shards[key >> 60 & (RATELIMIT_SHARDS - 1)];
+  int64_t capacity = (int64_t)rule->burst * rule->scale;
+  RateEntry *idle = NULL;
+  uint64_t idle_key = 0;
+
+  for (size_t i = 0; i < RATELIMIT_MAX_PROBE; i++) {
+    RateEntry *entry = &shard->slots[(key + i) & (RATELIMIT_SHARD_SLOTS - 1)];
+    uint64_t current = atomic_load_explicit(&entry->key, memory_order_acquire);
+
+    if (current == key)
+      return entry;
+
+    if (current == 0) {
+      // Slots are never emptied, so the client can't be further along
+      if (atomic_compare_exchange_strong(&entry->key, &current, key)) {
+        atomic_store(&entry->state,
+                     pack_state(now_ms, (int64_t)rule->burst * rule->scale));
+        atomic_fetch_add_explicit(&shard->entries, 1, memory_order_relaxed);
+        return entry;
+      }
+      if (current == key)
+        return entry;
+      continue; // Lost the slot to another client
+    }
+
+    uint32_t stamp;
+    if (idle == NULL &&
+        refilled(rule, atomic_load_explicit(&entry->state,
+                                            memory_order_relaxed),
+                 now_ms, &stamp) >= capacity) {
+      idle = entry;
+      idle_key = current;
+    }
+  }
+
+  if (idle != NULL && atomic_compare_exchange_strong(&idle->key, &idle_key,
+                                                     key)) {
+    atomic_store(&idle->state,
+                 pack_state(now_ms, (int64_t)rule->burst * rule->scale));
+    atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+    return idle;
+  }
+
+  atomic_fetch_add_explicit(&shard->overflows, 1, memory_order_relaxed);
+  return NULL;
+}
+
+int ratelimit_parse(const char *spec, unsigned int *rate,
+                    unsigned int *burst) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long value = strtoul(spec, &end, 10);
+  if (errno != 0 || end == spec || value > UINT_MAX)
+    return -1;
+  *rate = value;
+  *burst = value;
+
+  if (*end == ':') {
+    spec = end + 1;
+    value = strtoul(spec, &end, 10);
+    if (errno != 0 || end == spec || value == 0 || value > UINT_MAX)
+      return -1;
+    *burst = value;
+  }
+
+  return *end == '\0' ? 0 : -1;
+}
+
+int ratelimit_init(RateRule *rule, const char *name, const unsigned int rate,
+                   const unsigned int burst, const unsigned int scale,
+                   const int v4_prefix, const int v6_prefix) {
+  ratelimit_free(rule);
+
+  rule->name = name;
+  rule->rate = rate;
+  rule->burst = burst;
+  rule->scale = scale;
+  rule->v4_prefix = v4_prefix;
+  rule->v6_prefix = v6_prefix;
+  if (rate == 0)
+    return 0;
+
+  if ((uint64_t)burst * scale > INT32_MAX ||
+      (uint64_t)rate * scale > INT32_MAX) {
+    LOG(ERR, NULL, "Rate limit for %s is too large", name);
+    return -1;
+  }
+
+  rule->shards = (RateShard *)aligned_alloc(
+      _Alignof(RateShard), RATELIMIT_SHARDS * sizeof(RateShard));
+  if (rule->shards == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for the %s rate limit", name);
+    return -1;
+  }
+  memset(rule->shards, 0, RATELIMIT_SHARDS * sizeof(RateShard));
+
+  LOG(INFO, NULL, "Limiting %s to %u/s (burst %u) per /%d or /%d network",
+      name, rate, burst, v4_prefix, v6_prefix);
+  return 0;
+}
+
+/* Find the client's bucket, NULL if it isn't limited */
+static RateEntry *client_entry(RateRule *rule, const struct sockaddr *addr,
+                               const uint32_t now_ms, RateShard **shard) {
+  if (rule->shards == NULL)
+    return NULL;
+
+  uint64_t key = client_key(rule, addr);
+  if (key == 0)
+    return NULL;
+
+  *shard = &rule->shards[key >> 60 & (RATELIMIT_SHARDS - 1)];
+  return find_entry(rule, key, now_ms);
+}
+
+/* Milliseconds until the bucket holds `units` again */
+static uint64_t wait_ms(const RateRule *rule, const int64_t units,
+                        const int64_t wanted) {
+  uint64_t per_second = (uint64_t)rule->rate * rule->scale;
+  return ((wanted - units) * 1000 + per_second - 1) / per_second;
+}
+
+bool ratelimit_allow(RateRule *rule, const struct sockaddr *addr,
+                     unsigned int *retry_after) {
+  RateShard *shard = NULL;
+  uint32_t now_ms = clock_now_ns() / 1000000;
+  RateEntry *entry = client_entry(rule, addr, now_ms, &shard);
+  if (entry == NULL)
+    return true;
+
+  uint64_t state = atomic_load_explicit(&entry->state, memory_order_relaxed);
+  while (1) {
+    uint32_t stamp;
+    int64_t units = refilled(rule, state, now_ms, &stamp);
+    if (units < rule->scale) {
+      atomic_fetch_add_explicit(&shard->limited, 1, memory_order_relaxed);
+      if (retry_after != NULL)
+        *retry_after = (wait_ms(rule, units, rule->scale) + 999) / 1000;
+      return false;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(
+            &entry->state, &state, pack_state(stamp, units - rule->scale),
+            memory_order_relaxed, memory_order_relaxed))
+      break;
+  }
+
+  atomic_fetch_add_explicit(&shard->allowed, 1, memory_order_relaxed);
+  return true;
+}
+
+unsigned int ratelimit_charge(RateRule *rule, const struct sockaddr *addr,
+                              const size_t amount) {
+  RateShard *shard = NULL;
+  uint32_t now_ms = clock_now_ns() / 1000000;
+  RateEntry *entry = client_entry(rule, addr, now_ms, &shard);
+  if (entry == NULL)
+    return 0;
+
+  // The debt is bounded so it still fits the state
+  int64_t cost = (int64_t)MIN(amount, (size_t)INT32_MAX) * rule->scale;
+  int64_t units;
+  uint32_t stamp;
+  uint64_t state = atomic_load_explicit(&entry->state, memory_order_relaxed);
+  do {
+    units = refilled(rule, state, now_ms, &stamp) - cost;
+    if (units < INT32_MIN)
+      units = INT32_MIN;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &entry->state, &state, pack_state(stamp, units), memory_order_relaxed,
+      memory_order_relaxed));
+
+  if (units >= 0) {
+    atomic_fetch_add_explicit(&shard->allowed, amount, memory_order_relaxed);
+    return 0;
+  }
+
+  uint64_t wait = wait_ms(rule, units, 0);
+  atomic_fetch_add_explicit(&shard->limited, amount, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shard->delay_ms, wait, memory_order_relaxed);
+  return wait;
+}
+
+void ratelimit_get_stats(const RateRule *rule, RateStats *stats) {
+  memset(stats, 0, sizeof(RateStats));
+  if (rule->shards == NULL)
+    return;
+
+  for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+    const RateShard *shard = &rule->shards[i];
+    stats->allowed += atomic_load(&shard->allowed);
+    stats->limited += atomic_load(&shard->limited);
+    stats->entries += atomic_load(&shard->entries);
+    stats->evictions += atomic_load(&shard->evictions);
+    stats->overflows += atomic_load(&shard->overflows);
+    stats->delay_ms += atomic_load(&shard->delay_ms);
+  }
+}
+
+void ratelimit_log_stats(const RateRule *rule) {
+  if (rule->shards == NULL) {
+    LOG(INFO, NULL, "Rate limit %s: disabled", rule->name);
+    return;
+  }
+
+  RateStats stats;
+  ratelimit_get_stats(rule, &stats);
+  LOG(INFO, NULL,
+      "Rate limit %s: %lu allowed, %lu limited, %lu ms of pauses, %lu "
+      "buckets, %lu evicted, %lu let through without a bucket",
+      rule->name, stats.allowed, stats.limited, stats.delay_ms, stats.entries,
+      stats.evictions, stats.overflows);
+}
+
+void ratelimit_free(RateRule *rule) {
+  free(rule->shards);
+  rule->shards = NULL;
+}
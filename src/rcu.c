@@ -0,0 +1,83 @@
+#include <sched.h>
+
+#include "common.h"
+#include "rcu.h"
+
+static RcuReader readers[RCU_MAX_READERS];
+static atomic_ulong global_epoch = 1;
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static __thread RcuReader *self = NULL;
+
+static void release_reader(void *arg) {
+  RcuReader *reader = (RcuReader *)arg;
+  atomic_store(&reader->epoch, 0);
+  reader->nesting = 0;
+  atomic_store(&reader->used, false);
+}
+
+static void create_reader_key(void) {
+  if (pthread_key_create(&reader_key, release_reader) != 0) {
+    LOG(ERR, NULL, "Failed to create the RCU reader key");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Claim a reader slot for the calling thread, released when it exits */
+static RcuReader *register_reader(void) {
+  pthread_once(&reader_key_once, create_reader_key);
+
+  bool warned = false;
+  while (1) {
+    for (int i = 0; i < RCU_MAX_READERS; i++) {
+      bool expected = false;
+      if (atomic_compare_exchange_strong(&readers[i].used, &expected, true)) {
+        pthread_setspecific(reader_key, &readers[i]);
+        return &readers[i];
+      }
+    }
+
+    if (!warned) {
+      LOG(WARN, NULL, "All %d RCU reader slots are in use, waiting",
+          RCU_MAX_READERS);
+      warned = true;
+    }
+    sched_yield();
+  }
+}
+
+void rcu_read_lock(void) {
+  if (self == NULL)
+    self = register_reader();
+
+  if (self->nesting++ > 0)
+    return;
+
+  // Announce the epoch before any protected pointer is loaded. The
+  // sequentially consistent store orders it against those loads and pairs
+  // with the epoch increment and the scan in rcu_synchronize().
+  atomic_store(&self->epoch, atomic_load(&global_epoch));
+}
+
+void rcu_read_unlock(void) {
+  if (--self->nesting > 0)
+    return;
+
+  atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+void rcu_synchronize(void) {
+  // Readers that observe the new epoch started after the unpublish and
+  // can only have loaded the new pointer
+  unsigned long target = atomic_fetch_add(&global_epoch, 1) + 1;
+
+  for (int i = 0; i < RCU_MAX_READERS; i++) {
+    if (!atomic_load(&readers[i].used))
+      continue;
+
+    unsigned long epoch;
+    while ((epoch = atomic_load(&readers[i].epoch)) != 0 && epoch < target)
+      sched_yield();
+  }
+}
@@ -0,0 +1,352 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "rcu.h"
+#include "responses.h"
+
+#define FALLBACK_BLOCKED_PAGE "<h1>Website Blocked!</h1>"
+#define THROTTLED_BODY "Too many requests, slow down.\n"
+
+static _Atomic(ResponseSet *) current = NULL;
+static char *blocked_page_path = NULL;
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    LOG(WARN, NULL, "Couldn't open %s", path);
+    return NULL;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  char *content = size >= 0 ? (char *)malloc(size + 1) : NULL;
+  if (content == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory to read %s", path);
+    fclose(fp);
+    return NULL;
+  }
+
+  *len = fread(content, 1, size, fp);
+  content[*len] = '\0';
+  fclose(fp);
+  return content;
+}
+
+/* Move a large body into a sealed memfd so it can be served with sendfile()
+ * and can't change underneath a transfer */
+static int seal_body(StaticResponse *response, const char *name) {
+  int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+
+  size_t written = 0;
+  while (written < response->body_len) {
+    ssize_t n = write(fd, response->body + written,
+                      response->body_len - written);
+    if (n == -1) {
+      close(fd);
+      return -1;
+    }
+    written += n;
+  }
+
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+  free(response->body);
+  response->body = NULL;
+  response->body_fd = fd;
+  return 0;
+}
+
+static int build_response(StaticResponse *response, const char *status,
+                          const char *headers, char *body,
+                          const size_t body_len) {
+  char header[512];
+  int len;
+  if (body != NULL)
+    len = snprintf(header, sizeof header,
+                   "HTTP/1.1 %s\r\n%sContent-Length: %zu\r\nProxy-Agent: "
+                   "HTTProxy/1.0\r\n\r\n",
+                   status, headers, body_len);
+  else
+    len = snprintf(header, sizeof header,
+                   "HTTP/1.1 %s\r\n%sProxy-Agent: HTTProxy/1.0\r\n\r\n",
+                   status, headers);
+
+  response->header = strndup(header, len);
+  response->header_len = len;
+  response->body = body;
+  response->body_len = body != NULL ? body_len : 0;
+  response->body_fd = -1;
+  if (response->header == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for a static response");
+    return -1;
+  }
+
+  if (response->body_len >= SENDFILE_THRESHOLD &&
+      seal_body(response, "httproxy-response") == -1)
+    LOG(WARN, NULL, "Couldn't move a large response body to a memfd");
+
+  return 0;
+}
+
+static void free_set(ResponseSet *set) {
+  if (set == NULL)
+    return;
+
+  for (int i = 0; i < RESPONSE_COUNT; i++) {
+    free(set->responses[i].header);
+    free(set->responses[i].body);
+    if (set->responses[i].body_fd != -1)
+      close(set->responses[i].body_fd);
+  }
+  free(set);
+}
+
+static void release_set(ResponseSet *set) {
+  if (atomic_fetch_sub(&set->refs, 1) == 1)
+    free_set(set);
+}
+
+static ResponseSet *build_set(void) {
+  ResponseSet *set = (ResponseSet *)calloc(1, sizeof(ResponseSet));
+  if (set == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for the static responses");
+    return NULL;
+  }
+  for (int i = 0; i < RESPONSE_COUNT; i++)
+    set->responses[i].body_fd = -1;
+  atomic_init(&set->refs, 1);
+
+  size_t page_len = 0;
+  char *page = read_file(blocked_page_path, &page_len);
+  if (page == NULL) {
+    LOG(WARN, NULL, "Using the built-in blocked page");
+    page = strdup(FALLBACK_BLOCKED_PAGE);
+    page_len = strlen(FALLBACK_BLOCKED_PAGE);
+  }
+
+  if (page == NULL ||
+      build_response(&set->responses[RESPONSE_BLOCKED], "403 Forbidden",
+                     "Content-Type: text/html; charset=UTF-8\r\n"
+                     "Connection: close\r\n",
+                     page, page_len) == -1 ||
+      build_response(&set->responses[RESPONSE_BAD_REQUEST], "400 Bad Request",
+                     "Connection: close\r\n", NULL, 0) == -1 ||
+      build_response(&set->responses[RESPONSE_CONNECTED],
+                     "200 Connection Established", "", NULL, 0) == -1 ||
+      build_response(&set->responses[RESPONSE_THROTTLED],
+                     "429 Too Many Requests",
+                     "Content-Type: text/plain\r\nConnection: close\r\n",
+                     strdup(THROTTLED_BODY), strlen(THROTTLED_BODY)) == -1 ||
+      build_response(&set->responses[RESPONSE_REQUEST_TIMEOUT],
+                     "408 Request Timeout",
+                     "Content-Length: 0\r\nConnection: close\r\n", NULL,
+                     0) == -1 ||
+      build_response(&set->responses[RESPONSE_GATEWAY_TIMEOUT],
+                     "504 Gateway Timeout",
+                     "Content-Length: 0\r\nConnection: close\r\n", NULL,
+                     0) == -1) {
+    free_set(set); // The blocked response owns the page
+    return NULL;
+  }
+
+  return set;
+}
+
+int responses_init(const char *blocked_page) {
+  free(blocked_page_path);
+  blocked_page_path = strdup(blocked_page);
+  if (blocked_page_path == NULL)
+    return -1;
+
+  return responses_reload();
+}
+
+int responses_reload(void) {
+  ResponseSet *set = build_set();
+  if (set == NULL)
+    return -1;
+
+  // Once the grace period is over no sender can still be taking a reference
+  // on the old set, the last one holding it frees it
+  ResponseSet *old = rcu_publish(current, set);
+  rcu_synchronize();
+
+  if (old != NULL) {
+    release_set(old);
+    LOG(INFO, NULL, "Static responses reloaded");
+  }
+  return 0;
+}
+
+/* Wait for a client's non-blocking socket to take more, true if it did */
+static bool wait_writable(const int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  return poll(&pfd, 1, RESPONSE_SEND_WAIT_MS) == 1;
+}
+
+static int send_all(const int dest_fd, struct iovec *iov, int iov_count,
+                    const int flags) {
+  struct msghdr msg = {0};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iov_count;
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t sent = sendmsg(dest_fd, &msg, flags | MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR ||
+          ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(dest_fd)))
+        continue;
+      return -1;
+    }
+
+    // Skip past what was sent, handling partial writes
+    while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+      sent -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+      msg.msg_iov->iov_len -= sent;
+    }
+  }
+
+  return 0;
+}
+
+/* Pin the set so a slow client doesn't hold up the grace period */
+static ResponseSet *pin_set(void) {
+  rcu_read_lock();
+  ResponseSet *set = rcu_dereference(current);
+  if (set != NULL)
+    atomic_fetch_add(&set->refs, 1);
+  rcu_read_unlock();
+  return set;
+}
+
+int send_response(const int dest_fd, const response_t type) {
+  ResponseSet *set = pin_set();
+  if (set == NULL)
+    return -1;
+
+  const StaticResponse *response = &set->responses[type];
+  struct iovec iov[2] = {
+      {response->header, response->header_len},
+      {response->body, response->body_len},
+  };
+
+  int status;
+  if (response->body_fd == -1) {
+    status = send_all(dest_fd, iov, response->body_len > 0 ? 2 : 1, 0);
+  } else {
+    status = send_all(dest_fd, iov, 1, MSG_MORE);
+
+    off_t offset = 0;
+    while (status == 0 && (size_t)offset < response->body_len) {
+      ssize_t sent = sendfile(dest_fd, response->body_fd, &offset,
+                              response->body_len - offset);
+      if (sent == -1 && errno != EINTR &&
+          !((errno == EAGAIN || errno == EWOULDBLOCK) &&
+            wait_writable(dest_fd)))
+        status = -1;
+      else if (sent == 0)
+        status = -1;
+    }
+  }
+
+  release_set(set);
+  return status;
+}
+
+int queue_response(OutBuf *out, const response_t type) {
+  ResponseSet *set = pin_set();
+  if (set == NULL)
+    return -1;
+
+  const StaticResponse *response = &set->responses[type];
+  struct iovec iov[2] = {
+      {response->header, response->header_len},
+      {response->body, response->body_len},
+  };
+
+  int status;
+  if (response->body_fd == -1) {
+    status = outbuf_writev(out, iov, response->body_len > 0 ? 2 : 1, 0);
+  } else {
+    // The memfd outlives the set in the buffer, what the client doesn't take
+    // right away is sent from it later
+    status = outbuf_writev(out, iov, 1, MSG_MORE);
+    if (status == 0)
+      status = outbuf_sendfile(out, response->body_fd, 0, response->body_len);
+  }
+
+  release_set(set);
+  return status;
+}
+
+/* The 429 with a Retry-After header slipped in right after the status line */
+static void throttled_iov(const StaticResponse *response, char *retry,
+                          const size_t retry_size,
+                          const unsigned int retry_after,
+                          struct iovec iov[4]) {
+  size_t status_len =
+      (char *)memchr(response->header, '\n', response->header_len) -
+      response->header + 1;
+  int retry_len = snprintf(retry, retry_size, "Retry-After: %u\r\n",
+                           retry_after);
+
+  iov[0] = (struct iovec){response->header, status_len};
+  iov[1] = (struct iovec){retry, retry_len};
+  iov[2] = (struct iovec){response->header + status_len,
+                          response->header_len - status_len};
+  iov[3] = (struct iovec){response->body, response->body_len};
+}
+
+int send_throttled(const int dest_fd, const unsigned int retry_after) {
+  ResponseSet *set = pin_set();
+  if (set == NULL)
+    return -1;
+
+  char retry[32];
+  struct iovec iov[4];
+  throttled_iov(&set->responses[RESPONSE_THROTTLED], retry, sizeof retry,
+                retry_after, iov);
+
+  int status = send_all(dest_fd, iov, 4, 0);
+  release_set(set);
+  return status;
+}
+
+int queue_throttled(OutBuf *out, const unsigned int retry_after) {
+  ResponseSet *set = pin_set();
+  if (set == NULL)
+    return -1;
+
+  char retry[32];
+  struct iovec iov[4];
+  throttled_iov(&set->responses[RESPONSE_THROTTLED], retry, sizeof retry,
+                retry_after, iov);
+
+  int status = outbuf_writev(out, iov, 4, 0);
+  release_set(set);
+  return status;
+}
+
+void responses_cleanup(void) {
+  ResponseSet *set = rcu_publish(current, NULL);
+  rcu_synchronize();
+
+  if (set != NULL)
+    release_set(set);
+
+  free(blocked_page_path);
+  blocked_page_path = NULL;
+}
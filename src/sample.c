@@ -0,0 +1,25 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "sample.h"
+
+static atomic_uint_fast64_t seeds = 0;
+static __thread uint64_t rng_state;
+
+double sample_random(void) {
+  // Handler threads are short-lived and reuse the same pthread_self(): a seed
+  // count tells them apart, or each would make the same first draw
+  if (rng_state == 0) {
+    uint64_t n = atomic_fetch_add_explicit(&seeds, 1, memory_order_relaxed);
+    rng_state = ((uint64_t)pthread_self() ^ (uint64_t)time(NULL) << 32 ^
+                 (n + 1) * 0x9e3779b97f4a7c15ULL) |
+                1;
+  }
+
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (rng_state * 0x2545f4914f6cdd1dULL >> 11) * 0x1.0p-53;
+}
@@ -1,38 +1,149 @@
 #include "common.h"
+#include "clock.h"
 #include "handler.h"
+#include "metrics.h"
+#include "probes.h"
 
-int server_handler(const struct pollfd *fds, Response *res, bool *is_TLS) {
-  unsigned char buffer[MAX_HTTP_LEN] = {0};
+/*
+ * The response ended. When it's buffered and still on its way to the client,
+ * the upstream is closed rather than held for as long as the client takes;
+ * the next request connects again.
+ */
+static void response_done(ConnInfo *info) {
+  info->awaiting = false;
+  deadline_start(&info->deadline, DEADLINE_IDLE, info->fds[0].fd);
+
+  if (info->out[0].spill_at == 0 || !outbuf_pending(&info->out[0]) ||
+      info->req->is_partial || info->req->is_chunked)
+    return;
+
+  LOG(DBG, NULL, "Response buffered, closing the upstream connection");
+  close(info->fds[1].fd);
+  info->fds[1].fd = -1;
+  outbuf_free(&info->out[1]);
+  info->out[1].fd = -1;
+  metrics_add(METRIC_UPSTREAM_RELEASED, 1);
+}
+
+static int relay_transformed(ConnInfo *info, unsigned char *body,
+                             const size_t len) {
+  int status = transform_feed(&info->xf, &info->out[0], body, len);
+  if (status == -1)
+    return -1;
+
+  if (status == 1) { // Whole body relayed
+    transform_end(&info->xf);
+    response_done(info);
+  }
+
+  return 0;
+}
+
+int server_handler(ConnInfo *info) {
+  const struct pollfd *fds = info->fds;
+  Response *res = info->res;
+
+  unsigned char *buffer = info->rx;
   long bytes_recv = recv(fds[1].fd, buffer, MAX_HTTP_LEN - 1, 0);
+  if (bytes_recv == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0; // Woken up for nothing, the socket is non-blocking
   if (bytes_recv <= 0) {
     if (bytes_recv == -1)
       LOG(ERR, NULL, "Failed to receive from server");
-    if (bytes_recv == 0)
+    if (bytes_recv == 0) {
       LOG(INFO, NULL, "Server closed the connection!");
+
+      // A body delimited by the connection closing ends here
+      if (info->xf.active && info->xf.framing.kind == BODY_UNTIL_CLOSE &&
+          transform_finish(&info->xf, &info->out[0]) == 0)
+        transform_end(&info->xf);
+    }
     return -1;
   }
+  buffer[bytes_recv] = '\0'; // The buffer is reused, parsed as a string
 
-  if (*is_TLS) {
+  info->turn_bytes += bytes_recv;
+  shaper_charge(&info->shaper, (struct sockaddr *)&info->peer, SHAPER_SERVER,
+                bytes_recv);
+
+  metrics_add(METRIC_BYTES_FROM_UPSTREAM, bytes_recv);
+  metrics_top_bytes(&info->top, bytes_recv);
+  if (!info->first_byte_seen) {
+    metrics_observe(HIST_FIRST_BYTE,
+                    (clock_precise_ns() - info->accepted_ns) / 1000);
+    info->first_byte_seen = true;
+  }
+
+  Exchange *ex = &info->exchange;
+  ex->rec.bytes_out += bytes_recv;
+  if (ex->rec.phase_us[PHASE_FIRST_BYTE] == ACCESS_NO_PHASE) {
+    exchange_mark(ex, PHASE_FIRST_BYTE);
+    PROBE(response_first_byte, info->id, bytes_recv);
+    if (!info->is_TLS)
+      metrics_state(CONN_STATE_RELAYING);
+  }
+  exchange_mark(ex, PHASE_LAST_BYTE);
+
+  // Once the response started, only a stall in the transfer times out
+  if (info->deadline.phase == DEADLINE_RESPONSE)
+    deadline_start(&info->deadline, DEADLINE_TRANSFER, fds[1].fd);
+  else
+    deadline_touch(&info->deadline);
+
+  if (info->is_TLS) {
     LOG(DBG, NULL, "Received TLS traffic from server (%zu Bytes)", bytes_recv);
-    if (forward(fds[0].fd, buffer, bytes_recv) == -1) {
+    if (outbuf_write(&info->out[0], buffer, bytes_recv) == -1) {
       LOG(ERR, NULL, "Couldn't forward bytes to client");
       return -1;
     }
     return 0;
   }
 
+  // Bytes of a transformed body only ever continue a response
+  if (capture_enabled)
+    capture_data(info->id, CAPTURE_SERVER,
+                 !info->xf.active && !res->is_partial && !res->is_chunked,
+                 buffer, bytes_recv, &info->capture_lost);
+
+  if (info->xf.active) {
+    LOG(DBG, NULL, "Received body from server (%ld Bytes): ", bytes_recv);
+    return relay_transformed(info, buffer, bytes_recv);
+  }
+
   LOG(DBG, NULL, "Received from server (%ld Bytes): ", bytes_recv);
 
-  if (parse_response(buffer, bytes_recv, res) == -1)
+  // Otherwise the bytes continue the body of the previous response
+  bool fresh = !res->is_partial && !res->is_chunked;
+  if (parse_response(buffer, bytes_recv, res, info->xf.is_head) == -1)
     return -1;
 
-  print_res(res);
+  if (fresh && res->status_code != NULL)
+    ex->rec.status = atoi(res->status_code);
+  if (fresh && info->dump)
+    dump_response(res, buffer, bytes_recv);
+
+  int engaged = transform_start(&info->xf, &info->out[0], res);
+  if (engaged == -1)
+    return -1;
 
-  if (forward(fds[0].fd, buffer, bytes_recv) == -1) {
+  if (engaged == 1) {
+    // The transform tracks the body framing from here on
+    res->is_partial = false;
+    res->is_chunked = false;
+    return relay_transformed(info, buffer + res->header_size,
+                             bytes_recv - res->header_size);
+  }
+
+  if (outbuf_write(&info->out[0], buffer, bytes_recv) == -1) {
     LOG(ERR, NULL, "Couldn't forward bytes to client");
     return -1;
   }
 
+  // An interim (1xx) response is followed by the final one
+  if (!res->is_partial && !res->is_chunked && res->status_code != NULL &&
+      res->status_code[0] != '1')
+    response_done(info);
+
   LOG(INFO, NULL, "Bytes successfully forwarded to client");
   return 0;
 }
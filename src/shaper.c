@@ -0,0 +1,98 @@
+#include <stdatomic.h>
+
+#include "clock.h"
+#include "common.h"
+#include "ratelimit.h"
+#include "shaper.h"
+
+static atomic_ullong shaped_bytes = 0;
+static atomic_ullong throttled_bytes = 0;
+static atomic_ullong pauses = 0;
+static atomic_ullong delay_ms = 0;
+
+void shaper_init(Shaper *shaper) {
+  shaper->tokens = config.shape_burst;
+  shaper->last_ns = clock_now_ns();
+  shaper->resume_ns[SHAPER_CLIENT] = 0;
+  shaper->resume_ns[SHAPER_SERVER] = 0;
+}
+
+/* Milliseconds this connection must pause for on its own rate */
+static uint64_t charge_connection(Shaper *shaper, const uint64_t now,
+                                  const size_t bytes) {
+  if (config.shape_rate == 0)
+    return 0;
+
+  shaper->tokens += (now - shaper->last_ns) * 1e-9 * config.shape_rate;
+  if (shaper->tokens > config.shape_burst)
+    shaper->tokens = config.shape_burst;
+  shaper->last_ns = now;
+
+  shaper->tokens -= bytes;
+  if (shaper->tokens >= 0)
+    return 0;
+
+  return (uint64_t)(-shaper->tokens * 1e3 / config.shape_rate) + 1;
+}
+
+void shaper_charge(Shaper *shaper, const struct sockaddr *peer, const int side,
+                   const size_t bytes) {
+  if (config.shape_rate == 0 && bandwidth_limit.shards == NULL)
+    return;
+
+  uint64_t now = clock_now_ns();
+  uint64_t wait = charge_connection(shaper, now, bytes);
+  uint64_t client_wait = ratelimit_charge(&bandwidth_limit, peer, bytes);
+  if (client_wait > wait)
+    wait = client_wait;
+
+  atomic_fetch_add_explicit(&shaped_bytes, bytes, memory_order_relaxed);
+  if (wait == 0)
+    return;
+
+  shaper->resume_ns[side] = now + wait * 1000000;
+  atomic_fetch_add_explicit(&throttled_bytes, bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&pauses, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&delay_ms, wait, memory_order_relaxed);
+  LOG(DBG, NULL, "Pausing reads from the %s for %lu ms",
+      side == SHAPER_CLIENT ? "client" : "server", (unsigned long)wait);
+}
+
+int shaper_arm(Shaper *shaper, struct pollfd fds[2], const int timeout) {
+  int armed = timeout;
+  uint64_t now = clock_now_ns();
+
+  for (int side = SHAPER_CLIENT; side <= SHAPER_SERVER; side++) {
+    if (shaper->resume_ns[side] == 0)
+      continue;
+
+    if (now >= shaper->resume_ns[side]) {
+      shaper->resume_ns[side] = 0;
+      fds[side].events |= POLLIN;
+      continue;
+    }
+
+    fds[side].events &= ~POLLIN;
+    int left = (shaper->resume_ns[side] - now + 999999) / 1000000;
+    if (left < armed)
+      armed = left;
+  }
+
+  return armed;
+}
+
+void shaper_get_stats(ShapeStats *stats) {
+  stats->bytes = atomic_load(&shaped_bytes);
+  stats->throttled = atomic_load(&throttled_bytes);
+  stats->pauses = atomic_load(&pauses);
+  stats->delay_ms = atomic_load(&delay_ms);
+}
+
+void shaper_log_stats(void) {
+  ShapeStats stats;
+  shaper_get_stats(&stats);
+  LOG(INFO, NULL,
+      "Shaping: %llu Bytes relayed, %llu Bytes throttled, %llu pauses "
+      "(%llu ms in total)",
+      stats.bytes, stats.throttled, stats.pauses, stats.delay_ms);
+}
@@ -0,0 +1,165 @@
+#include <time.h>
+
+#include "clock.h"
+#include "common.h"
+#include "timer.h"
+
+#define TICK_NS (TIMER_TICK_MS * 1000000ULL)
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+/*
+ * Hierarchical timing wheel: level 0 holds the timers due within 64 ticks,
+ * one slot per tick, and each level above spans 64 times more. Whenever level
+ * 0 wraps around, the next slot of level 1 is spread over level 0, and so on
+ * up. Timers are only touched when armed, cancelled, cascaded (at most once
+ * per level) or fired, however many are pending.
+ */
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static Timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t current = 0; // Next tick to run
+static uint64_t started_ns = 0;
+
+static unsigned long pending = 0, fired = 0; // Under the lock
+
+static void link_timer(Timer *timer) {
+  uint64_t expires = timer->expires;
+  uint64_t delta = expires >= current ? expires - current : 0;
+  if (delta > MAX_DELTA) { // Beyond the wheel, fires at its far end
+    delta = MAX_DELTA;
+    expires = current + delta;
+  }
+
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= 1ULL << ((level + 1) * TIMER_SLOT_BITS))
+    level++;
+  uint64_t at = delta == 0 ? current : expires;
+  Timer **slot = &wheel[level][(at >> (level * TIMER_SLOT_BITS)) & SLOT_MASK];
+
+  timer->next = *slot;
+  if (*slot != NULL)
+    (*slot)->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void unlink_timer(Timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/* Spread a slot of an upper level over the levels below */
+static void cascade(const int level) {
+  int index = (current >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+  Timer *timer = wheel[level][index];
+  wheel[level][index] = NULL;
+  while (timer != NULL) {
+    Timer *next = timer->next;
+    link_timer(timer);
+    timer = next;
+  }
+}
+
+/* Run one tick: cascade when level 0 wraps, then fire its current slot */
+static void run_tick(void) {
+  int index = current & SLOT_MASK;
+  for (int level = 1; level < TIMER_LEVELS && index == 0; level++) {
+    cascade(level);
+    index = (current >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+  }
+
+  Timer **slot = &wheel[0][current & SLOT_MASK];
+  current++;
+  while (*slot != NULL) {
+    Timer *timer = *slot;
+    unlink_timer(timer);
+    pending--;
+    fired++;
+
+    uint64_t again_ms = timer->fire(timer);
+    if (again_ms > 0) {
+      timer->expires = current + (again_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+      link_timer(timer);
+      pending++;
+    }
+  }
+}
+
+static void *turn_wheel(void *arg) {
+  (void)arg;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1) {
+    next.tv_nsec += TICK_NS;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    // Catch up on the ticks missed while descheduled
+    uint64_t now = (clock_precise_ns() - started_ns) / TICK_NS;
+    pthread_mutex_lock(&wheel_lock);
+    while (current <= now)
+      run_tick();
+    pthread_mutex_unlock(&wheel_lock);
+  }
+
+  return NULL;
+}
+
+int timer_start(void) {
+  started_ns = clock_precise_ns();
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, turn_wheel, NULL) != 0) {
+    LOG(ERR, NULL, "Failed to start the timer thread");
+    return -1;
+  }
+
+  pthread_detach(tid);
+  return 0;
+}
+
+void timer_init(Timer *timer, uint64_t (*fire)(Timer *timer)) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->fire = fire;
+}
+
+void timer_arm(Timer *timer, const uint64_t ms) {
+  // Ticks are counted from the next one to run, rounding up
+  uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+  pthread_mutex_lock(&wheel_lock);
+  if (timer->pprev != NULL)
+    unlink_timer(timer);
+  else
+    pending++;
+  timer->expires = current + ticks;
+  link_timer(timer);
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+void timer_cancel(Timer *timer) {
+  pthread_mutex_lock(&wheel_lock);
+  if (timer->pprev != NULL) {
+    unlink_timer(timer);
+    pending--;
+  }
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+void timer_log_stats(void) {
+  pthread_mutex_lock(&wheel_lock);
+  unsigned long now_pending = pending, now_fired = fired;
+  pthread_mutex_unlock(&wheel_lock);
+
+  LOG(INFO, NULL, "Timers: %lu pending, %lu fired", now_pending, now_fired);
+}
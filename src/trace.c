@@ -0,0 +1,155 @@
+#include <stdatomic.h>
+
+#include "common.h"
+#include "sample.h"
+#include "trace.h"
+
+bool trace_enabled = false;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = NULL;
+static bool first_event = true;
+
+static uint64_t slow_us = DEFAULT_TRACE_SLOW_MS * 1000ULL;
+static double sample_rate = 1.0;
+
+static atomic_ulong slow;
+static atomic_ulong traced;
+
+/* Slices drawn under a request, from one phase to the next */
+static const struct {
+  const char *name;
+  access_phase_t from, to;
+} slices[] = {
+    {"resolve", PHASE_PARSED, PHASE_RESOLVED},
+    {"connect", PHASE_RESOLVED, PHASE_CONNECTED},
+    {"send", PHASE_CONNECTED, PHASE_SENT}, // From PHASE_PARSED when reused
+    {"wait", PHASE_SENT, PHASE_FIRST_BYTE},
+    {"receive", PHASE_FIRST_BYTE, PHASE_LAST_BYTE},
+};
+
+/* Write a string as a JSON string literal */
+static void write_string(const char *text) {
+  fputc('"', trace_file);
+  for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      fprintf(trace_file, "\\%c", *c);
+    else if (*c < 0x20)
+      fprintf(trace_file, "\\u%04x", *c);
+    else
+      fputc(*c, trace_file);
+  }
+  fputc('"', trace_file);
+}
+
+/* Start an event, the array is left open so a killed proxy's file loads */
+static void begin_event(const char *ph, const char *name,
+                        const uint64_t conn_id, const uint64_t ts) {
+  fprintf(trace_file, "%s{\"ph\":\"%s\",\"pid\":1,\"tid\":%llu,\"ts\":%llu,"
+                      "\"name\":",
+          first_event ? "" : ",\n", ph, (unsigned long long)conn_id,
+          (unsigned long long)ts);
+  write_string(name);
+  first_event = false;
+}
+
+int trace_open(const char *path, const unsigned int slow_ms,
+               const double sample) {
+  if (!(sample > 0 && sample <= 1)) {
+    LOG(ERR, NULL, "Trace sample must be in (0, 1], got %g", sample);
+    return -1;
+  }
+
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL) {
+    LOG(ERR, NULL, "Failed to create trace file %s", path);
+    return -1;
+  }
+  fprintf(trace_file, "[\n");
+
+  slow_us = slow_ms * 1000ULL;
+  sample_rate = sample;
+  trace_enabled = true;
+  LOG(INFO, NULL, "Tracing %g%% of the requests slower than %ums to %s",
+      sample * 100, slow_ms, path);
+  return 0;
+}
+
+void trace_exchange(const Exchange *ex, const uint64_t duration_us) {
+  if (duration_us < slow_us)
+    return;
+
+  atomic_fetch_add_explicit(&slow, 1, memory_order_relaxed);
+  if (sample_rate < 1 && sample_random() >= sample_rate)
+    return;
+
+  const AccessRecord *rec = &ex->rec;
+  const uint32_t *phase = rec->phase_us;
+  uint64_t start = rec->start_ns / 1000;
+  char name[sizeof(ex->target) + 16];
+  snprintf(name, sizeof(name), "%s %s", access_method_name(rec->method),
+           ex->target[0] ? ex->target : "-");
+
+  // A cancelled thread would otherwise leave the lock held
+  int cancel_state;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file == NULL) {
+    pthread_mutex_unlock(&trace_lock);
+    pthread_setcancelstate(cancel_state, NULL);
+    return;
+  }
+
+  char thread_name[32];
+  snprintf(thread_name, sizeof(thread_name), "connection %llu",
+           (unsigned long long)rec->conn_id);
+  begin_event("M", "thread_name", rec->conn_id, 0);
+  fprintf(trace_file, ",\"args\":{\"name\":");
+  write_string(thread_name);
+  fprintf(trace_file, "}}");
+
+  begin_event("i", "accepted", rec->conn_id, start - rec->conn_age_us);
+  fprintf(trace_file, ",\"s\":\"t\"}");
+
+  begin_event("X", name, rec->conn_id, start);
+  fprintf(trace_file,
+          ",\"dur\":%llu,\"args\":{\"status\":%u,\"bytes_in\":%llu,"
+          "\"bytes_out\":%llu,\"flags\":%u}}",
+          (unsigned long long)duration_us, rec->status,
+          (unsigned long long)rec->bytes_in,
+          (unsigned long long)rec->bytes_out, rec->flags);
+
+  for (size_t i = 0; i < sizeof(slices) / sizeof(*slices); i++) {
+    uint32_t from = phase[slices[i].from], to = phase[slices[i].to];
+    if (from == ACCESS_NO_PHASE && slices[i].from == PHASE_CONNECTED)
+      from = phase[PHASE_PARSED];
+    if (from == ACCESS_NO_PHASE || to == ACCESS_NO_PHASE || to < from)
+      continue;
+
+    begin_event("X", slices[i].name, rec->conn_id, start + from);
+    fprintf(trace_file, ",\"dur\":%u}", to - from);
+  }
+  fflush(trace_file);
+  pthread_mutex_unlock(&trace_lock);
+  pthread_setcancelstate(cancel_state, NULL);
+
+  atomic_fetch_add_explicit(&traced, 1, memory_order_relaxed);
+}
+
+void trace_log_stats(void) {
+  if (!trace_enabled)
+    return;
+
+  LOG(INFO, NULL, "Trace: %lu slow requests, %lu traced",
+      atomic_load(&slow), atomic_load(&traced));
+}
+
+void trace_close(void) {
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file != NULL) {
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,314 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "clock.h"
+#include "common.h"
+#include "metrics.h"
+#include "tui.h"
+
+#define TUI_TAIL_BYTES 8192 // Read from the end of the log for its last lines
+#define TUI_LOG_LINES 64    // Log lines kept at most
+#define TUI_LOOKUP 64       // Keys merged to find the request counts of a row
+
+#define ENTER_SCREEN "\x1B[?1049h\x1B[?25l" // Alternate screen, no cursor
+#define LEAVE_SCREEN "\x1B[?25h\x1B[?1049l"
+#define CLEAR_LINE "\x1B[K\n"
+
+static atomic_bool running = false;
+static atomic_bool started = false;
+static pthread_t drawer;
+static const char *log_name = NULL;
+
+/* Heaviest keys of a pair of sketches, by bytes and by requests */
+typedef struct TopView {
+  HeavyStat bytes[TUI_HOSTS];
+  size_t bytes_count;
+  HeavyStat requests[TUI_LOOKUP];
+  size_t requests_count;
+} TopView;
+
+static const struct {
+  const char *title;
+  sketch_t bytes, requests;
+  size_t rows;
+} tops[] = {
+    {"Top hosts", TOP_HOST_BYTES, TOP_HOST_REQUESTS, TUI_HOSTS},
+    {"Top clients", TOP_CLIENT_BYTES, TOP_CLIENT_REQUESTS, TUI_CLIENTS},
+};
+
+#define TUI_TOPS (sizeof(tops) / sizeof(*tops))
+
+/* Only touched by the drawing thread */
+static MetricsSnapshot snaps[2];
+static TopView views[2][TUI_TOPS];
+static uint64_t started_ns;
+
+static const struct {
+  const char *name;
+  histogram_t hist;
+} latencies[] = {
+    {"first byte", HIST_FIRST_BYTE},   {"resolve", HIST_RESOLVE},
+    {"connect", HIST_CONNECT},         {"upstream wait", HIST_WAIT},
+    {"request", HIST_REQUEST},
+};
+
+static const char *const state_labels[CONN_STATES] = {
+    [CONN_STATE_READING] = "reading",   [CONN_STATE_CONNECTING] = "connecting",
+    [CONN_STATE_WAITING] = "waiting",   [CONN_STATE_RELAYING] = "relaying",
+    [CONN_STATE_TUNNEL] = "tunnel",
+};
+
+static void format_bytes(char *out, const size_t size, const double bytes) {
+  static const char *const units[] = {"B", "KB", "MB", "GB", "TB"};
+  double value = bytes;
+  size_t unit = 0;
+  while (value >= 1024 && unit < sizeof(units) / sizeof(*units) - 1) {
+    value /= 1024;
+    unit++;
+  }
+  snprintf(out, size, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+static const HeavyStat *find_key(const HeavyStat *list, const size_t count,
+                                 const char *key) {
+  for (size_t i = 0; i < count; i++)
+    if (strcmp(list[i].key, key) == 0)
+      return &list[i];
+  return NULL;
+}
+
+static void read_view(TopView *view, const size_t top) {
+  view->bytes_count = metrics_top(tops[top].bytes, view->bytes,
+                                  tops[top].rows);
+  view->requests_count = metrics_top(tops[top].requests, view->requests,
+                                     TUI_LOOKUP);
+}
+
+/* Write the rows of a view, with rates against the previous one */
+static void put_view(FILE *out, const size_t top, const TopView *now,
+                     const TopView *before, const double seconds) {
+  fprintf(out, CLEAR_LINE "\x1B[1m %-40s %10s %8s %10s %10s\x1B[22m"
+               CLEAR_LINE,
+          tops[top].title, "requests", "req/s", "bytes", "bytes/s");
+  for (size_t i = 0; i < now->bytes_count; i++) {
+    const HeavyStat *bytes = &now->bytes[i];
+    const HeavyStat *prev = find_key(before->bytes, before->bytes_count,
+                                     bytes->key);
+    char total[32], rate[32] = "-", requests[32] = "-", req_rate[32] = "-";
+    format_bytes(total, sizeof(total), bytes->count);
+    if (prev != NULL && bytes->count >= prev->count) {
+      format_bytes(rate, sizeof(rate), (bytes->count - prev->count) / seconds);
+      strcat(rate, "/s");
+    }
+
+    // Both sketches see the same keys, their heaviest ones usually match
+    const HeavyStat *req = find_key(now->requests, now->requests_count,
+                                    bytes->key);
+    const HeavyStat *prev_req = find_key(before->requests,
+                                         before->requests_count, bytes->key);
+    if (req != NULL)
+      snprintf(requests, sizeof(requests), "%llu",
+               (unsigned long long)req->count);
+    if (req != NULL && prev_req != NULL && req->count >= prev_req->count)
+      snprintf(req_rate, sizeof(req_rate), "%.1f",
+               (req->count - prev_req->count) / seconds);
+    fprintf(out, "   %-38.38s %10s %8s %10s %10s" CLEAR_LINE, bytes->key,
+            requests, req_rate, total, rate);
+  }
+}
+
+/* Write a log line without its escape sequences, cut to the width */
+static void put_log_line(FILE *out, const char *line, const size_t len,
+                         const int width) {
+  int shown = 0;
+  for (size_t i = 0; i < len && shown < width - 2; i++) {
+    if (line[i] == '\x1B') {
+      while (i < len && !(line[i] >= 'A' && line[i] <= 'z' && line[i] != '['))
+        i++;
+      continue;
+    }
+    fputc(line[i], out);
+    shown++;
+  }
+  fputs(CLEAR_LINE, out);
+}
+
+/* Write the last `lines` lines of the log file */
+static void put_log_tail(FILE *out, const int lines, const int width) {
+  static char tail[TUI_TAIL_BYTES];
+  if (lines <= 0 || log_name == NULL)
+    return;
+
+  int fd = open(log_name, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  off_t from = st.st_size > TUI_TAIL_BYTES ? st.st_size - TUI_TAIL_BYTES : 0;
+  ssize_t len = pread(fd, tail, sizeof(tail), from);
+  close(fd);
+  if (len <= 0)
+    return;
+
+  // Walk back over the last lines, the first one may be cut
+  const char *starts[TUI_LOG_LINES + 1];
+  int found = 0;
+  ssize_t end = len > 0 && tail[len - 1] == '\n' ? len - 1 : len;
+  for (ssize_t i = end - 1; i >= 0 && found < lines && found < TUI_LOG_LINES;
+       i--)
+    if (tail[i] == '\n')
+      starts[found++] = tail + i + 1;
+  if (found < lines && found < TUI_LOG_LINES && from == 0)
+    starts[found++] = tail;
+
+  for (int i = found - 1; i >= 0; i--) {
+    const char *newline = memchr(starts[i], '\n', tail + end - starts[i]);
+    size_t line_len = newline ? (size_t)(newline - starts[i])
+                              : (size_t)(tail + end - starts[i]);
+    put_log_line(out, starts[i], line_len, width);
+  }
+}
+
+static void draw(FILE *out, const MetricsSnapshot *now,
+                 const MetricsSnapshot *before, const double seconds,
+                 const int rows, const int width) {
+  const uint64_t *c = now->counters, *p = before->counters;
+  char in_rate[32], out_rate[32];
+  format_bytes(in_rate, sizeof(in_rate),
+               (c[METRIC_BYTES_FROM_CLIENT] - p[METRIC_BYTES_FROM_CLIENT]) /
+                   seconds);
+  format_bytes(out_rate, sizeof(out_rate),
+               (c[METRIC_BYTES_FROM_UPSTREAM] -
+                p[METRIC_BYTES_FROM_UPSTREAM]) /
+                   seconds);
+
+  uint64_t up = (clock_precise_ns() - started_ns) / 1000000000ULL;
+  fprintf(out,
+          "\x1B[H\x1B[1m HTTProxy on :%s\x1B[22m   up %llu:%02llu:%02llu   "
+          "%llu connections   %.1f req/s   in %s/s   out %s/s" CLEAR_LINE
+          CLEAR_LINE,
+          config.port, (unsigned long long)(up / 3600),
+          (unsigned long long)(up / 60 % 60), (unsigned long long)(up % 60),
+          (unsigned long long)(c[METRIC_CONN_ACCEPTED] -
+                               c[METRIC_CONN_CLOSED]),
+          (c[METRIC_REQUESTS] - p[METRIC_REQUESTS]) / seconds, in_rate,
+          out_rate);
+
+  fprintf(out, " Connections ");
+  for (int s = CONN_STATE_NONE + 1; s < CONN_STATES; s++)
+    fprintf(out, "  %s %llu", state_labels[s],
+            (unsigned long long)now->states[s]);
+  fprintf(out, CLEAR_LINE);
+
+  fprintf(out,
+          " Requests     total %llu  bad %llu  blocked %llu  throttled %llu  "
+          "upstream failures %llu" CLEAR_LINE
+          " Refused      busy %llu  throttled %llu  log dropped %lu" CLEAR_LINE
+          CLEAR_LINE,
+          (unsigned long long)c[METRIC_REQUESTS],
+          (unsigned long long)c[METRIC_REQ_BAD],
+          (unsigned long long)c[METRIC_REQ_BLOCKED],
+          (unsigned long long)c[METRIC_REQ_THROTTLED],
+          (unsigned long long)c[METRIC_UPSTREAM_FAILED],
+          (unsigned long long)c[METRIC_CONN_REJECTED],
+          (unsigned long long)c[METRIC_CONN_THROTTLED], logger_dropped());
+
+  fprintf(out, "\x1B[1m Latency (ms)        p50       p90       p99     p99.9"
+               "   (since start)\x1B[22m" CLEAR_LINE);
+  for (size_t i = 0; i < sizeof(latencies) / sizeof(*latencies); i++) {
+    fprintf(out, "   %-14s", latencies[i].name);
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(*quantiles); q++)
+      fprintf(out, "%10.2f",
+              metrics_quantile(now, latencies[i].hist, quantiles[q]) / 1e3);
+    fprintf(out, CLEAR_LINE);
+  }
+
+  int used = 8 + (int)(sizeof(latencies) / sizeof(*latencies)) + 3;
+  for (size_t i = 0; i < TUI_TOPS; i++) {
+    put_view(out, i, &views[0][i], &views[1][i], seconds);
+    used += 2 + (int)views[0][i].bytes_count;
+  }
+
+  // The log gets the rows left
+  fprintf(out, CLEAR_LINE "\x1B[1m Log (%s)\x1B[22m" CLEAR_LINE, log_name);
+  put_log_tail(out, rows - used - 1, width);
+  fprintf(out, "\x1B[J");
+}
+
+static void *draw_loop(void *arg) {
+  (void)arg;
+  metrics_snapshot(&snaps[1]);
+  uint64_t last = clock_precise_ns();
+
+  while (atomic_load(&running)) {
+    struct timespec pause = {0, TUI_REFRESH_MS * 1000000L};
+    nanosleep(&pause, NULL);
+
+    uint64_t now = clock_precise_ns();
+    metrics_snapshot(&snaps[0]);
+    for (size_t i = 0; i < TUI_TOPS; i++)
+      read_view(&views[0][i], i);
+
+    struct winsize ws;
+    int rows = 24, width = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+      rows = ws.ws_row;
+      width = ws.ws_col;
+    }
+
+    char *frame = NULL;
+    size_t frame_len = 0;
+    FILE *out = open_memstream(&frame, &frame_len);
+    if (out == NULL)
+      continue;
+    draw(out, &snaps[0], &snaps[1], (now - last) / 1e9, rows, width);
+    fclose(out);
+    if (write(STDOUT_FILENO, frame, frame_len) == -1)
+      LOG(WARN, NULL, "Failed to draw the TUI");
+    free(frame);
+
+    snaps[1] = snaps[0];
+    memcpy(views[1], views[0], sizeof(views[0]));
+    last = now;
+  }
+
+  return NULL;
+}
+
+int tui_start(const char *log_path) {
+  if (!isatty(STDOUT_FILENO)) {
+    LOG(ERR, NULL, "The TUI needs stdout to be a terminal");
+    return -1;
+  }
+
+  log_name = log_path;
+  started_ns = clock_precise_ns();
+  atomic_store(&running, true);
+  if (pthread_create(&drawer, NULL, draw_loop, NULL) != 0) {
+    LOG(ERR, NULL, "Failed to create the TUI thread");
+    atomic_store(&running, false);
+    return -1;
+  }
+
+  if (write(STDOUT_FILENO, ENTER_SCREEN, strlen(ENTER_SCREEN)) == -1)
+    LOG(WARN, NULL, "Failed to set the terminal up");
+  atomic_store(&started, true);
+  atexit(tui_stop);
+  return 0;
+}
+
+void tui_stop(void) {
+  if (!atomic_exchange(&started, false))
+    return;
+
+  atomic_store(&running, false);
+  pthread_join(drawer, NULL);
+  if (write(STDOUT_FILENO, LEAVE_SCREEN, strlen(LEAVE_SCREEN)) == -1)
+    LOG(WARN, NULL, "Failed to restore the terminal");
+}
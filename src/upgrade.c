@@ -0,0 +1,194 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "upgrade.h"
+
+#define UPGRADE_MAGIC 0x55585048 // "HPXU"
+
+/* Sent along with the listeners */
+typedef struct UpgradeHello {
+  uint32_t magic;
+  uint32_t fd_count; // Proxy listener, then the admin one if any
+} UpgradeHello;
+
+extern char **environ;
+
+static char exe_path[PATH_MAX];
+static char **exe_argv = NULL;
+static int previous_fd = -1; // Socket to the previous process until ready
+
+int upgrade_init(char **argv) {
+  // Resolved now: a new binary installed over the path is what gets started
+  ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+  if (len == -1) {
+    LOG(WARN, NULL, "Failed to find the proxy binary, hot upgrades disabled");
+    return -1;
+  }
+
+  exe_path[len] = '\0';
+  exe_argv = argv;
+  return 0;
+}
+
+int upgrade_receive(int *proxy_fd, int *admin_fd) {
+  *proxy_fd = *admin_fd = -1;
+  const char *env = getenv(UPGRADE_ENV);
+  if (env == NULL)
+    return 0;
+
+  int sock = atoi(env);
+  unsetenv(UPGRADE_ENV);
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+  UpgradeHello hello = {0};
+  char control[CMSG_SPACE(2 * sizeof(int))] = {0};
+  struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+
+  ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (received != sizeof(hello) || hello.magic != UPGRADE_MAGIC ||
+      hello.fd_count < 1 || hello.fd_count > 2 || cmsg == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(hello.fd_count * sizeof(int))) {
+    LOG(ERR, NULL, "Failed to receive the listeners of the previous process");
+    close(sock);
+    return -1;
+  }
+
+  int fds[2] = {-1, -1};
+  memcpy(fds, CMSG_DATA(cmsg), hello.fd_count * sizeof(int));
+  *proxy_fd = fds[0];
+  *admin_fd = fds[1];
+  previous_fd = sock;
+  LOG(INFO, NULL, "Taking over from process %d", (int)getppid());
+  return 0;
+}
+
+void upgrade_ready(void) {
+  if (previous_fd == -1)
+    return;
+
+  if (write(previous_fd, "R", 1) != 1)
+    LOG(WARN, NULL, "Failed to tell the previous process to drain");
+  close(previous_fd);
+  previous_fd = -1;
+}
+
+/* Environment of the new process: ours, pointing it to the socket */
+static char **build_env(char *var, const size_t size) {
+  size_t count = 0;
+  while (environ[count] != NULL)
+    count++;
+
+  char **envp = (char **)malloc((count + 2) * sizeof(char *));
+  if (envp == NULL)
+    return NULL;
+
+  size_t prefix = strlen(UPGRADE_ENV "=");
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (strncmp(environ[i], UPGRADE_ENV "=", prefix) != 0)
+      envp[n++] = environ[i];
+  snprintf(var, size, UPGRADE_ENV "=%d", UPGRADE_SOCKET_FD);
+  envp[n++] = var;
+  envp[n] = NULL;
+  return envp;
+}
+
+static int send_listeners(const int sock, const int proxy_fd,
+                          const int admin_fd) {
+  int fds[2] = {proxy_fd, admin_fd};
+  UpgradeHello hello = {.magic = UPGRADE_MAGIC,
+                        .fd_count = admin_fd != -1 ? 2 : 1};
+  char control[CMSG_SPACE(2 * sizeof(int))] = {0};
+  struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen =
+                           CMSG_SPACE(hello.fd_count * sizeof(int))};
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(hello.fd_count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, hello.fd_count * sizeof(int));
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hello) ? 0 : -1;
+}
+
+/* Whether the new process reported ready in time */
+static bool wait_ready(const int sock) {
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+  char ready = 0;
+  return poll(&pfd, 1, UPGRADE_TIMEOUT_S * 1000) == 1 &&
+         read(sock, &ready, 1) == 1 && ready == 'R';
+}
+
+int upgrade_exec(const int proxy_fd, const int admin_fd) {
+  if (exe_argv == NULL || proxy_fd == -1)
+    return -1;
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+    LOG(ERR, NULL, "Failed to create the upgrade socket");
+    return -1;
+  }
+
+  // Built before fork(): only async-signal-safe calls may follow it
+  char var[64];
+  char **envp = build_env(var, sizeof(var));
+  if (envp == NULL) {
+    LOG(ERR, NULL, "Failed to allocate the environment of the new process");
+    close(pair[0]);
+    close(pair[1]);
+    return -1;
+  }
+  sigset_t none;
+  sigemptyset(&none);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Only the socket is passed on, the connections stay with this process
+    if ((pair[1] == UPGRADE_SOCKET_FD
+             ? fcntl(pair[1], F_SETFD, 0)
+             : dup2(pair[1], UPGRADE_SOCKET_FD)) == -1)
+      _exit(127);
+    close_range(UPGRADE_SOCKET_FD + 1, ~0U, 0);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execve(exe_path, exe_argv, envp);
+    _exit(127);
+  }
+
+  free(envp);
+  close(pair[1]);
+  if (pid == -1) {
+    LOG(ERR, NULL, "Failed to start the new process");
+    close(pair[0]);
+    return -1;
+  }
+
+  LOG(INFO, NULL, "Started %s as process %d", exe_path, (int)pid);
+  if (send_listeners(pair[0], proxy_fd, admin_fd) == -1 ||
+      !wait_ready(pair[0])) {
+    LOG(ERR, NULL, "Process %d didn't take over, carrying on", (int)pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(pair[0]);
+    return -1;
+  }
+
+  LOG(INFO, NULL, "Process %d took over the listeners", (int)pid);
+  close(pair[0]);
+  return 0;
+}
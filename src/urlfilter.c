@@ -0,0 +1,321 @@
+#include <ctype.h>
+#include <time.h>
+
+#include "common.h"
+#include "rcu.h"
+#include "urlfilter.h"
+
+_Atomic(UrlFilter *) urlfilter = NULL;
+
+/* Pattern trie used while building, before it's turned into a DFA */
+typedef struct Trie {
+  uint32_t *child;   // First child of each node
+  uint32_t *sibling; // Next sibling of each node
+  uint8_t *cls;      // Class of the byte leading to each node
+  size_t count;
+} Trie;
+
+static int32_t stronger(const UrlFilter *uf, const int32_t a,
+                        const int32_t b) {
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+  return uf->actions[b] > uf->actions[a] ? b : a;
+}
+
+static void assign_classes(UrlFilter *uf) {
+  bool seen[256] = {false};
+  for (size_t i = 0; i < uf->pattern_count; i++)
+    for (const char *p = uf->patterns[i]; *p != '\0'; p++)
+      seen[tolower((unsigned char)*p)] = true;
+
+  uf->class_count = 1; // Class 0: bytes that appear in no pattern
+  for (int b = 0; b < 256; b++)
+    uf->classes[b] = seen[b] ? uf->class_count++ : 0;
+
+  for (int b = 0; b < 256; b++)
+    uf->classes[b] = uf->classes[tolower(b)];
+}
+
+static uint32_t trie_step(Trie *trie, const uint32_t node, const uint8_t cls) {
+  for (uint32_t c = trie->child[node]; c != 0; c = trie->sibling[c])
+    if (trie->cls[c] == cls)
+      return c;
+
+  uint32_t c = trie->count++;
+  trie->child[c] = 0;
+  trie->cls[c] = cls;
+  trie->sibling[c] = trie->child[node];
+  trie->child[node] = c;
+  return c;
+}
+
+/*
+ * Turn the trie into a full DFA breadth-first. A state's row starts as a
+ * copy of its failure state's row (already final since it's shallower), and
+ * its own trie edges are then written over it.
+ */
+static int build_dfa(UrlFilter *uf, Trie *trie) {
+  const size_t C = uf->class_count;
+  uf->state_count = trie->count;
+
+  if (uf->state_count * C >= URLFILTER_MATCH_BIT) {
+    LOG(ERR, NULL, "URL filter automaton is too large");
+    return -1;
+  }
+
+  uf->delta = (uint32_t *)calloc(uf->state_count * C, sizeof(uint32_t));
+  uint32_t *fail = (uint32_t *)calloc(uf->state_count, sizeof(uint32_t));
+  uint32_t *queue = (uint32_t *)malloc(uf->state_count * sizeof(uint32_t));
+  if (uf->delta == NULL || fail == NULL || queue == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for the URL filter automaton");
+    free(fail);
+    free(queue);
+    return -1;
+  }
+
+  size_t head = 0, tail = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    uint32_t s = queue[head++];
+    uint32_t *row = uf->delta + s * C;
+    const uint32_t *fail_row = uf->delta + fail[s] * C;
+
+    if (s != 0)
+      memcpy(row, fail_row, C * sizeof(uint32_t));
+
+    for (uint32_t t = trie->child[s]; t != 0; t = trie->sibling[t]) {
+      fail[t] = s != 0 ? fail_row[trie->cls[t]] : 0;
+      uf->outputs[t] = stronger(uf, uf->outputs[t], uf->outputs[fail[t]]);
+      row[trie->cls[t]] = t;
+      queue[tail++] = t;
+    }
+  }
+
+  // Store row offsets instead of state numbers and flag output states
+  for (size_t i = 0; i < uf->state_count * C; i++) {
+    uint32_t t = uf->delta[i];
+    uf->delta[i] = t * C | (uf->outputs[t] >= 0 ? URLFILTER_MATCH_BIT : 0);
+  }
+
+  free(fail);
+  free(queue);
+  return 0;
+}
+
+UrlFilter *urlfilter_build(const char *const *patterns,
+                           const url_action_t *actions, const size_t count) {
+  UrlFilter *uf = (UrlFilter *)calloc(1, sizeof(UrlFilter));
+  if (uf == NULL)
+    return NULL;
+
+  size_t total = 1;
+  uf->patterns = (char **)calloc(count ? count : 1, sizeof(char *));
+  uf->actions = (url_action_t *)calloc(count ? count : 1, sizeof(url_action_t));
+  if (uf->patterns == NULL || uf->actions == NULL)
+    goto fail;
+
+  for (size_t i = 0; i < count; i++) {
+    if (patterns[i][0] == '\0')
+      continue;
+
+    uf->patterns[uf->pattern_count] = strdup(patterns[i]);
+    if (uf->patterns[uf->pattern_count] == NULL)
+      goto fail;
+    uf->actions[uf->pattern_count++] = actions[i];
+    total += strlen(patterns[i]);
+  }
+
+  assign_classes(uf);
+
+  Trie trie = {0};
+  trie.child = (uint32_t *)calloc(total, sizeof(uint32_t));
+  trie.sibling = (uint32_t *)calloc(total, sizeof(uint32_t));
+  trie.cls = (uint8_t *)calloc(total, sizeof(uint8_t));
+  uf->outputs = (int32_t *)malloc(total * sizeof(int32_t));
+  if (trie.child == NULL || trie.sibling == NULL || trie.cls == NULL ||
+      uf->outputs == NULL) {
+    LOG(ERR, NULL, "Failed to allocate memory for the URL filter trie");
+    goto fail_trie;
+  }
+  memset(uf->outputs, -1, total * sizeof(int32_t));
+
+  trie.count = 1; // Root
+  for (size_t i = 0; i < uf->pattern_count; i++) {
+    uint32_t node = 0;
+    for (const char *p = uf->patterns[i]; *p != '\0'; p++)
+      node = trie_step(&trie, node, uf->classes[(unsigned char)*p]);
+    uf->outputs[node] = stronger(uf, uf->outputs[node], (int32_t)i);
+  }
+
+  if (build_dfa(uf, &trie) == -1)
+    goto fail_trie;
+
+  int32_t *outputs =
+      (int32_t *)realloc(uf->outputs, trie.count * sizeof(int32_t));
+  if (outputs != NULL)
+    uf->outputs = outputs;
+
+  free(trie.child);
+  free(trie.sibling);
+  free(trie.cls);
+  return uf;
+
+fail_trie:
+  free(trie.child);
+  free(trie.sibling);
+  free(trie.cls);
+fail:
+  urlfilter_free(uf);
+  return NULL;
+}
+
+UrlFilter *urlfilter_load(const char *path) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    LOG(WARN, NULL, "Couldn't open URL pattern file %s", path);
+    return NULL;
+  }
+
+  size_t count = 0, cap = 256;
+  char **patterns = (char **)malloc(cap * sizeof(char *));
+  url_action_t *actions = (url_action_t *)malloc(cap * sizeof(url_action_t));
+  char line[MAX_HTTP_LEN];
+
+  while (patterns != NULL && actions != NULL &&
+         fgets(line, sizeof line, fp) != NULL) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+
+    char *first = strtok(line, " \t\r\n");
+    char *second = strtok(NULL, " \t\r\n");
+    if (first == NULL)
+      continue;
+
+    url_action_t action = URL_ACTION_BLOCK;
+    char *pattern = first;
+    if (second != NULL) {
+      if (strcasecmp(first, "tag") == 0) {
+        action = URL_ACTION_TAG;
+      } else if (strcasecmp(first, "block") != 0) {
+        LOG(WARN, NULL, "Skipping URL pattern with unknown action \"%s\"",
+            first);
+        continue;
+      }
+      pattern = second;
+    }
+
+    if (count == cap) {
+      cap *= 2;
+      char **grown_patterns = (char **)realloc(patterns, cap * sizeof(char *));
+      if (grown_patterns != NULL)
+        patterns = grown_patterns;
+      url_action_t *grown_actions =
+          (url_action_t *)realloc(actions, cap * sizeof(url_action_t));
+      if (grown_actions != NULL)
+        actions = grown_actions;
+      if (grown_patterns == NULL || grown_actions == NULL)
+        break;
+    }
+
+    patterns[count] = strdup(pattern);
+    actions[count] = action;
+    if (patterns[count] == NULL)
+      break;
+    count++;
+  }
+  fclose(fp);
+
+  UrlFilter *uf = NULL;
+  if (patterns != NULL && actions != NULL)
+    uf = urlfilter_build((const char *const *)patterns, actions, count);
+  else
+    LOG(ERR, NULL, "Failed to allocate memory to read URL patterns");
+
+  for (size_t i = 0; patterns != NULL && i < count; i++)
+    free(patterns[i]);
+  free(patterns);
+  free(actions);
+  if (uf == NULL)
+    return NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  LOG(INFO, NULL,
+      "Compiled %zu URL patterns from %s in %.2f ms (%zu states, %zu "
+      "classes, %zu Bytes)",
+      uf->pattern_count, path,
+      (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+      uf->state_count, uf->class_count, urlfilter_memory(uf));
+  return uf;
+}
+
+int urlfilter_reload(const char *path) {
+  UrlFilter *uf = urlfilter_load(path);
+  if (uf == NULL)
+    return -1;
+
+  UrlFilter *old = rcu_publish(urlfilter, uf);
+  rcu_synchronize();
+  urlfilter_free(old);
+  return 0;
+}
+
+url_action_t urlfilter_match(const UrlFilter *uf, const char *uri,
+                             const size_t len, const char **pattern) {
+  if (uf == NULL || uf->pattern_count == 0)
+    return URL_ACTION_NONE;
+
+  const uint32_t *delta = uf->delta;
+  const uint8_t *classes = uf->classes;
+  uint32_t state = 0;
+  int32_t best = -1;
+
+  for (size_t i = 0; i < len; i++) {
+    state = delta[state + classes[(unsigned char)uri[i]]];
+    if (!(state & URLFILTER_MATCH_BIT))
+      continue;
+
+    state &= ~URLFILTER_MATCH_BIT;
+    best = stronger(uf, best, uf->outputs[state / uf->class_count]);
+    if (uf->actions[best] == URL_ACTION_BLOCK)
+      break; // Nothing overrides a block
+  }
+
+  if (best < 0)
+    return URL_ACTION_NONE;
+
+  if (pattern != NULL)
+    *pattern = uf->patterns[best];
+  return uf->actions[best];
+}
+
+size_t urlfilter_memory(const UrlFilter *uf) {
+  if (uf == NULL)
+    return 0;
+
+  size_t memory = sizeof(UrlFilter) +
+                  uf->state_count * uf->class_count * sizeof(uint32_t) +
+                  uf->state_count * sizeof(int32_t) +
+                  uf->pattern_count * (sizeof(char *) + sizeof(url_action_t));
+  for (size_t i = 0; i < uf->pattern_count; i++)
+    memory += strlen(uf->patterns[i]) + 1;
+  return memory;
+}
+
+void urlfilter_free(UrlFilter *uf) {
+  if (uf == NULL)
+    return;
+
+  for (size_t i = 0; uf->patterns != NULL && i < uf->pattern_count; i++)
+    free(uf->patterns[i]);
+  free(uf->patterns);
+  free(uf->actions);
+  free(uf->outputs);
+  free(uf->delta);
+  free(uf);
+}
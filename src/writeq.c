@@ -0,0 +1,74 @@
+#include "writeq.h"
+
+static void *write_loop(void *arg) {
+  WriteQueue *q = (WriteQueue *)arg;
+
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (q->head == NULL && !q->stopping)
+      pthread_cond_wait(&q->cond, &q->lock);
+    if (q->head == NULL)
+      break;
+
+    // Take the whole queue, oldest first
+    WriteNode *batch = NULL;
+    while (q->head != NULL) {
+      WriteNode *node = q->head;
+      q->head = node->next;
+      node->next = batch;
+      batch = node;
+      q->count--;
+      q->bytes -= node->bytes;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    q->write(batch);
+
+    pthread_mutex_lock(&q->lock);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+int writeq_start(WriteQueue *q) {
+  q->stopping = false;
+  return pthread_create(&q->writer, NULL, write_loop, q) == 0 ? 0 : -1;
+}
+
+bool writeq_reserve(WriteQueue *q, const size_t bytes, const bool always) {
+  pthread_mutex_lock(&q->lock);
+  bool full = !always &&
+              ((q->max_count > 0 && q->count >= q->max_count) ||
+               (q->max_bytes > 0 && q->bytes + bytes > q->max_bytes));
+  if (!full) {
+    q->count++;
+    q->bytes += bytes;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return !full;
+}
+
+void writeq_cancel(WriteQueue *q, const size_t bytes) {
+  pthread_mutex_lock(&q->lock);
+  q->count--;
+  q->bytes -= bytes;
+  pthread_mutex_unlock(&q->lock);
+}
+
+void writeq_push(WriteQueue *q, WriteNode *node) {
+  pthread_mutex_lock(&q->lock);
+  node->next = q->head;
+  q->head = node;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+void writeq_stop(WriteQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->stopping = true;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+
+  pthread_join(q->writer, NULL);
+}
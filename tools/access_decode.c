@@ -0,0 +1,217 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } format_t;
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "USAGE: %s [-f text|csv|json] FILE...\n"
+          "Decode binary access log files written with httproxy -a\n",
+          prog);
+}
+
+static void format_addr(char *out, const size_t size, const uint8_t family,
+                        const uint8_t ip[16], const uint16_t port) {
+  char text[INET6_ADDRSTRLEN] = "-";
+  if (family == 4)
+    inet_ntop(AF_INET, ip, text, sizeof(text));
+  else if (family == 6)
+    inet_ntop(AF_INET6, ip, text, sizeof(text));
+
+  if (family == 6)
+    snprintf(out, size, "[%s]:%u", text, port);
+  else if (family == 4)
+    snprintf(out, size, "%s:%u", text, port);
+  else
+    snprintf(out, size, "-");
+}
+
+static void format_time(char *out, const size_t size, const uint64_t ns) {
+  time_t sec = ns / 1000000000ULL;
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  size_t len = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(out + len, size - len, ".%06luZ",
+           (unsigned long)(ns % 1000000000ULL / 1000));
+}
+
+static const char *cache_name(const uint8_t cache) {
+  switch (cache) {
+  case ACCESS_CACHE_MISS:
+    return "miss";
+  case ACCESS_CACHE_HIT:
+    return "hit";
+  default:
+    return "none";
+  }
+}
+
+static void format_flags(char *out, const size_t size, const uint8_t flags) {
+  snprintf(out, size, "%s%s%s%s", flags & ACCESS_TUNNEL ? "tunnel " : "",
+           flags & ACCESS_BLOCKED ? "blocked " : "",
+           flags & ACCESS_THROTTLED ? "throttled " : "", flags ? "" : "-");
+  size_t len = strlen(out);
+  if (len > 0 && out[len - 1] == ' ')
+    out[len - 1] = '\0';
+}
+
+static void print_header(const format_t format) {
+  if (format != FORMAT_CSV)
+    return;
+
+  printf("time,conn,client,upstream,method,status,bytes_in,bytes_out,cache,"
+         "flags,conn_age_us");
+  for (int i = 0; i < ACCESS_PHASES; i++)
+    printf(",%s_us", access_phase_name(i));
+  printf("\n");
+}
+
+static void print_record(const AccessRecord *rec, const format_t format) {
+  char time_text[64], client[64], upstream[64], flags[64];
+  format_time(time_text, sizeof(time_text), rec->start_ns);
+  format_addr(client, sizeof(client), rec->client_family, rec->client_ip,
+              rec->client_port);
+  format_addr(upstream, sizeof(upstream), rec->upstream_family,
+              rec->upstream_ip, rec->upstream_port);
+  format_flags(flags, sizeof(flags), rec->flags);
+  const char *method = access_method_name(rec->method);
+
+  switch (format) {
+  case FORMAT_TEXT:
+    printf("%s conn=%llu %s -> %s %s %u in=%llu out=%llu cache=%s flags=%s "
+           "conn_age=%uus",
+           time_text, (unsigned long long)rec->conn_id, client, upstream,
+           method, rec->status, (unsigned long long)rec->bytes_in,
+           (unsigned long long)rec->bytes_out, cache_name(rec->cache), flags,
+           rec->conn_age_us);
+    for (int i = 0; i < ACCESS_PHASES; i++) {
+      if (rec->phase_us[i] == ACCESS_NO_PHASE)
+        printf(" %s=-", access_phase_name(i));
+      else
+        printf(" %s=%uus", access_phase_name(i), rec->phase_us[i]);
+    }
+    printf("\n");
+    break;
+  case FORMAT_CSV:
+    printf("%s,%llu,%s,%s,%s,%u,%llu,%llu,%s,%s,%u", time_text,
+           (unsigned long long)rec->conn_id, client, upstream, method,
+           rec->status, (unsigned long long)rec->bytes_in,
+           (unsigned long long)rec->bytes_out, cache_name(rec->cache), flags,
+           rec->conn_age_us);
+    for (int i = 0; i < ACCESS_PHASES; i++) {
+      if (rec->phase_us[i] == ACCESS_NO_PHASE)
+        printf(",");
+      else
+        printf(",%u", rec->phase_us[i]);
+    }
+    printf("\n");
+    break;
+  case FORMAT_JSON:
+    printf("{\"time\":\"%s\",\"conn\":%llu,\"client\":\"%s\","
+           "\"upstream\":\"%s\",\"method\":\"%s\",\"status\":%u,"
+           "\"bytes_in\":%llu,\"bytes_out\":%llu,\"cache\":\"%s\","
+           "\"flags\":\"%s\",\"conn_age_us\":%u",
+           time_text, (unsigned long long)rec->conn_id, client, upstream,
+           method, rec->status, (unsigned long long)rec->bytes_in,
+           (unsigned long long)rec->bytes_out, cache_name(rec->cache), flags,
+           rec->conn_age_us);
+    for (int i = 0; i < ACCESS_PHASES; i++) {
+      if (rec->phase_us[i] == ACCESS_NO_PHASE)
+        printf(",\"%s_us\":null", access_phase_name(i));
+      else
+        printf(",\"%s_us\":%u", access_phase_name(i), rec->phase_us[i]);
+    }
+    printf("}\n");
+    break;
+  }
+}
+
+/* Print the complete records of a file, skipping the torn ones */
+static int decode(const char *path, const format_t format) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(AccessFileHeader)) {
+    fprintf(stderr, "%s: not an access log\n", path);
+    close(fd);
+    return -1;
+  }
+
+  unsigned char *map =
+      (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+
+  AccessFileHeader header;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, ACCESS_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != ACCESS_VERSION ||
+      header.record_size != sizeof(AccessRecord)) {
+    fprintf(stderr, "%s: not an access log, or of another version\n", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  size_t count = (st.st_size - sizeof(AccessFileHeader)) / sizeof(AccessRecord);
+  if (count > header.capacity)
+    count = header.capacity;
+
+  for (size_t i = 0; i < count; i++) {
+    AccessRecord rec;
+    memcpy(&rec, map + sizeof(AccessFileHeader) + i * sizeof(AccessRecord),
+           sizeof(rec));
+    if (rec.magic == ACCESS_RECORD_MAGIC)
+      print_record(&rec, format);
+  }
+
+  munmap(map, st.st_size);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  format_t format = FORMAT_TEXT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:h")) != -1) {
+    if (opt == 'f' && strcmp(optarg, "text") == 0) {
+      format = FORMAT_TEXT;
+    } else if (opt == 'f' && strcmp(optarg, "csv") == 0) {
+      format = FORMAT_CSV;
+    } else if (opt == 'f' && strcmp(optarg, "json") == 0) {
+      format = FORMAT_JSON;
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind == argc) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  print_header(format);
+  int status = EXIT_SUCCESS;
+  for (int i = optind; i < argc; i++)
+    if (decode(argv[i], format) == -1)
+      status = EXIT_FAILURE;
+
+  return status;
+}